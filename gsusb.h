@@ -0,0 +1,175 @@
+// gsusb.h
+//
+// The USB side of the Geschwister Schneider / candleLight protocol. These are the
+// definitions shared between usb2can.c and the software emulated device in gsusb_emu.c.
+
+#ifndef __GSUSB_H__
+#define __GSUSB_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "utils/compat.h"
+
+// The endpoint for these devices
+#define ENDPOINT_FLAG_IN        0x80
+#define ENDPOINT_IN     (0x01 | ENDPOINT_FLAG_IN)
+#define ENDPOINT_OUT    0x02
+
+// Device Specific Constants
+enum usb2can_breq {
+  USB2CAN_BREQ_HOST_FORMAT = 0,
+  USB2CAN_BREQ_BITTIMING,
+  USB2CAN_BREQ_MODE,
+  USB2CAN_BREQ_BERR,
+  USB2CAN_BREQ_BT_CONST,
+  USB2CAN_BREQ_DEVICE_CONFIG,
+  USB2CAN_BREQ_TIMESTAMP,
+  USB2CAN_BREQ_IDENTIFY,
+  USB2CAN_BREQ_GET_USER_ID,
+  USB2CAN_BREQ_SET_USER_ID,
+  USB2CAN_BREQ_DATA_BITTIMING,
+  USB2CAN_BREQ_BT_CONST_EXT,
+  USB2CAN_BREQ_SET_TERMINATION,
+  USB2CAN_BREQ_GET_TERMINATION,
+  USB2CAN_BREQ_GET_STATE,
+};
+
+enum usb2can_mode {
+  USB2CAN_MODE_RESET = 0, // Reset a channel, tunrs it off
+  USB2CAN_MODE_START,   // Start a channel
+};
+
+// Bit Timing Const Definitions
+#define USB2CAN_FEATURE_LISTEN_ONLY (1 << 0)
+#define USB2CAN_FEATURE_LOOP_BACK (1 << 1)
+#define USB2CAN_FEATURE_TRIPLE_SAMPLE (1 << 2)
+#define USB2CAN_FEATURE_ONE_SHOT (1 << 3)
+#define USB2CAN_FEATURE_HW_TIMESTAMP (1 << 4)
+#define USB2CAN_FEATURE_IDENTIFY (1 << 5)
+#define USB2CAN_FEATURE_USER_ID (1 << 6)
+#define USB2CAN_FEATURE_PAD_PKTS_TO_MAX_PKT_SIZE (1 << 7)
+#define USB2CAN_FEATURE_FD (1 << 8)
+#define USB2CAN_FEATURE_REQ_USB_QUIRK_LPC546XX (1 << 9)
+#define USB2CAN_FEATURE_BT_CONST_EXT (1 << 10)
+#define USB2CAN_FEATURE_TERMINATION (1 << 11)
+#define USB2CAN_FEATURE_BERR_REPORTING (1 << 12)
+#define USB2CAN_FEATURE_GET_STATE (1 << 13)
+
+/// @brief Bit Timing struct
+struct usb2can_device_bt_const {
+  uint32_t feature;
+  uint32_t fclk_can;
+  uint32_t tseg1_min;
+  uint32_t tseg1_max;
+  uint32_t tseg2_min;
+  uint32_t tseg2_max;
+  uint32_t sjw_max;
+  uint32_t brp_min;
+  uint32_t brp_max;
+  uint32_t brp_inc;
+} __packed;
+
+/// @brief Bit Timing struct with the limits for the data phase of CAN FD frames as well
+/// (USB2CAN_BREQ_BT_CONST_EXT, only if the device has USB2CAN_FEATURE_BT_CONST_EXT).
+struct usb2can_device_bt_const_extended {
+  uint32_t feature;
+  uint32_t fclk_can;
+  uint32_t tseg1_min;
+  uint32_t tseg1_max;
+  uint32_t tseg2_min;
+  uint32_t tseg2_max;
+  uint32_t sjw_max;
+  uint32_t brp_min;
+  uint32_t brp_max;
+  uint32_t brp_inc;
+
+  uint32_t dtseg1_min;
+  uint32_t dtseg1_max;
+  uint32_t dtseg2_min;
+  uint32_t dtseg2_max;
+  uint32_t dsjw_max;
+  uint32_t dbrp_min;
+  uint32_t dbrp_max;
+  uint32_t dbrp_inc;
+} __packed;
+
+/// @brief The bit timing that we send with USB2CAN_BREQ_BITTIMING and USB2CAN_BREQ_DATA_BITTIMING.
+/// The device adds prop_seg and phase_seg1 together to get tseg1.
+struct usb2can_device_bittiming {
+  uint32_t prop_seg;
+  uint32_t phase_seg1;
+  uint32_t phase_seg2;
+  uint32_t sjw;
+  uint32_t brp;
+} __packed;
+
+/// @brief USB device information
+struct usb2can_device_config {
+  uint8_t reserved1;
+  uint8_t reserved2;
+  uint8_t reserved3;
+  uint8_t icount;       // The number of interfaces available on this device (can be up to 3)
+  uint32_t sw_version;
+  uint32_t hw_version;
+} __packed;
+
+/// @brief This is the CAN frame that is sent over the USB
+struct host_frame {
+  uint32_t echo_id; // So that we can recognise messages that we have sent.
+  uint32_t can_id;
+  uint8_t can_dlc;
+  uint8_t channel;
+  uint8_t flags;
+  uint8_t reserved;
+  uint8_t data[8];
+  uint32_t timestamp; // Device time in us. Only sent by the device once USB2CAN_FEATURE_HW_TIMESTAMP has been turned on, never sent to it.
+} __packed;
+
+/// @brief A CAN FD frame as it is sent over the USB, it's a host_frame with room for 64 bytes.
+/// Only used for frames with HOST_FRAME_FLAG_FD set, can_dlc is then a CAN FD DLC (0 to 15).
+struct host_frame_fd {
+  uint32_t echo_id;
+  uint32_t can_id;
+  uint8_t can_dlc;
+  uint8_t channel;
+  uint8_t flags;
+  uint8_t reserved;
+  uint8_t data[64];
+  uint32_t timestamp; // As for host_frame.
+} __packed;
+
+// The size of a host_frame on the wire, without and with the timestamp.
+#define HOST_FRAME_SIZE     (offsetof(struct host_frame, timestamp))
+#define HOST_FRAME_SIZE_TS  (sizeof(struct host_frame))
+// The same for host_frame_fd.
+#define HOST_FRAME_FD_SIZE    (offsetof(struct host_frame_fd, timestamp))
+#define HOST_FRAME_FD_SIZE_TS (sizeof(struct host_frame_fd))
+// Everything before the data, enough to tell how big the rest of the frame is.
+#define HOST_FRAME_HEADER_SIZE  (offsetof(struct host_frame, data))
+
+// The echo_id the device uses for frames that it received from the bus (as opposed to our own Tx echoes).
+#define HOST_FRAME_ECHO_ID_RX     (0xFFFFFFFF)
+
+#define HOST_FRAME_FLAG_OVERFLOW  (0x01)
+#define HOST_FRAME_FLAG_FD        (0x02)
+#define HOST_FRAME_FLAG_BRS       (0x04)
+#define HOST_FRAME_FLAG_ESI       (0x08)
+
+// The size of a frame on the wire. CAN FD frames are bigger and the device only adds the
+// timestamp if it has been turned on (and never to frames that we send it).
+static inline int host_frame_size(uint8_t flags, uint8_t timestamp) {
+  if(flags & HOST_FRAME_FLAG_FD) {
+    return timestamp ? HOST_FRAME_FD_SIZE_TS : HOST_FRAME_FD_SIZE;
+  }
+  return timestamp ? HOST_FRAME_SIZE_TS : HOST_FRAME_SIZE;
+}
+
+// Where the timestamp is in a frame from the device, it follows the data so it moves with the size of the frame.
+static inline uint32_t host_frame_timestamp(const struct host_frame* frame) {
+  if(frame->flags & HOST_FRAME_FLAG_FD) {
+    return ((const struct host_frame_fd*)frame)->timestamp;
+  }
+  return frame->timestamp;
+}
+
+#endif  // __GSUSB_H__
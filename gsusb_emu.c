@@ -0,0 +1,555 @@
+// gsusb_emu.c
+//
+// Software emulation of a gs_usb/candleLight device with up to EMU_MAX_CHANNELS channels. It answers the
+// control requests that usb2can makes during setup and echoes every frame written to
+// ENDPOINT_OUT back on ENDPOINT_IN, as a real device does once the frame has been
+// transmitted on a bus with at least one other node to ACK it. The channels are separate
+// buses, a frame is only echoed on the channel that it was sent on.
+//
+// Unlike the candleLight firmware, which sends one frame per transfer, we pack as many
+// waiting frames as will fit into each IN transfer so that the host's handling of
+// multi-frame transfers gets exercised.
+//
+// The device's clock runs slightly fast and starts just short of wrapping around so that
+// usb2can's clock sync gets exercised too.
+//
+// Every channel supports CAN FD. CAN FD frames are bigger than a full speed packet so, like
+// the real devices, we expect each one to be the last frame in its OUT transfer.
+//
+// There can also be another node on each bus (gsusb_emu_set_bus()) that sends a frame every
+// EMU_BUS_PERIOD_US. A channel only receives them if it's set to the node's bitrate, at any other
+// bitrate it gets bus errors instead, which is enough to exercise auto-baud.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "utils/compat.h"
+#include "gsusb.h"
+#include "gsusb_emu.h"
+#include "usb2can.h"
+#include "utils/timestamp.h"
+#include "utils/bittiming.h"
+
+#define EMU_MAX_TRANSFERS (64)  // The most transfers that we can have queued in each direction.
+#define EMU_MAX_FRAMES    (256) // The size of the device's Rx FIFO.
+#define EMU_MAX_CHANNELS  (3)   // As many as the gs_usb protocol allows.
+
+#define EMU_FCLK_CAN      (48000000)  // Same as the STM32F0 based candleLight devices.
+#define EMU_MAX_PACKET    (64)        // A full speed device.
+#define EMU_CLOCK_START   (0xFFFFFFFFU - 10000000U) // The device's clock wraps 10s after we start.
+#define EMU_CLOCK_PPM     (50)        // How fast the device's clock runs compared to ours.
+#define EMU_FEATURES      (USB2CAN_FEATURE_LISTEN_ONLY | USB2CAN_FEATURE_LOOP_BACK | USB2CAN_FEATURE_IDENTIFY | USB2CAN_FEATURE_HW_TIMESTAMP | \
+                           USB2CAN_FEATURE_PAD_PKTS_TO_MAX_PKT_SIZE | USB2CAN_FEATURE_FD | USB2CAN_FEATURE_BT_CONST_EXT | \
+                           USB2CAN_FEATURE_BERR_REPORTING | USB2CAN_FEATURE_ONE_SHOT)
+#define EMU_BUS_PERIOD_US (10000)     // How often the other node on the bus sends a frame.
+#define EMU_BUS_ID        (0x100)     // The other node's frames have this id plus the channel number.
+
+/// @brief A fixed size FIFO of transfers.
+struct emu_transfer_queue {
+  struct libusb_transfer* transfer[EMU_MAX_TRANSFERS];
+  uint32_t head;
+  uint32_t count;
+};
+
+/// @brief The state of our emulated device.
+struct gsusb_emu {
+  int pipefd[2];          // Doorbell. [0] is given to the caller to watch, we write to [1].
+  uint8_t signalled;      // Set when there's a byte waiting in the doorbell.
+  uint8_t channels;       // The number of channels that we have.
+  uint8_t started[EMU_MAX_CHANNELS];      // Set by USB2CAN_MODE_START, cleared by USB2CAN_MODE_RESET.
+  uint32_t mode_flags[EMU_MAX_CHANNELS];  // The flags sent with USB2CAN_BREQ_MODE.
+  uint8_t overflow;       // Set when we've had to drop a frame because the Rx FIFO was full.
+  uint8_t bittiming[EMU_MAX_CHANNELS][20];  // The last bit timing that we were sent.
+  uint8_t data_bittiming[EMU_MAX_CHANNELS][20]; // The last CAN FD data phase bit timing that we were sent.
+  uint64_t clock_base;    // Our time in us when the device's clock read EMU_CLOCK_START.
+  uint32_t bus_bitrate;   // The bitrate of the other node on each bus, 0 if there isn't one.
+  uint64_t bus_next[EMU_MAX_CHANNELS];  // When (micros()) the other node next sends on each channel.
+  uint8_t bus_count[EMU_MAX_CHANNELS];  // Goes in the other node's frames so that they're all different.
+  struct emu_transfer_queue in;   // IN transfers waiting for data.
+  struct emu_transfer_queue done; // Transfers waiting for their callbacks to be called.
+  struct host_frame_fd fifo[EMU_MAX_FRAMES]; // Frames waiting to be sent to the host, classic CAN frames only use the start.
+  uint32_t fifo_head;
+  uint32_t fifo_count;
+};
+
+static int queue_push(struct emu_transfer_queue* q, struct libusb_transfer* transfer) {
+  if(q->count >= EMU_MAX_TRANSFERS) {
+    return -1;
+  }
+  q->transfer[(q->head + q->count) % EMU_MAX_TRANSFERS] = transfer;
+  q->count++;
+  return 0;
+}
+
+static struct libusb_transfer* queue_pop(struct emu_transfer_queue* q) {
+  if(q->count == 0) {
+    return NULL;
+  }
+  struct libusb_transfer* transfer = q->transfer[q->head];
+  q->head = (q->head + 1) % EMU_MAX_TRANSFERS;
+  q->count--;
+  return transfer;
+}
+
+// Remove a specific transfer from the queue, keeping the order of the others. Returns 0 if it was found.
+static int queue_remove(struct emu_transfer_queue* q, struct libusb_transfer* transfer) {
+  for(uint32_t i = 0; i < q->count; i++) {
+    if(q->transfer[(q->head + i) % EMU_MAX_TRANSFERS] == transfer) {
+      for(uint32_t j = i; j + 1 < q->count; j++) {
+        q->transfer[(q->head + j) % EMU_MAX_TRANSFERS] = q->transfer[(q->head + j + 1) % EMU_MAX_TRANSFERS];
+      }
+      q->count--;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Wake up whoever is watching our file descriptor.
+static void ring_doorbell(struct gsusb_emu* emu) {
+  if(!emu->signalled) {
+    uint8_t b = 0;
+    if(write(emu->pipefd[1], &b, 1) == 1) {
+      emu->signalled = 1;
+    }
+  }
+}
+
+// The device's free running us counter.
+static uint32_t device_clock(struct gsusb_emu* emu) {
+  uint64_t elapsed = micros() - emu->clock_base;
+  return (uint32_t)(EMU_CLOCK_START + elapsed + ((elapsed * EMU_CLOCK_PPM) / 1000000));
+}
+
+// The size of a frame that we send to the host, they only have the timestamp if it was asked for on its channel.
+static int frame_size(struct gsusb_emu* emu, struct host_frame_fd* frame) {
+  return host_frame_size(frame->flags, (emu->mode_flags[frame->channel] & USB2CAN_FEATURE_HW_TIMESTAMP) != 0);
+}
+
+// Round a size up to a whole number of packets.
+static int packets(int size) {
+  return ((size + EMU_MAX_PACKET - 1) / EMU_MAX_PACKET) * EMU_MAX_PACKET;
+}
+
+// Queue a frame to go back to the host. If the FIFO is full the frame is lost and the next one gets the overflow flag, like the real thing.
+static void fifo_push(struct gsusb_emu* emu, struct host_frame_fd* frame) {
+  if(emu->fifo_count >= EMU_MAX_FRAMES) {
+    emu->overflow = 1;
+    return;
+  }
+  struct host_frame_fd* dst = &emu->fifo[(emu->fifo_head + emu->fifo_count) % EMU_MAX_FRAMES];
+  memcpy(dst, frame, sizeof(struct host_frame_fd));
+  if(emu->overflow) {
+    dst->flags |= HOST_FRAME_FLAG_OVERFLOW;
+    emu->overflow = 0;
+  }
+  emu->fifo_count++;
+}
+
+// The bitrate that a channel's been set to, from the last bit timing that we were sent.
+static uint32_t channel_bitrate(struct gsusb_emu* emu, int channel) {
+  uint32_t bt[5];
+  memcpy(bt, emu->bittiming[channel], sizeof(bt));
+  return bittiming_bitrate(EMU_FCLK_CAN, le32toh(bt[0]), le32toh(bt[1]), le32toh(bt[2]), le32toh(bt[4]));
+}
+
+// Whether the other node on a channel's bus is at the channel's bitrate (to within 1%), so that it
+// understands and acknowledges what the channel sends.
+static int bus_matches(struct gsusb_emu* emu, int channel) {
+  if(emu->bus_bitrate == 0) {
+    return 0;
+  }
+  uint32_t rate = channel_bitrate(emu, channel);
+  uint32_t diff = (rate > emu->bus_bitrate) ? (rate - emu->bus_bitrate) : (emu->bus_bitrate - rate);
+  return (diff * 100ULL) <= emu->bus_bitrate;
+}
+
+// Whatever the other node on each bus has sent since we last looked. Channels that aren't at
+// its bitrate (to within 1%) can't make sense of it and get a bus error instead.
+static void bus_traffic(struct gsusb_emu* emu) {
+  if(emu->bus_bitrate == 0) {
+    return;
+  }
+  uint64_t now = micros();
+  for(int c = 0; c < emu->channels; c++) {
+    if(!emu->started[c] || (now < emu->bus_next[c])) {
+      continue;
+    }
+    emu->bus_next[c] = now + EMU_BUS_PERIOD_US;
+
+    struct host_frame_fd frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.echo_id = htole32(HOST_FRAME_ECHO_ID_RX);
+    frame.channel = c;
+    if(bus_matches(emu, c)) {
+      frame.can_id = htole32(EMU_BUS_ID + c);
+      frame.can_dlc = 8;
+      memset(frame.data, emu->bus_count[c]++, 8);
+    } else {
+      frame.can_id = htole32(CAN_ERR_FLAG | CAN_ERR_PROT | CAN_ERR_BUSERROR);
+      frame.can_dlc = CAN_ERR_DLC;
+      frame.data[2] = CAN_ERR_PROT_STUFF;
+    }
+    uint32_t ts = htole32(device_clock(emu));
+    memcpy((uint8_t*)&frame + HOST_FRAME_SIZE, &ts, sizeof(ts));
+    fifo_push(emu, &frame);
+  }
+}
+
+struct gsusb_emu* gsusb_emu_create(int channels) {
+  if((channels < 1) || (channels > EMU_MAX_CHANNELS)) {
+    return NULL;
+  }
+  struct gsusb_emu* emu = calloc(1, sizeof(struct gsusb_emu));
+  if(emu == NULL) {
+    return NULL;
+  }
+  emu->channels = channels;
+  if(pipe(emu->pipefd) != 0) {
+    free(emu);
+    return NULL;
+  }
+  fcntl(emu->pipefd[0], F_SETFL, fcntl(emu->pipefd[0], F_GETFL) | O_NONBLOCK);
+  fcntl(emu->pipefd[1], F_SETFL, fcntl(emu->pipefd[1], F_GETFL) | O_NONBLOCK);
+  emu->clock_base = micros();
+  return emu;
+}
+
+void gsusb_emu_set_bus(struct gsusb_emu* emu, uint32_t bitrate) {
+  emu->bus_bitrate = bitrate;
+}
+
+void gsusb_emu_destroy(struct gsusb_emu* emu) {
+  if(emu == NULL) {
+    return;
+  }
+  close(emu->pipefd[0]);
+  close(emu->pipefd[1]);
+  free(emu);
+}
+
+int gsusb_emu_get_fd(struct gsusb_emu* emu) {
+  return emu->pipefd[0];
+}
+
+int gsusb_emu_get_max_packet_size(struct gsusb_emu* emu, unsigned char endpoint) {
+  if((endpoint != ENDPOINT_IN) && (endpoint != ENDPOINT_OUT)) {
+    return LIBUSB_ERROR_NOT_FOUND;
+  }
+  return EMU_MAX_PACKET;
+}
+
+int gsusb_emu_control_transfer(struct gsusb_emu* emu, uint8_t bmReqType, uint8_t bReq, uint16_t wVal, uint16_t wIndex, unsigned char* data, uint16_t wLen) {
+  if((bmReqType & 0x60) == 0x00) {
+    // Standard requests (i.e. SET_CONFIGURATION) are handled by the USB stack on a real device.
+    return 0;
+  }
+
+  // These are per channel, the channel is in wVal.
+  if(((bReq == USB2CAN_BREQ_BITTIMING) || (bReq == USB2CAN_BREQ_MODE) || (bReq == USB2CAN_BREQ_BT_CONST) ||
+      (bReq == USB2CAN_BREQ_DATA_BITTIMING) || (bReq == USB2CAN_BREQ_BT_CONST_EXT)) && (wVal >= emu->channels)) {
+    return LIBUSB_ERROR_PIPE;
+  }
+
+  switch(bReq) {
+    case USB2CAN_BREQ_HOST_FORMAT:
+    case USB2CAN_BREQ_BERR:
+    case USB2CAN_BREQ_IDENTIFY:
+      return wLen;
+
+    case USB2CAN_BREQ_BITTIMING:
+      if(wLen > sizeof(emu->bittiming[wVal])) {
+        return LIBUSB_ERROR_OVERFLOW;
+      }
+      memcpy(emu->bittiming[wVal], data, wLen);
+      return wLen;
+
+    case USB2CAN_BREQ_DATA_BITTIMING:
+      if(wLen > sizeof(emu->data_bittiming[wVal])) {
+        return LIBUSB_ERROR_OVERFLOW;
+      }
+      memcpy(emu->data_bittiming[wVal], data, wLen);
+      return wLen;
+
+    case USB2CAN_BREQ_MODE: {
+      if((wIndex != 0) || (wLen < 8)) {
+        return LIBUSB_ERROR_PIPE;
+      }
+      uint32_t mode;
+      uint32_t flags;
+      memcpy(&mode, &data[0], sizeof(mode));
+      memcpy(&flags, &data[4], sizeof(flags));
+      if(le32toh(mode) == USB2CAN_MODE_START) {
+        emu->started[wVal] = 1;
+        emu->mode_flags[wVal] = le32toh(flags);
+      } else {
+        emu->started[wVal] = 0;
+        emu->mode_flags[wVal] = 0;
+        // Drop this channel's frames, they may no longer be the right size.
+        uint32_t kept = 0;
+        for(uint32_t i = 0; i < emu->fifo_count; i++) {
+          struct host_frame_fd* frame = &emu->fifo[(emu->fifo_head + i) % EMU_MAX_FRAMES];
+          if(frame->channel != wVal) {
+            emu->fifo[(emu->fifo_head + kept) % EMU_MAX_FRAMES] = *frame;
+            kept++;
+          }
+        }
+        emu->fifo_count = kept;
+      }
+      return wLen;
+    }
+
+    case USB2CAN_BREQ_BT_CONST: {
+      struct usb2can_device_bt_const bt_const = {
+        .feature = htole32(EMU_FEATURES),
+        .fclk_can = htole32(EMU_FCLK_CAN),
+        .tseg1_min = htole32(1),
+        .tseg1_max = htole32(16),
+        .tseg2_min = htole32(1),
+        .tseg2_max = htole32(8),
+        .sjw_max = htole32(4),
+        .brp_min = htole32(1),
+        .brp_max = htole32(1024),
+        .brp_inc = htole32(1)
+      };
+      if(wLen > sizeof(bt_const)) {
+        wLen = sizeof(bt_const);
+      }
+      memcpy(data, &bt_const, wLen);
+      return wLen;
+    }
+
+    case USB2CAN_BREQ_BT_CONST_EXT: {
+      // The data phase limits are those of the STM32G0's FDCAN.
+      struct usb2can_device_bt_const_extended bt_const_ext = {
+        .feature = htole32(EMU_FEATURES),
+        .fclk_can = htole32(EMU_FCLK_CAN),
+        .tseg1_min = htole32(1),
+        .tseg1_max = htole32(16),
+        .tseg2_min = htole32(1),
+        .tseg2_max = htole32(8),
+        .sjw_max = htole32(4),
+        .brp_min = htole32(1),
+        .brp_max = htole32(1024),
+        .brp_inc = htole32(1),
+        .dtseg1_min = htole32(1),
+        .dtseg1_max = htole32(32),
+        .dtseg2_min = htole32(1),
+        .dtseg2_max = htole32(16),
+        .dsjw_max = htole32(16),
+        .dbrp_min = htole32(1),
+        .dbrp_max = htole32(32),
+        .dbrp_inc = htole32(1)
+      };
+      if(wLen > sizeof(bt_const_ext)) {
+        wLen = sizeof(bt_const_ext);
+      }
+      memcpy(data, &bt_const_ext, wLen);
+      return wLen;
+    }
+
+    case USB2CAN_BREQ_DEVICE_CONFIG: {
+      struct usb2can_device_config config = {
+        .icount = emu->channels - 1,  // icount is the number of channels - 1
+        .sw_version = htole32(2),
+        .hw_version = htole32(1)
+      };
+      if(wLen > sizeof(config)) {
+        wLen = sizeof(config);
+      }
+      memcpy(data, &config, wLen);
+      return wLen;
+    }
+
+    case USB2CAN_BREQ_TIMESTAMP: {
+      uint32_t ts = htole32(device_clock(emu));
+      if(wLen > sizeof(ts)) {
+        wLen = sizeof(ts);
+      }
+      memcpy(data, &ts, wLen);
+      return wLen;
+    }
+
+    default:
+      // The real devices stall on requests that they don't understand.
+      return LIBUSB_ERROR_PIPE;
+  }
+}
+
+int gsusb_emu_submit_transfer(struct gsusb_emu* emu, struct libusb_transfer* transfer) {
+  if(transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+    if(emu->done.count >= EMU_MAX_TRANSFERS) {
+      return LIBUSB_ERROR_BUSY;
+    }
+    // Control transfers complete straight away, the setup packet is at the start of the buffer.
+    struct libusb_control_setup* setup = libusb_control_transfer_get_setup(transfer);
+    int ret = gsusb_emu_control_transfer(emu, setup->bmRequestType, setup->bRequest, le16toh(setup->wValue), le16toh(setup->wIndex),
+                                         libusb_control_transfer_get_data(transfer), le16toh(setup->wLength));
+    if(ret < 0) {
+      transfer->actual_length = 0;
+      transfer->status = LIBUSB_TRANSFER_STALL;
+    } else {
+      transfer->actual_length = ret;
+      transfer->status = LIBUSB_TRANSFER_COMPLETED;
+    }
+    queue_push(&emu->done, transfer);
+    ring_doorbell(emu);
+    return LIBUSB_SUCCESS;
+  }
+  if(transfer->type != LIBUSB_TRANSFER_TYPE_BULK) {
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+  }
+
+  if(transfer->endpoint == ENDPOINT_IN) {
+    if(queue_push(&emu->in, transfer) != 0) {
+      return LIBUSB_ERROR_BUSY;
+    }
+  } else if(transfer->endpoint == ENDPOINT_OUT) {
+    if(emu->done.count >= EMU_MAX_TRANSFERS) {
+      return LIBUSB_ERROR_BUSY;
+    }
+    // Echo every frame we've been given, unless we've been told not to transmit. Like the
+    // real devices we treat each packet as one frame, anything after the frame is padding.
+    // A CAN FD frame can take more than one packet.
+    for(int pos = 0; pos + (int)HOST_FRAME_HEADER_SIZE <= transfer->length; ) {
+      struct host_frame_fd frame;
+      memset(&frame, 0, sizeof(frame));
+      memcpy(&frame, &transfer->buffer[pos], HOST_FRAME_HEADER_SIZE);
+      int size = host_frame_size(frame.flags, 0);
+      if(pos + size > transfer->length) {
+        break;
+      }
+      memcpy(&frame, &transfer->buffer[pos], size);
+      pos += packets(size);
+      if((frame.channel >= emu->channels) || !emu->started[frame.channel] || (emu->mode_flags[frame.channel] & USB2CAN_FEATURE_LISTEN_ONLY)) {
+        continue;
+      }
+      if((frame.flags & HOST_FRAME_FLAG_FD) && !(emu->mode_flags[frame.channel] & USB2CAN_FEATURE_FD)) {
+        continue; // A classic CAN controller can't send it.
+      }
+      // The timestamp follows the data, wherever that ends.
+      uint32_t ts = htole32(device_clock(emu));
+      if((emu->mode_flags[frame.channel] & USB2CAN_FEATURE_ONE_SHOT) && !bus_matches(emu, frame.channel)) {
+        // Nobody acknowledged it. Without one shot mode a real controller would keep trying, we
+        // pretend that it got through, but in one shot mode it gives up and reports the error.
+        uint8_t channel = frame.channel;
+        memset(&frame, 0, sizeof(frame));
+        frame.echo_id = htole32(HOST_FRAME_ECHO_ID_RX);
+        frame.can_id = htole32(CAN_ERR_FLAG | CAN_ERR_ACK);
+        frame.can_dlc = CAN_ERR_DLC;
+        frame.channel = channel;
+        memcpy((uint8_t*)&frame + HOST_FRAME_SIZE, &ts, sizeof(ts));
+        fifo_push(emu, &frame);
+        continue;
+      }
+      memcpy((uint8_t*)&frame + size, &ts, sizeof(ts));
+      fifo_push(emu, &frame);
+    }
+    transfer->actual_length = transfer->length;
+    transfer->status = LIBUSB_TRANSFER_COMPLETED;
+    queue_push(&emu->done, transfer);
+  } else {
+    return LIBUSB_ERROR_NOT_FOUND;
+  }
+
+  ring_doorbell(emu);
+  return LIBUSB_SUCCESS;
+}
+
+int gsusb_emu_cancel_transfer(struct gsusb_emu* emu, struct libusb_transfer* transfer) {
+  if(queue_remove(&emu->in, transfer) != 0) {
+    return LIBUSB_ERROR_NOT_FOUND;
+  }
+  transfer->actual_length = 0;
+  transfer->status = LIBUSB_TRANSFER_CANCELLED;
+  queue_push(&emu->done, transfer);
+  ring_doorbell(emu);
+  return LIBUSB_SUCCESS;
+}
+
+int gsusb_emu_handle_events(struct gsusb_emu* emu) {
+  uint8_t buf[16];
+  while(read(emu->pipefd[0], buf, sizeof(buf)) > 0) {
+    // Just emptying the doorbell
+  }
+  emu->signalled = 0;
+
+  bus_traffic(emu);
+
+  // Hand any waiting frames over to the IN transfers.
+  while((emu->in.count > 0) && (emu->fifo_count > 0) && (emu->done.count < EMU_MAX_TRANSFERS)) {
+    struct libusb_transfer* transfer = queue_pop(&emu->in);
+    if(transfer->length < frame_size(emu, &emu->fifo[emu->fifo_head])) {
+      transfer->actual_length = 0;
+      transfer->status = LIBUSB_TRANSFER_OVERFLOW;
+    } else {
+      int pos = 0;
+      while(emu->fifo_count > 0) {
+        struct host_frame_fd* frame = &emu->fifo[emu->fifo_head];
+        int size = frame_size(emu, frame);
+        int stride = size;
+        if(emu->mode_flags[frame->channel] & USB2CAN_FEATURE_PAD_PKTS_TO_MAX_PKT_SIZE) {
+          stride = packets(size);
+        }
+        if((pos + stride) > transfer->length) {
+          break;
+        }
+        memset(&transfer->buffer[pos], 0, stride);
+        memcpy(&transfer->buffer[pos], frame, size);
+        emu->fifo_head = (emu->fifo_head + 1) % EMU_MAX_FRAMES;
+        emu->fifo_count--;
+        pos += stride;
+      }
+      transfer->actual_length = pos;
+      transfer->status = LIBUSB_TRANSFER_COMPLETED;
+    }
+    queue_push(&emu->done, transfer);
+  }
+
+  // Call the callbacks for everything that's finished. The callbacks may well submit new
+  // transfers, those will be picked up the next time around.
+  uint32_t n = emu->done.count;
+  while(n-- > 0) {
+    struct libusb_transfer* transfer = queue_pop(&emu->done);
+    uint8_t flags = transfer->flags;
+    transfer->callback(transfer);
+    if(flags & LIBUSB_TRANSFER_FREE_TRANSFER) {
+      if(flags & LIBUSB_TRANSFER_FREE_BUFFER) {
+        free(transfer->buffer);
+        transfer->buffer = NULL;
+      }
+      libusb_free_transfer(transfer);
+    }
+  }
+
+  if((emu->done.count > 0) || ((emu->in.count > 0) && (emu->fifo_count > 0))) {
+    ring_doorbell(emu);
+  }
+
+  return LIBUSB_SUCCESS;
+}
+
+int gsusb_emu_get_next_timeout(struct gsusb_emu* emu, struct timeval* tv) {
+  // The other node on the bus is the only thing that happens on its own.
+  if(emu->bus_bitrate == 0) {
+    return 0;
+  }
+  uint64_t next = UINT64_MAX;
+  for(int c = 0; c < emu->channels; c++) {
+    if(emu->started[c] && (emu->bus_next[c] < next)) {
+      next = emu->bus_next[c];
+    }
+  }
+  if(next == UINT64_MAX) {
+    return 0;
+  }
+  uint64_t now = micros();
+  uint64_t us = (next > now) ? (next - now) : 0;
+  tv->tv_sec = us / 1000000;
+  tv->tv_usec = us % 1000000;
+  return 1;
+}
@@ -0,0 +1,51 @@
+// gsusb_emu.h
+//
+// A software emulated gs_usb/candleLight device. It sits behind the same asynchronous
+// transfer interface as libusb so that usb2can can be run and tested without any
+// hardware. Completions are signalled through a file descriptor that the caller adds to
+// its event loop, just like libusb's pollfds.
+
+#ifndef __GSUSB_EMU_H__
+#define __GSUSB_EMU_H__
+
+#include <stdint.h>
+#include "libusb.h"
+
+struct gsusb_emu;
+
+/// @brief Create an emulated device with 1 to 3 channels.
+/// @return The device or NULL if we ran out of memory or file descriptors.
+extern struct gsusb_emu* gsusb_emu_create(int channels);
+
+/// @brief Put another node on every channel's bus that sends a frame at this bitrate every 10ms. Channels set to
+/// a different bitrate get bus errors instead. 0, the default, for no other node.
+extern void gsusb_emu_set_bus(struct gsusb_emu* emu, uint32_t bitrate);
+
+/// @brief Free an emulated device. Any transfers still submitted are dropped without their callbacks being called.
+extern void gsusb_emu_destroy(struct gsusb_emu* emu);
+
+/// @brief The file descriptor that becomes readable when gsusb_emu_handle_events() has work to do.
+extern int gsusb_emu_get_fd(struct gsusb_emu* emu);
+
+/// @brief Works like libusb_get_max_packet_size().
+extern int gsusb_emu_get_max_packet_size(struct gsusb_emu* emu, unsigned char endpoint);
+
+/// @brief Works like libusb_control_transfer().
+/// @return The number of bytes transferred or a LIBUSB_ERROR code.
+extern int gsusb_emu_control_transfer(struct gsusb_emu* emu, uint8_t bmReqType, uint8_t bReq, uint16_t wVal, uint16_t wIndex, unsigned char* data, uint16_t wLen);
+
+/// @brief Works like libusb_submit_transfer(). Only control transfers and bulk transfers on ENDPOINT_IN and ENDPOINT_OUT are supported.
+extern int gsusb_emu_submit_transfer(struct gsusb_emu* emu, struct libusb_transfer* transfer);
+
+/// @brief Works like libusb_cancel_transfer(). The callback is called with LIBUSB_TRANSFER_CANCELLED from gsusb_emu_handle_events().
+extern int gsusb_emu_cancel_transfer(struct gsusb_emu* emu, struct libusb_transfer* transfer);
+
+/// @brief Works like libusb_handle_events(), never blocks. Calls the callbacks of every transfer that has completed.
+/// @return 0 on success or a LIBUSB_ERROR code.
+extern int gsusb_emu_handle_events(struct gsusb_emu* emu);
+
+/// @brief Works like libusb_get_next_timeout(), how long until gsusb_emu_handle_events() needs calling even if the file descriptor doesn't become readable.
+/// @return 1 if tv has been set, 0 if there's nothing to wait for.
+extern int gsusb_emu_get_next_timeout(struct gsusb_emu* emu, struct timeval* tv);
+
+#endif  // __GSUSB_EMU_H__
@@ -9,7 +9,6 @@
 #include <sys/socket.h> // Sockets
 #include <netinet/in.h>
 #include <sys/un.h>     // ?
-#include <sys/event.h>  // Events
 #include <assert.h>     // The assert function
 #include <unistd.h>     // ?
 #include <stdint.h>
@@ -23,20 +22,19 @@
 
 
 #include "usb2can.h"
+#include "usb2can_client.h"
 #include "utils/timestamp.h"
+#include "utils/reactor.h"
 #define LOG_LEVEL 3
 #include "utils/logs.h"
 
 #define BUFSIZE 1024
 
 // function prototypes
-int tcpopen(const char *host, int port);
-void sendbuftosck(int sckfd, const char *buf, int len);
-int sendcantosck(int sckfd, struct can_frame* frame);
+int parse_frame(const char* buf, struct canfd_frame* frame);
 
-#define KQUEUE_CH_SIZE 	3
-#define KQUEUE_EV_SIZE	3
-#define TIMER_FD  1234
+#define EV_SIZE	3
+#define RX_FRAMES	16
 
 void sigint_handler(int sig) {
   printf("\nSignal received (%i).\n", sig);
@@ -49,7 +47,7 @@ void sigint_handler(int sig) {
   }
 }
 
-void print_can_frame(const char* source, const char* type, struct can_frame *frame, uint8_t err, const char *format, ...) {
+void print_can_frame(const char* source, const char* type, struct canfd_frame *frame, uint8_t err, const char *format, ...) {
   FILE * fd = stdout;
 
   if(err || (frame->can_id & CAN_ERR_FLAG)) {
@@ -66,7 +64,7 @@ void print_can_frame(const char* source, const char* type, struct can_frame *fra
   }
   fprintf(fd, ", len: %2u", frame->len);
   fprintf(fd, ", Data: ");
-  for(int n = 0; n < CAN_MAX_DLC; n++) {
+  for(int n = 0; (n < frame->len) && (n < CANFD_MAX_DLEN); n++) {
     fprintf(fd, "%02x, ", frame->data[n]);
   }
 
@@ -89,38 +87,52 @@ int main(int argc, char *argv[])
   // Create the signal handler here - ensures that Ctrl-C gets passed back up to 
   signal(SIGINT, sigint_handler);
 
-  struct kevent chlist[KQUEUE_CH_SIZE]; // events we want to monitor
-  struct kevent evlist[KQUEUE_EV_SIZE]; // events that were triggered
+  struct reactor r;
+  struct reactor_event evlist[EV_SIZE]; // events that were triggered
   char buf[BUFSIZE]; 
-  int sckfd, kq, nev, i;
-  struct can_frame frame;	// The incoming frame
+  struct usb2can_client client;
+  int sckfd, timer, nev, i;
+  struct canfd_frame frame;	// The outgoing frame
+  struct canfd_frame frames[RX_FRAMES];	// The incoming frames
   int period_ms = 10;
 
   LOGI(__FUNCTION__, "INFO", "starting...\n");
 
   // check argument count
-  if (argc != 3) { 
+  if ((argc != 2) && (argc != 3)) { 
     fprintf(stderr, "USB2CAN Test app\n\n");
     fprintf(stderr, "usage: %s host port\n", argv[0]);
+    fprintf(stderr, "       %s path     (usb2can's Unix domain socket, using the shared memory if usb2can has m)\n", argv[0]);
+    fprintf(stderr, "Lines typed on stdin are sent as frames, id#data in hex (i.e. 123#deadbeef).\n");
     exit(EXIT_FAILURE);
   }
 
-  // open a connection to a host:port pair
-  sckfd = tcpopen(argv[1], atoi(argv[2]));
+  // open a connection to a host:port pair, or the Unix domain socket
+  if (argc == 3) {
+    if (usb2can_client_open_tcp(&client, argv[1], atoi(argv[2])) != 0) {
+      perror("usb2can_client_open_tcp()");
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    if (usb2can_client_open_unix(&client, argv[1]) != 0) {
+      perror("usb2can_client_open_unix()");
+      exit(EXIT_FAILURE);
+    }
+    usb2can_client_attach_shm(&client);
+  }
+  sckfd = usb2can_client_fd(&client);
 
   // create a new kernel event queue
-  if ((kq = kqueue()) == -1) {
-    LOGE(__FUNCTION__, "INFO", "Unable to create kqueue\n");
+  if (reactor_init(&r) == -1) {
+    LOGE(__FUNCTION__, "INFO", "Unable to create the event queue\n");
     exit(EXIT_FAILURE);
   }
 
-  // initialise kevent structures
-  EV_SET(&chlist[0], sckfd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, 0);
-  EV_SET(&chlist[1], fileno(stdin), EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, 0);
-  EV_SET(&chlist[2], TIMER_FD, EVFILT_TIMER, EV_ADD | EV_ENABLE, 0, period_ms, 0);
-  nev = kevent(kq, chlist, KQUEUE_CH_SIZE, NULL, 0, NULL);
-  if (nev < 0) {
-    LOGE(__FUNCTION__, "INFO", "Unable to listen to kqueue\n");
+  // watch the socket, stdin and a timer
+  if ((reactor_add(&r, sckfd, REACTOR_READ, NULL) == -1) ||
+      (reactor_add(&r, fileno(stdin), REACTOR_READ, NULL) == -1) ||
+      ((timer = reactor_add_timer(&r, period_ms, NULL)) == -1)) {
+    LOGE(__FUNCTION__, "INFO", "Unable to listen to the event queue\n");
     exit(EXIT_FAILURE);
   }
 
@@ -129,99 +141,78 @@ int main(int argc, char *argv[])
   // loop forever
   for (;;)
   {
-    nev = kevent(kq, NULL, 0, evlist, KQUEUE_EV_SIZE, NULL);
+    // Don't wait if the library already has something for us.
+    nev = reactor_wait(&r, evlist, EV_SIZE, usb2can_client_ready(&client) ? 0 : -1);
 
     if (nev < 0) {
-      LOGE(__FUNCTION__, "INFO", "Unable to listen to kqueue 2\n");
+      LOGE(__FUNCTION__, "INFO", "Unable to listen to the event queue 2\n");
       exit(EXIT_FAILURE);
     }
-    else if (nev > 0)
-    {
-      for (i = 0; i < nev; i++) {
-        if (evlist[i].flags & EV_EOF) {
-          LOGE(__FUNCTION__, "INFO", "Read direction of socket has shutdown\n");
-          exit(EXIT_FAILURE);
-        }
 
-        if (evlist[i].flags & EV_ERROR) {                /* report errors */
-          LOGE(__FUNCTION__, "INFO", "EV_ERROR: %s\n", strerror(evlist[i].data));
-          exit(EXIT_FAILURE);
+    for (i = 0; i < nev; i++) {
+      if((evlist[i].events & REACTOR_TIMER) && (evlist[i].fd == timer)) {
+        // LOGI(__FUNCTION__, "INFO", "Timeout.\n");
+        memset(&frame, 0, sizeof(frame));
+        frame.can_id = 0x01U;
+        frame.len = 8;
+        frame.data[0] = (uint8_t)((count >> 24) & 0x000000FF);
+        frame.data[1] = (uint8_t)((count >> 16) & 0x000000FF);
+        frame.data[2] = (uint8_t)((count >> 8) & 0x000000FF);
+        frame.data[3] = (uint8_t)(count & 0x000000FF);
+        frame.data[4] = 0x01;
+        frame.data[5] = 0x23;
+        frame.data[6] = 0x45;
+        frame.data[7] = 0x67;
+        count++;
+        print_can_frame("PIPE", "OUT", &frame, 0, "");
+        usb2can_client_send(&client, &frame, 1, -1);
+      } else if (evlist[i].fd == fileno(stdin)) {     /* we have data from stdin */
+        memset(buf, 0, BUFSIZE);
+        if (fgets(buf, BUFSIZE, stdin) == NULL) {
+          exit(EXIT_SUCCESS);
         }
-  
-        if(evlist[i].ident == TIMER_FD) {
-          // LOGI(__FUNCTION__, "INFO", "Timeout.\n");
-          frame.can_id = 0x01U;
-          frame.len = 8;
-          frame.data[0] = (uint8_t)((count >> 24) & 0x000000FF);
-          frame.data[1] = (uint8_t)((count >> 16) & 0x000000FF);
-          frame.data[2] = (uint8_t)((count >> 8) & 0x000000FF);
-          frame.data[3] = (uint8_t)(count & 0x000000FF);
-          frame.data[4] = 0x01;
-          frame.data[5] = 0x23;
-          frame.data[6] = 0x45;
-          frame.data[7] = 0x67;
-          count++;
-          sendcantosck(sckfd, &frame);
-        } else if (evlist[i].ident == sckfd) {                  /* we have data from the host */
-          memset(buf, 0, BUFSIZE);
-          int i = recv(sckfd, &frame, sizeof(frame), 0);
-          if (i < 0){                /* report errors */
-            LOGE(__FUNCTION__, "INFO", "recv()\n");
-            exit(EXIT_FAILURE);
-          }
-
-          print_can_frame("PIPE", "IN", &frame, 0, "");
-        } else if (evlist[i].ident == fileno(stdin)) {     /* we have data from stdin */
-          memset(buf, 0, BUFSIZE);
-          fgets(buf, BUFSIZE, stdin);
-          sendbuftosck(sckfd, buf, strlen(buf));
+        if (parse_frame(buf, &frame) != 0) {
+          LOGE(__FUNCTION__, "INFO", "Frames are id#data in hex, i.e. 123#deadbeef\n");
+        } else {
+          print_can_frame("PIPE", "OUT", &frame, 0, "");
+          usb2can_client_send(&client, &frame, 1, -1);
         }
       }
     }
+
+    // we have data from the host, or the shared memory
+    int n = usb2can_client_recv(&client, frames, RX_FRAMES, 0);
+    if (n < 0) {
+      LOGE(__FUNCTION__, "INFO", "usb2can has gone away\n");
+      exit(EXIT_FAILURE);
+    }
+    for (int f = 0; f < n; f++) {
+      print_can_frame("PIPE", "IN", &frames[f], 0, "");
+    }
   }
 
-  close(kq);
+  usb2can_client_close(&client);
+  reactor_close(&r);
   return EXIT_SUCCESS;
 }
 
-void diep(const char *s) {
-  perror(s); exit(EXIT_FAILURE);
-}
-
-int tcpopen(const char *host, int port) {
-  struct sockaddr_in server;
-  int sckfd;
-
-  struct hostent *hp = gethostbyname(host);
-  if (hp == NULL)
-    diep("gethostbyname()");
-
-  if ((sckfd = socket(PF_INET, SOCK_STREAM, 0)) < 0)
-    diep("socket()");
-
-  server.sin_family = AF_INET;
-  server.sin_port = htons(port);
-  server.sin_addr = (*(struct in_addr *)hp->h_addr);
-  memset(&(server.sin_zero), 0, 8);
-
-  if (connect(sckfd, (struct sockaddr *)&server, sizeof(struct sockaddr)) < 0)
-    diep("connect()");
-
-  return sckfd;
-}
-
-int sendcantosck(int sckfd, struct can_frame* frame) {
-  print_can_frame("PIPE", "OUT", frame, 0, "");
-  return send(sckfd, frame, sizeof(struct can_frame), 0);
-}
-
-void sendbuftosck(int sckfd, const char *buf, int len) {
-  int bytessent, pos;
-
-  pos = 0;
-  do {
-    if ((bytessent = send(sckfd, buf + pos, len - pos, 0)) < 0)
-      diep("send()");
-    pos += bytessent;
-  } while (bytessent > 0);
+// Parse a frame typed as id#data in hex, i.e. 123#deadbeef. Ids over 7ff are extended.
+int parse_frame(const char* buf, struct canfd_frame* frame) {
+  char* end;
+  memset(frame, 0, sizeof(*frame));
+  unsigned long id = strtoul(buf, &end, 16);
+  if ((end == buf) || (*end != '#') || (id > CAN_EFF_MASK)) {
+    return -1;
+  }
+  frame->can_id = (uint32_t)id | ((id > CAN_SFF_MASK) ? CAN_EFF_FLAG : 0);
+  const char* p = end + 1;
+  while ((p[0] != '\0') && (p[0] != '\n') && (p[0] != '\r')) {
+    unsigned int byte;
+    if ((frame->len >= CAN_MAX_DLEN) || (sscanf(p, "%2x", &byte) != 1) || (p[1] == '\0')) {
+      return -1;
+    }
+    frame->data[frame->len++] = (uint8_t)byte;
+    p += 2;
+  }
+  return 0;
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE   // sendmmsg() on Linux
 #define LOG_LEVEL 3
 #include "utils/logs.h"
 #include "utils/timestamp.h"
@@ -12,19 +13,30 @@
 #include <sys/socket.h> // Sockets
 #include <netinet/in.h> // More sockets
 #include <sys/un.h>     // ?
-#include <sys/event.h>  // Events
 #include <assert.h>     // The assert function
 #include <unistd.h>     // ?
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/endian.h>
 #include <netdb.h>
 #include <signal.h>
 #include "usb2can.h"
 #include <stdarg.h>
 #include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include "gsusb.h"
+#include "gsusb_emu.h"
+#include "utils/clocksync.h"
+#include "utils/bittiming.h"
+#include "utils/timerwheel.h"
+#include "utils/reactor.h"
+#include "utils/compat.h"
+#include "utils/canfilter.h"
+#include "usb2can_shm.h"
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 // Supported USB products
 #define USB_VENDOR_ID_GS_USB_1            0x1D50
@@ -36,249 +48,232 @@
 #define USB_VENDOR_ID_ABE_CANDEBUGGER_FD  0x16d0
 #define USB_PRODUCT_ID_ABE_CANDEBUGGER_FD 0x10b8
 
-// The endpoint for these devices
-#define ENDPOINT_FLAG_IN        0x80
-#define ENDPOINT_IN     (0x01 | ENDPOINT_FLAG_IN)
-#define ENDPOINT_OUT    0x02
+static const struct {
+  uint16_t vendor;
+  uint16_t product;
+} supported_devices[] = {
+  { USB_VENDOR_ID_GS_USB_1, USB_PRODUCT_ID_GS_USB_1 },
+  { USB_VENDOR_ID_CANDLELIGHT, USB_PRODUCT_ID_CANDLELIGHT },
+  { USB_VENDOR_ID_CES_CANEXT_FD, USB_PRODUCT_ID_CES_CANEXT_FD },
+  { USB_VENDOR_ID_ABE_CANDEBUGGER_FD, USB_PRODUCT_ID_ABE_CANDEBUGGER_FD }
+};
+#define SUPPORTED_DEVICES (sizeof(supported_devices) / sizeof(supported_devices[0]))
 
-#define MAX_EVENTS      (32)
+// The most devices that we'll serve at once.
+#define USB2CAN_MAX_DEVICES (16)
+// Long enough for any serial number string descriptor that we've seen.
+#define USB2CAN_SERIAL_LEN  (64)
 
-#define TIMER_FD (1234)
+#define MAX_EVENTS      (32)
 
 // Declarations
 struct usb2can_can;
+struct usb2can_channel;
 struct usb2can_tx_context;
 
-// Device Specific Constants
-enum usb2can_breq {
-  USB2CAN_BREQ_HOST_FORMAT = 0,
-  USB2CAN_BREQ_BITTIMING,
-  USB2CAN_BREQ_MODE,
-  USB2CAN_BREQ_BERR,
-  USB2CAN_BREQ_BT_CONST,
-  USB2CAN_BREQ_DEVICE_CONFIG,
-  USB2CAN_BREQ_TIMESTAMP,
-  USB2CAN_BREQ_IDENTIFY,
-  USB2CAN_BREQ_GET_USER_ID,
-  USB2CAN_BREQ_SET_USER_ID,
-  USB2CAN_BREQ_DATA_BITTIMING,
-  USB2CAN_BREQ_BT_CONST_EXT,
-  USB2CAN_BREQ_SET_TERMINATION,
-  USB2CAN_BREQ_GET_TERMINATION,
-  USB2CAN_BREQ_GET_STATE,
+// Each channel has a pool of tx contexts, one for every frame that we've sent and are waiting
+// for the device to echo back. The size of the pool is set when we start (tx_depth), it limits
+// how many frames each channel can have in flight.
+#define USB2CAN_TX_DEPTH_DEFAULT  (10)
+// The echo_id is the index of the context in the pool in the bottom USB2CAN_TX_INDEX_BITS with a
+// generation above that, which changes every time the context is used, so that a late echo for a
+// frame that we've already given up on can't release the frame that's using the context now.
+// The top bit is always clear so it can't be mistaken for HOST_FRAME_ECHO_ID_RX.
+#define USB2CAN_TX_INDEX_BITS     (12)
+#define USB2CAN_TX_INDEX_MASK     ((1U << USB2CAN_TX_INDEX_BITS) - 1)
+#define USB2CAN_TX_GENERATION_MASK  (0x7FFFFFFFU & ~USB2CAN_TX_INDEX_MASK)
+#define USB2CAN_MAX_TX_DEPTH      (1 << USB2CAN_TX_INDEX_BITS)
+// The most frames that we put in one OUT transfer.
+#define USB2CAN_TX_BATCH_FRAMES   (10)
+// The number of IN transfers that we keep submitted at all times. The device can only
+// send to us when there's a transfer waiting, so we keep several queued so that it never
+// has to wait for us to resubmit one, otherwise echoes get lost when its FIFO fills.
+#define USB2CAN_RX_TRANSFERS  (8)
+// Each IN transfer's buffer is this many of the endpoint's max packet size. The device can
+// then give us several frames in one transfer, which we walk through in rx_callback().
+#define USB2CAN_RX_BUFFER_PACKETS (16)
+// The number of frames that each channel holds, in arbitration order, waiting for a tx context.
+#define USB2CAN_TX_PENDING  (256)
+// How long the device gets to accept an OUT transfer before we give up on it.
+#define USB2CAN_OUT_TIMEOUT_MS  (100)
+// How long the device gets to answer a control request, so that one that has wedged can't hang us.
+#define USB2CAN_CTRL_TIMEOUT_MS (1000)
+// How often we read the device's clock to keep our estimate of its offset and drift up to date.
+// We read it more often to begin with so that timestamps are accurate as soon as possible.
+#define USB2CAN_CLOCK_SYNC_MS         (1000)
+#define USB2CAN_CLOCK_SYNC_FAST_MS    (100)
+
+// There may be some 3 channel devices out there but not more.
+#define USB2CAN_MAX_CHANNELS (3)
+
+/// @brief Who sent a frame, so that we can tell them what became of it (see USB2CAN_CTRL_TX_STATUS).
+struct usb2can_tx_owner {
+  int32_t client;     // Index into clients[], -1 if nobody wants to know.
+  uint32_t conn;      // clients[client].conn when it was sent, so that a connection that reuses the slot isn't told.
+  uint32_t number;    // The frame's number on that connection.
+  uint64_t queued;    // When we read it from the client, nanos().
+  uint8_t status;     // Tell the client what became of it, see USB2CAN_CTRL_TX_STATUS.
+  uint8_t loopback;   // Pass it on to the other clients once it's been sent, see USB2CAN_CTRL_LOOPBACK.
 };
 
-enum usb2can_mode {
-  USB2CAN_MODE_RESET = 0, // Reset a channel, tunrs it off
-  USB2CAN_MODE_START,   // Start a channel
+/// @brief The transmit context. We keep track of each transmission until the device echoes it back or we give up on it.
+struct usb2can_tx_context {
+  struct usb2can_channel* channel;  // NULL while the context is free.
+  uint32_t echo_id;       // The echo_id that the frame is sent with, when free it's the one that the next frame will use.
+  uint64_t timestamp;     // When we give up waiting for the echo, in millis().
+  int32_t prev;           // While in use these link the contexts in flight, oldest first. When free next
+  int32_t next;           // links the free list. -1 at the ends.
+  struct usb2can_tx_owner owner;
+  struct canfd_frame frame;
 };
 
-// We only send a maximum of USB2CAN_MAX_TX_REQ per channel at any one time.
-// We keep track of how many are in play at a time by setting the echo_id and
-// looking for it when it comes back.
-#define USB2CAN_MAX_TX_REQ  (10)
-// We have to read more than we write or we won't get our Tx messages echoed back to us. We tend to read 30 times for each 1 write.
-#define USB2CAN_MAX_RX_REQ  (30)
+/// @brief A frame waiting for a tx context, see tx_schedule().
+struct usb2can_tx_pending {
+  uint32_t priority;  // From tx_priority(), lowest goes first.
+  uint64_t seq;       // The order that frames were queued in, so that frames with the same id stay in order.
+  struct usb2can_tx_owner owner;
+  struct canfd_frame frame;
+};
 
-// There may be some 3 channel devices out there but not more.
-#define USB2CAN_MAX_CHANNELS (3)
+/// @brief Per channel counters, logged when we exit.
+struct usb2can_channel_stats {
+  uint64_t rx_frames;     // Frames received from the bus.
+  uint64_t tx_frames;     // Frames queued for transmission.
+  uint64_t tx_echoes;     // Transmissions that the device has confirmed.
+  uint64_t tx_timeouts;   // Transmissions that weren't confirmed in time.
+  uint64_t tx_errors;     // Transmissions that never made it to the device.
+  uint64_t err_frames;    // Error frames from the device.
+  uint64_t overflows;     // Frames with HOST_FRAME_FLAG_OVERFLOW set, i.e. the device lost some.
+};
 
-// Bit Timing Const Definitions
-#define USB2CAN_FEATURE_LISTEN_ONLY (1 << 0)
-#define USB2CAN_FEATURE_LOOP_BACK (1 << 1)
-#define USB2CAN_FEATURE_TRIPLE_SAMPLE (1 << 2)
-#define USB2CAN_FEATURE_ONE_SHOT (1 << 3)
-#define USB2CAN_FEATURE_HW_TIMESTAMP (1 << 4)
-#define USB2CAN_FEATURE_IDENTIFY (1 << 5)
-#define USB2CAN_FEATURE_USER_ID (1 << 6)
-#define USB2CAN_FEATURE_PAD_PKTS_TO_MAX_PKT_SIZE (1 << 7)
-#define USB2CAN_FEATURE_FD (1 << 8)
-#define USB2CAN_FEATURE_REQ_USB_QUIRK_LPC546XX (1 << 9)
-#define USB2CAN_FEATURE_BT_CONST_EXT (1 << 10)
-#define USB2CAN_FEATURE_TERMINATION (1 << 11)
-#define USB2CAN_FEATURE_BERR_REPORTING (1 << 12)
-#define USB2CAN_FEATURE_GET_STATE (1 << 13)
-
-/// @brief Bit Timing struct
-struct usb2can_device_bt_const {
-  uint32_t feature;
-  uint32_t fclk_can;
-  uint32_t tseg1_min;
-  uint32_t tseg1_max;
-  uint32_t tseg2_min;
-  uint32_t tseg2_max;
-  uint32_t sjw_max;
-  uint32_t brp_min;
-  uint32_t brp_max;
-  uint32_t brp_inc;
-} __packed;
-
-/// @brief USB device information
-struct usb2can_device_config {
-  uint8_t reserved1;
-  uint8_t reserved2;
-  uint8_t reserved3;
-  uint8_t icount;       // The number of interfaces available on this device (can be up to 3)
-  uint32_t sw_version;
-  uint32_t hw_version;
-} __packed;
-
-/// @brief The transmit context. We keep track of transmissions as we can only have USB2CAN_MAX_TX_REQ transmissions at a time
-struct usb2can_tx_context {
+/// @brief A single CAN bus on the device. Each channel has its own bit timing, mode and tx contexts
+/// but they all share the device's USB transfers.
+struct usb2can_channel {
   struct usb2can_can* can;
-  uint32_t echo_id;
-  uint64_t timestamp;
-  struct can_frame* frame;
+  uint8_t index;          // The channel number, host_frame.channel on the USB side and can_frame.channel for our clients.
+  uint8_t open;           // Set once port_open() has succeeded.
+  uint32_t tx_timeout;    // How long the device has to confirm a frame in ms, see set_tx_timeout().
+  uint32_t bitrate;       // The nominal bitrate in bits/s, while auto-baud is searching it's the one being tried.
+  uint16_t sample_point;  // In tenths of a percent, BITTIMING_SAMPLE_POINT_DEFAULT picks one for the bitrate.
+  uint32_t mode_flags;    // Flags for this channel only, sent along with the device's mode_flags.
+  struct usb2can_device_bt_const bt_const;
+  struct usb2can_device_bt_const_extended bt_const_ext;  // Only read if we're going to use CAN FD.
+  uint32_t data_bitrate;  // The CAN FD data phase bitrate in bits/s, 0 for classic CAN only.
+  uint16_t data_sample_point; // As sample_point for the data phase.
+  int8_t autobaud;        // While auto-baud is searching, the index into autobaud_rates[] being tried. -1 otherwise.
+  uint64_t autobaud_start;    // When we started listening at this bitrate (nanos()), anything that arrived before was at the last one.
+  uint64_t autobaud_deadline; // When to give up on this bitrate (millis()) if we've seen nothing.
+  uint32_t autobaud_frames;   // Frames received at this bitrate.
+  uint32_t autobaud_errors;   // Error frames received at this bitrate.
+  struct usb2can_tx_context* tx_context;  // The pool of tx_depth contexts, indexed by the bottom of the echo_id.
+  uint32_t tx_depth;
+  int32_t tx_free;        // The first free context, -1 if they're all in use.
+  int32_t tx_oldest;      // The contexts in flight in the order that they were sent, which is also the order that they time out.
+  int32_t tx_newest;
+  uint32_t tx_contexts_used;  // The number of tx_contexts in use.
+  struct usb2can_tx_pending* tx_pending;  // USB2CAN_TX_PENDING frames waiting for a tx context.
+  uint16_t* tx_heap;      // Indexes into tx_pending, a binary heap with the frame that goes first at the top.
+  uint16_t* tx_spare;     // Indexes of the tx_pending that aren't in tx_heap.
+  uint32_t tx_heap_count;
+  uint64_t tx_seq;
+  struct usb2can_channel_stats stats;
 };
 
 /// @brief Struct to keep track of the connection
 struct usb2can_can {
+  libusb_context* ctx;
   struct libusb_device_handle* devh;
-  struct usb2can_device_bt_const bt_const;
+  struct gsusb_emu* emu;  // If this is set then we're talking to the emulated device instead of devh.
+  libusb_device* dev;     // The device that devh was opened from (we hold a reference), NULL for the emulated device.
+  int interface;          // The interface that we've claimed.
+  char serial[USB2CAN_SERIAL_LEN];  // The device's serial number, which is how we name it.
+  uint32_t id;            // usb2can_device_id(serial), how clients refer to the device.
   struct usb2can_device_config device_config;
-  struct usb2can_tx_context tx_context[USB2CAN_MAX_TX_REQ];
+  struct usb2can_channel channels[USB2CAN_MAX_CHANNELS];
+  int channel_count;      // The number of channels the device has, from device_config.icount.
+  struct libusb_transfer* rx_transfers[USB2CAN_RX_TRANSFERS];
+  uint8_t* rx_buffers[USB2CAN_RX_TRANSFERS];
+  int rx_buffer_len;      // The size of each of the rx_buffers.
+  int in_max_packet;      // wMaxPacketSize of ENDPOINT_IN.
+  uint32_t mode_flags;    // The flags that we start every channel with. These use the same bits as the USB2CAN_FEATURE_ flags.
+  struct clocksync clock; // Maps the device's timestamps on to our clock.
+  struct libusb_transfer* clock_transfer; // Used to read the device's clock, see sync_device_clock().
+  uint8_t clock_active;   // Set while clock_transfer is submitted.
+  uint64_t clock_request_ns;  // When we submitted clock_transfer.
+  uint64_t clock_next_ms; // When we next need to read the device's clock.
+  int rx_active;    // The number of IN transfers currently submitted.
+  struct libusb_transfer** tx_free; // OUT transfers that aren't in use, room for tx_transfers.
+  int tx_free_count;
+  int tx_transfers;       // The number of OUT transfers that we allocated.
+  struct libusb_transfer* tx_batch; // The OUT transfer that we're currently filling, or NULL.
+  int tx_batch_frames;    // The number of frames in tx_batch.
+  int tx_batch_len;       // The number of bytes of tx_batch in use, the last frame isn't padded.
+  int tx_buffer_len;      // The size of each OUT transfer's buffer.
+  int out_max_packet;     // wMaxPacketSize of ENDPOINT_OUT.
+  int tx_active;    // The number of OUT transfers currently submitted.
+  uint8_t stopping; // Set when we're shutting down so the IN transfers aren't resubmitted.
+  uint8_t dead;     // Set when the device has gone away.
+  uint64_t rx_seq;  // The number of the last frame that we passed on to the clients, see usb2can_v2_entry.seq.
 };
 
-/// @brief This is the CAN frame that is sent over the USB
-struct host_frame {
-  uint32_t echo_id; // So that we can recognise messages that we have sent.
-  uint32_t can_id;
-  uint8_t can_dlc;
-  uint8_t channel;
-  uint8_t flags;
-  uint8_t reserved;
-  uint8_t data[8];
-  // uint32_t timestamp;
-} __packed;
-
-#define HOST_FRAME_FLAG_OVERFLOW  (0x01)
-#define HOST_FRAME_FLAG_FD        (0x02)
-#define HOST_FRAME_FLAG_BRS       (0x04)
-#define HOST_FRAME_FLAG_ESI       (0x08)
-
-#define BITRATE_DATA_LEN  (20)
-int8_t bitrate = 12;
-// It is possible that these definitions may be different to different devices. One the few I've tried they've all been fine though.
-unsigned char bitrates[16][BITRATE_DATA_LEN] = {
-  { // 20k
-    0x06, 0x00, 0x00, 0x00, // Prop seg
-    0x07, 0x00, 0x00, 0x00, // Phase Seg 1
-    0x02, 0x00, 0x00, 0x00, // Seg 2
-    0x01, 0x00, 0x00, 0x00, // SJW
-    0x96, 0x00, 0x00, 0x00  // BRP
-  },
-  { // 33.33k
-    0x03, 0x00, 0x00, 0x00, // Prop seg
-    0x03, 0x00, 0x00, 0x00, // Phase Seg 1
-    0x01, 0x00, 0x00, 0x00, // Seg 2
-    0x01, 0x00, 0x00, 0x00, // SJW
-    0xB4, 0x00, 0x00, 0x00  // BRP
-  },
-  { // 40k
-    0x06, 0x00, 0x00, 0x00, // Prop seg
-    0x07, 0x00, 0x00, 0x00, // Phase Seg 1
-    0x02, 0x00, 0x00, 0x00, // Seg 2
-    0x01, 0x00, 0x00, 0x00, // SJW
-    0x4B, 0x00, 0x00, 0x00  // BRP
-  },
-  { // 50k
-    0x06, 0x00, 0x00, 0x00, // Prop seg
-    0x07, 0x00, 0x00, 0x00, // Phase Seg 1
-    0x02, 0x00, 0x00, 0x00, // Seg 2
-    0x01, 0x00, 0x00, 0x00, // SJW
-    0x3C, 0x00, 0x00, 0x00  // BRP
-  },
-  { // 66.66k
-    0x03, 0x00, 0x00, 0x00, // Prop seg
-    0x03, 0x00, 0x00, 0x00, // Phase Seg 1
-    0x01, 0x00, 0x00, 0x00, // Seg 2
-    0x01, 0x00, 0x00, 0x00, // SJW
-    0x5A, 0x00, 0x00, 0x00  // BRP
-  },
-  { // 80k
-    0x03, 0x00, 0x00, 0x00, // Prop seg
-    0x03, 0x00, 0x00, 0x00, // Phase Seg 1
-    0x01, 0x00, 0x00, 0x00, // Seg 2
-    0x01, 0x00, 0x00, 0x00, // SJW
-    0x4B, 0x00, 0x00, 0x00  // BRP
-  },
-  { // 83.33k
-    0x03, 0x00, 0x00, 0x00, // Prop seg
-    0x03, 0x00, 0x00, 0x00, // Phase Seg 1
-    0x01, 0x00, 0x00, 0x00, // Seg 2
-    0x01, 0x00, 0x00, 0x00, // SJW
-    0x48, 0x00, 0x00, 0x00  // BRP
-  },
-  { // 100k
-    0x06, 0x00, 0x00, 0x00, // Prop seg
-    0x07, 0x00, 0x00, 0x00, // Phase Seg 1
-    0x02, 0x00, 0x00, 0x00, // Seg 2
-    0x01, 0x00, 0x00, 0x00, // SJW
-    0x1E, 0x00, 0x00, 0x00  // BRP
-  },
-  { // 125k
-    0x06, 0x00, 0x00, 0x00, // Prop seg
-    0x07, 0x00, 0x00, 0x00, // Phase Seg 1
-    0x02, 0x00, 0x00, 0x00, // Seg 2
-    0x01, 0x00, 0x00, 0x00, // SJW
-    0x18, 0x00, 0x00, 0x00  // BRP
-  },
-  { // 200k
-    0x06, 0x00, 0x00, 0x00, // Prop seg
-    0x07, 0x00, 0x00, 0x00, // Phase Seg 1
-    0x02, 0x00, 0x00, 0x00, // Seg 2
-    0x01, 0x00, 0x00, 0x00, // SJW
-    0x0f, 0x00, 0x00, 0x00  // BRP
-  },
-  { // 250k
-    0x06, 0x00, 0x00, 0x00, // Prop seg
-    0x07, 0x00, 0x00, 0x00, // Phase Seg 1
-    0x01, 0x00, 0x00, 0x00, // Seg 2
-    0x01, 0x00, 0x00, 0x00, // SJW
-    0x0C, 0x00, 0x00, 0x00  // BRP
-  },
-  { // 400k
-    0x03, 0x00, 0x00, 0x00, // Prop seg
-    0x03, 0x00, 0x00, 0x00, // Phase Seg 1
-    0x01, 0x00, 0x00, 0x00, // Seg 2
-    0x01, 0x00, 0x00, 0x00, // SJW
-    0x0F, 0x00, 0x00, 0x00  // BRP
-  },
-  { // 500k (default)
-    0x06, 0x00, 0x00, 0x00, // Prop seg
-    0x07, 0x00, 0x00, 0x00, // Phase Seg 1
-    0x02, 0x00, 0x00, 0x00, // Seg 2
-    0x01, 0x00, 0x00, 0x00, // SJW
-    0x06, 0x00, 0x00, 0x00  // BRP
-  },
-  { // 666k
-    0x03, 0x00, 0x00, 0x00, // Prop seg
-    0x03, 0x00, 0x00, 0x00, // Phase Seg 1
-    0x02, 0x00, 0x00, 0x00, // Seg 2
-    0x01, 0x00, 0x00, 0x00, // SJW
-    0x08, 0x00, 0x00, 0x00  // BRP
-  },
-  { // 800k
-    0x07, 0x00, 0x00, 0x00, // Prop seg
-    0x08, 0x00, 0x00, 0x00, // Phase Seg 1
-    0x04, 0x00, 0x00, 0x00, // Seg 2
-    0x01, 0x00, 0x00, 0x00, // SJW
-    0x03, 0x00, 0x00, 0x00  // BRP
-  },
-  { // 1m
-    0x05, 0x00, 0x00, 0x00, // Prop seg
-    0x06, 0x00, 0x00, 0x00, // Phase Seg 1
-    0x04, 0x00, 0x00, 0x00, // Seg 2
-    0x01, 0x00, 0x00, 0x00, // SJW
-    0x03, 0x00, 0x00, 0x00  // BRP
-  }
-};
+// The devices that we're serving. Empty slots are NULL.
+struct usb2can_can* devices[USB2CAN_MAX_DEVICES];
+
+#define BITRATE_DEFAULT   (500000)
+// The bitrate that asks for auto-baud instead of a fixed rate.
+#define BITRATE_AUTO      (0)
+// The nominal bitrate for each channel in bits/s.
+uint32_t bitrate[USB2CAN_MAX_CHANNELS] = { BITRATE_DEFAULT, BITRATE_DEFAULT, BITRATE_DEFAULT };
+// The sample point for each channel in tenths of a percent, BITTIMING_SAMPLE_POINT_DEFAULT picks one for the bitrate.
+uint16_t sample_point[USB2CAN_MAX_CHANNELS] = { BITTIMING_SAMPLE_POINT_DEFAULT, BITTIMING_SAMPLE_POINT_DEFAULT, BITTIMING_SAMPLE_POINT_DEFAULT };
+// The CAN FD data phase bitrate for each channel in bits/s, 0 leaves the channel as classic CAN.
+uint32_t data_bitrate[USB2CAN_MAX_CHANNELS] = { 0, 0, 0 };
+// The same as sample_point for the data phase.
+uint16_t data_sample_point[USB2CAN_MAX_CHANNELS] = { BITTIMING_SAMPLE_POINT_DEFAULT, BITTIMING_SAMPLE_POINT_DEFAULT, BITTIMING_SAMPLE_POINT_DEFAULT };
+// The bitrates that auto-baud tries, the most common first.
+uint32_t autobaud_rates[] = { 500000, 250000, 125000, 1000000, 800000, 100000, 83333, 50000, 33333, 20000, 10000 };
+#define AUTOBAUD_RATES  ((int)(sizeof(autobaud_rates) / sizeof(autobaud_rates[0])))
+// How long auto-baud listens at a bitrate that isn't giving errors before trying the next one.
+#define USB2CAN_AUTOBAUD_DWELL_MS (200)
+// The number of frames auto-baud needs to receive, without any errors, to lock on to a bitrate.
+#define USB2CAN_AUTOBAUD_FRAMES   (3)
+// The most frames that can be waiting to go to a client that isn't keeping up, see q.
+#define USB2CAN_OUT_DEPTH_DEFAULT (1024)
+#define USB2CAN_OUT_DEPTH_MAX     (1048576)
+// What happens to a client that falls further behind than that.
+#define OUT_POLICY_DROP_NEWEST    (0) // The frames that don't fit are dropped, as a full SocketCAN socket does.
+#define OUT_POLICY_DROP_OLDEST    (1) // The oldest are dropped to make room, so it always gets the latest.
+#define OUT_POLICY_DISCONNECT     (2) // It's disconnected.
+// The most connections that we take at once, see c.
+#define USB2CAN_CLIENTS_DEFAULT   (256)
+#define USB2CAN_CLIENTS_MAX       (65536)
+
+int port = 2303;  // The port that we're going to open.
+int deviceNumber = -1; // If this is set then we only use this one of the devices that are connected now, otherwise we use them all.
+int emulate = 0;  // The number of emulated devices to use instead of real hardware.
+int emu_channels[USB2CAN_MAX_DEVICES];  // The number of channels that each emulated device has.
+uint32_t emu_bus[USB2CAN_MAX_DEVICES];  // The bitrate of the other node on each emulated device's buses, 0 for none.
+int pad_packets = 0;  // Ask the device for USB2CAN_FEATURE_PAD_PKTS_TO_MAX_PKT_SIZE.
+uint32_t tx_depth = USB2CAN_TX_DEPTH_DEFAULT; // The number of frames each channel can have in flight.
+uint32_t tx_timeout[USB2CAN_MAX_CHANNELS] = { 0, 0, 0 }; // How long each channel's device has to confirm a frame in ms, 0 to work it out from the bitrate.
+uint8_t one_shot[USB2CAN_MAX_CHANNELS] = { 0, 0, 0 };  // Ask each channel for USB2CAN_FEATURE_ONE_SHOT, so that the device doesn't retry frames.
+uint32_t busy_poll = 0; // How long in us to keep polling after something happens rather than going to sleep, 0 to always sleep.
+const char* unix_path = NULL; // Where to put the Unix domain socket for local clients, NULL for none.
+mode_t unix_mode = 0660;      // Who can use the Unix domain socket.
+uint8_t use_shm = 0;          // Offer local clients the shared memory rings, see usb2can_shm.h.
+uint32_t out_depth = USB2CAN_OUT_DEPTH_DEFAULT; // The most frames that can be waiting to go to each client.
+uint8_t out_policy = OUT_POLICY_DROP_NEWEST;    // What happens to a client that falls further behind than that, OUT_POLICY_*.
+int max_clients = USB2CAN_CLIENTS_DEFAULT;      // The most connections that we take at once, any more are refused.
 
 // Function Declarations
-int sendCANToAll(struct can_frame * frame);
-int send_packet(struct usb2can_can* can, struct can_frame* frame);
-int release_tx_context(struct usb2can_can* can, uint32_t tx_echo_id);
-struct usb2can_tx_context* get_tx_context(struct usb2can_can* can, struct can_frame* frame);
+int sendCANToAll(struct usb2can_can* can, struct canfd_frame * frame, uint64_t timestamp, uint8_t timestamp_source, struct usb2can_tx_owner* owner);
+int send_packet(struct usb2can_can* can, struct canfd_frame* frame, struct usb2can_tx_owner* owner);
+int release_tx_context(struct usb2can_channel* ch, uint32_t tx_echo_id, uint8_t status);
+struct usb2can_tx_context* get_tx_context(struct usb2can_channel* ch, struct canfd_frame* frame, struct usb2can_tx_owner* owner);
+void conn_tx_status(struct usb2can_tx_owner* owner, uint8_t channel, uint8_t status);
+void cyclic_stop_client(int client);
+void shm_attach(int client);
+void shm_detach(int client);
 
 void sigint_handler(int sig) {
   fprintf(stderr, "\nSignal received (%i).\n", sig);
@@ -291,7 +286,7 @@ void sigint_handler(int sig) {
   }
 }
 
-void print_can_frame(const char* source, const char* type, struct can_frame *frame, uint8_t err, const char *format, ...) {
+void print_can_frame(const char* source, const char* type, struct canfd_frame *frame, uint8_t err, const char *format, ...) {
   FILE * fd = stdout;
 
   if(err || (frame->can_id & CAN_ERR_FLAG)) {
@@ -307,8 +302,12 @@ void print_can_frame(const char* source, const char* type, struct can_frame *fra
     fprintf(fd, "     %03x", frame->can_id & CAN_SFF_MASK);
   }
   fprintf(fd, ", len: %2u", frame->len);
+  if(frame->flags & CANFD_FDF) {
+    fprintf(fd, ", FD%s%s", (frame->flags & CANFD_BRS) ? " BRS" : "", (frame->flags & CANFD_ESI) ? " ESI" : "");
+  }
   fprintf(fd, ", Data: ");
-  for(int n = 0; n < CAN_MAX_DLC; n++) {
+  int bytes = ((frame->flags & CANFD_FDF) && (frame->len > CAN_MAX_DLEN)) ? frame->len : CAN_MAX_DLEN;
+  for(int n = 0; n < bytes; n++) {
     fprintf(fd, "%02x, ", frame->data[n]);
   }
 
@@ -325,74 +324,400 @@ void print_can_frame(const char* source, const char* type, struct can_frame *fra
   fprintf(fd, "\n");
 }
 
-#define TX_TIMEOUT_LENGTH_MS  (8) //(50) // When we Tx we should see the message come back to us within this time threshold in ms.
+#define TX_TIMEOUT_LENGTH_MS  (8) //(50) // When we Tx we should see the message come back to us within this time threshold in ms, on top of the time that it takes on the bus.
+// The most bits that a frame can take on the bus, with the worst case stuffing. A classic CAN frame is
+// an extended one with 8 bytes. A CAN FD frame with 64 bytes is the arbitration and the end of the frame
+// at the nominal bitrate and the data and CRC at the data bitrate.
+#define USB2CAN_FRAME_BITS          (160)
+#define USB2CAN_FD_FRAME_BITS       (80)
+#define USB2CAN_FD_FRAME_DATA_BITS  (700)
+
+// Work out how long the device has to confirm a frame, unless it was set with w[ms]. The frame can
+// be behind tx_depth - 1 others in the device so that's how many frames' worth of bus time it gets,
+// plus TX_TIMEOUT_LENGTH_MS for the USB. At 500k with the default depth that's 12ms, at 10k 168ms.
+void set_tx_timeout(struct usb2can_channel* ch) {
+  if(tx_timeout[ch->index] != 0) {
+    ch->tx_timeout = tx_timeout[ch->index];
+    return;
+  }
+  uint64_t frame_ns = 0;
+  if(ch->bitrate != 0) {
+    frame_ns = (USB2CAN_FRAME_BITS * 1000000000ULL) / ch->bitrate;
+    if((ch->mode_flags & USB2CAN_FEATURE_FD) && (ch->data_bitrate != 0)) {
+      uint64_t fd_ns = ((USB2CAN_FD_FRAME_BITS * 1000000000ULL) / ch->bitrate) + ((USB2CAN_FD_FRAME_DATA_BITS * 1000000000ULL) / ch->data_bitrate);
+      if(fd_ns > frame_ns) {
+        frame_ns = fd_ns;
+      }
+    }
+  }
+  ch->tx_timeout = TX_TIMEOUT_LENGTH_MS + (uint32_t)(((ch->tx_depth * frame_ns) + 999999) / 1000000);
+}
+
+// Set up a channel's pool of tx contexts, they all start on the free list.
+int init_tx_contexts(struct usb2can_channel* ch, uint32_t depth) {
+  ch->tx_context = calloc(depth, sizeof(struct usb2can_tx_context));
+  ch->tx_pending = calloc(USB2CAN_TX_PENDING, sizeof(struct usb2can_tx_pending));
+  ch->tx_heap = calloc(USB2CAN_TX_PENDING, sizeof(uint16_t));
+  ch->tx_spare = calloc(USB2CAN_TX_PENDING, sizeof(uint16_t));
+  if((ch->tx_context == NULL) || (ch->tx_pending == NULL) || (ch->tx_heap == NULL) || (ch->tx_spare == NULL)) {
+    return -1;
+  }
+  for(uint32_t i = 0; i < USB2CAN_TX_PENDING; i++) {
+    ch->tx_spare[i] = i;
+  }
+  ch->tx_heap_count = 0;
+  ch->tx_seq = 0;
+  ch->tx_depth = depth;
+  for(uint32_t i = 0; i < depth; i++) {
+    ch->tx_context[i].echo_id = i;
+    ch->tx_context[i].prev = -1;
+    ch->tx_context[i].next = (i + 1 < depth) ? (int32_t)(i + 1) : -1;
+  }
+  ch->tx_free = 0;
+  ch->tx_oldest = -1;
+  ch->tx_newest = -1;
+  ch->tx_contexts_used = 0;
+  return 0;
+}
 
 // Checks to see if there is space to Tx.
 // If we have space then we return a pointer to to the struct usb2can_tx_context, else we return NULL.
-struct usb2can_tx_context* get_tx_context(struct usb2can_can* can, struct can_frame* frame) {
-  for(uint32_t i = 0; i < USB2CAN_MAX_TX_REQ; i++) {
-    if(can->tx_context[i].echo_id == USB2CAN_MAX_TX_REQ) {
-      can->tx_context[i].can = can;
-      can->tx_context[i].echo_id = i;
-      can->tx_context[i].timestamp = millis() + TX_TIMEOUT_LENGTH_MS;  // Set a timestamp.
-      can->tx_context[i].frame = malloc(sizeof(struct can_frame));
-      memcpy(can->tx_context[i].frame, frame, sizeof(struct can_frame));
-      return &can->tx_context[i];
+// Each channel has its own contexts, the echo_id only has to be unique within the channel.
+struct usb2can_tx_context* get_tx_context(struct usb2can_channel* ch, struct canfd_frame* frame, struct usb2can_tx_owner* owner) {
+  if(ch->tx_free < 0) {
+    return NULL;
+  }
+  int32_t i = ch->tx_free;
+  struct usb2can_tx_context* tx_context = &ch->tx_context[i];
+  ch->tx_free = tx_context->next;
+
+  // They all have the same timeout so the newest is always the last to time out.
+  tx_context->prev = ch->tx_newest;
+  tx_context->next = -1;
+  if(ch->tx_newest >= 0) {
+    ch->tx_context[ch->tx_newest].next = i;
+  } else {
+    ch->tx_oldest = i;
+  }
+  ch->tx_newest = i;
+
+  tx_context->channel = ch;
+  tx_context->timestamp = millis() + ch->tx_timeout;  // Set a timestamp.
+  if(owner != NULL) {
+    tx_context->owner = *owner;
+  } else {
+    tx_context->owner.client = -1;
+    tx_context->owner.status = 0;
+    tx_context->owner.loopback = 1;
+  }
+  memcpy(&tx_context->frame, frame, sizeof(struct canfd_frame));
+  ch->tx_contexts_used++;
+  return tx_context;
+}
+
+// Whether a frame for this channel would have to wait for one of the channel's frames in flight to be confirmed.
+int tx_full(struct usb2can_can* can, uint8_t channel) {
+  return (channel < can->channel_count) && (can->channels[channel].tx_free < 0);
+}
+
+// Whether a frame goes on the bus with an extended id: if it asks for one, or if its id doesn't fit
+// in a standard one. Both tx_priority() and send_packet() go by this.
+int tx_extended(struct canfd_frame* frame) {
+  return (frame->can_id & CAN_EFF_FLAG) || ((frame->can_id & CAN_EFF_MASK) > CAN_SFF_MASK);
+}
+
+// A frame's place in arbitration, lower wins. This is the arbitration field in the order that it goes on
+// the bus: the base id, then RTR for a standard frame or SRR and IDE (both recessive) and the rest of the
+// id and RTR for an extended one. So a standard frame beats an extended one with the same base id and a
+// data frame beats a remote frame with the same id, just as they would on the bus.
+uint32_t tx_priority(struct canfd_frame* frame) {
+  uint32_t rtr = (frame->can_id & CAN_RTR_FLAG) ? 1 : 0;
+  if(tx_extended(frame)) {
+    uint32_t id = frame->can_id & CAN_EFF_MASK;
+    return ((id >> 18) << 21) | (3 << 19) | ((id & 0x3FFFF) << 1) | rtr;
+  }
+  return ((frame->can_id & CAN_SFF_MASK) << 21) | (rtr << 20);
+}
+
+// Whether tx_pending[a] goes before tx_pending[b].
+int tx_before(struct usb2can_channel* ch, uint16_t a, uint16_t b) {
+  struct usb2can_tx_pending* pa = &ch->tx_pending[a];
+  struct usb2can_tx_pending* pb = &ch->tx_pending[b];
+  return (pa->priority < pb->priority) || ((pa->priority == pb->priority) && (pa->seq < pb->seq));
+}
+
+// Whether a channel can't take any more frames until tx_schedule() has sent some.
+int tx_pending_full(struct usb2can_can* can, uint8_t channel) {
+  return (channel < can->channel_count) && (can->channels[channel].tx_heap_count >= USB2CAN_TX_PENDING);
+}
+
+// Queue a frame from a client to go out in arbitration order, see tx_schedule(). Frames for channels
+// that don't exist go straight to send_packet() so that they're rejected the same way as ever.
+int tx_enqueue(struct usb2can_can* can, struct canfd_frame* frame, struct usb2can_tx_owner* owner) {
+  if(frame->channel >= can->channel_count) {
+    int ret = send_packet(can, frame, owner);
+    if(ret < 0) {
+      conn_tx_status(owner, frame->channel, USB2CAN_TX_FAILED);
+    }
+    return ret;
+  }
+  struct usb2can_channel* ch = &can->channels[frame->channel];
+  if(ch->tx_heap_count >= USB2CAN_TX_PENDING) {
+    return LIBUSB_ERROR_BUSY;
+  }
+  uint16_t slot = ch->tx_spare[USB2CAN_TX_PENDING - 1 - ch->tx_heap_count];
+  ch->tx_pending[slot].priority = tx_priority(frame);
+  ch->tx_pending[slot].seq = ch->tx_seq++;
+  ch->tx_pending[slot].owner = *owner;
+  memcpy(&ch->tx_pending[slot].frame, frame, sizeof(struct canfd_frame));
+
+  // Sift it up.
+  uint32_t i = ch->tx_heap_count++;
+  while(i > 0) {
+    uint32_t parent = (i - 1) / 2;
+    if(!tx_before(ch, slot, ch->tx_heap[parent])) {
+      break;
+    }
+    ch->tx_heap[i] = ch->tx_heap[parent];
+    i = parent;
+  }
+  ch->tx_heap[i] = slot;
+  return 0;
+}
+
+// Take the frame that goes first off a channel's heap. Returns its index in tx_pending, which stays valid until the next tx_enqueue().
+uint16_t tx_dequeue(struct usb2can_channel* ch) {
+  uint16_t top = ch->tx_heap[0];
+  uint16_t last = ch->tx_heap[--ch->tx_heap_count];
+  ch->tx_spare[USB2CAN_TX_PENDING - 1 - ch->tx_heap_count] = top;
+
+  // Sift the last one down from the top.
+  uint32_t i = 0;
+  while(1) {
+    uint32_t child = (2 * i) + 1;
+    if(child >= ch->tx_heap_count) {
+      break;
+    }
+    if(((child + 1) < ch->tx_heap_count) && tx_before(ch, ch->tx_heap[child + 1], ch->tx_heap[child])) {
+      child++;
+    }
+    if(!tx_before(ch, ch->tx_heap[child], last)) {
+      break;
+    }
+    ch->tx_heap[i] = ch->tx_heap[child];
+    i = child;
+  }
+  if(ch->tx_heap_count > 0) {
+    ch->tx_heap[i] = last;
+  }
+  return top;
+}
+
+// Send each channel's queued frames, the one that would win arbitration first each time, for as long
+// as the channel has tx contexts free. Frames only go to the device when it can take them, so at most
+// tx_depth of them can be stuck in its FIFO in front of a more urgent frame that arrives later.
+void tx_schedule(struct usb2can_can* can) {
+  for(int c = 0; c < can->channel_count; c++) {
+    struct usb2can_channel* ch = &can->channels[c];
+    while((ch->tx_heap_count > 0) && !tx_full(can, c) && !can->dead) {
+      uint16_t slot = tx_dequeue(ch);
+      if(send_packet(can, &ch->tx_pending[slot].frame, &ch->tx_pending[slot].owner) < 0) {
+        conn_tx_status(&ch->tx_pending[slot].owner, ch->index, USB2CAN_TX_FAILED);
+      }
     }
   }
-  return NULL;
 }
 
-// Go through the tx_contexts and check if the messages were sent within the specified time period. If not then we need to cancel the context.
+// Go through the tx_contexts and check if the messages were sent within the channel's tx_timeout. If not then we cancel the context and tell whoever sent it.
+// The oldest are first so we can stop at the first one that hasn't timed out.
 void handleRetries(struct usb2can_can* can) {
   uint64_t now = millis();
-  struct can_frame frame;
-  for(uint32_t i = 0; i < USB2CAN_MAX_TX_REQ; i++) {
-    if((can->tx_context[i].echo_id < USB2CAN_MAX_TX_REQ) && (now > can->tx_context[i].timestamp)) {
-      memcpy(&frame, can->tx_context[i].frame, sizeof(struct can_frame));
-      release_tx_context(can, can->tx_context[i].echo_id);
+  for(int c = 0; c < can->channel_count; c++) {
+    struct usb2can_channel* ch = &can->channels[c];
+    while((ch->tx_oldest >= 0) && (now > ch->tx_context[ch->tx_oldest].timestamp)) {
+      ch->stats.tx_timeouts++;
+      release_tx_context(ch, ch->tx_context[ch->tx_oldest].echo_id, USB2CAN_TX_TIMEOUT);
+    }
+  }
+}
+
+// The soonest that handleRetries(), handle_autobaud() or sync_device_clock() will have something to
+// do for a device, in millis(), or UINT64_MAX if none of them are waiting for a time.
+uint64_t device_deadline(struct usb2can_can* can) {
+  uint64_t deadline = UINT64_MAX;
+  for(int c = 0; c < can->channel_count; c++) {
+    struct usb2can_channel* ch = &can->channels[c];
+    // These both wait until the time has gone past.
+    if((ch->tx_oldest >= 0) && (ch->tx_context[ch->tx_oldest].timestamp + 1 < deadline)) {
+      deadline = ch->tx_context[ch->tx_oldest].timestamp + 1;
     }
+    if((ch->autobaud >= 0) && (ch->autobaud_deadline + 1 < deadline)) {
+      deadline = ch->autobaud_deadline + 1;
+    }
+  }
+  if((can->mode_flags & USB2CAN_FEATURE_HW_TIMESTAMP) && !can->stopping && !can->clock_active && (can->clock_next_ms < deadline)) {
+    deadline = can->clock_next_ms;
   }
+  return deadline;
 }
 
-// Release the tx_echo_id
-// If you pass an echo_id out of range it will be ignored.
-int release_tx_context(struct usb2can_can* can, uint32_t tx_echo_id) {
-  if(tx_echo_id == 0xFFFFFFFF) {
+// Find the context in flight for tx_echo_id.
+// Returns 1 if it was found, 0 for HOST_FRAME_ECHO_ID_RX (a frame from the bus rather than one of
+// ours), -2 if it's out of range and -1 if it isn't in flight (i.e. we've already given up on it).
+int find_tx_context(struct usb2can_channel* ch, uint32_t tx_echo_id, struct usb2can_tx_context** tx_context) {
+  *tx_context = NULL;
+  if(tx_echo_id == HOST_FRAME_ECHO_ID_RX) {
     return 0;
-  } else if(tx_echo_id >= USB2CAN_MAX_TX_REQ){
+  }
+  uint32_t i = tx_echo_id & USB2CAN_TX_INDEX_MASK;
+  if((i >= ch->tx_depth) || (tx_echo_id & ~(USB2CAN_TX_INDEX_MASK | USB2CAN_TX_GENERATION_MASK))) {
     return -2;
-  } else if(tx_echo_id != can->tx_context[tx_echo_id].echo_id){
+  }
+  if((ch->tx_context[i].channel == NULL) || (ch->tx_context[i].echo_id != tx_echo_id)) {
     return -1;
-  } else if(tx_echo_id < USB2CAN_MAX_TX_REQ) {
-    can->tx_context[tx_echo_id].can = NULL;
-    can->tx_context[tx_echo_id].echo_id = USB2CAN_MAX_TX_REQ;
-    free(can->tx_context[tx_echo_id].frame);
-    can->tx_context[tx_echo_id].frame = NULL;  // House keeping
-    can->tx_context[tx_echo_id].timestamp = 0; // House keeping
-    return 1;
   }
-  LOGE("CAN", "IN", "Unreachable code reached!, Line: %i\n", __LINE__);
+  *tx_context = &ch->tx_context[i];
+  return 1;
+}
 
-  return 0;
+// Release the tx_echo_id, status (one of USB2CAN_TX_*) is what became of the frame, for whoever sent it.
+// Returns the same as find_tx_context().
+int release_tx_context(struct usb2can_channel* ch, uint32_t tx_echo_id, uint8_t status) {
+  struct usb2can_tx_context* tx_context;
+  int found = find_tx_context(ch, tx_echo_id, &tx_context);
+  if(found <= 0) {
+    return found;
+  }
+  uint32_t i = tx_echo_id & USB2CAN_TX_INDEX_MASK;
+
+  if(tx_context->prev >= 0) {
+    ch->tx_context[tx_context->prev].next = tx_context->next;
+  } else {
+    ch->tx_oldest = tx_context->next;
+  }
+  if(tx_context->next >= 0) {
+    ch->tx_context[tx_context->next].prev = tx_context->prev;
+  } else {
+    ch->tx_newest = tx_context->prev;
+  }
+
+  conn_tx_status(&tx_context->owner, ch->index, status);
+  tx_context->channel = NULL;
+  tx_context->echo_id = ((tx_echo_id + USB2CAN_MAX_TX_DEPTH) & USB2CAN_TX_GENERATION_MASK) | i;
+  tx_context->timestamp = 0; // House keeping
+  tx_context->prev = -1;
+  tx_context->next = ch->tx_free;
+  ch->tx_free = i;
+  ch->tx_contexts_used--;
+  return 1;
+}
+
+// Free every channel's tx contexts.
+void free_tx_contexts(struct usb2can_can* can) {
+  for(int c = 0; c < USB2CAN_MAX_CHANNELS; c++) {
+    struct usb2can_channel* ch = &can->channels[c];
+    free(ch->tx_context);
+    ch->tx_context = NULL;
+    ch->tx_depth = 0;
+    free(ch->tx_pending);
+    ch->tx_pending = NULL;
+    free(ch->tx_heap);
+    ch->tx_heap = NULL;
+    free(ch->tx_spare);
+    ch->tx_spare = NULL;
+    ch->tx_heap_count = 0;
+  }
 }
 
 // Create and allocate space for a struct usb2can_can and initialise it.
 // Returns pointer or NULL if failed.
-struct usb2can_can* init_usb2can_can(struct libusb_device_handle* devh) {
+// If emu is set then we use the emulated device instead of devh.
+struct usb2can_can* init_usb2can_can(libusb_context* ctx, struct libusb_device_handle* devh, struct gsusb_emu* emu) {
   struct usb2can_can* can;
   can = calloc(1, sizeof(struct usb2can_can));
   if(can != NULL) {
+    can->ctx = ctx;
     can->devh = devh;
-    for(uint32_t i = 0; i < USB2CAN_MAX_TX_REQ; i++) {
-      can->tx_context[i].can = NULL;
-      can->tx_context[i].echo_id = USB2CAN_MAX_TX_REQ;
+    can->emu = emu;
+    can->channel_count = 1; // Until we've read the device config.
+    for(uint8_t c = 0; c < USB2CAN_MAX_CHANNELS; c++) {
+      struct usb2can_channel* ch = &can->channels[c];
+      ch->can = can;
+      ch->index = c;
+      ch->bitrate = BITRATE_DEFAULT;
+      ch->autobaud = -1;
+      if(init_tx_contexts(ch, tx_depth) != 0) {
+        free_tx_contexts(can);
+        free(can);
+        return NULL;
+      }
     }
+    clocksync_init(&can->clock);
   }
 
   return can;
 }
 
+// Send a control request to either the real or the emulated device. Works like libusb_control_transfer().
+int usb2can_control_transfer(struct usb2can_can* can, uint8_t bmReqType, uint8_t bReq, uint16_t wVal, uint16_t wIndex, unsigned char* data, uint16_t wLen, unsigned int to) {
+  if(can->emu != NULL) {
+    return gsusb_emu_control_transfer(can->emu, bmReqType, bReq, wVal, wIndex, data, wLen);
+  }
+  return libusb_control_transfer(can->devh, bmReqType, bReq, wVal, wIndex, data, wLen, to);
+}
+
+// Submit an asynchronous transfer to either the real or the emulated device. Works like libusb_submit_transfer().
+int usb2can_submit_transfer(struct usb2can_can* can, struct libusb_transfer* transfer) {
+  if(can->emu != NULL) {
+    return gsusb_emu_submit_transfer(can->emu, transfer);
+  }
+  return libusb_submit_transfer(transfer);
+}
+
+// Cancel an asynchronous transfer. Works like libusb_cancel_transfer().
+int usb2can_cancel_transfer(struct usb2can_can* can, struct libusb_transfer* transfer) {
+  if(can->emu != NULL) {
+    return gsusb_emu_cancel_transfer(can->emu, transfer);
+  }
+  return libusb_cancel_transfer(transfer);
+}
+
+// Get wMaxPacketSize for one of our endpoints. Works like libusb_get_max_packet_size().
+int usb2can_get_max_packet_size(struct usb2can_can* can, unsigned char endpoint) {
+  if(can->emu != NULL) {
+    return gsusb_emu_get_max_packet_size(can->emu, endpoint);
+  }
+  return libusb_get_max_packet_size(libusb_get_device(can->devh), endpoint);
+}
+
+// Call the callbacks of any transfers that have completed. Waits up to tv for something to happen (tv is ignored by the emulated device which never blocks).
+int usb2can_handle_events(struct usb2can_can* can, struct timeval* tv) {
+  if(can->emu != NULL) {
+    return gsusb_emu_handle_events(can->emu);
+  }
+  return libusb_handle_events_timeout_completed(can->ctx, tv, NULL);
+}
+
+const char* transfer_status_name(enum libusb_transfer_status status) {
+  switch(status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+      return "LIBUSB_TRANSFER_COMPLETED";
+    case LIBUSB_TRANSFER_ERROR:
+      return "LIBUSB_TRANSFER_ERROR";
+    case LIBUSB_TRANSFER_TIMED_OUT:
+      return "LIBUSB_TRANSFER_TIMED_OUT";
+    case LIBUSB_TRANSFER_CANCELLED:
+      return "LIBUSB_TRANSFER_CANCELLED";
+    case LIBUSB_TRANSFER_STALL:
+      return "LIBUSB_TRANSFER_STALL";
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      return "LIBUSB_TRANSFER_NO_DEVICE";
+    case LIBUSB_TRANSFER_OVERFLOW:
+      return "LIBUSB_TRANSFER_OVERFLOW";
+  }
+  return "UNKNOWN";
+}
+
 void print_host_frame(const char* source, const char* type, struct host_frame *data, uint8_t err, const char *format, ...) {
   FILE * fd = stdout;
 
@@ -589,8 +914,15 @@ void print_host_frame(const char* source, const char* type, struct host_frame *d
     fprintf(fd, ", DLC: %2u,", data->can_dlc);
 
     fprintf(fd, " Data: ");
-    for(int i = 0; i < CAN_MAX_DLC; i++) {
-      fprintf(fd, "%02x, ", data->data[i]);
+    if(data->flags & HOST_FRAME_FLAG_FD) {
+      struct host_frame_fd* fd_data = (struct host_frame_fd*)data;
+      for(int i = 0; i < can_fd_dlc2len(fd_data->can_dlc); i++) {
+        fprintf(fd, "%02x, ", fd_data->data[i]);
+      }
+    } else {
+      for(int i = 0; i < CAN_MAX_DLC; i++) {
+        fprintf(fd, "%02x, ", data->data[i]);
+      }
     }
 
     fprintf(fd, "echo_id: %08x, ", data->echo_id);
@@ -624,202 +956,614 @@ void print_host_frame(const char* source, const char* type, struct host_frame *d
   fprintf(fd, "\n");
 }
 
-void print_host_frame_raw(struct host_frame *data) {
-  printf("Raw: |     echo_id      |       can_id      |dlc | ch |flg | rs |  0 |  1 |  2 |  3 |  4 |  5 |  6 |  7 |\n");
+// len is the number of bytes of data that are valid, see host_frame_size().
+void print_host_frame_raw(struct host_frame *data, int len) {
+  // The headings only line up for classic CAN frames, CAN FD frames just get their bytes.
+  if(len <= HOST_FRAME_SIZE_TS) {
+    printf("Raw: |     echo_id      |       can_id      |dlc | ch |flg | rs |  0 |  1 |  2 |  3 |  4 |  5 |  6 |  7 |");
+    if(len >= HOST_FRAME_SIZE_TS) {
+      printf("     timestamp     |");
+    }
+    printf("\n");
+  }
   // printf("Raw:  xx   xx   xx   xx   xx   xx   xx   xx   xx   xx   xx   xx   xx   xx   xx   xx   xx   xx   xx   xx");
   printf("Raw:  ");
-  for(int i = 0; i < sizeof(struct host_frame); i++) {
+  for(int i = 0; (i < len) && (i < sizeof(struct host_frame_fd)); i++) {
     printf("%02x   ", ((uint8_t*)data)[i]);
   }
   printf("\n");
 }
 
-int read_packet(struct usb2can_can* can) {
-  struct host_frame data;
-  memset(&data, 0, sizeof(data));
-  int len = 0;
-  int ret = libusb_bulk_transfer(can->devh, ENDPOINT_IN, (uint8_t*) &data, sizeof(data), &len, 1);
-  if(ret == 0) {
-    if(len != sizeof(data)) {
-      LOGE("CAN", "IN", "Size mismatch! sizeof(data) = %lu, len = %u, ret = %x \n", sizeof(data), len, ret);
-      print_host_frame_raw(&data);
-      fflush(stdout);
+// Handle a single frame that the device has sent us. It's either an echo of one of our
+// transmissions, a frame received from the bus or an error frame. arrival is the time that
+// the USB transfer that it came in completed.
+void process_host_frame(struct usb2can_can* can, struct host_frame* data, uint64_t arrival) {
+  int size = host_frame_size(data->flags, (can->mode_flags & USB2CAN_FEATURE_HW_TIMESTAMP) != 0);
+  if(data->channel >= can->channel_count) {
+    print_host_frame("CAN", "IN", data, 1, "No such channel");
+    print_host_frame_raw(data, size);
+    return;
+  }
+  struct usb2can_channel* ch = &can->channels[data->channel];
+  if(data->flags & HOST_FRAME_FLAG_OVERFLOW) {
+    ch->stats.overflows++;
+  }
+  if(ch->autobaud >= 0) {
+    // Nothing is passed on while auto-baud is searching, we just count what we get at this bitrate.
+    if(arrival >= ch->autobaud_start) {
+      if(data->can_id & CAN_ERR_FLAG) {
+        ch->autobaud_errors++;
+      } else if(le32toh(data->echo_id) == HOST_FRAME_ECHO_ID_RX) {
+        ch->autobaud_frames++;
+      }
     }
+    return;
+  }
 
-    if(data.can_id & CAN_ERR_FLAG) {
-      print_host_frame("CAN", "IN", &data, 1, "");
-      print_host_frame_raw(&data);
-    } else if((data.channel >= USB2CAN_MAX_CHANNELS) || (data.can_dlc > CAN_MAX_DLC)) {
-      print_host_frame("CAN", "IN", &data, 1, "");
-      print_host_frame_raw(&data);
-    } else {
-      int tmp1 = release_tx_context(can, le32toh(data.echo_id));
-      if(tmp1 > 0) {
-        print_host_frame("CAN", "IN", &data, 0, "Context Released");
-      } else if(tmp1 == 0) {
-        print_host_frame("CAN", "IN", &data, 0, "");
-      } else if(tmp1 == -2) {
-        print_host_frame("CAN", "IN", &data, 1, "echo_id: %08x (%u) is invalid! TOO LARGE - ERROR!.\n", data.echo_id, data.echo_id);
-
-        print_host_frame_raw(&data);
-        fflush(stdout);
-      } else if(tmp1 == -1) {
-        // print_host_frame("CAN", "IN", &data, 1, "Context Error");
-        print_host_frame("CAN", "IN", &data, 1, "echo_id %08x (%u) is invalid! MISMATCH with %08x (%u). - ERROR!.\n", data.echo_id, data.echo_id, can->tx_context[data.echo_id].echo_id, can->tx_context[data.echo_id].echo_id);
+  if(data->can_id & CAN_ERR_FLAG) {
+    ch->stats.err_frames++;
+    print_host_frame("CAN", "IN", data, 1, "");
+    print_host_frame_raw(data, size);
+  } else if(data->can_dlc > ((data->flags & HOST_FRAME_FLAG_FD) ? CANFD_MAX_DLC : CAN_MAX_DLC)) {
+    print_host_frame("CAN", "IN", data, 1, "");
+    print_host_frame_raw(data, size);
+  } else {
+    // Who sent it, if it's one of ours, so that it goes to the right clients (see sendCANToAll()).
+    struct usb2can_tx_context* tx_context;
+    struct usb2can_tx_owner owner;
+    struct usb2can_tx_owner* sender = NULL;
+    if(find_tx_context(ch, le32toh(data->echo_id), &tx_context) > 0) {
+      owner = tx_context->owner;
+      sender = &owner;
+    }
+    int tmp1 = release_tx_context(ch, le32toh(data->echo_id), USB2CAN_TX_CONFIRMED);
+    if(tmp1 > 0) {
+      ch->stats.tx_echoes++;
+      print_host_frame("CAN", "IN", data, 0, "Context Released");
+    } else if(tmp1 == 0) {
+      ch->stats.rx_frames++;
+      print_host_frame("CAN", "IN", data, 0, "");
+    } else if(tmp1 == -2) {
+      print_host_frame("CAN", "IN", data, 1, "echo_id: %08x (%u) is invalid! TOO LARGE - ERROR!.\n", data->echo_id, data->echo_id);
+
+      print_host_frame_raw(data, size);
+      fflush(stdout);
+    } else if(tmp1 == -1) {
+      // print_host_frame("CAN", "IN", data, 1, "Context Error");
+      print_host_frame("CAN", "IN", data, 1, "echo_id %08x (%u) isn't in flight, we've probably given up on it. - ERROR!.\n", le32toh(data->echo_id), le32toh(data->echo_id));
 
-        print_host_frame_raw(&data);
-        fflush(stdout);
-      } else if(tmp1 < 0) {
-        print_host_frame("CAN", "IN", &data, 1, "Context Error");
+      print_host_frame_raw(data, size);
+      fflush(stdout);
+    } else if(tmp1 < 0) {
+      print_host_frame("CAN", "IN", data, 1, "Context Error");
 
-        print_host_frame_raw(&data);
-        fflush(stdout);
-      }
+      print_host_frame_raw(data, size);
+      fflush(stdout);
+    }
+
+    // Use the time the device saw it on the bus if we can, it's not affected by the USB scheduling.
+    uint64_t timestamp = 0;
+    uint8_t timestamp_source = USB2CAN_TIMESTAMP_HW;
+    if(can->mode_flags & USB2CAN_FEATURE_HW_TIMESTAMP) {
+      timestamp = clocksync_to_host(&can->clock, clocksync_unwrap(&can->clock, le32toh(host_frame_timestamp(data))));
+    }
+    if(timestamp == 0) {
+      timestamp = arrival;
+      timestamp_source = USB2CAN_TIMESTAMP_HOST;
+    }
 
-      struct can_frame frame;
+    struct canfd_frame frame;
+    memset(&frame, 0, sizeof(frame));
 
-      frame.can_id = le32toh(data.can_id);
+    frame.can_id = le32toh(data->can_id);
+    frame.channel = ch->index;
 
-      frame.len = data.can_dlc;
+    if(data->flags & HOST_FRAME_FLAG_FD) {
+      struct host_frame_fd* fd_data = (struct host_frame_fd*)data;
+      frame.flags = CANFD_FDF;
+      if(fd_data->flags & HOST_FRAME_FLAG_BRS) {
+        frame.flags |= CANFD_BRS;
+      }
+      if(fd_data->flags & HOST_FRAME_FLAG_ESI) {
+        frame.flags |= CANFD_ESI;
+      }
+      frame.len = can_fd_dlc2len(fd_data->can_dlc);
+      memcpy(frame.data, fd_data->data, frame.len);
+    } else {
+      frame.len = data->can_dlc;
       if(frame.len > CAN_MAX_DLC) {
         frame.len = CAN_MAX_DLC;
       }
 
       for(int i = 0; i < frame.len; i++) {
-        frame.data[i] = data.data[i];
+        frame.data[i] = data->data[i];
       }
-
-      sendCANToAll(&frame);
     }
-  } else if(ret != LIBUSB_ERROR_TIMEOUT) {
-    switch(ret) {
-    // case LIBUSB_ERROR_TIMEOUT:
-    //   print_host_frame("CAN", "IN", &data, 1, "LIBUSB_ERROR_TIMEOUT");
-    //   break;
-    case LIBUSB_ERROR_PIPE:
-      print_host_frame("CAN", "IN", &data, 1, "LIBUSB_ERROR_PIPE");
-      break;
-    case LIBUSB_ERROR_OVERFLOW:
-      print_host_frame("CAN", "IN", &data, 1, "LIBUSB_ERROR_OVERFLOW");
-      break;
-    case LIBUSB_ERROR_NO_DEVICE:
-      print_host_frame("CAN", "IN", &data, 1, "LIBUSB_ERROR_NO_DEVICE");
-      break;
-    case LIBUSB_ERROR_BUSY:
-      print_host_frame("CAN", "IN", &data, 1, "LIBUSB_ERROR_BUSY");
-      break;
-    case LIBUSB_ERROR_INVALID_PARAM:
-      print_host_frame("CAN", "IN", &data, 1, "LIBUSB_ERROR_INVALID_PARAM");
+
+    sendCANToAll(can, &frame, timestamp, timestamp_source, sender);
+  }
+}
+
+// The distance between the start of a frame of size bytes and the next in an IN transfer.
+// Normally the frames are back to back but if we've asked the device to pad them then each one
+// takes up whole max size packets (CAN FD frames can need more than one on a full speed device).
+int rx_frame_stride(struct usb2can_can* can, int size) {
+  if((can->mode_flags & USB2CAN_FEATURE_PAD_PKTS_TO_MAX_PKT_SIZE) && (can->in_max_packet > 0)) {
+    return ((size + can->in_max_packet - 1) / can->in_max_packet) * can->in_max_packet;
+  }
+  return size;
+}
+
+// Called by libusb when one of our IN transfers completes. We process every frame that we've
+// been sent and then resubmit the transfer straight away so that the device always has
+// somewhere to put the next ones.
+void rx_callback(struct libusb_transfer* transfer) {
+  struct usb2can_can* can = (struct usb2can_can*)transfer->user_data;
+  uint64_t arrival = nanos();
+  can->rx_active--;
+
+  switch(transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED: {
+      // Each frame's size depends on whether it's a CAN FD frame, which we can tell from its header.
+      uint8_t timestamps = (can->mode_flags & USB2CAN_FEATURE_HW_TIMESTAMP) != 0;
+      int pos = 0;
+      int size = 0;
+      while((pos + (int)HOST_FRAME_HEADER_SIZE) <= transfer->actual_length) {
+        struct host_frame* data = (struct host_frame*)&transfer->buffer[pos];
+        size = host_frame_size(data->flags, timestamps);
+        if((pos + size) > transfer->actual_length) {
+          break;
+        }
+        process_host_frame(can, data, arrival);
+        pos += rx_frame_stride(can, size);
+      }
+      if(pos < transfer->actual_length) {
+        LOGE("CAN", "IN", "Size mismatch! sizeof(data) = %u, len = %u, %i bytes left over\n", size, transfer->actual_length, transfer->actual_length - pos);
+        print_host_frame_raw((struct host_frame*)&transfer->buffer[pos], transfer->actual_length - pos);
+        fflush(stdout);
+      }
       break;
+    }
+    case LIBUSB_TRANSFER_CANCELLED:
+      return;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      LOGE("CAN", "IN", "%s\n", transfer_status_name(transfer->status));
+      can->dead = 1;
+      return;
     default:
-      print_host_frame("CAN", "IN", &data, 1, "UKNOWN (0x%08x)", ret);
+      LOGE("CAN", "IN", "%s\n", transfer_status_name(transfer->status));
+      fflush(stdout);
       break;
-    }
-    fflush(stdout);
   }
 
-  return ret;
+  if(can->stopping || can->dead) {
+    return;
+  }
+
+  int ret = usb2can_submit_transfer(can, transfer);
+  if(ret == 0) {
+    can->rx_active++;
+  } else {
+    LOGE("CAN", "IN", "%s: %s Unable to resubmit IN transfer.\n", libusb_error_name(ret), libusb_strerror(ret));
+    if(ret == LIBUSB_ERROR_NO_DEVICE) {
+      can->dead = 1;
+    }
+  }
 }
 
-int send_packet(struct usb2can_can* can, struct can_frame* frame) {
+// Allocate and submit all of our IN transfers. They stay submitted until stop_transfers() is called.
+int start_rx(struct usb2can_can* can) {
+  can->stopping = 0;
+  // Big enough for the largest frame that the device can send us.
+  uint8_t fd = 0;
+  for(int c = 0; c < can->channel_count; c++) {
+    fd |= (can->channels[c].mode_flags & USB2CAN_FEATURE_FD) != 0;
+  }
+  int largest = host_frame_size(fd ? HOST_FRAME_FLAG_FD : 0, (can->mode_flags & USB2CAN_FEATURE_HW_TIMESTAMP) != 0);
+  can->in_max_packet = usb2can_get_max_packet_size(can, ENDPOINT_IN);
+  if(can->in_max_packet <= 0) {
+    LOGE(__FUNCTION__, "INFO", "Unable to get the max packet size for endpoint 0x%02x, assuming 64.\n", ENDPOINT_IN);
+    can->in_max_packet = 64;
+  }
+  // Always a whole number of packets, otherwise a device that fills the buffer will overflow it.
+  can->rx_buffer_len = USB2CAN_RX_BUFFER_PACKETS * can->in_max_packet;
+  while(can->rx_buffer_len < rx_frame_stride(can, largest)) {
+    can->rx_buffer_len += can->in_max_packet;
+  }
+  LOGI(__FUNCTION__, "INFO", "wMaxPacketSize = %i, IN buffers are %i bytes, largest frame stride is %i bytes\n", can->in_max_packet, can->rx_buffer_len, rx_frame_stride(can, largest));
+
+  for(int i = 0; i < USB2CAN_RX_TRANSFERS; i++) {
+    if(can->rx_transfers[i] == NULL) {
+      can->rx_transfers[i] = libusb_alloc_transfer(0);
+      can->rx_buffers[i] = malloc(can->rx_buffer_len);
+      if((can->rx_transfers[i] == NULL) || (can->rx_buffers[i] == NULL)) {
+        return LIBUSB_ERROR_NO_MEM;
+      }
+    }
+    libusb_fill_bulk_transfer(can->rx_transfers[i], can->devh, ENDPOINT_IN, can->rx_buffers[i], can->rx_buffer_len, rx_callback, can, 0);
+    int ret = usb2can_submit_transfer(can, can->rx_transfers[i]);
+    if(ret != 0) {
+      LOGE(__FUNCTION__, "INFO", "%s: %s Unable to submit IN transfer %i.\n", libusb_error_name(ret), libusb_strerror(ret), i);
+      return ret;
+    }
+    can->rx_active++;
+  }
+  return 0;
+}
 
-  struct usb2can_tx_context* tx_context = get_tx_context(can, frame);
-  if(tx_context == NULL) {
-    print_can_frame("Q", "OUT", frame, 1, "BUSY");
-    return LIBUSB_ERROR_BUSY;
+// The distance between the start of one frame and the next in an OUT transfer. The devices
+// treat every packet that they receive as a single frame so, in order to send several frames
+// in one transfer, each frame has to be padded out to a whole max size packet.
+int tx_frame_stride(struct usb2can_can* can) {
+  int stride = HOST_FRAME_SIZE;
+  if(can->out_max_packet > stride) {
+    stride = can->out_max_packet;
   }
+  return stride;
+}
 
-  struct host_frame data = {
-    .echo_id = htole32(tx_context->echo_id),
-    .can_id = htole32(frame->can_id),
-    .can_dlc = frame->len,
-    .channel = 0,
-    .flags = 0,
-    .reserved = 0
-  };
-  if(frame->can_id > 0x03ff) {
-    data.can_id |= CAN_EFF_FLAG; // Set the extended bit flag (if not already set)
+// The distance from the start of this frame to the next one in an OUT transfer. A CAN FD frame
+// that's bigger than a packet is always the last one in its transfer, see send_packet().
+int tx_frame_span(struct usb2can_can* can, struct host_frame* data) {
+  int size = host_frame_size(data->flags, 0);
+  int stride = tx_frame_stride(can);
+  return (size > stride) ? size : stride;
+}
+
+// Allocate the OUT transfers, they're reused for the life of the connection.
+int start_tx(struct usb2can_can* can) {
+  can->out_max_packet = usb2can_get_max_packet_size(can, ENDPOINT_OUT);
+  if(can->out_max_packet <= 0) {
+    LOGE(__FUNCTION__, "INFO", "Unable to get the max packet size for endpoint 0x%02x, assuming 64.\n", ENDPOINT_OUT);
+    can->out_max_packet = 64;
   }
-  for(int i = 0; i < CAN_MAX_DLEN; i++) {
-    if(i < frame->len) {
-      data.data[i] = frame->data[i];
-    } else {
-      data.data[i] = 0;
+  can->tx_buffer_len = ((tx_depth < USB2CAN_TX_BATCH_FRAMES) ? tx_depth : USB2CAN_TX_BATCH_FRAMES) * tx_frame_stride(can);
+  // A CAN FD frame that's bigger than a packet goes on its own at the start of a transfer, there has
+  // to be room for it however few frames a transfer is meant to carry (t1 on a full speed device).
+  if(can->tx_buffer_len < host_frame_size(HOST_FRAME_FLAG_FD, 0)) {
+    can->tx_buffer_len = host_frame_size(HOST_FRAME_FLAG_FD, 0);
+  }
+  LOGI(__FUNCTION__, "INFO", "wMaxPacketSize = %i, OUT buffers are %i bytes, frame stride is %i bytes\n", can->out_max_packet, can->tx_buffer_len, tx_frame_stride(can));
+
+  can->tx_batch = NULL;
+  can->tx_batch_frames = 0;
+  // Every frame in flight has a tx context and each OUT transfer carries at least one frame, so
+  // we can never need more transfers than we have contexts.
+  can->tx_transfers = tx_depth * can->channel_count;
+  can->tx_free = calloc(can->tx_transfers, sizeof(struct libusb_transfer*));
+  if(can->tx_free == NULL) {
+    return LIBUSB_ERROR_NO_MEM;
+  }
+  for(can->tx_free_count = 0; can->tx_free_count < can->tx_transfers; can->tx_free_count++) {
+    struct libusb_transfer* transfer = libusb_alloc_transfer(0);
+    if(transfer == NULL) {
+      return LIBUSB_ERROR_NO_MEM;
     }
+    transfer->buffer = malloc(can->tx_buffer_len);
+    if(transfer->buffer == NULL) {
+      libusb_free_transfer(transfer);
+      return LIBUSB_ERROR_NO_MEM;
+    }
+    can->tx_free[can->tx_free_count] = transfer;
   }
+  return 0;
+}
 
-  int len = 0;
-  int ret = libusb_bulk_transfer(can->devh, ENDPOINT_OUT, (uint8_t*) &data, sizeof(data), &len, 1);
-  if((len != sizeof(data)) && (ret != LIBUSB_ERROR_TIMEOUT)) {
-    print_can_frame("Q", "OUT", frame, 1, "ERROR");
-    LOGE("CAN", "OUT", "Size mismatch! sizeof(data) = %lu, len = %u, ret = %x \n", sizeof(data), len, ret);
-    print_host_frame_raw(&data);
-    fflush(stdout);
+// Called by libusb when the device has told us what time it is.
+void clock_callback(struct libusb_transfer* transfer) {
+  uint64_t now = nanos();
+  struct usb2can_can* can = (struct usb2can_can*)transfer->user_data;
+  can->clock_active = 0;
+
+  if((transfer->status == LIBUSB_TRANSFER_COMPLETED) && (transfer->actual_length == sizeof(uint32_t))) {
+    uint32_t raw;
+    memcpy(&raw, libusb_control_transfer_get_data(transfer), sizeof(raw));
+    clocksync_add_sample(&can->clock, le32toh(raw), can->clock_request_ns, now);
+  } else {
+    LOGE(__FUNCTION__, "INFO", "%s, actual_length = %u\n", transfer_status_name(transfer->status), transfer->actual_length);
+    if(transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+      can->dead = 1;
+    }
+  }
+}
+
+// Read the device's clock if it's time to. The device's timestamps are in its own time, which
+// has a different start and runs at a slightly different rate to ours, so we keep sampling it
+// and let clocksync work out how to convert between the two.
+int sync_device_clock(struct usb2can_can* can) {
+  if(!(can->mode_flags & USB2CAN_FEATURE_HW_TIMESTAMP) || can->stopping || can->clock_active || (millis() < can->clock_next_ms)) {
+    return 0;
+  }
+
+  if(can->clock_transfer == NULL) {
+    can->clock_transfer = libusb_alloc_transfer(0);
+    unsigned char* buf = calloc(1, LIBUSB_CONTROL_SETUP_SIZE + sizeof(uint32_t));
+    if((can->clock_transfer == NULL) || (buf == NULL)) {
+      LOGE(__FUNCTION__, "INFO", "Unable to allocate the clock transfer.\n");
+      libusb_free_transfer(can->clock_transfer);
+      can->clock_transfer = NULL;
+      free(buf);
+      return LIBUSB_ERROR_NO_MEM;
+    }
+    libusb_fill_control_setup(buf, 0xC1, USB2CAN_BREQ_TIMESTAMP, 0, 0, sizeof(uint32_t));
+    libusb_fill_control_transfer(can->clock_transfer, can->devh, buf, clock_callback, can, 1000);
   }
+
+  can->clock_next_ms = millis() + ((can->clock.count < (CLOCKSYNC_SAMPLES / 2)) ? USB2CAN_CLOCK_SYNC_FAST_MS : USB2CAN_CLOCK_SYNC_MS);
+  can->clock_request_ns = nanos();
+  int ret = usb2can_submit_transfer(can, can->clock_transfer);
   if(ret == 0) {
-    print_can_frame("Q", "OUT", frame, 0, "SUCCESS");
-    print_host_frame("CAN", "OUT", &data, 0, "Tx Queue");
-    fflush(stdout);
-  } else if (ret == LIBUSB_ERROR_TIMEOUT) {
-    print_can_frame("Q", "OUT", frame, 1, "TIMEOUT");
+    can->clock_active = 1;
   } else {
-    print_can_frame("Q", "OUT", frame, 1, "ERROR");
-    print_host_frame("CAN", "OUT", &data, 1, "%s: %s\n", libusb_error_name(ret), libusb_strerror(ret));
-    print_host_frame_raw(&data);
-    fflush(stdout);
+    LOGE(__FUNCTION__, "INFO", "%s: %s\n", libusb_error_name(ret), libusb_strerror(ret));
+    if(ret == LIBUSB_ERROR_NO_DEVICE) {
+      can->dead = 1;
+    }
   }
   return ret;
 }
 
-// These are the speed settings. We'd like to offer custom bitrates and sample points too.
-int set_bitrate(struct usb2can_can* can) {
-  LOGI(__FUNCTION__, "INFO", "Setting bitrate...\n");
-  uint8_t bmReqType = 0x41;       // the request type (direction of transfer)
-  uint8_t bReq = USB2CAN_BREQ_BITTIMING;            // the request field for this packet
-  uint16_t wVal = 0x0000;         // the value field for this packet
-  uint16_t wIndex = 0x0000;       // the index field for this packet
-  uint16_t wLen = BITRATE_DATA_LEN;   // length of this setup packet 
-  unsigned int to = 0;    // timeout duration (if transfer fails)
+// Cancel all of our IN transfers (and any clock read) and wait for any OUT transfers to finish, then free them all.
+// Returns -1 if some of them didn't complete, in which case they are left allocated.
+int stop_transfers(struct usb2can_can* can) {
+  can->stopping = 1;
+  for(int i = 0; i < USB2CAN_RX_TRANSFERS; i++) {
+    if(can->rx_transfers[i] != NULL) {
+      usb2can_cancel_transfer(can, can->rx_transfers[i]);
+    }
+  }
+  if(can->clock_active) {
+    usb2can_cancel_transfer(can, can->clock_transfer);
+  }
 
-  // transfer the setup packet to the USB device
-  int config = libusb_control_transfer(can->devh,bmReqType,bReq,wVal,wIndex, bitrates[bitrate], wLen,to);
+  // Give the cancellations a second to come through.
+  uint64_t timeout = millis() + 1000;
+  while(((can->rx_active > 0) || (can->tx_active > 0) || can->clock_active) && !can->dead && (millis() < timeout)) {
+    struct timeval tv = {
+      .tv_sec = 0,
+      .tv_usec = 10000
+    };
+    usb2can_handle_events(can, &tv);
+  }
+  if((can->rx_active > 0) || (can->tx_active > 0) || can->clock_active) {
+    LOGE(__FUNCTION__, "INFO", "%i IN, %i OUT and %i control transfers didn't complete.\n", can->rx_active, can->tx_active, can->clock_active);
+    return -1; // Better to leak them than free them while libusb is still using them.
+  }
 
-  return config;
+  if(can->clock_transfer != NULL) {
+    free(can->clock_transfer->buffer);
+    can->clock_transfer->buffer = NULL;
+    libusb_free_transfer(can->clock_transfer);
+    can->clock_transfer = NULL;
+  }
+
+  for(int i = 0; i < USB2CAN_RX_TRANSFERS; i++) {
+    libusb_free_transfer(can->rx_transfers[i]);
+    can->rx_transfers[i] = NULL;
+    free(can->rx_buffers[i]);
+    can->rx_buffers[i] = NULL;
+  }
+  if(can->tx_batch != NULL) {
+    can->tx_free[can->tx_free_count++] = can->tx_batch;
+    can->tx_batch = NULL;
+  }
+  while(can->tx_free_count > 0) {
+    struct libusb_transfer* transfer = can->tx_free[--can->tx_free_count];
+    free(transfer->buffer);
+    transfer->buffer = NULL;
+    libusb_free_transfer(transfer);
+  }
+  free(can->tx_free);
+  can->tx_free = NULL;
+  return 0;
 }
 
-// Set User ID: candleLight allows optional support for reading/writing of a user defined value into the device's flash. It's isn't widely supported and probably isn't required most of the time.
-int port_set_user_id(struct usb2can_can* can) {
-  LOGI(__FUNCTION__, "INFO", "Set the User ID (USB2CAN_BREQ_SET_USER_ID)\n");
-  uint8_t bmReqType = 0x00;       // the request type (direction of transfer)
-  uint8_t bReq = USB2CAN_BREQ_SET_USER_ID;            // the request field for this packet
-  uint16_t wVal = 0x0001;         // the value field for this packet
-  uint16_t wIndex = 0x0000;       // the index field for this packet
-  uint16_t wLen = 0;      // length of this setup packet 
-  unsigned char data[] = {0x00};
-  unsigned int to = 0;    // timeout duration (if transfer fails)
+// Called by libusb when one of our OUT transfers completes. The transfer goes back on the free list.
+void tx_callback(struct libusb_transfer* transfer) {
+  struct usb2can_can* can = (struct usb2can_can*)transfer->user_data;
+  can->tx_active--;
 
-  // transfer the setup packet to the USB device
-  int config = libusb_control_transfer(can->devh, bmReqType, bReq, wVal, wIndex, data, wLen, to);
+  uint8_t ok = (transfer->status == LIBUSB_TRANSFER_COMPLETED) && (transfer->actual_length == transfer->length);
+  if(!ok && (transfer->status == LIBUSB_TRANSFER_COMPLETED)) {
+    LOGE("CAN", "OUT", "Size mismatch! length = %u, actual_length = %u\n", transfer->length, transfer->actual_length);
+  }
+  for(int pos = 0; (pos + (int)HOST_FRAME_SIZE) <= transfer->length; ) {
+    struct host_frame* data = (struct host_frame*)&transfer->buffer[pos];
+    pos += tx_frame_span(can, data);
+    if(ok) {
+      print_host_frame("CAN", "OUT", data, 0, "Tx Queue");
+    } else {
+      print_host_frame("CAN", "OUT", data, 1, "%s\n", transfer_status_name(transfer->status));
+      print_host_frame_raw(data, host_frame_size(data->flags, 0));
+      // It never made it to the device so we're not going to get an echo.
+      if(data->channel < can->channel_count) {
+        can->channels[data->channel].stats.tx_errors++;
+        release_tx_context(&can->channels[data->channel], le32toh(data->echo_id), USB2CAN_TX_FAILED);
+      }
+    }
+  }
+  if(!ok) {
+    fflush(stdout);
+    if(transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+      can->dead = 1;
+    }
+  }
 
-  return config;
+  can->tx_free[can->tx_free_count++] = transfer;
 }
 
-// Host format sets the endian. We write 0x0000beef to the device and it determines the endianess from that. However, candleLight may only support Little Endian so that why we always send it it Little Endian.
-int port_set_host_format(struct usb2can_can* can) {
-  LOGI(__FUNCTION__, "INFO", "Set the host format to Little Endian (as candleLight devices are always Little Endian) (USB2CAN_BREQ_HOST_FORMAT)\n");
-  uint8_t bmReqType = 0x41;       // the request type (direction of transfer)
-  uint8_t bReq = USB2CAN_BREQ_HOST_FORMAT;            // the request field for this packet
-  uint16_t wVal = 0x0001;         // the value field for this packet
-  uint16_t wIndex = 0x0000;       // the index field for this packet
-  // the data buffer for the in/output data
-  unsigned char data[] = {
-    0xef, 0xbe, 0x00, 0x00
-  };
-  uint16_t wLen = sizeof(data);   // length of this setup packet 
-  unsigned int to = 0;    // timeout duration (if transfer fails)
+// Submit the frames that have been gathered by send_packet() as a single OUT transfer.
+// Called when the batch is full and at the end of every pass of the processing loop.
+int flush_tx(struct usb2can_can* can) {
+  struct libusb_transfer* transfer = can->tx_batch;
+  if(transfer == NULL) {
+    return 0;
+  }
+  // The last frame doesn't need padding, the short packet marks the end of the transfer.
+  int len = can->tx_batch_len;
+  can->tx_batch = NULL;
+  can->tx_batch_frames = 0;
+  can->tx_batch_len = 0;
+
+  libusb_fill_bulk_transfer(transfer, can->devh, ENDPOINT_OUT, transfer->buffer, len, tx_callback, can, USB2CAN_OUT_TIMEOUT_MS);
+  int ret = usb2can_submit_transfer(can, transfer);
+  if(ret == 0) {
+    can->tx_active++;
+    return 0;
+  }
+
+  for(int pos = 0; pos < len; ) {
+    struct host_frame* data = (struct host_frame*)&transfer->buffer[pos];
+    pos += tx_frame_span(can, data);
+    print_host_frame("CAN", "OUT", data, 1, "%s: %s\n", libusb_error_name(ret), libusb_strerror(ret));
+    print_host_frame_raw(data, host_frame_size(data->flags, 0));
+    if(data->channel < can->channel_count) {
+      can->channels[data->channel].stats.tx_errors++;
+      release_tx_context(&can->channels[data->channel], le32toh(data->echo_id), USB2CAN_TX_FAILED);
+    }
+  }
+  fflush(stdout);
+  can->tx_free[can->tx_free_count++] = transfer;
+  if(ret == LIBUSB_ERROR_NO_DEVICE) {
+    can->dead = 1;
+  }
+  return ret;
+}
+
+// Queue a frame for transmission. Frames are gathered into a single OUT transfer which is
+// submitted by flush_tx(), either when it is full or at the end of the processing loop pass.
+// The frames for all of the channels share the same transfers, frame->channel says which bus it goes on.
+// CAN FD frames (CANFD_FDF) can only be sent on channels that we've put into CAN FD mode.
+// Returns 0 once the frame has a tx context, whatever happens to it after that is reported when its
+// context is released. A libusb error means it was turned away before then and the caller says so.
+int send_packet(struct usb2can_can* can, struct canfd_frame* frame, struct usb2can_tx_owner* owner) {
+  if(can->dead) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+  if((frame->channel >= can->channel_count) || !can->channels[frame->channel].open) {
+    print_can_frame("Q", "OUT", frame, 1, "NO SUCH CHANNEL (%u)", frame->channel);
+    return LIBUSB_ERROR_INVALID_PARAM;
+  }
+  struct usb2can_channel* ch = &can->channels[frame->channel];
+  if(ch->autobaud >= 0) {
+    print_can_frame("Q", "OUT", frame, 1, "CHANNEL %u IS LOOKING FOR ITS BITRATE", frame->channel);
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+  }
+  uint8_t fd = (frame->flags & CANFD_FDF) != 0;
+  if(fd && !(ch->mode_flags & USB2CAN_FEATURE_FD)) {
+    print_can_frame("Q", "OUT", frame, 1, "CHANNEL %u ISN'T CAN FD", frame->channel);
+    return LIBUSB_ERROR_INVALID_PARAM;
+  }
+  if(frame->len > (fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN)) {
+    print_can_frame("Q", "OUT", frame, 1, "TOO LONG");
+    return LIBUSB_ERROR_INVALID_PARAM;
+  }
+
+  struct usb2can_tx_context* tx_context = get_tx_context(ch, frame, owner);
+  if(tx_context == NULL) {
+    print_can_frame("Q", "OUT", frame, 1, "BUSY");
+    return LIBUSB_ERROR_BUSY;
+  }
+
+  // The device treats a short packet as the end of a frame, so a frame that needs more than one
+  // packet has to be the last in its transfer. It goes on its own, after whatever we've gathered.
+  int stride = tx_frame_stride(can);
+  int size = host_frame_size(fd ? HOST_FRAME_FLAG_FD : 0, 0);
+  if((size > stride) && (can->tx_batch != NULL)) {
+    flush_tx(can);
+  }
+
+  if(can->tx_batch == NULL) {
+    if(can->tx_free_count == 0) {
+      // Can't happen as we have as many transfers as tx contexts.
+      print_can_frame("Q", "OUT", frame, 1, "NO TRANSFER");
+      tx_context->owner.client = -1;  // The caller tells the client.
+      release_tx_context(ch, tx_context->echo_id, USB2CAN_TX_FAILED);
+      return LIBUSB_ERROR_BUSY;
+    }
+    can->tx_batch = can->tx_free[--can->tx_free_count];
+    can->tx_batch_frames = 0;
+    can->tx_batch_len = 0;
+  }
+
+  int pos = can->tx_batch_frames * stride;
+  uint8_t* buf = &can->tx_batch->buffer[pos];
+  memset(buf, 0, (size > stride) ? size : stride);
+  struct host_frame* data = (struct host_frame*)buf;
+  data->echo_id = htole32(tx_context->echo_id);
+  data->can_id = htole32(frame->can_id);
+  data->channel = ch->index;
+  data->flags = 0;
+  data->reserved = 0;
+  if(tx_extended(frame)) {
+    data->can_id |= htole32(CAN_EFF_FLAG); // Set the extended bit flag (if not already set)
+  }
+  if(fd) {
+    // Lengths that a DLC can't encode are rounded up, the padding is already zeroed.
+    struct host_frame_fd* fd_data = (struct host_frame_fd*)buf;
+    fd_data->can_dlc = can_fd_len2dlc(frame->len);
+    fd_data->flags = HOST_FRAME_FLAG_FD;
+    if(frame->flags & CANFD_BRS) {
+      fd_data->flags |= HOST_FRAME_FLAG_BRS;
+    }
+    memcpy(fd_data->data, frame->data, frame->len);
+  } else {
+    data->can_dlc = frame->len;
+    for(int i = 0; i < CAN_MAX_DLEN; i++) {
+      if(i < frame->len) {
+        data->data[i] = frame->data[i];
+      } else {
+        data->data[i] = 0;
+      }
+    }
+  }
+  can->tx_batch_frames++;
+  can->tx_batch_len = pos + size;
+  ch->stats.tx_frames++;
+  print_can_frame("Q", "OUT", frame, 0, "SUCCESS");
+
+  // Send it now if there's no room for another frame, this channel can't have any more in
+  // flight or it's a frame that has to be the last in its transfer. If that fails flush_tx() has
+  // already released this frame's context along with the rest, so it isn't reported again.
+  if((((can->tx_batch_frames + 1) * stride) > can->tx_buffer_len) || (ch->tx_contexts_used >= ch->tx_depth) || (size > stride)) {
+    flush_tx(can);
+  }
+  return 0;
+}
+
+// Set User ID: candleLight allows optional support for reading/writing of a user defined value into the device's flash. It's isn't widely supported and probably isn't required most of the time.
+int port_set_user_id(struct usb2can_can* can) {
+  LOGI(__FUNCTION__, "INFO", "Set the User ID (USB2CAN_BREQ_SET_USER_ID)\n");
+  uint8_t bmReqType = 0x00;       // the request type (direction of transfer)
+  uint8_t bReq = USB2CAN_BREQ_SET_USER_ID;            // the request field for this packet
+  uint16_t wVal = 0x0001;         // the value field for this packet
+  uint16_t wIndex = 0x0000;       // the index field for this packet
+  uint16_t wLen = 0;      // length of this setup packet 
+  unsigned char data[] = {0x00};
+  unsigned int to = USB2CAN_CTRL_TIMEOUT_MS;    // timeout duration (if transfer fails)
+
+  // transfer the setup packet to the USB device
+  int config = usb2can_control_transfer(can, bmReqType, bReq, wVal, wIndex, data, wLen, to);
+
+  return config;
+}
+
+// Host format sets the endian. We write 0x0000beef to the device and it determines the endianess from that. However, candleLight may only support Little Endian so that why we always send it it Little Endian.
+int port_set_host_format(struct usb2can_can* can) {
+  LOGI(__FUNCTION__, "INFO", "Set the host format to Little Endian (as candleLight devices are always Little Endian) (USB2CAN_BREQ_HOST_FORMAT)\n");
+  uint8_t bmReqType = 0x41;       // the request type (direction of transfer)
+  uint8_t bReq = USB2CAN_BREQ_HOST_FORMAT;            // the request field for this packet
+  uint16_t wVal = 0x0001;         // the value field for this packet
+  uint16_t wIndex = 0x0000;       // the index field for this packet
+  // the data buffer for the in/output data
+  unsigned char data[] = {
+    0xef, 0xbe, 0x00, 0x00
+  };
+  uint16_t wLen = sizeof(data);   // length of this setup packet 
+  unsigned int to = USB2CAN_CTRL_TIMEOUT_MS;    // timeout duration (if transfer fails)
 
   // transfer the setup packet to the USB device
-  int config = libusb_control_transfer(can->devh, bmReqType, bReq, wVal, wIndex, data, wLen, to);
+  int config = usb2can_control_transfer(can, bmReqType, bReq, wVal, wIndex, data, wLen, to);
 
   return config;
 }
@@ -834,10 +1578,10 @@ int port_get_device_config(struct usb2can_can* can) {
   // the data buffer for the in/output data
   struct usb2can_device_config data;
   uint16_t wLen = sizeof(data);   // length of this setup packet 
-  unsigned int to = 0;    // timeout duration (if transfer fails)
+  unsigned int to = USB2CAN_CTRL_TIMEOUT_MS;    // timeout duration (if transfer fails)
 
   // transfer the setup packet to the USB device
-  int ret = libusb_control_transfer(can->devh, bmReqType, bReq, wVal, wIndex, (uint8_t *)(&data), wLen, to);
+  int ret = usb2can_control_transfer(can, bmReqType, bReq, wVal, wIndex, (uint8_t *)(&data), wLen, to);
   if(ret >=0) {
     can->device_config.reserved1 = data.reserved1;
     can->device_config.reserved2 = data.reserved2;
@@ -848,6 +1592,12 @@ int port_get_device_config(struct usb2can_can* can) {
     LOGI(__FUNCTION__, "INFO", "   reserved1: 0x%02x\n", can->device_config.reserved1);
     LOGI(__FUNCTION__, "INFO", "   reserved2: 0x%02x\n", can->device_config.reserved2);
     LOGI(__FUNCTION__, "INFO", "   reserved3: 0x%02x\n", can->device_config.reserved3);
+    can->device_config.icount = data.icount;
+    can->channel_count = data.icount + 1;
+    if(can->channel_count > USB2CAN_MAX_CHANNELS) {
+      LOGW(__FUNCTION__, "INFO", "The device has %u channels, we only support %u.\n", can->channel_count, USB2CAN_MAX_CHANNELS);
+      can->channel_count = USB2CAN_MAX_CHANNELS;
+    }
     LOGI(__FUNCTION__, "INFO", "     i count: %u (%u interfaces)\n", can->device_config.icount, data.icount + 1);
     LOGI(__FUNCTION__, "INFO", "  sw_version: %u\n", can->device_config.sw_version);
     LOGI(__FUNCTION__, "INFO", "  hw_version: %u\n", can->device_config.hw_version);
@@ -857,32 +1607,32 @@ int port_get_device_config(struct usb2can_can* can) {
 }
 
 // Get the Bit Timming settings.
-int port_get_bit_timing(struct usb2can_can* can) {
-  LOGI(__FUNCTION__, "INFO", "Getting the port's bit timing info (USB2CAN_BREQ_BT_CONST)\n");
+int port_get_bit_timing(struct usb2can_channel* ch) {
+  LOGI(__FUNCTION__, "INFO", "Getting channel %u's bit timing info (USB2CAN_BREQ_BT_CONST)\n", ch->index);
   uint8_t bmReqType = 0xC1;       // the request type (direction of transfer)
   uint8_t bReq = USB2CAN_BREQ_BT_CONST;            // the request field for this packet
-  uint16_t wVal = 0x0000;         // the value field for this packet
+  uint16_t wVal = ch->index;      // the value field for this packet, the channel
   uint16_t wIndex = 0x0000;       // the index field for this packet
   // the data buffer for the in/output data
   struct usb2can_device_bt_const data;
   uint16_t wLen = sizeof(data);   // length of this setup packet 
-  unsigned int to = 0;    // timeout duration (if transfer fails)
+  unsigned int to = USB2CAN_CTRL_TIMEOUT_MS;    // timeout duration (if transfer fails)
 
   // transfer the setup packet to the USB device
-  int ret = libusb_control_transfer(can->devh, bmReqType, bReq, wVal, wIndex, (uint8_t *)(&data), wLen, to);
+  int ret = usb2can_control_transfer(ch->can, bmReqType, bReq, wVal, wIndex, (uint8_t *)(&data), wLen, to);
   if(ret >=0) {
-    can->bt_const.feature = le32toh(data.feature);
-    can->bt_const.fclk_can = le32toh(data.fclk_can);
-    can->bt_const.tseg1_min = le32toh(data.tseg1_min);
-    can->bt_const.tseg1_max = le32toh(data.tseg1_max);
-    can->bt_const.tseg2_min = le32toh(data.tseg2_min);
-    can->bt_const.tseg2_max = le32toh(data.tseg2_max);
-    can->bt_const.sjw_max = le32toh(data.sjw_max);
-    can->bt_const.brp_min = le32toh(data.brp_min);
-    can->bt_const.brp_max = le32toh(data.brp_max);
-    can->bt_const.brp_inc = le32toh(data.brp_inc);
+    ch->bt_const.feature = le32toh(data.feature);
+    ch->bt_const.fclk_can = le32toh(data.fclk_can);
+    ch->bt_const.tseg1_min = le32toh(data.tseg1_min);
+    ch->bt_const.tseg1_max = le32toh(data.tseg1_max);
+    ch->bt_const.tseg2_min = le32toh(data.tseg2_min);
+    ch->bt_const.tseg2_max = le32toh(data.tseg2_max);
+    ch->bt_const.sjw_max = le32toh(data.sjw_max);
+    ch->bt_const.brp_min = le32toh(data.brp_min);
+    ch->bt_const.brp_max = le32toh(data.brp_max);
+    ch->bt_const.brp_inc = le32toh(data.brp_inc);
     LOGI(__FUNCTION__, "INFO", "BT Const Information:\n");
-    int16_t feature = can->bt_const.feature;
+    int16_t feature = ch->bt_const.feature;
     LOGI(__FUNCTION__, "INFO", "    feature: %08x (", feature);
     if(feature & USB2CAN_FEATURE_LISTEN_ONLY) {
       printf("USB2CAN_FEATURE_LISTEN_ONLY, ");
@@ -927,46 +1677,187 @@ int port_get_bit_timing(struct usb2can_can* can) {
       printf("USB2CAN_FEATURE_GET_STATE, ");
     }
     printf(")\n");
-    LOGI(__FUNCTION__, "INFO", "   fclk_can: %u\n", can->bt_const.fclk_can);
-    LOGI(__FUNCTION__, "INFO", "  tseg1_min: %u\n", can->bt_const.tseg1_min);
-    LOGI(__FUNCTION__, "INFO", "  tseg1_max: %u\n", can->bt_const.tseg1_max);
-    LOGI(__FUNCTION__, "INFO", "  tseg2_min: %u\n", can->bt_const.tseg2_min);
-    LOGI(__FUNCTION__, "INFO", "  tseg2_max: %u\n", can->bt_const.tseg2_max);
-    LOGI(__FUNCTION__, "INFO", "    sjw_max: %u\n", can->bt_const.sjw_max);
-    LOGI(__FUNCTION__, "INFO", "    brp_min: %u\n", can->bt_const.brp_min);
-    LOGI(__FUNCTION__, "INFO", "    brp_max: %u\n", can->bt_const.brp_max);
-    LOGI(__FUNCTION__, "INFO", "    brp_inc: %u\n", can->bt_const.brp_inc);
+    LOGI(__FUNCTION__, "INFO", "   fclk_can: %u\n", ch->bt_const.fclk_can);
+    LOGI(__FUNCTION__, "INFO", "  tseg1_min: %u\n", ch->bt_const.tseg1_min);
+    LOGI(__FUNCTION__, "INFO", "  tseg1_max: %u\n", ch->bt_const.tseg1_max);
+    LOGI(__FUNCTION__, "INFO", "  tseg2_min: %u\n", ch->bt_const.tseg2_min);
+    LOGI(__FUNCTION__, "INFO", "  tseg2_max: %u\n", ch->bt_const.tseg2_max);
+    LOGI(__FUNCTION__, "INFO", "    sjw_max: %u\n", ch->bt_const.sjw_max);
+    LOGI(__FUNCTION__, "INFO", "    brp_min: %u\n", ch->bt_const.brp_min);
+    LOGI(__FUNCTION__, "INFO", "    brp_max: %u\n", ch->bt_const.brp_max);
+    LOGI(__FUNCTION__, "INFO", "    brp_inc: %u\n", ch->bt_const.brp_inc);
+  }
+
+  return ret;
+}
+
+// Get the extended Bit Timming settings, which include the limits for the CAN FD data phase.
+// Devices without USB2CAN_FEATURE_BT_CONST_EXT use the same limits for both phases.
+int port_get_bit_timing_ext(struct usb2can_channel* ch) {
+  if(!(ch->bt_const.feature & USB2CAN_FEATURE_BT_CONST_EXT)) {
+    memcpy(&ch->bt_const_ext, &ch->bt_const, sizeof(ch->bt_const));
+    ch->bt_const_ext.dtseg1_min = ch->bt_const.tseg1_min;
+    ch->bt_const_ext.dtseg1_max = ch->bt_const.tseg1_max;
+    ch->bt_const_ext.dtseg2_min = ch->bt_const.tseg2_min;
+    ch->bt_const_ext.dtseg2_max = ch->bt_const.tseg2_max;
+    ch->bt_const_ext.dsjw_max = ch->bt_const.sjw_max;
+    ch->bt_const_ext.dbrp_min = ch->bt_const.brp_min;
+    ch->bt_const_ext.dbrp_max = ch->bt_const.brp_max;
+    ch->bt_const_ext.dbrp_inc = ch->bt_const.brp_inc;
+    return 0;
+  }
+
+  LOGI(__FUNCTION__, "INFO", "Getting channel %u's extended bit timing info (USB2CAN_BREQ_BT_CONST_EXT)\n", ch->index);
+  uint8_t bmReqType = 0xC1;       // the request type (direction of transfer)
+  uint8_t bReq = USB2CAN_BREQ_BT_CONST_EXT;            // the request field for this packet
+  uint16_t wVal = ch->index;      // the value field for this packet, the channel
+  uint16_t wIndex = 0x0000;       // the index field for this packet
+  // the data buffer for the in/output data
+  struct usb2can_device_bt_const_extended data;
+  uint16_t wLen = sizeof(data);   // length of this setup packet 
+  unsigned int to = USB2CAN_CTRL_TIMEOUT_MS;    // timeout duration (if transfer fails)
+
+  // transfer the setup packet to the USB device
+  int ret = usb2can_control_transfer(ch->can, bmReqType, bReq, wVal, wIndex, (uint8_t *)(&data), wLen, to);
+  if(ret >=0) {
+    ch->bt_const_ext.feature = le32toh(data.feature);
+    ch->bt_const_ext.fclk_can = le32toh(data.fclk_can);
+    ch->bt_const_ext.tseg1_min = le32toh(data.tseg1_min);
+    ch->bt_const_ext.tseg1_max = le32toh(data.tseg1_max);
+    ch->bt_const_ext.tseg2_min = le32toh(data.tseg2_min);
+    ch->bt_const_ext.tseg2_max = le32toh(data.tseg2_max);
+    ch->bt_const_ext.sjw_max = le32toh(data.sjw_max);
+    ch->bt_const_ext.brp_min = le32toh(data.brp_min);
+    ch->bt_const_ext.brp_max = le32toh(data.brp_max);
+    ch->bt_const_ext.brp_inc = le32toh(data.brp_inc);
+    ch->bt_const_ext.dtseg1_min = le32toh(data.dtseg1_min);
+    ch->bt_const_ext.dtseg1_max = le32toh(data.dtseg1_max);
+    ch->bt_const_ext.dtseg2_min = le32toh(data.dtseg2_min);
+    ch->bt_const_ext.dtseg2_max = le32toh(data.dtseg2_max);
+    ch->bt_const_ext.dsjw_max = le32toh(data.dsjw_max);
+    ch->bt_const_ext.dbrp_min = le32toh(data.dbrp_min);
+    ch->bt_const_ext.dbrp_max = le32toh(data.dbrp_max);
+    ch->bt_const_ext.dbrp_inc = le32toh(data.dbrp_inc);
+    LOGI(__FUNCTION__, "INFO", "BT Const Ext Information:\n");
+    LOGI(__FUNCTION__, "INFO", " dtseg1_min: %u\n", ch->bt_const_ext.dtseg1_min);
+    LOGI(__FUNCTION__, "INFO", " dtseg1_max: %u\n", ch->bt_const_ext.dtseg1_max);
+    LOGI(__FUNCTION__, "INFO", " dtseg2_min: %u\n", ch->bt_const_ext.dtseg2_min);
+    LOGI(__FUNCTION__, "INFO", " dtseg2_max: %u\n", ch->bt_const_ext.dtseg2_max);
+    LOGI(__FUNCTION__, "INFO", "   dsjw_max: %u\n", ch->bt_const_ext.dsjw_max);
+    LOGI(__FUNCTION__, "INFO", "   dbrp_min: %u\n", ch->bt_const_ext.dbrp_min);
+    LOGI(__FUNCTION__, "INFO", "   dbrp_max: %u\n", ch->bt_const_ext.dbrp_max);
+    LOGI(__FUNCTION__, "INFO", "   dbrp_inc: %u\n", ch->bt_const_ext.dbrp_inc);
   }
 
   return ret;
 }
 
-int port_open(struct libusb_device_handle *devh) {
-  LOGI(__FUNCTION__, "INFO", "Opening the port (USB2CAN_BREQ_MODE)\n");
+// The most that the bitrate that we can actually get is allowed to be out by, in tenths of a percent.
+#define USB2CAN_MAX_BITRATE_ERROR (50)
+
+// Work out the bit timing for rate bits/s and send it to the channel with bReq, USB2CAN_BREQ_BITTIMING
+// or USB2CAN_BREQ_DATA_BITTIMING. name is only for the logs.
+int send_bittiming(struct usb2can_channel* ch, uint8_t bReq, const struct bittiming_limits* limits, uint32_t rate, uint16_t sp, const char* name) {
+  struct bittiming bt;
+  int error = bittiming_calc(limits, rate, sp, &bt);
+  if((error < 0) || (error > USB2CAN_MAX_BITRATE_ERROR)) {
+    LOGE(__FUNCTION__, "INFO", "Channel %u can't do a %s of %u bits/s with a %u Hz clock.\n", ch->index, name, rate, limits->fclk);
+    return LIBUSB_ERROR_INVALID_PARAM;
+  }
+  if(error > 0) {
+    LOGW(__FUNCTION__, "INFO", "Channel %u's %s is out by %d.%d%%, it's %u bits/s.\n", ch->index, name, error / 10, error % 10, bt.bitrate);
+  }
+  LOGI(__FUNCTION__, "INFO", "Channel %u %s %u bits/s: prop_seg %u, phase_seg1 %u, phase_seg2 %u, sjw %u, brp %u, sample point %u.%u%%\n",
+    ch->index, name, rate, bt.prop_seg, bt.phase_seg1, bt.phase_seg2, bt.sjw, bt.brp, bt.sample_point / 10, bt.sample_point % 10);
+
+  uint8_t bmReqType = 0x41;       // the request type (direction of transfer)
+  uint16_t wVal = ch->index;      // the value field for this packet, the channel
+  uint16_t wIndex = 0x0000;       // the index field for this packet
+  struct usb2can_device_bittiming data = {
+    .prop_seg = htole32(bt.prop_seg),
+    .phase_seg1 = htole32(bt.phase_seg1),
+    .phase_seg2 = htole32(bt.phase_seg2),
+    .sjw = htole32(bt.sjw),
+    .brp = htole32(bt.brp)
+  };
+  uint16_t wLen = sizeof(data);   // length of this setup packet 
+  unsigned int to = USB2CAN_CTRL_TIMEOUT_MS;    // timeout duration (if transfer fails)
+
+  // transfer the setup packet to the USB device
+  return usb2can_control_transfer(ch->can, bmReqType, bReq, wVal, wIndex, (uint8_t *)(&data), wLen, to);
+}
+
+// Set the nominal (arbitration phase) bitrate, ch->bitrate, from the limits in the device's bt_const.
+int set_bitrate(struct usb2can_channel* ch) {
+  LOGI(__FUNCTION__, "INFO", "Setting bitrate of channel %u to %u bits/s...\n", ch->index, ch->bitrate);
+  struct bittiming_limits limits = {
+    .fclk = ch->bt_const.fclk_can,
+    .tseg1_min = ch->bt_const.tseg1_min,
+    .tseg1_max = ch->bt_const.tseg1_max,
+    .tseg2_min = ch->bt_const.tseg2_min,
+    .tseg2_max = ch->bt_const.tseg2_max,
+    .sjw_max = ch->bt_const.sjw_max,
+    .brp_min = ch->bt_const.brp_min,
+    .brp_max = ch->bt_const.brp_max,
+    .brp_inc = ch->bt_const.brp_inc
+  };
+  return send_bittiming(ch, USB2CAN_BREQ_BITTIMING, &limits, ch->bitrate, ch->sample_point, "bitrate");
+}
+
+// Set the CAN FD data phase bitrate, ch->data_bitrate. The channel still needs starting in CAN FD mode.
+int set_data_bitrate(struct usb2can_channel* ch) {
+  LOGI(__FUNCTION__, "INFO", "Setting data bitrate of channel %u to %u bits/s...\n", ch->index, ch->data_bitrate);
+  struct bittiming_limits limits = {
+    .fclk = ch->bt_const_ext.fclk_can,
+    .tseg1_min = ch->bt_const_ext.dtseg1_min,
+    .tseg1_max = ch->bt_const_ext.dtseg1_max,
+    .tseg2_min = ch->bt_const_ext.dtseg2_min,
+    .tseg2_max = ch->bt_const_ext.dtseg2_max,
+    .sjw_max = ch->bt_const_ext.dsjw_max,
+    .brp_min = ch->bt_const_ext.dbrp_min,
+    .brp_max = ch->bt_const_ext.dbrp_max,
+    .brp_inc = ch->bt_const_ext.dbrp_inc
+  };
+  // The data phase is sampled earlier than the arbitration phase to leave room for the transceiver's delay.
+  uint16_t sp = ch->data_sample_point;
+  if(sp == BITTIMING_SAMPLE_POINT_DEFAULT) {
+    sp = 750;
+  }
+  return send_bittiming(ch, USB2CAN_BREQ_DATA_BITTIMING, &limits, ch->data_bitrate, sp, "data bitrate");
+}
+
+// Start a channel. It uses the device wide flags in can->mode_flags plus its own.
+int port_open(struct usb2can_channel* ch) {
+  LOGI(__FUNCTION__, "INFO", "Opening channel %u (USB2CAN_BREQ_MODE)\n", ch->index);
   uint8_t bmReqType = 0x41;       // the request type (direction of transfer)
   uint8_t bReq = USB2CAN_BREQ_MODE;            // the request field for this packet
-  uint16_t wVal = 0x0000;         // the value field for this packet
+  uint16_t wVal = ch->index;      // the value field for this packet, the channel
   uint16_t wIndex = 0x0000;       // the index field for this packet
   
   // the data buffer for the in/output data
   unsigned char data[] = {
     0x01, 0x00, 0x00, 0x00, // CAN_MODE_START
-    0x00, 0x00, 0x00, 0x00 
+    0x00, 0x00, 0x00, 0x00  // Flags, filled in below
   };
+  uint32_t flags = htole32(ch->can->mode_flags | ch->mode_flags);
+  memcpy(&data[4], &flags, sizeof(flags));
   uint16_t wLen = sizeof(data);   // length of this setup packet 
-  unsigned int to = 0;    // timeout duration (if transfer fails)
+  unsigned int to = USB2CAN_CTRL_TIMEOUT_MS;    // timeout duration (if transfer fails)
 
   // transfer the setup packet to the USB device
-  int config = libusb_control_transfer(devh, bmReqType, bReq, wVal, wIndex, data, wLen, to);
+  int config = usb2can_control_transfer(ch->can, bmReqType, bReq, wVal, wIndex, data, wLen, to);
+  if(config >= 0) {
+    ch->open = 1;
+  }
 
   return config;
 }
 
-int port_close(struct libusb_device_handle *devh) {
-  LOGI(__FUNCTION__, "INFO", "Closing the port (USB2CAN_BREQ_MODE)\n");
+int port_close(struct usb2can_channel* ch) {
+  LOGI(__FUNCTION__, "INFO", "Closing channel %u (USB2CAN_BREQ_MODE)\n", ch->index);
   uint8_t bmReqType = 0x41;       // the request type (direction of transfer)
   uint8_t bReq = USB2CAN_BREQ_MODE;            // the request field for this packet
-  uint16_t wVal = 0x0000;         // the value field for this packet
+  uint16_t wVal = ch->index;      // the value field for this packet, the channel
   uint16_t wIndex = 0x0000;       // the index field for this packet
   // the data buffer for the in/output data
   unsigned char data[] = {
@@ -974,48 +1865,269 @@ int port_close(struct libusb_device_handle *devh) {
     0x00, 0x00, 0x00, 0x00
   };
   uint16_t wLen = sizeof(data);   // length of this setup packet 
-  unsigned int to = 0;    // timeout duration (if transfer fails)
+  unsigned int to = USB2CAN_CTRL_TIMEOUT_MS;    // timeout duration (if transfer fails)
 
   // transfer the setup packet to the USB device
-  int config = libusb_control_transfer(devh, bmReqType, bReq, wVal, wIndex, data, wLen, to);
+  int config = usb2can_control_transfer(ch->can, bmReqType, bReq, wVal, wIndex, data, wLen, to);
+  ch->open = 0;
 
   return config;
 }
 
-#define NCLIENTS (10)
+// Set up the channel to listen at autobaud_rates[index], or the next one after it that the device can do.
+// The channel needs to be closed and it's up to the caller to open it again.
+int autobaud_try(struct usb2can_channel* ch, int index) {
+  int ret = LIBUSB_ERROR_INVALID_PARAM;
+  for(int n = 0; (n < AUTOBAUD_RATES) && (ret == LIBUSB_ERROR_INVALID_PARAM); n++) {
+    ch->autobaud = (index + n) % AUTOBAUD_RATES;
+    ch->bitrate = autobaud_rates[ch->autobaud];
+    ret = set_bitrate(ch);
+  }
+  ch->autobaud_frames = 0;
+  ch->autobaud_errors = 0;
+  ch->autobaud_start = nanos();
+  ch->autobaud_deadline = millis() + USB2CAN_AUTOBAUD_DWELL_MS;
+  return ret;
+}
+
+// Move auto-baud on to the next bitrate as soon as the one it's trying gets an error frame, or
+// after USB2CAN_AUTOBAUD_DWELL_MS if it gets nothing at all. Once it has received
+// USB2CAN_AUTOBAUD_FRAMES frames without any errors it locks on to the bitrate and the channel is
+// restarted normally.
+void handle_autobaud(struct usb2can_can* can) {
+  for(int c = 0; c < can->channel_count; c++) {
+    struct usb2can_channel* ch = &can->channels[c];
+    if(ch->autobaud < 0) {
+      continue;
+    }
+    int ret = 0;
+    if((ch->autobaud_errors == 0) && (ch->autobaud_frames >= USB2CAN_AUTOBAUD_FRAMES)) {
+      LOGI(__FUNCTION__, "INFO", "%s channel %u: auto-baud found %u bits/s.\n", can->serial, ch->index, ch->bitrate);
+      port_close(ch);
+      ch->autobaud = -1;
+      ch->mode_flags &= ~(USB2CAN_FEATURE_LISTEN_ONLY | USB2CAN_FEATURE_BERR_REPORTING);
+      set_tx_timeout(ch);
+      ret = port_open(ch);
+    } else if((ch->autobaud_errors > 0) || (millis() > ch->autobaud_deadline)) {
+      port_close(ch);
+      ret = autobaud_try(ch, ch->autobaud + 1);
+      if(ret >= 0) {
+        ret = port_open(ch);
+      }
+    }
+    if(ret == LIBUSB_ERROR_NO_DEVICE) {
+      can->dead = 1;
+    } else if(ret < 0) {
+      LOGE(__FUNCTION__, "INFO", "%s channel %u: auto-baud couldn't restart the channel: %s\n", can->serial, ch->index, libusb_error_name(ret));
+    }
+  }
+}
+
+// How many clients the table has room for to start with, it doubles as it needs to up to max_clients.
+#define CLIENTS_INITIAL (16)
+// The number of messages that we'll read from a client ahead of sending them to the device.
+#define CLIENT_TX_QUEUE (64)
+// How much we read from a client in one go: enough to fill its tx_queue with CAN FD frames, and on
+// the Unix domain socket there's always room for a whole message on top of what's left over.
+#define CLIENT_RX_BUF (USB2CAN_V2_RECORD_MAX + (CLIENT_TX_QUEUE * CANFD_MTU))
 
 #define CLIENT_TYPE_NONE  (0)
 #define CLIENT_TYPE_SOCK  (1)
 #define CLIENT_TYPE_LIBUSB  (2)
+#define CLIENT_TYPE_SEQPACKET (3) // On the Unix domain socket.
+// The most messages that we hand the kernel in one go when we send to a client.
+#define CONN_OUT_BATCH (USB2CAN_DELAY_BATCH)
+
+/// @brief A message waiting to go to a client, see conn_queue().
+struct conn_msg {
+  struct canfd_frame frame;
+  uint8_t size;         // How much of frame goes, conn_mtu() when it was queued.
+  uint8_t frame_group;  // It's a frame, or the USB2CAN_CTRL_TIMESTAMP that goes with one, so it can be dropped.
+  uint8_t with_next;    // It's a USB2CAN_CTRL_TIMESTAMP, it goes (or is dropped) with the frame after it.
+  uint8_t rights;       // Send shm_fd with it, see shm_attach().
+  uint8_t v2;           // It goes in a protocol v2 record, the rest are sent as they are.
+  uint64_t timestamp;   // For its usb2can_v2_entry.
+  uint64_t seq;
+};
+
+// How much room there is for protocol v2 records, enough for CONN_OUT_BATCH of the biggest entries.
+#define CONN_STAGE_SIZE (CONN_OUT_BATCH * (sizeof(struct usb2can_v2_record) + USB2CAN_V2_ENTRY_MAX))
+
+/// @brief The protocol v2 records on their way to a client, see conn_stage().
+struct conn_stage {
+  uint32_t len;         // How many bytes there are.
+  uint32_t pos;         // How many of them have gone.
+  uint32_t records;     // How many records there are, on the Unix domain socket each one is a message.
+  uint32_t next;        // The first record that hasn't gone.
+  uint32_t ends[CONN_OUT_BATCH]; // Where each record ends.
+  uint8_t rights;       // The first record goes with shm_fd.
+  uint8_t buf[CONN_STAGE_SIZE];
+};
 
 struct client_t {
   int fd;
   int typ;
+  uint32_t conn;      // Which connection this is, every connection gets a new number.
+  uint8_t timestamps; // Send a USB2CAN_CTRL_TIMESTAMP before each frame.
+  uint8_t channels;   // Bitmask of the channels that we send frames from, see USB2CAN_CTRL_SUBSCRIBE.
+  uint32_t device;    // The id of the device that it's bound to or 0 for the default device, see USB2CAN_CTRL_BIND.
+  uint8_t fd_frames;  // Send and receive struct canfd_frame instead of struct can_frame, see USB2CAN_CTRL_FD.
+  uint8_t rx_fd_frames; // fd_frames as far as we've read, it's ahead of fd_frames while the USB2CAN_CTRL_FD is in tx_queue.
+  uint8_t paused;     // Set while we've stopped reading from it because tx_queue is full.
+  uint8_t closing;    // Set once it has hung up, it's closed as soon as tx_queue is empty.
+  uint8_t tx_status;  // Send a USB2CAN_CTRL_TX_STATUS for each frame that it sends.
+  uint8_t loopback;   // The other clients receive the frames that it sends, see USB2CAN_CTRL_LOOPBACK.
+  uint8_t recv_own;   // It receives the frames that it sends, see USB2CAN_CTRL_RECV_OWN_MSGS.
+  uint8_t cyclic_pending; // Set after a USB2CAN_CTRL_CYCLIC, the next frame it sends is for cyclic_ctrl.
+  uint32_t tx_number; // The number that the next frame it sends gets in its USB2CAN_CTRL_TX_STATUS.
+  uint32_t tx_head;
+  uint32_t tx_count;
+  uint32_t rx_len;
+  int shm_ring;       // Its tx ring in the shared memory, -1 if it isn't using the rings (see USB2CAN_CTRL_SHM).
+  uint8_t shm_moved;  // We've taken something from its tx ring on this pass of the processing loop.
+  struct canfilter* filter; // Which frames it receives, NULL until it asks for anything but all of them (see USB2CAN_CTRL_FILTER).
+  // What's waiting to go to it: up to out_depth frames, control messages can use as many again (see conn_queue()).
+  struct conn_msg* out;
+  uint32_t out_head;
+  uint32_t out_count;
+  uint32_t out_frames;  // How many of them are frames (and their timestamps).
+  uint32_t out_offset;  // How much of the first one has gone, TCP can take part of a message.
+  uint8_t out_blocked;  // Its socket is full, we're waiting for it to be writable.
+  uint8_t out_watch;    // We're watching its socket for being writable.
+  uint8_t out_overflow; // It fell too far behind with OUT_POLICY_DISCONNECT, it's closed at the end of the pass.
+  uint64_t out_dropped; // How many frames we've dropped because it fell behind.
+  uint64_t out_logged;  // out_dropped when we last said so.
+  uint32_t out_delay;   // How long its frames can wait in microseconds, see USB2CAN_CTRL_DELAY.
+  uint64_t out_due;     // When the oldest frame that's waiting has to go, nanos(). 0 if there's no hurry.
+  uint8_t out_urgent;   // Something other than a frame is waiting, it all goes now.
+  struct conn_stage* stage; // NULL until it has asked for protocol v2.
+  uint8_t protocol;     // What we send it, USB2CAN_PROTOCOL_*.
+  uint8_t rx_protocol;  // What it sends us, it's ahead of protocol while the USB2CAN_CTRL_PROTOCOL is in tx_queue.
+  uint16_t rx_entries;  // Protocol v2: how many entries are left in the record we're reading.
+  uint32_t rx_record_left; // And how many bytes.
+  int next_free;        // Links the free slots, -1 at the end.
+  // The buffers go last, so that what sendCANToAll() looks at for every frame is in the first few cache lines.
+  struct canfd_frame cyclic_ctrl;
+  struct canfd_frame tx_queue[CLIENT_TX_QUEUE]; // What it has sent us that hasn't gone to the device yet, in order.
+  uint64_t tx_time[CLIENT_TX_QUEUE];  // When we read each of them, nanos().
+  uint8_t rx_buf[CLIENT_RX_BUF]; // What we've read from it over TCP that isn't in tx_queue yet, see conn_read().
 };
 
-struct client_t clients[NCLIENTS];
-
-// return the index of a particular client's fd, or empty slot if fd = 0;
+// The clients, each in a slot that's reused once it has closed. Anything that has to find a client
+// later keeps its slot and its conn, so it can tell when the slot has been reused.
+struct client_t* clients = NULL;
+int conn_slots = 0;   // Every client is in a slot below this, the ones that aren't in use have fd = 0.
+int conn_cap = 0;     // How many slots clients has room for.
+int conn_free = -1;   // The first of the free slots below conn_slots, linked by next_free.
+int conn_open = 0;    // How many clients there are.
+int* conn_fds = NULL; // The slot of the client that each file descriptor belongs to, -1 if it isn't a client's.
+int conn_fds_len = 0;
+int conn_queued = 0;  // The number of messages in all of the clients' tx_queues.
+int conn_next = 0;    // The client that conn_drain() starts with, the one after the last that it sent for.
+uint32_t conn_count = 0;  // The number of connections that we've had, for client_t.conn.
+
+// return the index of a particular client's fd, or -1 if it isn't a client's.
 int conn_index(int fd) {
-  int i;
-  for(i = 0; i < NCLIENTS; i++) {
-    if(clients[i].fd == fd) {
-      return i;
+  if((fd < 1) || (fd >= conn_fds_len)) {
+    return -1;
+  }
+  return conn_fds[fd];
+}
+
+// Make room for the slot of a client with file descriptor fd, and for another client if there
+// aren't any free slots. Returns 0 or -1 if we're out of memory.
+int conn_grow(int fd) {
+  if(fd >= conn_fds_len) {
+    int len = (conn_fds_len > 0) ? conn_fds_len : 64;
+    while(len <= fd) {
+      len *= 2;
+    }
+    int* fds = realloc(conn_fds, len * sizeof(int));
+    if(fds == NULL) {
+      return -1;
     }
+    for(int k = conn_fds_len; k < len; k++) {
+      fds[k] = -1;
+    }
+    conn_fds = fds;
+    conn_fds_len = len;
   }
-  return -1;
+  if((conn_free < 0) && (conn_slots == conn_cap)) {
+    int cap = (conn_cap > 0) ? (conn_cap * 2) : CLIENTS_INITIAL;
+    if(cap > max_clients) {
+      cap = max_clients;
+    }
+    struct client_t* c = realloc(clients, cap * sizeof(struct client_t));
+    if(c == NULL) {
+      return -1;
+    }
+    clients = c;
+    conn_cap = cap;
+  }
+  return 0;
 }
 
-// Add a new connection to the clients list
+// Add a new connection to the clients list. Returns 0, or -1 if there's no room for it and the caller
+// should close it.
 int conn_add(int fd, int typ) {
   if(fd < 1) return -1;
-  int i = conn_index(0);
-  if(i == NCLIENTS) {  // We don't have space for this one!
-    close(fd);
+  if(conn_open >= max_clients) {
+    LOGW(__FUNCTION__, "INFO", "Socket %i: there are already %i connections, refusing it\n", fd, conn_open);
+    return -1;
+  }
+  struct conn_msg* out = malloc(2 * out_depth * sizeof(struct conn_msg));
+  if((out == NULL) || (conn_grow(fd) != 0)) {
+    LOGE(__FUNCTION__, "INFO", "Socket %i: out of memory for another connection\n", fd);
+    free(out);
     return -1;
   }
+  int i = conn_free;
+  if(i >= 0) {
+    conn_free = clients[i].next_free;
+  } else {
+    i = conn_slots++;
+  }
+  conn_fds[fd] = i;
+  conn_open++;
+  clients[i].out = out;
   clients[i].fd = fd;
   clients[i].typ = typ;
+  clients[i].conn = ++conn_count;
+  clients[i].timestamps = 0;
+  clients[i].channels = 0x01;
+  clients[i].device = 0;
+  clients[i].fd_frames = 0;
+  clients[i].rx_fd_frames = 0;
+  clients[i].paused = 0;
+  clients[i].closing = 0;
+  clients[i].tx_status = 0;
+  clients[i].tx_number = 0;
+  clients[i].loopback = 1;
+  clients[i].recv_own = 0;
+  clients[i].cyclic_pending = 0;
+  clients[i].tx_head = 0;
+  clients[i].tx_count = 0;
+  clients[i].rx_len = 0;
+  clients[i].shm_ring = -1;
+  clients[i].shm_moved = 0;
+  clients[i].filter = NULL;
+  clients[i].out_head = 0;
+  clients[i].out_count = 0;
+  clients[i].out_frames = 0;
+  clients[i].out_offset = 0;
+  clients[i].out_blocked = 0;
+  clients[i].out_watch = 0;
+  clients[i].out_overflow = 0;
+  clients[i].out_dropped = 0;
+  clients[i].out_logged = 0;
+  clients[i].out_delay = 0;
+  clients[i].out_due = 0;
+  clients[i].out_urgent = 0;
+  clients[i].stage = NULL;
+  clients[i].protocol = USB2CAN_PROTOCOL_V1;
+  clients[i].rx_protocol = USB2CAN_PROTOCOL_V1;
+  clients[i].rx_entries = 0;
+  clients[i].rx_record_left = 0;
   return 0;
 }
 
@@ -1024,194 +2136,2351 @@ int conn_close(int fd) {
   if(fd < 1) return -1;
   int i = conn_index(fd);
   if(i < 0) return -1;
+  conn_fds[fd] = -1;
+  clients[i].next_free = conn_free;
+  conn_free = i;
+  conn_open--;
   clients[i].fd = 0;
   clients[i].typ = 0;
+  clients[i].timestamps = 0;
+  clients[i].channels = 0;
+  clients[i].device = 0;
+  clients[i].fd_frames = 0;
+  clients[i].rx_fd_frames = 0;
+  clients[i].paused = 0;
+  clients[i].closing = 0;
+  clients[i].tx_status = 0;
+  clients[i].loopback = 0;
+  clients[i].recv_own = 0;
+  clients[i].cyclic_pending = 0;
+  cyclic_stop_client(i);
+  shm_detach(i);
+  free(clients[i].filter);
+  clients[i].filter = NULL;
+  if(clients[i].rx_len > 0) {
+    LOGW(__FUNCTION__, "INFO", "Socket %i: hung up part way through a message, %u bytes dropped\n", fd, clients[i].rx_len);
+  }
+  if(clients[i].out_dropped > 0) {
+    LOGW(__FUNCTION__, "INFO", "Socket %i: %" PRIu64 " frames were dropped because it fell behind\n", fd, clients[i].out_dropped);
+  }
+  free(clients[i].out);
+  clients[i].out = NULL;
+  free(clients[i].stage);
+  clients[i].stage = NULL;
+  clients[i].out_count = 0;
+  clients[i].out_frames = 0;
+  clients[i].out_blocked = 0;
+  clients[i].out_overflow = 0;
+  conn_queued -= clients[i].tx_count;
+  clients[i].tx_head = 0;
+  clients[i].tx_count = 0;
+  clients[i].rx_len = 0;
   return close(fd);
 }
 
-int sockSend(int fd, const void *msg, size_t len) {
-  int res = send(fd, msg, len, 0);
-  if(res == -1) {
-    switch(errno) {
-      case EBADF:
-        LOGE("PIPE", "OUT", "Send error: EBADF\n");
-        break;
-      case EACCES:
-        LOGE("PIPE", "OUT", "Send error: EACCES\n");
-        break;
-      case ENOTCONN:
-        LOGE("PIPE", "OUT", "Send error: ENOTCONN\n");
-        break;
-      case ENOTSOCK:
-        LOGE("PIPE", "OUT", "Send error: ENOTSOCK\n");
-        break;
-      case EFAULT:
-        LOGE("PIPE", "OUT", "Send error: EFAULT\n");
-        break;
-      case EMSGSIZE:
-        LOGE("PIPE", "OUT", "Send error: EMSGSIZE\n");
-        break;
-      case EAGAIN:
-        LOGE("PIPE", "OUT", "Send error: EAGAIN\n");
-        break;
-      case ENOBUFS:
-        LOGE("PIPE", "OUT", "Send error: ENOBUFS\n");
-        break;
-      case EHOSTUNREACH:
-        LOGE("PIPE", "OUT", "Send error: EHOSTUNREACH\n");
-        break;
-      case EISCONN:
-        LOGE("PIPE", "OUT", "Send error: EISCONN\n");
-        break;
-      case ECONNREFUSED:
-        LOGE("PIPE", "OUT", "Send error: ECONNREFUSED\n");
-        break;
-      case EHOSTDOWN:
-        LOGE("PIPE", "OUT", "Send error: EHOSTDOWN\n");
-        break;
-      case ENETDOWN:
-        LOGE("PIPE", "OUT", "Send error: ENETDOWN\n");
-        break;
-      case EADDRNOTAVAIL:
-        LOGE("PIPE", "OUT", "Send error: EADDRNOTAVAIL\n");
-        break;
-      case EPIPE:
-        LOGE("PIPE", "OUT", "Send error: EPIPE\n");
-        break;
-      default :
-        LOGE("PIPE", "OUT", "Send error: unknown\n");
-        break;
+// Say why sending to a client failed, err is errno.
+void sockSendError(int err) {
+  switch(err) {
+    case EBADF:
+      LOGE("PIPE", "OUT", "Send error: EBADF\n");
+      break;
+    case EACCES:
+      LOGE("PIPE", "OUT", "Send error: EACCES\n");
+      break;
+    case ENOTCONN:
+      LOGE("PIPE", "OUT", "Send error: ENOTCONN\n");
+      break;
+    case ENOTSOCK:
+      LOGE("PIPE", "OUT", "Send error: ENOTSOCK\n");
+      break;
+    case EFAULT:
+      LOGE("PIPE", "OUT", "Send error: EFAULT\n");
+      break;
+    case EMSGSIZE:
+      LOGE("PIPE", "OUT", "Send error: EMSGSIZE\n");
+      break;
+    case EAGAIN:
+      LOGE("PIPE", "OUT", "Send error: EAGAIN\n");
+      break;
+    case ENOBUFS:
+      LOGE("PIPE", "OUT", "Send error: ENOBUFS\n");
+      break;
+    case EHOSTUNREACH:
+      LOGE("PIPE", "OUT", "Send error: EHOSTUNREACH\n");
+      break;
+    case EISCONN:
+      LOGE("PIPE", "OUT", "Send error: EISCONN\n");
+      break;
+    case ECONNREFUSED:
+      LOGE("PIPE", "OUT", "Send error: ECONNREFUSED\n");
+      break;
+    case EHOSTDOWN:
+      LOGE("PIPE", "OUT", "Send error: EHOSTDOWN\n");
+      break;
+    case ENETDOWN:
+      LOGE("PIPE", "OUT", "Send error: ENETDOWN\n");
+      break;
+    case EADDRNOTAVAIL:
+      LOGE("PIPE", "OUT", "Send error: EADDRNOTAVAIL\n");
+      break;
+    case EPIPE:
+      LOGE("PIPE", "OUT", "Send error: EPIPE\n");
+      break;
+    default :
+      LOGE("PIPE", "OUT", "Send error: unknown\n");
+      break;
+  }
+}
+
+// Find a device by its id, 0 gets the default device (the first one in devices[]). Returns NULL if it isn't attached.
+struct usb2can_can* find_device(uint32_t id) {
+  for(int d = 0; d < USB2CAN_MAX_DEVICES; d++) {
+    if((devices[d] != NULL) && ((id == 0) || (devices[d]->id == id))) {
+      return devices[d];
     }
   }
-  return res;
+  return NULL;
 }
 
-int sendCANToAll(struct can_frame * frame) {
-  print_can_frame("PIPE", "OUT", frame, 0, "");
+// The size of the messages that a client sends and receives.
+size_t conn_mtu(int i) {
+  return clients[i].fd_frames ? CANFD_MTU : CAN_MTU;
+}
 
-  int i;
-  int cnt = 0;
-  for(i = 0; i < NCLIENTS; i++) {
-    if((clients[i].fd > 0) && (clients[i].typ == CLIENT_TYPE_SOCK)) {
-      int ret = sockSend(clients[i].fd, frame, sizeof(frame));
-      if(ret > 0) {
-        cnt++;
-      }
+// Drop the oldest frame (and its timestamp) waiting for a client to make room for a new one, but
+// never one that has started to go. The messages in front of it move up so that they stay in order.
+// Returns the number of messages dropped, 0 if there isn't a frame to drop.
+uint32_t conn_drop_oldest(struct client_t* client) {
+  uint32_t size = 2 * out_depth;
+  uint32_t pos = 0;
+  if(client->out_offset > 0) {
+    while((pos < client->out_count) && client->out[(client->out_head + pos) % size].with_next) {
+      pos++;
     }
+    pos++;
+  }
+  while((pos < client->out_count) && !client->out[(client->out_head + pos) % size].frame_group) {
+    pos++;
+  }
+  if(pos >= client->out_count) {
+    return 0;
   }
-  return cnt; // How many we succesfully sent to.
+  uint32_t len = client->out[(client->out_head + pos) % size].with_next ? 2 : 1;
+  for(uint32_t k = pos; k > 0; k--) {
+    client->out[(client->out_head + k - 1 + len) % size] = client->out[(client->out_head + k - 1) % size];
+  }
+  client->out_head = (client->out_head + len) % size;
+  client->out_count -= len;
+  client->out_frames -= len;
+  client->out_dropped++;
+  return len;
 }
 
-int readCAN(struct usb2can_can* can) {
-    int max = 0;
-    int ret = 0;
-    while((0 == ret) && (max < USB2CAN_MAX_RX_REQ)) {
-      ret = read_packet(can);
-      max++;
+// Queue a message for client i in the format that it's using, with the USB2CAN_CTRL_TIMESTAMP that
+// goes before it if ts isn't NULL. A struct can_frame is the start of a struct canfd_frame so
+// classic CAN connections just get the first CAN_MTU bytes, protocol v2 connections keep all of it
+// for conn_stage(). Nothing is sent until conn_flush(), so however slow a client is it never holds
+// up anything else. If it has fallen more than out_depth
+// frames behind then out_policy decides what happens. Control messages are never dropped, they'd
+// leave the client out of step with its connection, unless it has so many waiting that it can't be
+// reading at all, then it's disconnected.
+// Returns the message so that the caller can change it, or NULL if it wasn't queued.
+struct conn_msg* conn_queue(int i, struct canfd_frame* frame, struct canfd_frame* ts) {
+  struct client_t* client = &clients[i];
+  if((client->out == NULL) || client->closing || client->out_overflow) {
+    return NULL;  // It's hung up (or about to be), there's nobody to send to.
+  }
+  uint32_t len = (ts != NULL) ? 2 : 1;
+  uint8_t frame_group = !(frame->msg_flags & USB2CAN_MSG_CTRL);
+  if(frame_group) {
+    while(((client->out_frames + len) > out_depth) && (out_policy == OUT_POLICY_DROP_OLDEST) && (conn_drop_oldest(client) > 0)) {
     }
-    return ret;
+    if((client->out_frames + len) > out_depth) {
+      client->out_dropped++;
+      if(out_policy == OUT_POLICY_DISCONNECT) {
+        client->out_overflow = 1;
+      }
+      return NULL;
+    }
+  } else if((client->out_count + len) > (2 * out_depth)) {
+    client->out_overflow = 1;
+    return NULL;
+  }
+  uint8_t v2 = (client->protocol == USB2CAN_PROTOCOL_V2);
+  uint8_t size = v2 ? CANFD_MTU : (uint8_t)conn_mtu(i);
+  struct conn_msg* m;
+  if(ts != NULL) {
+    m = &client->out[(client->out_head + client->out_count++) % (2 * out_depth)];
+    memcpy(&m->frame, ts, size);
+    m->size = size;
+    m->frame_group = frame_group;
+    m->with_next = 1;
+    m->rights = 0;
+    m->v2 = 0;
+  }
+  m = &client->out[(client->out_head + client->out_count++) % (2 * out_depth)];
+  memcpy(&m->frame, frame, size);
+  m->size = size;
+  m->frame_group = frame_group;
+  m->with_next = 0;
+  m->rights = 0;
+  m->v2 = v2;
+  m->timestamp = 0;
+  m->seq = 0;
+  if(frame_group) {
+    client->out_frames += len;
+    if((client->out_delay > 0) && (client->out_due == 0)) {
+      client->out_due = nanos() + ((uint64_t)client->out_delay * 1000);
+    }
+  } else {
+    client->out_urgent = 1;
+  }
+  return m;
 }
 
-int processing_loop(int kq, int sockFd, struct usb2can_can* can, libusb_context *ctx) {
-  struct kevent evSet;
-  struct kevent evList[MAX_EVENTS];
-  struct sockaddr_storage addr;
-  socklen_t socklen = sizeof(addr);
-  int fd;
-  struct timespec zero_ts = {
-    .tv_sec = 0,
-    .tv_nsec = 0
-  };
-  struct can_frame frame;
-
-  LOGI(__FUNCTION__, "INFO", "Entering Main Loop...\n");
-  LOGI(__FUNCTION__, "INFO", "sockFd = %i\n", sockFd);
+// Send a message to a client, see conn_queue().
+int conn_send(int fd, struct canfd_frame* frame) {
+  int i = conn_index(fd);
+  if(i < 0) return -1;
+  return (conn_queue(i, frame, NULL) != NULL) ? 0 : -1;
+}
 
-  while(1) {
-    int ret = 0;
-    ret = readCAN(can);
-    if(LIBUSB_ERROR_NO_DEVICE == ret) {
-      break;
+// The channels of a device that are running CAN FD as a bitmask.
+uint8_t fd_channels(struct usb2can_can* can) {
+  uint8_t mask = 0;
+  for(int c = 0; (can != NULL) && (c < can->channel_count); c++) {
+    if(can->channels[c].mode_flags & USB2CAN_FEATURE_FD) {
+      mask |= 1 << c;
     }
-    handleRetries(can);
+  }
+  return mask;
+}
 
-    int nev = kevent(kq, NULL, 0, evList, MAX_EVENTS, &zero_ts);
-    if(nev < 0) {
-      LOGE(__FUNCTION__, "INFO", "kevent error\n");
-      exit(1);
-    }
+// Send a USB2CAN_CTRL_BIND to tell a client whether the device it's bound to is attached.
+int conn_send_bind(int fd, uint32_t id, uint8_t attached) {
+  struct canfd_frame reply;
+  memset(&reply, 0, sizeof(reply));
+  reply.can_id = USB2CAN_CTRL_BIND;
+  reply.msg_flags = USB2CAN_MSG_CTRL;
+  reply.len = attached;
+  memcpy(reply.data, &id, sizeof(id));
+  return conn_send(fd, &reply);
+}
 
-    for(int i = 0; i < nev; i++) {
-      if(sockFd == (int)(evList[i].ident)) {
-        fd = accept(evList[i].ident, (struct sockaddr *)&addr, & socklen);
-        if(fd == -1) {
-          LOGE(__FUNCTION__, "INFO", "kevent error\n");
-        } else if(conn_add(fd, CLIENT_TYPE_SOCK) == 0) {
-        LOGI(__FUNCTION__, "INFO", "Accepted socket %i.\n", fd);
-          EV_SET(&evSet, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
-          assert(-1 != kevent(kq, &evSet, 1, NULL, 0, NULL));
-        } else {
-          LOGE(__FUNCTION__, "INFO", "Connection refused!\n");
-          close(fd);
+// Handle a control message from a client (see enum usb2can_ctrl).
+int conn_ctrl(int fd, struct canfd_frame* frame) {
+  int i = conn_index(fd);
+  if(i < 0) return -1;
+  struct usb2can_can* can = find_device(clients[i].device);
+  switch(frame->can_id) {
+    case USB2CAN_CTRL_TIMESTAMP:
+      clients[i].timestamps = (frame->len != 0);
+      LOGI(__FUNCTION__, "INFO", "Socket %i: timestamps %s\n", fd, clients[i].timestamps ? "on" : "off");
+      return 0;
+    case USB2CAN_CTRL_SUBSCRIBE: {
+      int channel_count = (can != NULL) ? can->channel_count : 0;
+      clients[i].channels = frame->data[0] & ((1 << channel_count) - 1);
+      LOGI(__FUNCTION__, "INFO", "Socket %i: channels %02x\n", fd, clients[i].channels);
+      struct canfd_frame reply;
+      memset(&reply, 0, sizeof(reply));
+      reply.can_id = USB2CAN_CTRL_SUBSCRIBE;
+      reply.msg_flags = USB2CAN_MSG_CTRL;
+      reply.len = 2;
+      reply.data[0] = clients[i].channels;
+      reply.data[1] = channel_count;
+      conn_send(fd, &reply);
+      return 0;
+    }
+    case USB2CAN_CTRL_BIND: {
+      uint32_t id;
+      memcpy(&id, frame->data, sizeof(id));
+      clients[i].device = id;
+      clients[i].channels = 0x01;
+      can = find_device(id);
+      LOGI(__FUNCTION__, "INFO", "Socket %i: bound to device %08x (%s)\n", fd, id, (can != NULL) ? can->serial : "not attached");
+      conn_send_bind(fd, id, can != NULL);
+      return 0;
+    }
+    case USB2CAN_CTRL_DEVICES: {
+      struct canfd_frame reply;
+      memset(&reply, 0, sizeof(reply));
+      reply.can_id = USB2CAN_CTRL_DEVICES;
+      reply.msg_flags = USB2CAN_MSG_CTRL;
+      int count = 0;
+      for(int d = 0; d < USB2CAN_MAX_DEVICES; d++) {
+        count += (devices[d] != NULL);
+      }
+      if(count == 0) {
+        conn_send(fd, &reply);
+        return 0;
+      }
+      int n = 0;
+      for(int d = 0; d < USB2CAN_MAX_DEVICES; d++) {
+        if(devices[d] != NULL) {
+          reply.len = 8;
+          memcpy(reply.data, &devices[d]->id, sizeof(devices[d]->id));
+          reply.data[4] = devices[d]->channel_count;
+          reply.data[5] = n++;
+          reply.data[6] = count;
+          reply.data[7] = fd_channels(devices[d]);
+          conn_send(fd, &reply);
         }
-      } else if(conn_index((int)(evList[i].ident)) > -1) {
-        fd = (int)(evList[i].ident);
-        switch(clients[conn_index(fd)].typ) {
-        case CLIENT_TYPE_SOCK:
-          if(evList[i].flags & EV_EOF) {
-            LOGI(__FUNCTION__, "INFO", "Socket closed: %i\n", fd);
-            conn_close(fd);
-          } else {
-            int ret;
-            int i = 0;
-            int toread = (int)(evList[i].data);
-            do {
-              i++;
-              ret = recv(fd, &frame, sizeof(struct can_frame), 0);
-              toread -= ret;
-              if(ret != sizeof(struct can_frame)) {
-                LOGE(__FUNCTION__, "INFO", "Read %u bytes, expected %lu bytes!\n", ret, sizeof(struct can_frame));
-              } else {
-                print_can_frame("PIPE", "IN", &frame, 0, "");
-                send_packet(can, &frame);
-              }
-            } while (toread >= sizeof(struct can_frame));
+      }
+      return 0;
+    }
+    case USB2CAN_CTRL_FD: {
+      clients[i].fd_frames = (frame->len != 0);
+      LOGI(__FUNCTION__, "INFO", "Socket %i: %s frames\n", fd, clients[i].fd_frames ? "CAN FD" : "classic CAN");
+      struct canfd_frame reply;
+      memset(&reply, 0, sizeof(reply));
+      reply.can_id = USB2CAN_CTRL_FD;
+      reply.msg_flags = USB2CAN_MSG_CTRL;
+      reply.len = clients[i].fd_frames;
+      reply.data[0] = fd_channels(can);
+      conn_send(fd, &reply);
+      return 0;
+    }
+    case USB2CAN_CTRL_LOOPBACK:
+      clients[i].loopback = (frame->len != 0);
+      LOGI(__FUNCTION__, "INFO", "Socket %i: loopback %s\n", fd, clients[i].loopback ? "on" : "off");
+      return 0;
+    case USB2CAN_CTRL_RECV_OWN_MSGS:
+      clients[i].recv_own = (frame->len != 0);
+      LOGI(__FUNCTION__, "INFO", "Socket %i: own messages %s\n", fd, clients[i].recv_own ? "on" : "off");
+      return 0;
+    case USB2CAN_CTRL_CYCLIC:
+      // It's for the next frame that the client sends.
+      clients[i].cyclic_pending = 1;
+      memcpy(&clients[i].cyclic_ctrl, frame, sizeof(struct canfd_frame));
+      return 0;
+    case USB2CAN_CTRL_TX_STATUS: {
+      clients[i].tx_status = (frame->len != 0);
+      clients[i].tx_number = 0;
+      LOGI(__FUNCTION__, "INFO", "Socket %i: tx status %s\n", fd, clients[i].tx_status ? "on" : "off");
+      struct canfd_frame reply;
+      memset(&reply, 0, sizeof(reply));
+      reply.can_id = USB2CAN_CTRL_TX_STATUS;
+      reply.msg_flags = USB2CAN_MSG_CTRL;
+      reply.len = clients[i].tx_status;
+      conn_send(fd, &reply);
+      return 0;
+    }
+    case USB2CAN_CTRL_SHM:
+      if(frame->len == USB2CAN_SHM_ATTACH) {
+        shm_attach(i);
+      } else if(frame->len == USB2CAN_SHM_DETACH) {
+        shm_detach(i);
+        struct canfd_frame reply;
+        memset(&reply, 0, sizeof(reply));
+        reply.can_id = USB2CAN_CTRL_SHM;
+        reply.msg_flags = USB2CAN_MSG_CTRL;
+        reply.len = USB2CAN_SHM_DETACH;
+        conn_send(fd, &reply);
+      }
+      // A doorbell has already done its job by waking us up.
+      return 0;
+    case USB2CAN_CTRL_FILTER: {
+      if(clients[i].filter == NULL) {
+        clients[i].filter = malloc(sizeof(struct canfilter));
+        if(clients[i].filter == NULL) {
+          LOGE(__FUNCTION__, "INFO", "Socket %i: out of memory for filters\n", fd);
+          return -1;
+        }
+        canfilter_init(clients[i].filter);
+      }
+      uint32_t id, mask;
+      memcpy(&id, frame->data, sizeof(id));
+      memcpy(&mask, &frame->data[4], sizeof(mask));
+      switch(frame->len) {
+        case USB2CAN_FILTER_ADD:
+          if(canfilter_add(clients[i].filter, id, mask) < 0) {
+            LOGW(__FUNCTION__, "INFO", "Socket %i: more than %u filters, %08x/%08x dropped\n", fd, USB2CAN_FILTER_MAX, id, mask);
           }
+          return 0;
+        case USB2CAN_FILTER_ERR:
+          canfilter_err(clients[i].filter, id);
+          LOGI(__FUNCTION__, "INFO", "Socket %i: error frames %08x\n", fd, clients[i].filter->err_mask);
+          return 0;
+        case USB2CAN_FILTER_SET:
+          canfilter_set(clients[i].filter);
           break;
+        case USB2CAN_FILTER_ALL:
+          canfilter_all(clients[i].filter);
+          break;
+        default:
+          LOGE(__FUNCTION__, "INFO", "Socket %i: unknown filter request %u\n", fd, frame->len);
+          return -1;
+      }
+      LOGI(__FUNCTION__, "INFO", "Socket %i: %u filters%s\n", fd, clients[i].filter->count, clients[i].filter->all ? ", receiving everything" : "");
+      struct canfd_frame reply;
+      memset(&reply, 0, sizeof(reply));
+      reply.can_id = USB2CAN_CTRL_FILTER;
+      reply.msg_flags = USB2CAN_MSG_CTRL;
+      reply.len = frame->len;
+      memcpy(reply.data, &clients[i].filter->count, sizeof(clients[i].filter->count));
+      conn_send(fd, &reply);
+      return 0;
+    }
+    case USB2CAN_CTRL_DELAY: {
+      uint32_t delay;
+      memcpy(&delay, frame->data, sizeof(delay));
+      clients[i].out_delay = (delay > USB2CAN_DELAY_MAX_US) ? USB2CAN_DELAY_MAX_US : delay;
+      LOGI(__FUNCTION__, "INFO", "Socket %i: frames wait for up to %uus\n", fd, clients[i].out_delay);
+      struct canfd_frame reply;
+      memset(&reply, 0, sizeof(reply));
+      reply.can_id = USB2CAN_CTRL_DELAY;
+      reply.msg_flags = USB2CAN_MSG_CTRL;
+      memcpy(reply.data, &clients[i].out_delay, sizeof(clients[i].out_delay));
+      conn_send(fd, &reply);
+      return 0;
+    }
+    case USB2CAN_CTRL_PROTOCOL: {
+      // What it sends has been read in the new protocol since we read this, see conn_rx_format().
+      if((frame->len == USB2CAN_PROTOCOL_V2) && (clients[i].protocol != USB2CAN_PROTOCOL_V2) && (clients[i].stage != NULL)) {
+        struct usb2can_v2_hello hello = {
+          .magic = USB2CAN_V2_MAGIC,
+          .version = USB2CAN_PROTOCOL_V2,
+          .hello_size = sizeof(struct usb2can_v2_hello),
+          .record_size = sizeof(struct usb2can_v2_record),
+          .entry_size = sizeof(struct usb2can_v2_entry),
+          .max_entries = USB2CAN_V2_MAX_ENTRIES,
+          .reserved = 0
+        };
+        // It's queued as a control message so that it's never dropped, and then sent as it is.
+        struct canfd_frame msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_flags = USB2CAN_MSG_CTRL;
+        struct conn_msg* m = conn_queue(i, &msg, NULL);
+        if(m != NULL) {
+          memcpy(&m->frame, &hello, sizeof(hello));
+          m->size = sizeof(hello);
         }
+        clients[i].protocol = USB2CAN_PROTOCOL_V2;
+      } else if(frame->len == USB2CAN_PROTOCOL_V1) {
+        clients[i].protocol = USB2CAN_PROTOCOL_V1;
       }
+      LOGI(__FUNCTION__, "INFO", "Socket %i: protocol v%u\n", fd, clients[i].protocol);
+      struct canfd_frame reply;
+      memset(&reply, 0, sizeof(reply));
+      reply.can_id = USB2CAN_CTRL_PROTOCOL;
+      reply.msg_flags = USB2CAN_MSG_CTRL;
+      reply.len = clients[i].protocol;
+      conn_send(fd, &reply);
+      return 0;
     }
   }
-
-  return 0;
+  LOGE(__FUNCTION__, "INFO", "Socket %i: unknown control message %u\n", fd, frame->can_id);
+  return -1;
 }
 
-void printusage() {
-  printf("usb2can V3\n");
-  printf("\n");
-  printf("usb2can opens either the first or the specified GS USB or candleLight style USB2CAN device and binds to a socket (default address is 2303).\n");
-  printf("You must #include usb2can.h. Then all messages transmitted & received will be in the format specified in struct can_frame.\n");
-  printf("\n");
-  printf("Usage: usb2can <s[rate]/?/p[nnnn]>/d[nnnn]\n");
-  printf("\n");
-  printf("Where: \n");
-  printf("  s[rate] = Chosen bitrate. Defaults to 500k.\n");
-  printf("            Select from: 20k, 33.33k, 40k, 50k, 66.66k\n");
-  printf("                         80k, 83.33k, 100k, 125k, 200k\n");
-  printf("                         250k, 400k, 500k, 666k, 800k\n");
-  printf("                         1m\n");
-  printf("  ? = print this message. \n");
-  printf("  p[nnnn] = a \"p\" followed by a number - use this as the port number. \n");
-  printf("  d[nnnn] = a \"d\" followed by a number - if there are multiple device connected then speficy which to use. If this is omiited it will connect to the first compatible device that it finds.\n");
-  printf("\n");
-}
+/// @brief A frame that we send over and over again for a client, see USB2CAN_CTRL_CYCLIC.
+struct usb2can_cyclic {
+  struct timerwheel_entry timer;  // On cyclic_wheel for when the next frame is due.
+  int32_t client;         // Index into clients[], -1 while the job is free.
+  uint32_t conn;          // clients[client].conn
+  uint32_t device;        // The device that the client was bound to when it started the job.
+  uint64_t next;          // When the next frame is due, micros().
+  uint32_t period;        // In microseconds.
+  uint32_t remaining;     // The number of frames left to send, 0 for no limit.
+  uint8_t counter_byte;   // The byte of the frame that holds an alive counter, plus 1, 0 for none.
+  uint8_t counter_mask;   // The bits of that byte that the counter uses.
+  uint8_t counter;
+  int32_t next_free;      // Links the free jobs, -1 at the end.
+  struct canfd_frame frame;
+};
 
-int port = 2303;  // The port that we're going to open.
-int deviceNumber = 0; // If there's multiple device connected then use this one.
+struct usb2can_cyclic cyclic_jobs[USB2CAN_CYCLIC_JOBS];
+int32_t cyclic_free = -1;         // The first free job, -1 if they're all running.
+struct timerwheel cyclic_wheel;   // When each running job next needs to send.
 
-void processArgs(int argc, char *argv[]) {
-  if(argc > 1) {
-    for(int i = 1; i < argc; i++)
+// Put all of the jobs on the free list.
+void cyclic_init() {
+  for(int j = USB2CAN_CYCLIC_JOBS - 1; j >= 0; j--) {
+    cyclic_jobs[j].client = -1;
+    cyclic_jobs[j].next_free = cyclic_free;
+    cyclic_free = j;
+  }
+  timerwheel_init(&cyclic_wheel, micros());
+}
+
+// Find a client's job by its channel and can_id. Only done when a client changes a job, so we just look through them all.
+struct usb2can_cyclic* cyclic_find(int client, uint8_t channel, canid_t can_id) {
+  for(int j = 0; j < USB2CAN_CYCLIC_JOBS; j++) {
+    struct usb2can_cyclic* job = &cyclic_jobs[j];
+    if((job->client == client) && (job->conn == clients[client].conn) && (job->frame.channel == channel) && (job->frame.can_id == can_id)) {
+      return job;
+    }
+  }
+  return NULL;
+}
+
+// Stop a job and put it back on the free list.
+void cyclic_release(struct usb2can_cyclic* job) {
+  timerwheel_remove(&cyclic_wheel, &job->timer);
+  job->client = -1;
+  job->next_free = cyclic_free;
+  cyclic_free = (int32_t)(job - cyclic_jobs);
+}
+
+// Tell a client that one of its jobs has stopped, or couldn't be started, without it asking.
+void cyclic_stopped(int client, uint8_t channel, canid_t can_id) {
+  struct canfd_frame reply;
+  memset(&reply, 0, sizeof(reply));
+  reply.can_id = USB2CAN_CTRL_CYCLIC;
+  reply.msg_flags = USB2CAN_MSG_CTRL;
+  reply.len = USB2CAN_CYCLIC_STOP;
+  reply.channel = channel;
+  memcpy(reply.data, &can_id, sizeof(can_id));
+  conn_send(clients[client].fd, &reply);
+}
+
+// Stop all of a client's jobs, when it goes away.
+void cyclic_stop_client(int client) {
+  for(int j = 0; j < USB2CAN_CYCLIC_JOBS; j++) {
+    if(cyclic_jobs[j].client == client) {
+      cyclic_release(&cyclic_jobs[j]);
+    }
+  }
+}
+
+// Start, update or stop a client's job, ctrl is the USB2CAN_CTRL_CYCLIC and frame the frame that followed it.
+void cyclic_setup(int client, struct canfd_frame* ctrl, struct canfd_frame* frame) {
+  struct usb2can_cyclic* job = cyclic_find(client, frame->channel, frame->can_id);
+  switch(ctrl->len) {
+    case USB2CAN_CYCLIC_STOP:
+      if(job != NULL) {
+        cyclic_release(job);
+      }
+      return;
+    case USB2CAN_CYCLIC_UPDATE:
+      if(job == NULL) {
+        print_can_frame("CYC", "IN", frame, 1, "NO SUCH JOB");
+        cyclic_stopped(client, frame->channel, frame->can_id);
+        return;
+      }
+      job->frame.len = frame->len;
+      job->frame.flags = frame->flags;
+      memcpy(job->frame.data, frame->data, sizeof(job->frame.data));
+      return;
+    case USB2CAN_CYCLIC_START:
+      break;
+    default:
+      LOGE(__FUNCTION__, "INFO", "Socket %i: unknown cyclic request %u\n", clients[client].fd, ctrl->len);
+      return;
+  }
+
+  uint32_t period;
+  uint16_t count;
+  memcpy(&period, &ctrl->data[0], sizeof(period));
+  memcpy(&count, &ctrl->data[4], sizeof(count));
+  struct usb2can_can* can = find_device(clients[client].device);
+  uint8_t fd = (frame->flags & CANFD_FDF) != 0;
+  if((period < USB2CAN_CYCLIC_MIN_PERIOD_US) || (can == NULL) || (frame->channel >= can->channel_count) ||
+     (frame->len > (fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN)) || (fd && !(can->channels[frame->channel].mode_flags & USB2CAN_FEATURE_FD)) ||
+     (ctrl->data[6] > frame->len)) {
+    print_can_frame("CYC", "IN", frame, 1, "CAN'T START, PERIOD %uus", period);
+    if(job != NULL) {
+      cyclic_release(job);
+    }
+    cyclic_stopped(client, frame->channel, frame->can_id);
+    return;
+  }
+  if(job == NULL) {
+    if(cyclic_free < 0) {
+      print_can_frame("CYC", "IN", frame, 1, "TOO MANY JOBS");
+      cyclic_stopped(client, frame->channel, frame->can_id);
+      return;
+    }
+    job = &cyclic_jobs[cyclic_free];
+    cyclic_free = job->next_free;
+    job->client = client;
+    job->conn = clients[client].conn;
+    job->timer.active = 0;
+  } else {
+    timerwheel_remove(&cyclic_wheel, &job->timer);
+  }
+  job->device = clients[client].device;
+  job->period = period;
+  job->remaining = count;
+  job->counter_byte = ctrl->data[6];
+  job->counter_mask = (ctrl->data[7] != 0) ? ctrl->data[7] : 0xFF;
+  job->counter = 0;
+  memcpy(&job->frame, frame, sizeof(struct canfd_frame));
+  print_can_frame("CYC", "IN", frame, 0, "every %uus", period);
+  // The first one goes on this pass of the processing loop.
+  job->next = micros();
+  timerwheel_add(&cyclic_wheel, &job->timer, job->next);
+}
+
+// Send the frames for the jobs that are due. They're queued like any other frame so they go out in
+// arbitration order, unless their channel's queue is full in which case we leave that one out
+// rather than let them build up. Jobs keep to the time that they were started at, if we're held
+// up then the frames that we've missed are skipped instead of being sent all at once.
+void cyclic_run() {
+  uint64_t now = micros();
+  struct timerwheel_entry* entry;
+  while((entry = timerwheel_expire(&cyclic_wheel, now)) != NULL) {
+    struct usb2can_cyclic* job = timerwheel_container(entry, struct usb2can_cyclic, timer);
+    struct usb2can_can* can = find_device(job->device);
+    if((can != NULL) && !tx_pending_full(can, job->frame.channel)) {
+      if(job->counter_byte > 0) {
+        // Put the counter in the bits of the mask, starting with its lowest bit.
+        uint8_t shift = 0;
+        while(!((job->counter_mask >> shift) & 1)) {
+          shift++;
+        }
+        uint8_t* byte = &job->frame.data[job->counter_byte - 1];
+        *byte = (*byte & ~job->counter_mask) | ((uint8_t)(job->counter << shift) & job->counter_mask);
+        job->counter++;
+      }
+      struct usb2can_tx_owner owner = { job->client, job->conn, 0, nanos(), 0, clients[job->client].loopback };
+      tx_enqueue(can, &job->frame, &owner);
+      if((job->remaining > 0) && (--job->remaining == 0)) {
+        cyclic_stopped(job->client, job->frame.channel, job->frame.can_id);
+        cyclic_release(job);
+        continue;
+      }
+    }
+    job->next += job->period;
+    if(job->next <= now) {
+      job->next += (((now - job->next) / job->period) + 1) * job->period;
+    }
+    timerwheel_add(&cyclic_wheel, &job->timer, job->next);
+  }
+}
+
+// Control messages that change the format of what a client sends take effect as soon as we've read
+// them, the rest of what it sends is in the new format even though they wait in tx_queue to be acted
+// on. The rx_buf for protocol v2 is allocated here, so that if there isn't the memory for it both
+// ways stay as they are. Returns 1 if rx_protocol changed.
+int conn_rx_format(struct client_t* client, struct canfd_frame* frame) {
+  if(!(frame->msg_flags & USB2CAN_MSG_CTRL)) {
+    return 0;
+  }
+  if(frame->can_id == USB2CAN_CTRL_FD) {
+    client->rx_fd_frames = (frame->len != 0);
+  } else if((frame->can_id == USB2CAN_CTRL_PROTOCOL) && (frame->len != client->rx_protocol)) {
+    if(frame->len == USB2CAN_PROTOCOL_V2) {
+      if(client->stage == NULL) {
+        client->stage = malloc(sizeof(struct conn_stage));
+        if(client->stage == NULL) {
+          LOGE(__FUNCTION__, "INFO", "Socket %i: out of memory for protocol v2\n", client->fd);
+          return 0;
+        }
+        client->stage->len = 0;
+        client->stage->pos = 0;
+      }
+    } else if(frame->len != USB2CAN_PROTOCOL_V1) {
+      return 0;
+    }
+    client->rx_protocol = frame->len;
+    client->rx_entries = 0;
+    return 1;
+  }
+  return 0;
+}
+
+// Move the whole messages in client i's rx_buf into its tx_queue, as many as there's room for. What's
+// left (the start of the next message, or more than the queue can take) moves to the front of rx_buf.
+// In protocol v2 the records are taken apart as we go, so a record can be bigger than the room that
+// there is in the queue.
+// Returns 1 if tx_queue is full, or -1 if it has sent something that isn't protocol v2 and we can't
+// tell where the next record starts.
+int conn_parse(int i, uint64_t now) {
+  struct client_t* client = &clients[i];
+  uint32_t pos = 0;
+  int ret = 0;
+  while(client->tx_count < CLIENT_TX_QUEUE) {
+    uint32_t left = client->rx_len - pos;
+    uint32_t tail = (client->tx_head + client->tx_count) % CLIENT_TX_QUEUE;
+    struct canfd_frame* frame = &client->tx_queue[tail];
+    if(client->rx_protocol == USB2CAN_PROTOCOL_V2) {
+      if(client->rx_entries == 0) {
+        struct usb2can_v2_record record;
+        if(left < sizeof(record)) {
+          break;
+        }
+        memcpy(&record, &client->rx_buf[pos], sizeof(record));
+        if((record.count > USB2CAN_V2_MAX_ENTRIES) || (record.size < sizeof(record)) || (record.size > USB2CAN_V2_RECORD_MAX) ||
+           ((record.count == 0) != (record.size == sizeof(record)))) {
+          ret = -1;
+          break;
+        }
+        pos += sizeof(record);
+        client->rx_entries = record.count;
+        client->rx_record_left = record.size - sizeof(record);
+        continue;
+      }
+      struct usb2can_v2_entry entry;
+      if(left < sizeof(entry)) {
+        break;
+      }
+      memcpy(&entry, &client->rx_buf[pos], sizeof(entry));
+      uint32_t data = usb2can_v2_data_size(&entry);
+      uint32_t size = sizeof(entry) + data;
+      if((data > CANFD_MAX_DLEN) || (size > client->rx_record_left)) {
+        ret = -1;
+        break;
+      }
+      if(left < size) {
+        break;
+      }
+      frame->can_id = entry.can_id;
+      frame->len = entry.len;
+      frame->flags = entry.flags;
+      frame->channel = entry.channel;
+      frame->msg_flags = entry.msg_flags;
+      memcpy(frame->data, &client->rx_buf[pos + sizeof(entry)], data);
+      pos += size;
+      client->rx_record_left -= size;
+      client->rx_entries--;
+      if((client->rx_entries == 0) && (client->rx_record_left != 0)) {
+        ret = -1;
+        break;
+      }
+    } else {
+      size_t mtu = client->rx_fd_frames ? CANFD_MTU : CAN_MTU;
+      if(left < mtu) {
+        break;
+      }
+      memcpy(frame, &client->rx_buf[pos], mtu);
+      pos += mtu;
+      if(mtu == CAN_MTU) {
+        frame->flags = 0;  // It's a struct can_frame, this is its __pad.
+      }
+    }
+    client->tx_time[tail] = now;
+    client->tx_count++;
+    conn_queued++;
+    // Going back to v1 part way through a record would leave us reading the rest of it as frames.
+    if(conn_rx_format(client, frame) && (client->rx_protocol == USB2CAN_PROTOCOL_V1) && (client->rx_record_left > 0)) {
+      ret = -1;
+      break;
+    }
+  }
+  if(pos > 0) {
+    memmove(client->rx_buf, &client->rx_buf[pos], client->rx_len - pos);
+    client->rx_len -= pos;
+  }
+  if(ret < 0) {
+    return -1;
+  }
+  return client->tx_count >= CLIENT_TX_QUEUE;
+}
+
+// Hang up on a client that has sent us something that we can't make sense of. What it sent before
+// that still goes.
+void conn_reject(struct reactor* r, int i) {
+  struct client_t* client = &clients[i];
+  LOGE(__FUNCTION__, "INFO", "Socket %i: that isn't a protocol v2 record, hanging up\n", client->fd);
+  reactor_remove(r, client->fd);
+  client->rx_len = 0;
+  client->rx_entries = 0;
+  client->rx_record_left = 0;
+  client->paused = 0;
+  client->closing = 1;
+}
+
+// Read one message from a client on the Unix domain socket into buf. A message that doesn't fit is
+// dropped whole, the part of it that fits may not be whole frames (or records) and the client
+// meant the rest to go with it. Returns what recv() would, -1 with errno EMSGSIZE if it was dropped.
+ssize_t conn_recv_message(int fd, uint8_t* buf, size_t size) {
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = size;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  ssize_t ret = recvmsg(fd, &msg, 0);
+  if((ret > 0) && (msg.msg_flags & MSG_TRUNC)) {
+    LOGE(__FUNCTION__, "INFO", "Socket %i: dropped a message that's bigger than the %zu bytes that it can be.\n", fd, size);
+    errno = EMSGSIZE;
+    return -1;
+  }
+  return ret;
+}
+
+// Read what a client has sent us, avail bytes of it, into its tx_queue. It's read into rx_buf as
+// much at a time as will fit, so a burst costs one recv() rather than one per frame, and a message
+// that TCP has split is kept until the rest of it arrives. If the queue fills up we stop watching
+// the socket until conn_drain() has made room. The client's socket buffer then fills up and its
+// writes block, so bursts are slowed down to what the bus can take rather than being dropped.
+// Clients on the Unix domain socket come here too once they've switched to protocol v2, each of their
+// messages has to be read whole so we only read while there's room for the biggest.
+void conn_read(struct reactor* r, int i, int avail) {
+  struct client_t* client = &clients[i];
+  uint8_t seqpacket = (client->typ == CLIENT_TYPE_SEQPACKET);
+  uint64_t now = nanos();
+  int full = conn_parse(i, now);
+  while(full == 0) {
+    // On the Unix domain socket what's left once there's room for it all can only be part of a record.
+    if(seqpacket && ((client->rx_len > 0) || (client->rx_entries > 0))) {
+      LOGE(__FUNCTION__, "INFO", "Socket %i: dropped %u bytes of a message that ended part way through a record.\n", client->fd, client->rx_len);
+      client->rx_len = 0;
+      client->rx_entries = 0;
+      client->rx_record_left = 0;
+    }
+    if((avail <= 0) || (seqpacket && ((CLIENT_RX_BUF - client->rx_len) < USB2CAN_V2_RECORD_MAX))) {
+      break;
+    }
+    size_t room = CLIENT_RX_BUF - client->rx_len;
+    ssize_t ret = seqpacket ? conn_recv_message(client->fd, &client->rx_buf[client->rx_len], room) : recv(client->fd, &client->rx_buf[client->rx_len], room, 0);
+    if(seqpacket && (ret < 0) && (errno == EMSGSIZE)) {
+      avail -= room;
+      continue;
+    }
+    if(ret <= 0) {
+      break;
+    }
+    avail -= ret;
+    client->rx_len += ret;
+    full = conn_parse(i, now);
+  }
+  if(full < 0) {
+    conn_reject(r, i);
+    return;
+  }
+  if(full && ((avail > 0) || (client->rx_len > 0)) && !client->paused) {
+    reactor_pause(r, client->fd);
+    client->paused = 1;
+  }
+}
+
+// The same as conn_read() for a client on the Unix domain socket. Each message is whole frames, up
+// to USB2CAN_SEQPACKET_BATCH of them, and has to be read in one go, so we only read while there's
+// room in tx_queue for a whole batch. Once it switches to protocol v2 (or there's anything left in
+// rx_buf) it's conn_read() that reads it.
+void conn_read_seqpacket(struct reactor* r, int i, int avail) {
+  struct client_t* client = &clients[i];
+  uint8_t buf[USB2CAN_SEQPACKET_BATCH * CANFD_MTU];
+  uint64_t now = nanos();
+  while((avail > 0) && ((CLIENT_TX_QUEUE - client->tx_count) >= USB2CAN_SEQPACKET_BATCH)) {
+    if((client->rx_protocol != USB2CAN_PROTOCOL_V1) || (client->rx_len > 0)) {
+      conn_read(r, i, avail);
+      return;
+    }
+    int ret = conn_recv_message(client->fd, buf, sizeof(buf));
+    if((ret < 0) && (errno == EMSGSIZE)) {
+      avail -= sizeof(buf);
+      continue;
+    }
+    if(ret <= 0) {
+      return;
+    }
+    avail -= ret;
+    uint32_t queued = client->tx_count;
+    uint8_t fd_frames = client->rx_fd_frames;
+    size_t mtu = client->rx_fd_frames ? CANFD_MTU : CAN_MTU;
+    int pos = 0;
+    for(int n = 0; (n < USB2CAN_SEQPACKET_BATCH) && ((pos + (int)mtu) <= ret); n++) {
+      uint32_t tail = (client->tx_head + client->tx_count) % CLIENT_TX_QUEUE;
+      struct canfd_frame* frame = &client->tx_queue[tail];
+      memcpy(frame, &buf[pos], mtu);
+      client->tx_time[tail] = now;
+      pos += mtu;
+      if(mtu == CAN_MTU) {
+        frame->flags = 0;  // It's a struct can_frame, this is its __pad.
+      }
+      client->tx_count++;
+      conn_queued++;
+      // The size of everything after this changes straight away, even in the same message.
+      if(conn_rx_format(client, frame)) {
+        // The rest of the message is protocol v2.
+        memcpy(client->rx_buf, &buf[pos], ret - pos);
+        client->rx_len = ret - pos;
+        conn_read(r, i, avail);
+        return;
+      }
+      mtu = client->rx_fd_frames ? CANFD_MTU : CAN_MTU;
+    }
+    if((pos + (int)mtu) <= ret) {
+      // There are more frames than a message can hold, none of them go.
+      LOGE(__FUNCTION__, "INFO", "Socket %i: dropped a %i byte message, it's more than %i frames.\n", client->fd, ret, USB2CAN_SEQPACKET_BATCH);
+      conn_queued -= client->tx_count - queued;
+      client->tx_count = queued;
+      client->rx_fd_frames = fd_frames;
+      continue;
+    }
+    if(pos != ret) {
+      LOGE(__FUNCTION__, "INFO", "Dropped %i bytes of a %i byte message, it must be up to %i whole frames.\n", ret - pos, ret, USB2CAN_SEQPACKET_BATCH);
+    }
+  }
+  if((avail > 0) && !client->paused) {
+    reactor_pause(r, client->fd);
+    client->paused = 1;
+  }
+}
+
+// Pass on the messages that the clients have queued up, one from each client in turn so that a
+// busy client can't hold up the others. Frames go to their channel's tx_pending to be sent in
+// arbitration order by tx_schedule(). A client waits while the next frame in its queue is for a
+// channel whose tx_pending is full. Clients that we stopped reading from are started again once
+// half of their queue is free.
+void conn_drain(struct reactor* r) {
+  uint8_t progress = (conn_queued > 0);
+  while(progress) {
+    progress = 0;
+    int start = conn_next;
+    for(int n = 0; n < conn_slots; n++) {
+      struct client_t* client = &clients[(start + n) % conn_slots];
+      if((client->fd <= 0) || (client->tx_count == 0)) {
+        continue;
+      }
+      struct canfd_frame* frame = &client->tx_queue[client->tx_head];
+      struct usb2can_can* can = find_device(client->device);
+      if(!(frame->msg_flags & USB2CAN_MSG_CTRL) && (can != NULL) && tx_pending_full(can, frame->channel)) {
+        continue;
+      }
+      uint64_t queued = client->tx_time[client->tx_head];
+      client->tx_head = (client->tx_head + 1) % CLIENT_TX_QUEUE;
+      client->tx_count--;
+      conn_queued--;
+      progress = 1;
+      conn_next = (start + n + 1) % conn_slots;
+
+      if(frame->msg_flags & USB2CAN_MSG_CTRL) {
+        conn_ctrl(client->fd, frame);
+      } else if(client->cyclic_pending) {
+        client->cyclic_pending = 0;
+        cyclic_setup((start + n) % conn_slots, &client->cyclic_ctrl, frame);
+      } else {
+        struct usb2can_tx_owner owner;
+        owner.client = (start + n) % conn_slots;
+        owner.conn = client->conn;
+        owner.number = client->tx_status ? client->tx_number++ : 0;
+        owner.queued = queued;
+        owner.status = client->tx_status;
+        owner.loopback = client->loopback;
+        print_can_frame("PIPE", "IN", frame, 0, "");
+        if(can != NULL) {
+          tx_enqueue(can, frame, &owner);
+        } else {
+          print_can_frame("PIPE", "IN", frame, 1, "NO DEVICE");
+          conn_tx_status(&owner, frame->channel, USB2CAN_TX_FAILED);
+        }
+      }
+    }
+  }
+
+  for(int i = 0; i < conn_slots; i++) {
+    struct client_t* client = &clients[i];
+    if(client->fd <= 0) {
+      continue;
+    }
+    // What's left in its rx_buf goes first, we only go back to its socket once that's all queued.
+    if(client->paused && (client->tx_count <= (CLIENT_TX_QUEUE / 2))) {
+      int full = conn_parse(i, nanos());
+      if(full < 0) {
+        conn_reject(r, i);
+      } else if(!full) {
+        reactor_resume(r, client->fd);
+        client->paused = 0;
+      }
+    }
+    if(client->closing && (client->tx_count == 0)) {
+      LOGI(__FUNCTION__, "INFO", "Socket closed: %i\n", client->fd);
+      conn_close(client->fd);
+    }
+  }
+}
+
+// Tell a client what became of one of its frames, if it's still connected and wants to know (see
+// USB2CAN_CTRL_TX_STATUS). status is one of USB2CAN_TX_*.
+void conn_tx_status(struct usb2can_tx_owner* owner, uint8_t channel, uint8_t status) {
+  if((owner == NULL) || (owner->client < 0)) {
+    return;
+  }
+  struct client_t* client = &clients[owner->client];
+  if(!owner->status || (client->fd <= 0) || (client->conn != owner->conn) || !client->tx_status) {
+    return;
+  }
+  struct canfd_frame reply;
+  memset(&reply, 0, sizeof(reply));
+  reply.can_id = USB2CAN_CTRL_TX_STATUS;
+  reply.msg_flags = USB2CAN_MSG_CTRL;
+  reply.len = status;
+  reply.channel = channel;
+  uint32_t latency = 0;
+  if(status == USB2CAN_TX_CONFIRMED) {
+    uint64_t us = (nanos() - owner->queued) / 1000;
+    latency = (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+  }
+  memcpy(&reply.data[0], &owner->number, sizeof(owner->number));
+  memcpy(&reply.data[4], &latency, sizeof(latency));
+  conn_send(client->fd, &reply);
+}
+
+// The shared memory rings (see usb2can_shm.h), NULL unless we were started with m.
+struct usb2can_shm* shm = NULL;
+int shm_fd = -1;
+int shm_owner[USB2CAN_SHM_CLIENTS]; // The client (index into clients[]) using each tx ring, -1 if it's free.
+int shm_clients = 0;                // How many clients are using the rings.
+uint8_t shm_published = 0;          // We've put something in rx on this pass of the processing loop.
+
+// Create the shared memory. Nobody else can open it by name, the only way in is the file
+// descriptor that we hand to each client, so it goes away when we and they do.
+int shm_init() {
+#ifdef SHM_ANON
+  shm_fd = shm_open(SHM_ANON, O_RDWR | O_CREAT, 0600);
+#else
+  char name[32];
+  snprintf(name, sizeof(name), "/usb2can.%ld", (long)getpid());
+  shm_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if(shm_fd >= 0) {
+    shm_unlink(name);
+  }
+#endif
+  if(shm_fd < 0) {
+    LOGE(__FUNCTION__, "INFO", "ERROR: Unable to create the shared memory: %s\n", strerror(errno));
+    return -1;
+  }
+  // ftruncate() fills it with zeros.
+  void* p = MAP_FAILED;
+  if(ftruncate(shm_fd, sizeof(struct usb2can_shm)) == 0) {
+    p = mmap(NULL, sizeof(struct usb2can_shm), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  }
+  if(p == MAP_FAILED) {
+    LOGE(__FUNCTION__, "INFO", "ERROR: Unable to map the shared memory: %s\n", strerror(errno));
+    close(shm_fd);
+    shm_fd = -1;
+    return -1;
+  }
+  shm = (struct usb2can_shm*)p;
+  shm->magic = USB2CAN_SHM_MAGIC;
+  shm->version = USB2CAN_SHM_VERSION;
+  shm->rx_slots = USB2CAN_SHM_RX_SLOTS;
+  shm->tx_slots = USB2CAN_SHM_TX_SLOTS;
+  shm->clients = USB2CAN_SHM_CLIENTS;
+  for(int k = 0; k < USB2CAN_SHM_CLIENTS; k++) {
+    shm_owner[k] = -1;
+  }
+  LOGI(__FUNCTION__, "INFO", "Shared memory rings: %zu bytes, %i clients\n", sizeof(struct usb2can_shm), USB2CAN_SHM_CLIENTS);
+  return 0;
+}
+
+void shm_close() {
+  if(shm != NULL) {
+    munmap(shm, sizeof(struct usb2can_shm));
+    close(shm_fd);
+  }
+  shm = NULL;
+  shm_fd = -1;
+}
+
+// Keep usb2can_shm.default_device up to date as devices come and go.
+void shm_set_default() {
+  if(shm != NULL) {
+    struct usb2can_can* can = find_device(0);
+    atomic_store(&shm->default_device, (can != NULL) ? can->id : 0);
+  }
+}
+
+// Give a client a tx ring and send it the shared memory, see USB2CAN_CTRL_SHM. It's refused if we
+// weren't started with m, the client isn't on the Unix domain socket or all of the rings are in use.
+void shm_attach(int client) {
+  struct client_t* c = &clients[client];
+  struct canfd_frame reply;
+  memset(&reply, 0, sizeof(reply));
+  reply.can_id = USB2CAN_CTRL_SHM;
+  reply.msg_flags = USB2CAN_MSG_CTRL;
+  reply.len = USB2CAN_SHM_DETACH;
+
+  int k = c->shm_ring;
+  if((k < 0) && (shm != NULL) && (c->typ == CLIENT_TYPE_SEQPACKET)) {
+    for(k = 0; (k < USB2CAN_SHM_CLIENTS) && (shm_owner[k] >= 0); k++) {
+    }
+  }
+  if((k < 0) || (k >= USB2CAN_SHM_CLIENTS)) {
+    LOGE(__FUNCTION__, "INFO", "Socket %i: can't use shared memory.\n", c->fd);
+    conn_send(c->fd, &reply);
+    return;
+  }
+  struct usb2can_shm_tx_ring* ring = &shm->tx[k];
+  if(c->shm_ring < 0) {
+    atomic_store(&ring->head, 0);
+    atomic_store(&ring->tail, 0);
+    atomic_store(&ring->waiting, 0);
+    ring->rx_start = atomic_load(&shm->rx_head);
+  }
+  reply.len = USB2CAN_SHM_ATTACH;
+  uint32_t index = (uint32_t)k;
+  memcpy(&reply.data[0], &index, sizeof(index));
+  memcpy(&reply.data[4], &c->conn, sizeof(c->conn));
+
+  // The file descriptor goes with the reply.
+  struct conn_msg* m = conn_queue(client, &reply, NULL);
+  if(m == NULL) {
+    LOGE(__FUNCTION__, "INFO", "Socket %i: unable to send the shared memory.\n", c->fd);
+    return;
+  }
+  m->rights = 1;
+  if(c->shm_ring < 0) {
+    c->shm_ring = k;
+    shm_owner[k] = client;
+    shm_clients++;
+  }
+  LOGI(__FUNCTION__, "INFO", "Socket %i: using shared memory ring %i\n", c->fd, k);
+}
+
+// Stop a client using the rings, its frames go back to its socket. Whatever is left in its tx ring is dropped.
+void shm_detach(int client) {
+  struct client_t* c = &clients[client];
+  if(c->shm_ring < 0) {
+    return;
+  }
+  LOGI(__FUNCTION__, "INFO", "Socket %i: finished with shared memory ring %i\n", c->fd, c->shm_ring);
+  shm_owner[c->shm_ring] = -1;
+  shm_clients--;
+  c->shm_ring = -1;
+  c->shm_moved = 0;
+}
+
+// Write a frame into rx for the clients that are using the rings, they each pick out the ones that
+// they want. The arguments are the same as sendCANToAll()'s.
+void shm_publish(struct usb2can_can* can, struct canfd_frame* frame, uint64_t timestamp, uint8_t timestamp_source, struct usb2can_tx_owner* owner) {
+  uint64_t n = atomic_load_explicit(&shm->rx_head, memory_order_relaxed);
+  struct usb2can_shm_rx_slot* slot = &shm->rx[n % USB2CAN_SHM_RX_SLOTS];
+  // Anyone who reads the slot while we're writing it sees that seq has changed.
+  atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  slot->timestamp = timestamp;
+  slot->device = can->id;
+  slot->conn = (owner != NULL) ? owner->conn : 0;
+  slot->timestamp_source = timestamp_source;
+  slot->loopback = (owner != NULL) ? owner->loopback : 1;
+  memcpy(&slot->frame, frame, sizeof(struct canfd_frame));
+  atomic_store_explicit(&slot->seq, n + 1, memory_order_release);
+  atomic_store_explicit(&shm->rx_head, n + 1, memory_order_release);
+  shm_published = 1;
+}
+
+// Take what the clients have put in their tx rings into their tx_queues, as conn_read() does for a socket.
+void shm_read() {
+  if(shm_clients == 0) {
+    return;
+  }
+  uint64_t now = nanos();
+  for(int k = 0; k < USB2CAN_SHM_CLIENTS; k++) {
+    if(shm_owner[k] < 0) {
+      continue;
+    }
+    struct client_t* client = &clients[shm_owner[k]];
+    struct usb2can_shm_tx_ring* ring = &shm->tx[k];
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if((tail == head) || client->closing) {
+      continue;
+    }
+    while((tail != head) && (client->tx_count < CLIENT_TX_QUEUE)) {
+      uint32_t t = (client->tx_head + client->tx_count) % CLIENT_TX_QUEUE;
+      struct canfd_frame* frame = &client->tx_queue[t];
+      memcpy(frame, &ring->slots[tail % USB2CAN_SHM_TX_SLOTS], sizeof(struct canfd_frame));
+      client->tx_time[t] = now;
+      tail++;
+      // It changes what the client sends over its socket.
+      conn_rx_format(client, frame);
+      client->tx_count++;
+      conn_queued++;
+      client->shm_moved = 1;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+  }
+}
+
+// Whether any client has something in its tx ring that shm_read() would take.
+uint8_t shm_pending() {
+  for(int k = 0; (k < USB2CAN_SHM_CLIENTS) && (shm_clients > 0); k++) {
+    if((shm_owner[k] >= 0) && (clients[shm_owner[k]].tx_count < CLIENT_TX_QUEUE) &&
+       (atomic_load(&shm->tx[k].head) != atomic_load(&shm->tx[k].tail))) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Wake up the clients that are waiting on the rings, if there's something new in rx or we've made
+// room in their tx ring. Done once at the end of each pass of the processing loop, however many
+// frames it has handled.
+void shm_doorbells() {
+  if(shm_clients == 0) {
+    return;
+  }
+  // Pairs with the client setting waiting and then looking at the rings again.
+  atomic_thread_fence(memory_order_seq_cst);
+  struct canfd_frame bell;
+  memset(&bell, 0, sizeof(bell));
+  bell.can_id = USB2CAN_CTRL_SHM;
+  bell.msg_flags = USB2CAN_MSG_CTRL;
+  bell.len = USB2CAN_SHM_DOORBELL;
+  for(int k = 0; k < USB2CAN_SHM_CLIENTS; k++) {
+    if(shm_owner[k] < 0) {
+      continue;
+    }
+    struct client_t* client = &clients[shm_owner[k]];
+    if((shm_published || client->shm_moved) && atomic_load(&shm->tx[k].waiting) && atomic_exchange(&shm->tx[k].waiting, 0)) {
+      conn_send(client->fd, &bell);
+    }
+    client->shm_moved = 0;
+  }
+  shm_published = 0;
+}
+
+// Whether client i gets a frame, see sendCANToAll() for the arguments. own is set if it's the
+// echo of one of the client's own frames. The cheap checks go first, most frames that a client
+// doesn't want are turned away by its filters without being copied anywhere.
+uint8_t conn_wants(int i, struct usb2can_can* can, struct canfd_frame* frame, struct usb2can_tx_owner* owner, uint8_t* own) {
+  struct client_t* client = &clients[i];
+  if((client->fd <= 0) || ((client->typ != CLIENT_TYPE_SOCK) && (client->typ != CLIENT_TYPE_SEQPACKET)) || client->closing) {
+    return 0;
+  }
+  if(!(client->channels & (1 << frame->channel)) || ((frame->flags & CANFD_FDF) && !client->fd_frames)) {
+    return 0;
+  }
+  *own = (owner != NULL) && (owner->client == i) && (owner->conn == client->conn);
+  if(*own ? !client->recv_own : ((owner != NULL) && !owner->loopback)) {
+    return 0;
+  }
+  if((client->filter != NULL) && !canfilter_match(client->filter, frame->can_id)) {
+    return 0;
+  }
+  return find_device(client->device) == can;
+}
+
+// timestamp is when the frame was received in nanoseconds (see nanos()) and timestamp_source
+// is one of USB2CAN_TIMESTAMP_*. They're only sent to clients that have asked for them.
+// Only clients bound to can get the frame, and CAN FD frames only go to clients using CAN FD.
+// owner is who sent it if it's the echo of one of our frames, NULL if it came from the bus. The
+// sender only gets it if it has asked for its own messages, marked with USB2CAN_MSG_OWN, and the
+// other clients only get it if the sender had loopback on. Each client's filters have the last word.
+// Protocol v2 clients always get the timestamp, in the frame's entry along with its number.
+int sendCANToAll(struct usb2can_can* can, struct canfd_frame * frame, uint64_t timestamp, uint8_t timestamp_source, struct usb2can_tx_owner* owner) {
+  print_can_frame("PIPE", "OUT", frame, 0, "");
+
+  struct canfd_frame ts;
+  memset(&ts, 0, sizeof(ts));
+  ts.can_id = USB2CAN_CTRL_TIMESTAMP;
+  ts.msg_flags = USB2CAN_MSG_CTRL;
+  ts.len = timestamp_source;
+  memcpy(ts.data, &timestamp, sizeof(timestamp));
+  uint64_t seq = ++can->rx_seq;
+
+  int i;
+  int cnt = 0;
+  uint8_t shm_wanted = 0;
+  for(i = 0; i < conn_slots; i++) {
+    uint8_t own;
+    if(!conn_wants(i, can, frame, owner, &own)) {
+      continue;
+    }
+    // The clients using the rings all get it from there.
+    if(clients[i].shm_ring >= 0) {
+      shm_wanted = 1;
+      continue;
+    }
+    uint8_t v2 = (clients[i].protocol == USB2CAN_PROTOCOL_V2);
+    struct conn_msg* m = conn_queue(i, frame, (clients[i].timestamps && !v2) ? &ts : NULL);
+    if(m != NULL) {
+      if(own) {
+        m->frame.msg_flags |= USB2CAN_MSG_OWN;
+      }
+      if(m->v2) {
+        m->timestamp = timestamp;
+        m->seq = seq;
+        if(timestamp_source == USB2CAN_TIMESTAMP_HW) {
+          m->frame.msg_flags |= USB2CAN_MSG_HW_TIMESTAMP;
+        }
+      }
+      cnt++;
+    }
+  }
+  if(shm_wanted) {
+    shm_publish(can, frame, timestamp, timestamp_source, owner);
+  }
+  return cnt; // How many we queued it for.
+}
+
+// Take the first message off a client's queue once it has gone.
+void conn_out_pop(struct client_t* client) {
+  if(client->out[client->out_head].frame_group) {
+    client->out_frames--;
+  }
+  client->out_head = (client->out_head + 1) % (2 * out_depth);
+  client->out_count--;
+  client->out_offset = 0;
+}
+
+// Put shm_fd in the control data of a message, see shm_attach().
+void conn_attach_rights(struct msghdr* hdr, char* buf, size_t size) {
+  memset(buf, 0, size);
+  hdr->msg_control = buf;
+  hdr->msg_controllen = size;
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &shm_fd, sizeof(int));
+}
+
+// Build protocol v2 records for a client out of the messages at the front of its queue, as many as
+// its stage has room for. Consecutive messages share a record, up to USB2CAN_V2_MAX_ENTRIES of them,
+// except that one that goes with shm_fd has a record of its own and it has to be the first.
+void conn_stage(struct client_t* client) {
+  struct conn_stage* stage = client->stage;
+  stage->len = 0;
+  stage->pos = 0;
+  stage->records = 0;
+  stage->next = 0;
+  stage->rights = 0;
+  while((client->out_count > 0) && (stage->records < CONN_OUT_BATCH) &&
+        ((stage->len + sizeof(struct usb2can_v2_record) + USB2CAN_V2_ENTRY_MAX) <= CONN_STAGE_SIZE)) {
+    struct conn_msg* m = &client->out[client->out_head];
+    if(!m->v2 || (m->rights && (stage->records > 0))) {
+      break;
+    }
+    uint8_t rights = m->rights;
+    uint32_t start = stage->len;
+    struct usb2can_v2_record record;
+    record.count = 0;
+    record.reserved = 0;
+    stage->len += sizeof(record);
+    while((client->out_count > 0) && (record.count < USB2CAN_V2_MAX_ENTRIES) && ((stage->len + USB2CAN_V2_ENTRY_MAX) <= CONN_STAGE_SIZE)) {
+      m = &client->out[client->out_head];
+      if(!m->v2 || (m->rights && (record.count > 0))) {
+        break;
+      }
+      struct usb2can_v2_entry entry;
+      entry.timestamp = m->timestamp;
+      entry.seq = m->seq;
+      entry.can_id = m->frame.can_id;
+      entry.len = m->frame.len;
+      entry.flags = m->frame.flags;
+      entry.channel = m->frame.channel;
+      entry.msg_flags = m->frame.msg_flags;
+      uint32_t data = usb2can_v2_data_size(&entry);
+      uint32_t used = (entry.msg_flags & USB2CAN_MSG_CTRL) ? data : entry.len;
+      memcpy(&stage->buf[stage->len], &entry, sizeof(entry));
+      memcpy(&stage->buf[stage->len + sizeof(entry)], m->frame.data, used);
+      memset(&stage->buf[stage->len + sizeof(entry) + used], 0, data - used);
+      stage->len += sizeof(entry) + data;
+      record.count++;
+      conn_out_pop(client);
+      if(rights) {
+        break;
+      }
+    }
+    record.size = stage->len - start;
+    memcpy(&stage->buf[start], &record, sizeof(record));
+    stage->ends[stage->records++] = stage->len;
+    if(rights) {
+      stage->rights = 1;
+      break;
+    }
+  }
+}
+
+// Send as much of a client's stage as its socket will take: each record is a message of its own
+// on the Unix domain socket, over TCP they're just bytes. Returns what send() would.
+ssize_t conn_send_stage(struct client_t* client) {
+  struct conn_stage* stage = client->stage;
+  ssize_t ret;
+  if(client->typ == CLIENT_TYPE_SEQPACKET) {
+    struct mmsghdr msgs[CONN_OUT_BATCH];
+    struct iovec iov[CONN_OUT_BATCH];
+    union {
+      struct cmsghdr hdr;
+      char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    uint32_t n = stage->records - stage->next;
+    memset(msgs, 0, n * sizeof(struct mmsghdr));
+    for(uint32_t k = 0; k < n; k++) {
+      uint32_t rec = stage->next + k;
+      uint32_t start = (rec > 0) ? stage->ends[rec - 1] : 0;
+      iov[k].iov_base = &stage->buf[start];
+      iov[k].iov_len = stage->ends[rec] - start;
+      msgs[k].msg_hdr.msg_iov = &iov[k];
+      msgs[k].msg_hdr.msg_iovlen = 1;
+      if((rec == 0) && stage->rights) {
+        conn_attach_rights(&msgs[k].msg_hdr, control.buf, sizeof(control.buf));
+      }
+    }
+    ret = sendmmsg(client->fd, msgs, n, 0);
+    if(ret > 0) {
+      stage->next += ret;
+      stage->pos = stage->ends[stage->next - 1];
+    }
+  } else {
+    ret = send(client->fd, &stage->buf[stage->pos], stage->len - stage->pos, 0);
+    if(ret > 0) {
+      stage->pos += ret;
+    }
+  }
+  if(stage->pos >= stage->len) {
+    stage->len = 0;
+    stage->pos = 0;
+  }
+  return ret;
+}
+
+// Send up to CONN_OUT_BATCH of the messages at the front of a client's queue as they are, with
+// writev() over TCP and sendmmsg() on the Unix domain socket, where each message has to stay a
+// message of its own. It stops at the first that goes in a protocol v2 record. Returns what
+// writev() (or sendmmsg()) did.
+ssize_t conn_send_raw(struct client_t* client) {
+  uint32_t size = 2 * out_depth;
+  uint32_t n = 0;
+  struct iovec iov[CONN_OUT_BATCH];
+  while((n < client->out_count) && (n < CONN_OUT_BATCH)) {
+    struct conn_msg* m = &client->out[(client->out_head + n) % size];
+    if(m->v2) {
+      break;
+    }
+    iov[n].iov_base = &m->frame;
+    iov[n].iov_len = m->size;
+    n++;
+  }
+  ssize_t ret;
+  if(client->typ == CLIENT_TYPE_SEQPACKET) {
+    struct mmsghdr msgs[CONN_OUT_BATCH];
+    union {
+      struct cmsghdr hdr;
+      char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(msgs, 0, n * sizeof(struct mmsghdr));
+    for(uint32_t k = 0; k < n; k++) {
+      msgs[k].msg_hdr.msg_iov = &iov[k];
+      msgs[k].msg_hdr.msg_iovlen = 1;
+      if(client->out[(client->out_head + k) % size].rights) {
+        if(k > 0) {
+          n = k;  // It goes first in the next batch.
+          break;
+        }
+        // The shared memory's file descriptor goes with it.
+        conn_attach_rights(&msgs[k].msg_hdr, control.buf, sizeof(control.buf));
+      }
+    }
+    ret = sendmmsg(client->fd, msgs, n, 0);
+    for(ssize_t k = 0; k < ret; k++) {
+      conn_out_pop(client);
+    }
+  } else {
+    iov[0].iov_base = (uint8_t*)iov[0].iov_base + client->out_offset;
+    iov[0].iov_len -= client->out_offset;
+    ret = writev(client->fd, iov, n);
+    // It can take part of a message, the rest goes next time.
+    size_t sent = (ret > 0) ? (size_t)ret : 0;
+    while(sent > 0) {
+      size_t left = client->out[client->out_head].size - client->out_offset;
+      if(sent < left) {
+        client->out_offset += sent;
+        break;
+      }
+      sent -= left;
+      conn_out_pop(client);
+    }
+  }
+  return ret;
+}
+
+// Send as much of what's waiting for client i as its socket will take, CONN_OUT_BATCH messages (or
+// a stage of protocol v2 records) at a time. If the socket is full we watch it until it's writable
+// again and carry on then, nobody else waits for it.
+void conn_flush(struct reactor* r, int i) {
+  struct client_t* client = &clients[i];
+  struct conn_stage* stage = client->stage;
+  while((client->out_count > 0) || ((stage != NULL) && (stage->len > 0))) {
+    if((stage != NULL) && (stage->len == 0) && client->out[client->out_head].v2) {
+      conn_stage(client);
+    }
+    ssize_t ret = ((stage != NULL) && (stage->len > 0)) ? conn_send_stage(client) : conn_send_raw(client);
+    if(ret < 0) {
+      if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        client->out_blocked = 1;
+        if(!client->out_watch) {
+          client->out_watch = 1;
+          reactor_watch_write(r, client->fd, 1, NULL);
+        }
+        return;
+      } else if(errno != EINTR) {
+        // It's gone, we'll see it hang up when we next read from it.
+        sockSendError(errno);
+        client->out_count = 0;
+        client->out_frames = 0;
+        client->out_offset = 0;
+        if(stage != NULL) {
+          stage->len = 0;
+          stage->pos = 0;
+        }
+        client->closing = 1;
+        break;
+      }
+    }
+  }
+  client->out_due = 0;
+  client->out_urgent = 0;
+  if(client->out_watch) {
+    client->out_watch = 0;
+    reactor_watch_write(r, client->fd, 0, NULL);
+  }
+  if(client->out_dropped != client->out_logged) {
+    LOGW(__FUNCTION__, "INFO", "Socket %i: fell behind, %" PRIu64 " frames dropped so far\n", client->fd, client->out_dropped);
+    client->out_logged = client->out_dropped;
+  }
+}
+
+// Send what's waiting for each client, done once at the end of each pass of the processing loop
+// however many messages it has queued. Frames for a client with a USB2CAN_CTRL_DELAY can wait
+// until they're due or there's a whole batch of them, unless something else is waiting with them.
+// The clients that have fallen too far behind with OUT_POLICY_DISCONNECT are disconnected.
+void conn_flush_all(struct reactor* r) {
+  uint64_t now = nanos();
+  for(int i = 0; i < conn_slots; i++) {
+    struct client_t* client = &clients[i];
+    if(client->fd <= 0) {
+      continue;
+    }
+    if(client->out_overflow) {
+      LOGW(__FUNCTION__, "INFO", "Socket %i: fell too far behind, disconnecting it\n", client->fd);
+      conn_close(client->fd);
+    } else if(!client->out_blocked && (((client->stage != NULL) && (client->stage->len > 0)) ||
+              ((client->out_count > 0) && (client->out_urgent || (client->out_count >= CONN_OUT_BATCH) || (now >= client->out_due))))) {
+      conn_flush(r, i);
+    }
+  }
+}
+
+// When the first of the frames that are waiting for a client with a USB2CAN_CTRL_DELAY is due,
+// nanos(), or UINT64_MAX if none of them are waiting.
+uint64_t conn_deadline() {
+  uint64_t deadline = UINT64_MAX;
+  for(int i = 0; i < conn_slots; i++) {
+    struct client_t* client = &clients[i];
+    if((client->fd > 0) && (client->out_count > 0) && !client->out_blocked && (client->out_due > 0) && (client->out_due < deadline)) {
+      deadline = client->out_due;
+    }
+  }
+  return deadline;
+}
+
+// We use the address of this as the udata for the file descriptors that belong to libusb (or the emulated devices).
+static int usb_pollfd_marker;
+
+// Called by libusb when it wants us to watch a new file descriptor. These are level triggered,
+// libusb expects poll() and doesn't promise to deal with everything each time we call it.
+void usb_pollfd_added(int fd, short events, void* user_data) {
+  struct reactor* r = (struct reactor*)user_data;
+  uint8_t watch = ((events & POLLIN) ? REACTOR_READ : 0) | ((events & POLLOUT) ? REACTOR_WRITE : 0);
+  if((watch != 0) && (reactor_add(r, fd, watch, &usb_pollfd_marker) != 0)) {
+    LOGE(__FUNCTION__, "INFO", "Unable to watch libusb fd %i\n", fd);
+  }
+}
+
+// Called by libusb when it no longer needs a file descriptor watched.
+void usb_pollfd_removed(int fd, void* user_data) {
+  reactor_remove((struct reactor*)user_data, fd);
+}
+
+// Add libusb's file descriptors to our reactor so that transfer completions (and hotplug events) wake up the processing loop.
+int usb_watch(struct reactor* r, libusb_context* ctx) {
+  const struct libusb_pollfd** pollfds = libusb_get_pollfds(ctx);
+  if(pollfds == NULL) {
+    LOGE(__FUNCTION__, "INFO", "Unable to get the libusb file descriptors.\n");
+    return -1;
+  }
+  for(int i = 0; pollfds[i] != NULL; i++) {
+    usb_pollfd_added(pollfds[i]->fd, pollfds[i]->events, r);
+  }
+  libusb_free_pollfds(pollfds);
+  libusb_set_pollfd_notifiers(ctx, usb_pollfd_added, usb_pollfd_removed, r);
+  return 0;
+}
+
+void usb_unwatch(libusb_context* ctx) {
+  libusb_set_pollfd_notifiers(ctx, NULL, NULL, NULL);
+}
+
+// Is this one of the devices that we support?
+int is_supported_device(struct libusb_device_descriptor* desc) {
+  for(int i = 0; i < SUPPORTED_DEVICES; i++) {
+    if((supported_devices[i].vendor == desc->idVendor) && (supported_devices[i].product == desc->idProduct)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Open and claim a device. Returns NULL if that isn't possible.
+struct libusb_device_handle* open_usb_device(libusb_device* dev, int interface) {
+  struct libusb_device_handle *devh = NULL;
+  int ret = libusb_open(dev, &devh);
+  if(ret != 0) {
+    LOGE(__FUNCTION__, "INFO", "%s: %s Failed to open the device.\n", libusb_error_name(ret), libusb_strerror(ret));
+    return NULL;
+  }
+  LOGI(__FUNCTION__, "INFO", "Device opened.\n");
+
+  LOGI(__FUNCTION__, "INFO", "Checking if kernel driver is active...\n");
+  if(libusb_kernel_driver_active(devh, interface) == 1) {
+    LOGI(__FUNCTION__, "INFO", "Detaching kernel driver...\n");
+    int ret = libusb_detach_kernel_driver(devh, interface);
+    if(ret < 0) {
+      LOGE(__FUNCTION__, "INFO", "%s: %s Unable to detach.\n", libusb_error_name(ret), libusb_strerror(ret));
+    }
+  }
+
+  LOGI(__FUNCTION__, "INFO", "Claiming interface...\n");
+  ret = libusb_claim_interface(devh, interface);
+  if(ret < 0) {
+    LOGE(__FUNCTION__, "INFO", "%s: %s Unable to claim interface %d.\n", libusb_error_name(ret), libusb_strerror(ret), interface);
+  }
+
+  LOGI(__FUNCTION__, "INFO", "Getting descriptor...\n");
+  struct libusb_config_descriptor* descriptor = NULL;
+  if(libusb_get_active_config_descriptor(dev, &descriptor) < 0)
+  {
+    LOGE(__FUNCTION__, "INFO", "Failed to get config descriptor\n");
+  } else {
+    //check for correct endpoints
+    LOGI(__FUNCTION__, "INFO", "Endpoints found:\n");
+    if(descriptor->bNumInterfaces > 0)
+    {
+      struct libusb_interface_descriptor iface = descriptor->interface[0].altsetting[0];
+      for(int i=0; i<iface.bNumEndpoints; ++i) {
+        LOGI(__FUNCTION__, "INFO", " %d (0x%02x),\n", iface.endpoint[i].bEndpointAddress, iface.endpoint[i].bEndpointAddress);
+      }
+    }
+
+    LOGI(__FUNCTION__, "INFO", "libusb_free_config_descriptor()\n");
+    libusb_free_config_descriptor(descriptor);
+  }
+
+  return devh;
+}
+
+// Create the context for a real device. Returns NULL if we can't open it.
+struct usb2can_can* create_usb_device(libusb_context* ctx, libusb_device* dev) {
+  int interface = 0;
+  struct libusb_device_handle* devh = open_usb_device(dev, interface);
+  if(devh == NULL) {
+    return NULL;
+  }
+  struct usb2can_can* can = init_usb2can_can(ctx, devh, NULL);
+  if(can == NULL) {
+    libusb_close(devh);
+    return NULL;
+  }
+  can->dev = libusb_ref_device(dev);
+  can->interface = interface;
+  return can;
+}
+
+// Create the context for an emulated device.
+struct usb2can_can* create_emu_device(libusb_context* ctx, int channels, int number) {
+  struct gsusb_emu* emu = gsusb_emu_create(channels);
+  if(emu == NULL) {
+    LOGE(__FUNCTION__, "INFO", "ERROR! Unable to create the emulated device.\n");
+    return NULL;
+  }
+  gsusb_emu_set_bus(emu, emu_bus[number]);
+  struct usb2can_can* can = init_usb2can_can(ctx, NULL, emu);
+  if(can == NULL) {
+    gsusb_emu_destroy(emu);
+    return NULL;
+  }
+  snprintf(can->serial, sizeof(can->serial), "EMU%i", number);
+  return can;
+}
+
+// Everything that we need to do to get a device ready to use, from reading its serial number
+// to opening each of its channels. It only uses control transfers on the device's own handle
+// so several devices can be set up at the same time (see setup_device_thread()).
+int setup_device(struct usb2can_can* can) {
+  int ret;
+
+  if(can->devh != NULL) {
+    struct libusb_device_descriptor desc;
+    memset(&desc, 0, sizeof(desc));
+    if((libusb_get_device_descriptor(can->dev, &desc) == 0) && (desc.iSerialNumber != 0)) {
+      ret = libusb_get_string_descriptor_ascii(can->devh, desc.iSerialNumber, (unsigned char*)can->serial, sizeof(can->serial));
+      if(ret < 0) {
+        can->serial[0] = '\0';
+      }
+    }
+    if(can->serial[0] == '\0') {
+      // Without a serial number the best we can do is name it after where it's plugged in.
+      snprintf(can->serial, sizeof(can->serial), "%04x:%04x@%u-%u", desc.idVendor, desc.idProduct, libusb_get_bus_number(can->dev), libusb_get_port_number(can->dev));
+    }
+  }
+  can->id = usb2can_device_id(can->serial);
+
+  LOGI(__FUNCTION__, "INFO", "Setting up %s for comms...\n", can->serial);
+  ret = port_set_user_id(can);
+  if(ret < 0) {
+    LOGE(__FUNCTION__, "INFO", "ERROR! Unable to set user ID.\n");
+    return ret;
+  }
+  ret = port_set_host_format(can);
+  if(ret < 0) {
+    LOGE(__FUNCTION__, "INFO", "ERROR! Unable to set host format.\n");
+    return ret;
+  }
+  ret = port_get_device_config(can);
+  if(ret < 0) {
+    LOGE(__FUNCTION__, "INFO", "ERROR! Unable to get the device config.\n");
+    return ret;
+  }
+  for(int c = 0; c < can->channel_count; c++) {
+    struct usb2can_channel* ch = &can->channels[c];
+    ch->bitrate = bitrate[c];
+    ch->sample_point = sample_point[c];
+    ch->data_sample_point = data_sample_point[c];
+    ret = port_get_bit_timing(ch);
+    if(ret < 0) {
+      LOGE(__FUNCTION__, "INFO", "ERROR! Unable to get bit timing.\n");
+      return ret;
+    }
+    if(ch->bitrate == BITRATE_AUTO) {
+      // We have to listen without acknowledging anything, otherwise we'd fill the bus with error
+      // frames while we're at the wrong bitrate.
+      if(!(ch->bt_const.feature & USB2CAN_FEATURE_LISTEN_ONLY)) {
+        LOGE(__FUNCTION__, "INFO", "ERROR! Channel %i doesn't support listen only mode so it can't auto-baud.\n", c);
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+      }
+      ch->mode_flags |= USB2CAN_FEATURE_LISTEN_ONLY;
+      // Bus errors tell us straight away that we've got the wrong bitrate.
+      if(ch->bt_const.feature & USB2CAN_FEATURE_BERR_REPORTING) {
+        ch->mode_flags |= USB2CAN_FEATURE_BERR_REPORTING;
+      }
+      ch->autobaud = 0;
+    }
+    if(data_bitrate[c] != 0) {
+      if(!(ch->bt_const.feature & USB2CAN_FEATURE_FD)) {
+        LOGW(__FUNCTION__, "INFO", "Channel %i doesn't support CAN FD, it will only use classic CAN.\n", c);
+        continue;
+      }
+      ret = port_get_bit_timing_ext(ch);
+      if(ret < 0) {
+        LOGE(__FUNCTION__, "INFO", "ERROR! Unable to get extended bit timing.\n");
+        return ret;
+      }
+      ch->data_bitrate = data_bitrate[c];
+    }
+  }
+
+  // These change the format of the USB transfers which all the channels share, so we only use
+  // them if every channel supports them.
+  uint32_t features = 0xFFFFFFFF;
+  for(int c = 0; c < can->channel_count; c++) {
+    features &= can->channels[c].bt_const.feature;
+  }
+  if(pad_packets) {
+    if(features & USB2CAN_FEATURE_PAD_PKTS_TO_MAX_PKT_SIZE) {
+      can->mode_flags |= USB2CAN_FEATURE_PAD_PKTS_TO_MAX_PKT_SIZE;
+    } else {
+      LOGW(__FUNCTION__, "INFO", "The device doesn't support padding packets, ignoring.\n");
+    }
+  }
+  if(features & USB2CAN_FEATURE_HW_TIMESTAMP) {
+    can->mode_flags |= USB2CAN_FEATURE_HW_TIMESTAMP;
+  } else {
+    LOGI(__FUNCTION__, "INFO", "The device doesn't support timestamps, using the time frames arrive over USB.\n");
+  }
+
+  for(int c = 0; c < can->channel_count; c++) {
+    if(can->channels[c].autobaud >= 0) {
+      LOGI(__FUNCTION__, "INFO", "Channel %i is looking for its bitrate...\n", c);
+      ret = autobaud_try(&can->channels[c], 0);
+    } else {
+      ret = set_bitrate(&can->channels[c]);
+    }
+    if(ret < 0) {
+      LOGE(__FUNCTION__, "INFO", "ERROR! Unable to set bitrate.\n");
+      return ret;
+    }
+    if(can->channels[c].data_bitrate != 0) {
+      ret = set_data_bitrate(&can->channels[c]);
+      if(ret < 0) {
+        LOGE(__FUNCTION__, "INFO", "ERROR! Unable to set data bitrate.\n");
+        return ret;
+      }
+      can->channels[c].mode_flags |= USB2CAN_FEATURE_FD;
+    }
+    // In one shot mode the controller doesn't retry a frame that loses arbitration or gets an error,
+    // so a frame that times out hasn't been sent and won't be later.
+    if(one_shot[c]) {
+      if(can->channels[c].bt_const.feature & USB2CAN_FEATURE_ONE_SHOT) {
+        can->channels[c].mode_flags |= USB2CAN_FEATURE_ONE_SHOT;
+      } else {
+        LOGW(__FUNCTION__, "INFO", "Channel %i doesn't support one shot mode, the device will retry frames.\n", c);
+      }
+    }
+    set_tx_timeout(&can->channels[c]);
+    LOGI(__FUNCTION__, "INFO", "Channel %i: frames time out after %ums.\n", c, can->channels[c].tx_timeout);
+
+    LOGI(__FUNCTION__, "INFO", "Opening port...\n");
+    ret = port_open(&can->channels[c]);
+    if(ret < 0) {
+      LOGE(__FUNCTION__, "INFO", "ERROR! Unable to open port.\n");
+      return ret;
+    }
+  }
+  LOGI(__FUNCTION__, "INFO", "USB to CAN device %s (id %08x) is connected with %i channel(s)!\n", can->serial, can->id, can->channel_count);
+  return 0;
+}
+
+void* setup_device_thread(void* arg) {
+  return (void*)(intptr_t)setup_device((struct usb2can_can*)arg);
+}
+
+// Shut a device down and free it. The device may already have gone away.
+void close_device(struct usb2can_can* can) {
+  int leaked = (stop_transfers(can) != 0);
+  if(can->clock.count > 0) {
+    LOGI(__FUNCTION__, "INFO", "%s: Device clock drift: %.1f ppm\n", can->serial, clocksync_drift_ppm(&can->clock));
+  }
+  for(int c = 0; c < can->channel_count; c++) {
+    struct usb2can_channel* ch = &can->channels[c];
+    LOGI(__FUNCTION__, "INFO", "%s channel %i: rx %" PRIu64 ", tx %" PRIu64 ", echoed %" PRIu64 ", timed out %" PRIu64 ", failed %" PRIu64 ", errors %" PRIu64 ", overflows %" PRIu64 "\n",
+         can->serial, c, ch->stats.rx_frames, ch->stats.tx_frames, ch->stats.tx_echoes, ch->stats.tx_timeouts, ch->stats.tx_errors, ch->stats.err_frames, ch->stats.overflows);
+    if(ch->open && !can->dead) {
+      if(port_close(ch) < 0) {
+        LOGE(__FUNCTION__, "INFO", "ERROR! Unable to close port.\n");
+      }
+    }
+    // Whoever sent the frames that are left needs to know that they won't be sent now.
+    while(ch->tx_oldest >= 0) {
+      release_tx_context(ch, ch->tx_context[ch->tx_oldest].echo_id, USB2CAN_TX_FAILED);
+    }
+    while(ch->tx_heap_count > 0) {
+      uint16_t slot = tx_dequeue(ch);
+      conn_tx_status(&ch->tx_pending[slot].owner, ch->index, USB2CAN_TX_FAILED);
+    }
+  }
+
+  if(can->devh != NULL) {
+    if(!can->dead) {
+      int ret = libusb_attach_kernel_driver(can->devh, can->interface);
+      if(ret < 0) {
+        LOGE(__FUNCTION__, "INFO", "%s: %s Unable to reattach existing driver.\n", libusb_error_name(ret), libusb_strerror(ret));
+      }
+    }
+
+    libusb_close(can->devh);
+    LOGI(__FUNCTION__, "INFO", "Device closed.\n");
+  }
+  if(can->dev != NULL) {
+    libusb_unref_device(can->dev);
+  }
+  if(leaked) {
+    return; // The transfers that are still out there point at can and the emulated device.
+  }
+  gsusb_emu_destroy(can->emu);
+  free_tx_contexts(can);
+  free(can);
+}
+
+// Start serving a device that has been set up.
+int attach_device(struct reactor* r, struct usb2can_can* can) {
+  int d;
+  for(d = 0; (d < USB2CAN_MAX_DEVICES) && (devices[d] != NULL); d++) {
+  }
+  if(d == USB2CAN_MAX_DEVICES) {
+    LOGE(__FUNCTION__, "INFO", "Too many devices, ignoring %s.\n", can->serial);
+    return -1;
+  }
+  if(find_device(can->id) != NULL) {
+    LOGE(__FUNCTION__, "INFO", "We already have a device called %s, ignoring this one.\n", can->serial);
+    return -1;
+  }
+
+  if(can->emu != NULL) {
+    usb_pollfd_added(gsusb_emu_get_fd(can->emu), POLLIN, r);
+  }
+  if((start_rx(can) != 0) || (start_tx(can) != 0)) {
+    if(can->emu != NULL) {
+      usb_pollfd_removed(gsusb_emu_get_fd(can->emu), r);
+    }
+    return -1;
+  }
+  devices[d] = can;
+  shm_set_default();
+
+  // Let anyone who was waiting for it know that it's back.
+  for(int i = 0; i < conn_slots; i++) {
+    if((clients[i].fd > 0) && (clients[i].device == can->id)) {
+      conn_send_bind(clients[i].fd, can->id, 1);
+    }
+  }
+  return 0;
+}
+
+// Stop serving a device and free it.
+void detach_device(struct reactor* r, struct usb2can_can* can) {
+  LOGI(__FUNCTION__, "INFO", "Detaching %s.\n", can->serial);
+  for(int d = 0; d < USB2CAN_MAX_DEVICES; d++) {
+    if(devices[d] == can) {
+      devices[d] = NULL;
+    }
+  }
+  shm_set_default();
+  if(can->emu != NULL) {
+    usb_pollfd_removed(gsusb_emu_get_fd(can->emu), r);
+  }
+  for(int i = 0; i < conn_slots; i++) {
+    if((clients[i].fd > 0) && (clients[i].device == can->id)) {
+      conn_send_bind(clients[i].fd, can->id, 0);
+    }
+  }
+  close_device(can);
+}
+
+// Hotplug events are queued by the callback, which libusb calls from inside its event
+// handling, and dealt with by handle_hotplug() once it has finished.
+#define HOTPLUG_QUEUE_LEN (16)
+struct hotplug_event {
+  libusb_device* dev;
+  libusb_hotplug_event event;
+};
+struct hotplug_event hotplug_queue[HOTPLUG_QUEUE_LEN];
+int hotplug_count = 0;
+
+int hotplug_callback(libusb_context* ctx, libusb_device* dev, libusb_hotplug_event event, void* user_data) {
+  if(hotplug_count >= HOTPLUG_QUEUE_LEN) {
+    LOGE(__FUNCTION__, "INFO", "Too many hotplug events, dropping one.\n");
+    return 0;
+  }
+  hotplug_queue[hotplug_count].dev = libusb_ref_device(dev);
+  hotplug_queue[hotplug_count].event = event;
+  hotplug_count++;
+  return 0; // Keep the callback registered.
+}
+
+// Ask libusb to tell us when any of the devices that we support are plugged in or removed.
+int hotplug_register(libusb_context* ctx) {
+  if(!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+    LOGW(__FUNCTION__, "INFO", "libusb doesn't support hotplug, we'll only use the devices that are connected now.\n");
+    return -1;
+  }
+  for(int i = 0; i < SUPPORTED_DEVICES; i++) {
+    int ret = libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, 0,
+                                               supported_devices[i].vendor, supported_devices[i].product, LIBUSB_HOTPLUG_MATCH_ANY,
+                                               hotplug_callback, NULL, NULL);
+    if(ret != LIBUSB_SUCCESS) {
+      LOGE(__FUNCTION__, "INFO", "%s: %s Unable to register for hotplug events.\n", libusb_error_name(ret), libusb_strerror(ret));
+      return ret;
+    }
+  }
+  return 0;
+}
+
+// Devices that are plugged in are set up on threads of their own, as they are at startup, so that
+// the control requests to a slow device don't hold up everything else. Each thread writes a struct
+// setup_result to setup_pipe when it's done and hotplug_setup_done() attaches the device.
+struct setup_result {
+  struct usb2can_can* can;
+  int ret;
+};
+int setup_pipe[2] = {-1, -1};
+static int setup_pipe_marker;  // The udata for setup_pipe[0].
+struct usb2can_can* setting_up[USB2CAN_MAX_DEVICES];  // The devices that are being set up.
+int setting_up_count = 0;
+
+void* hotplug_setup_thread(void* arg) {
+  struct setup_result result;
+  result.can = (struct usb2can_can*)arg;
+  result.ret = setup_device(result.can);
+  // It's smaller than PIPE_BUF so it's written in one go.
+  if(write(setup_pipe[1], &result, sizeof(result)) != sizeof(result)) {
+    LOGE(__FUNCTION__, "INFO", "Unable to hand %s back to the processing loop.\n", result.can->serial);
+  }
+  return NULL;
+}
+
+// Attach the devices whose setup has finished.
+void hotplug_setup_done(struct reactor* r) {
+  struct setup_result result;
+  while(read(setup_pipe[0], &result, sizeof(result)) == sizeof(result)) {
+    for(int k = 0; k < setting_up_count; k++) {
+      if(setting_up[k] == result.can) {
+        setting_up[k] = setting_up[--setting_up_count];
+        break;
+      }
+    }
+    if((result.ret < 0) || (attach_device(r, result.can) != 0)) {
+      close_device(result.can);
+    }
+  }
+}
+
+// Start setting up a device that has been plugged in, see hotplug_setup_thread().
+void hotplug_setup(struct reactor* r, struct usb2can_can* can) {
+  if((setup_pipe[0] < 0) && (pipe(setup_pipe) == 0)) {
+    fcntl(setup_pipe[0], F_SETFL, fcntl(setup_pipe[0], F_GETFL) | O_NONBLOCK);
+    if(reactor_add(r, setup_pipe[0], REACTOR_READ, &setup_pipe_marker) != 0) {
+      close(setup_pipe[0]);
+      close(setup_pipe[1]);
+      setup_pipe[0] = -1;
+      setup_pipe[1] = -1;
+    }
+  }
+  pthread_t thread;
+  if((setup_pipe[0] >= 0) && (setting_up_count < USB2CAN_MAX_DEVICES) && (pthread_create(&thread, NULL, hotplug_setup_thread, can) == 0)) {
+    pthread_detach(thread);
+    setting_up[setting_up_count++] = can;
+    return;
+  }
+  LOGE(__FUNCTION__, "INFO", "Unable to create a thread, setting the device up now.\n");
+  if((setup_device(can) < 0) || (attach_device(r, can) != 0)) {
+    close_device(can);
+  }
+}
+
+// Attach the devices that have been plugged in and mark the ones that have been removed as dead,
+// the processing loop detaches those.
+void handle_hotplug(struct reactor* r, libusb_context* ctx) {
+  for(int n = 0; n < hotplug_count; n++) {
+    libusb_device* dev = hotplug_queue[n].dev;
+    struct usb2can_can* existing = NULL;
+    for(int d = 0; d < USB2CAN_MAX_DEVICES; d++) {
+      if((devices[d] != NULL) && (devices[d]->dev == dev)) {
+        existing = devices[d];
+      }
+    }
+    uint8_t pending = 0;
+    for(int k = 0; k < setting_up_count; k++) {
+      if(setting_up[k]->dev == dev) {
+        pending = 1;  // It's still being set up, if it has gone that fails by itself.
+      }
+    }
+
+    if(hotplug_queue[n].event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+      if(existing != NULL) {
+        LOGI(__FUNCTION__, "INFO", "%s has been unplugged.\n", existing->serial);
+        existing->dead = 1;
+      }
+    } else if((existing == NULL) && !pending) {
+      LOGI(__FUNCTION__, "INFO", "A new device has been plugged in.\n");
+      struct usb2can_can* can = create_usb_device(ctx, dev);
+      if(can != NULL) {
+        hotplug_setup(r, can);
+      }
+    }
+    libusb_unref_device(dev);
+  }
+  hotplug_count = 0;
+}
+
+// How long b on its own busy-polls for.
+#define USB2CAN_BUSY_POLL_DEFAULT_US  (50)
+
+// Cut *timeout_ns down to ns if that's sooner, a negative *timeout_ns is forever.
+static void wake_within(int64_t* timeout_ns, int64_t ns) {
+  if(ns < 0) {
+    ns = 0;
+  }
+  if((*timeout_ns < 0) || (ns < *timeout_ns)) {
+    *timeout_ns = ns;
+  }
+}
+
+// ctx is NULL if we're only using emulated devices. If hotplug is set then we keep going when
+// there aren't any devices, otherwise we stop when the last one goes away.
+// unixFd is the Unix domain socket's listener, or -1 if there isn't one.
+int processing_loop(struct reactor* r, int sockFd, int unixFd, libusb_context* ctx, uint8_t hotplug) {
+  struct reactor_event evList[MAX_EVENTS];
+  struct sockaddr_storage addr;
+  socklen_t socklen = sizeof(addr);
+  int fd;
+  struct timeval zero_tv = {
+    .tv_sec = 0,
+    .tv_usec = 0
+  };
+
+  uint64_t spin_until = 0; // When to stop busy-polling, see busy_poll.
+
+  LOGI(__FUNCTION__, "INFO", "Entering Main Loop...\n");
+  LOGI(__FUNCTION__, "INFO", "sockFd = %i\n", sockFd);
+
+  if((ctx != NULL) && (usb_watch(r, ctx) != 0)) {
+    return -1;
+  }
+
+  while(1) {
+    int device_count = 0;
+    uint64_t deadline_ms = UINT64_MAX;
+    for(int d = 0; d < USB2CAN_MAX_DEVICES; d++) {
+      struct usb2can_can* can = devices[d];
+      if(can == NULL) {
+        continue;
+      }
+      if(can->dead) {
+        LOGE(__FUNCTION__, "INFO", "The USB device %s has gone away.\n", can->serial);
+        detach_device(r, can);
+        continue;
+      }
+      device_count++;
+      handleRetries(can);
+      handle_autobaud(can);
+      sync_device_clock(can);
+      uint64_t deadline = device_deadline(can);
+      if(deadline < deadline_ms) {
+        deadline_ms = deadline;
+      }
+    }
+    if((device_count == 0) && !hotplug) {
+      LOGE(__FUNCTION__, "INFO", "No devices left.\n");
+      break;
+    }
+
+    // Sleep until something happens, or until the soonest that something needs doing: a frame
+    // times out, auto-baud moves on, a device's clock needs reading, libusb (or an emulated
+    // device) has a timeout, a cyclic frame is due or a client's frames have waited long enough.
+    // With nothing like that we sleep for as long as it takes.
+    int64_t timeout_ns = -1;
+    uint64_t now = nanos();
+    if(deadline_ms != UINT64_MAX) {
+      wake_within(&timeout_ns, (int64_t)(deadline_ms * 1000000) - (int64_t)now);
+    }
+    struct timeval tv;
+    if((ctx != NULL) && (libusb_get_next_timeout(ctx, &tv) == 1)) {
+      wake_within(&timeout_ns, ((int64_t)tv.tv_sec * 1000000000) + ((int64_t)tv.tv_usec * 1000));
+    }
+    for(int d = 0; d < USB2CAN_MAX_DEVICES; d++) {
+      if((devices[d] != NULL) && (devices[d]->emu != NULL) && (gsusb_emu_get_next_timeout(devices[d]->emu, &tv) == 1)) {
+        wake_within(&timeout_ns, ((int64_t)tv.tv_sec * 1000000000) + ((int64_t)tv.tv_usec * 1000));
+      }
+    }
+    uint64_t due = conn_deadline();
+    if(due != UINT64_MAX) {
+      wake_within(&timeout_ns, (int64_t)(due - now));
+    }
+    if(cyclic_wheel.count > 0) {
+      // It only looks one turn of the wheel ahead, if nothing is due by then we wake up and look again.
+      wake_within(&timeout_ns, (int64_t)timerwheel_next(&cyclic_wheel, now / 1000, TIMERWHEEL_SLOTS * TIMERWHEEL_TICK_US) * 1000);
+    }
+    // Don't sleep at all for a while after something has happened, in case something else does.
+    if(now < spin_until) {
+      timeout_ns = 0;
+    }
+    // Clients only ring our doorbell if they see that we're asleep, so say that we are and then
+    // look at their rings once more in case one of them has only just written to it.
+    if((shm != NULL) && (timeout_ns != 0)) {
+      atomic_store(&shm->sleeping, 1);
+      if(shm_pending()) {
+        timeout_ns = 0;
+      }
+    }
+
+    int nev = reactor_wait(r, evList, MAX_EVENTS, timeout_ns);
+    if(shm != NULL) {
+      atomic_store(&shm->sleeping, 0);
+    }
+    if(nev < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      LOGE(__FUNCTION__, "INFO", "reactor_wait error\n");
+      exit(1);
+    }
+    if((nev > 0) && (busy_poll > 0)) {
+      spin_until = nanos() + ((uint64_t)busy_poll * 1000);
+    }
+
+    // Let libusb deal with any completions (and timeouts if nothing happened). One call
+    // handles every real device, the emulated ones each need their own.
+    uint8_t usb_event = (nev == 0);
+    for(int i = 0; i < nev; i++) {
+      if(evList[i].udata == &usb_pollfd_marker) {
+        usb_event = 1;
+      }
+    }
+    if(usb_event) {
+      if(ctx != NULL) {
+        libusb_handle_events_timeout_completed(ctx, &zero_tv, NULL);
+      }
+      for(int d = 0; d < USB2CAN_MAX_DEVICES; d++) {
+        if((devices[d] != NULL) && (devices[d]->emu != NULL)) {
+          gsusb_emu_handle_events(devices[d]->emu);
+        }
+      }
+      if(ctx != NULL) {
+        handle_hotplug(r, ctx);
+      }
+    }
+
+    for(int i = 0; i < nev; i++) {
+      if(evList[i].udata == &usb_pollfd_marker) {
+        continue; // Already handled
+      } else if(evList[i].udata == &setup_pipe_marker) {
+        hotplug_setup_done(r);
+      } else if((sockFd == evList[i].fd) || (unixFd == evList[i].fd)) {
+        socklen = sizeof(addr);
+        fd = accept(evList[i].fd, (struct sockaddr *)&addr, & socklen);
+        if(fd == -1) {
+          LOGE(__FUNCTION__, "INFO", "accept error\n");
+        } else if(conn_add(fd, (evList[i].fd == unixFd) ? CLIENT_TYPE_SEQPACKET : CLIENT_TYPE_SOCK) == 0) {
+          // We never wait for a client, if it can't take what we send it then it waits in its queue.
+          fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+          LOGI(__FUNCTION__, "INFO", "Accepted socket %i.\n", fd);
+          // Edge triggered, conn_read() reads everything that's there or pauses it.
+          assert(-1 != reactor_add(r, fd, REACTOR_READ | REACTOR_EDGE, NULL));
+        } else {
+          LOGE(__FUNCTION__, "INFO", "Connection refused!\n");
+          close(fd);
+        }
+      } else if(conn_index(evList[i].fd) > -1) {
+        fd = evList[i].fd;
+        // There's room in its socket again, what's waiting for it goes at the end of this pass.
+        if(evList[i].events & REACTOR_WRITE) {
+          clients[conn_index(fd)].out_blocked = 0;
+        }
+        if(!(evList[i].events & REACTOR_READ)) {
+          continue;
+        }
+        switch(clients[conn_index(fd)].typ) {
+        case CLIENT_TYPE_SOCK:
+        case CLIENT_TYPE_SEQPACKET:
+          if(clients[conn_index(fd)].typ == CLIENT_TYPE_SEQPACKET) {
+            conn_read_seqpacket(r, conn_index(fd), evList[i].avail);
+          } else {
+            conn_read(r, conn_index(fd), evList[i].avail);
+          }
+          // Once it has hung up and we've read everything, it's closed as soon as what it sent has gone.
+          if(evList[i].eof && !clients[conn_index(fd)].paused) {
+            if(clients[conn_index(fd)].tx_count == 0) {
+              LOGI(__FUNCTION__, "INFO", "Socket closed: %i\n", fd);
+              conn_close(fd);
+            } else {
+              reactor_remove(r, fd);
+              clients[conn_index(fd)].closing = 1;
+            }
+          }
+          break;
+        }
+      }
+    }
+
+    shm_read();
+    conn_drain(r);
+    cyclic_run();
+
+    // Send everything that we've gathered during this pass in one go.
+    for(int d = 0; d < USB2CAN_MAX_DEVICES; d++) {
+      if(devices[d] != NULL) {
+        tx_schedule(devices[d]);
+        flush_tx(devices[d]);
+      }
+    }
+    shm_doorbells();
+    conn_flush_all(r);
+  }
+
+  if(ctx != NULL) {
+    usb_unwatch(ctx);
+  }
+  return 0;
+}
+
+void printusage() {
+  printf("usb2can V3\n");
+  printf("\n");
+  printf("usb2can opens either the first or the specified GS USB or candleLight style USB2CAN device and binds to a socket (default address is 2303).\n");
+  printf("You must #include usb2can.h. Then all messages transmitted & received will be in the format specified in struct can_frame (or struct canfd_frame, see USB2CAN_CTRL_FD).\n");
+  printf("\n");
+  printf("Usage: usb2can <s[rate][@channel]/f[rate][@channel]/?/p[nnnn]>/d[nnnn]/t[n]/w[ms][@channel]/o[@channel]/b[us]/u[path][:mode]/m/q[n][:policy]/c[n]/x/e[n]\n");
+  printf("\n");
+  printf("Where: \n");
+  printf("  s[rate] = Chosen bitrate in bits/s, k and m can be used (i.e. s250k, s83.33k or s1m). Defaults to 500k.\n");
+  printf("            Add : and a sample point in percent (i.e. s500k:75) to use it instead of the CiA recommended one.\n");
+  printf("            sauto listens for traffic at each of the common bitrates in turn and uses the first that receives frames without errors.\n");
+  printf("            Add @ and a channel number (i.e. s250k@1) to set just that channel of a multi-channel device, otherwise it sets all of them.\n");
+  printf("  f[rate] = CAN FD data phase bitrate in bits/s (i.e. f2m or f5m:70). Channels that support CAN FD are started in CAN FD\n");
+  printf("            mode, the others stay classic CAN. The sample point defaults to 75%%. @ and a channel number work as for s.\n");
+  printf("  ? = print this message. \n");
+  printf("  p[nnnn] = a \"p\" followed by a number - use this as the port number. \n");
+  printf("  d[nnnn] = a \"d\" followed by a number - if there are multiple device connected then speficy which to use. If this is omiited it will use every compatible device that it finds, and any that are plugged in later.\n");
+  printf("  t[n] = let each channel have up to n frames in flight, waiting for the device to confirm them (1 to %i, defaults to %i).\n", USB2CAN_MAX_TX_DEPTH, USB2CAN_TX_DEPTH_DEFAULT);
+  printf("  w[ms] = give the device ms milliseconds to confirm each frame that it's sent before we give up on it (1 to 60000). By default it's\n");
+  printf("          worked out from the bitrate and t[n]. @ and a channel number work as for s.\n");
+  printf("  o = put the channels in one shot mode (if they support it), frames that fail aren't retried. @ and a channel number work as for s.\n");
+  printf("  b[us] = busy-poll for us microseconds (1 to 1000000, defaults to %i) after anything happens rather than going straight back to sleep.\n", USB2CAN_BUSY_POLL_DEFAULT_US);
+  printf("          It cuts the time that it takes to wake up for the next event, at the cost of a core while the bus is busy.\n");
+  printf("  u[path][:mode] = also listen for local clients on a SOCK_SEQPACKET Unix domain socket at path (%s if omitted). mode is its\n", USB2CAN_UNIX_PATH);
+  printf("          permissions in octal, 660 if omitted, so that only its owner and group can connect.\n");
+  printf("  m = let the clients on the Unix domain socket receive and send frames through shared memory rings (see usb2can_shm.h) rather than\n");
+  printf("      the socket. It implies u if that isn't given. Anyone who can connect to the socket can read and write all of it.\n");
+  printf("  q[n][:policy] = let up to n frames wait for each client that isn't keeping up (%i to %i, defaults to %i). policy is what happens\n", 4, USB2CAN_OUT_DEPTH_MAX, USB2CAN_OUT_DEPTH_DEFAULT);
+  printf("          when it falls further behind than that: new drops the frames that don't fit (the default), old drops the oldest to make\n");
+  printf("          room and close disconnects it. Either way the others and the bus carry on as if nothing had happened.\n");
+  printf("  c[n] = take up to n connections at once (1 to %i, defaults to %i), any more are refused.\n", USB2CAN_CLIENTS_MAX, USB2CAN_CLIENTS_DEFAULT);
+  printf("  x = ask the device to pad every frame to the USB packet size (if it supports it), so that it can send us several frames per transfer.\n");
+  printf("  e[n] = use a software emulated device instead of real hardware. Every frame sent is echoed back as if it had been transmitted. n is the number of channels, 1 if omitted. Repeat it for more devices.\n");
+  printf("         Add : and a bitrate (i.e. e2:250k) to put another node at that bitrate on its buses, it sends a frame every 10ms.\n");
+  printf("\n");
+}
+
+// Parse a bitrate in bits/s, k and m can be used, followed by an optional : and sample point in
+// percent, i.e. 250k, 83.33k or 500k:75. The sample point is returned in tenths of a percent.
+// Returns 0 if it's valid up to the end of the string or an @.
+int parse_bitrate(const char* arg, uint32_t* rate, uint16_t* sp) {
+  // The rates that have always been given rounded, so that they still come out exact.
+  static const struct {
+    const char* name;
+    uint32_t rate;
+  } rounded[] = {
+    { "33.33k", 33333 },
+    { "66.66k", 66666 },
+    { "83.33k", 83333 },
+    { "666k", 666666 }
+  };
+  char* end;
+  double r = strtod(arg, &end);
+  if(end == arg) {
+    return -1;
+  }
+  if(*end == 'k') {
+    r *= 1000;
+    end++;
+  } else if(*end == 'm') {
+    r *= 1000000;
+    end++;
+  }
+  for(size_t i = 0; i < sizeof(rounded) / sizeof(rounded[0]); i++) {
+    if((end - arg) == (ptrdiff_t)strlen(rounded[i].name) && (0 == strncmp(arg, rounded[i].name, end - arg))) {
+      r = rounded[i].rate;
+    }
+  }
+  *rate = (uint32_t)(r + 0.5);
+  *sp = BITTIMING_SAMPLE_POINT_DEFAULT;
+  if(*end == ':') {
+    const char* start = end + 1;
+    double p = strtod(start, &end);
+    if((end == start) || (p < 50) || (p >= 100)) {
+      return -1;
+    }
+    *sp = (uint16_t)((p * 10) + 0.5);
+  }
+  return ((*end == '\0') || (*end == '@')) ? 0 : -1;
+}
+
+// The channel after an @ in an argument, or -1 if there isn't one and it's for all of them.
+int parse_channel(const char* arg) {
+  const char* at = strchr(arg, '@');
+  if(at == NULL) {
+    return -1;
+  }
+  int channel = atoi(at + 1);
+  if((channel < 0) || (channel >= USB2CAN_MAX_CHANNELS)) {
+    fprintf(stderr, "Incorrect channel!\n\n");
+    printusage();
+    exit(1);
+  }
+  return channel;
+}
+
+void processArgs(int argc, char *argv[]) {
+  if(argc > 1) {
+    for(int i = 1; i < argc; i++)
     {
       if(argv[i][0]  == '?') {
         printusage();
@@ -1227,63 +4496,218 @@ void processArgs(int argc, char *argv[]) {
       } else if(argv[i][0] == 'd') {
         int deviceNumber2 = atoi(&(argv[i][1]));
         deviceNumber = deviceNumber2;
-      } else if(argv[i][0] == 's') {
-        if(0 == strncmp(argv[i], "s20k", 4)) {
-          bitrate = 0;
-        } else if(0 == strncmp(argv[i], "s33.33k", 7)) {
-          bitrate = 1;
-        } else if(0 == strncmp(argv[i], "s40k", 4))  {
-          bitrate = 2;
-        } else if(0 == strncmp(argv[i], "s50k", 4))  {
-          bitrate = 3;
-        } else if(0 == strncmp(argv[i], "s66.66k", 7))  {
-          bitrate = 4;
-        } else if(0 == strncmp(argv[i], "s80k", 4))  {
-          bitrate = 5;
-        } else if(0 == strncmp(argv[i], "s83.33k", 7))  {
-          bitrate = 6;
-        } else if(0 == strncmp(argv[i], "s100k", 5))  {
-          bitrate = 7;
-        } else if(0 == strncmp(argv[i], "s125k", 5))  {
-          bitrate = 8;
-        } else if(0 == strncmp(argv[i], "s200k", 5))  {
-          bitrate = 9;
-        } else if(0 == strncmp(argv[i], "s250k", 5))  {
-          bitrate = 10;
-        } else if(0 == strncmp(argv[i], "s400k", 5))  {
-          bitrate = 11;
-        } else if(0 == strncmp(argv[i], "s500k", 5))  {
-          bitrate = 12;
-        } else if(0 == strncmp(argv[i], "s666k", 5))  {
-          bitrate = 13;
-        } else if(0 == strncmp(argv[i], "s800k", 5))  {
-          bitrate = 14;
-        } else if(0 == strncmp(argv[i], "s1m", 3))  {
-          bitrate = 15;
-        } else {
-          fprintf(stderr, "Incorrect bitrate!\n\n");
+      } else if(argv[i][0] == 'e') {
+        if(emulate >= USB2CAN_MAX_DEVICES) {
+          fprintf(stderr, "Too many emulated devices!\n\n");
+          printusage();
+          exit(1);
+        }
+        int channels = 1;
+        if((argv[i][1] != '\0') && (argv[i][1] != ':')) {
+          channels = atoi(&(argv[i][1]));
+          if((channels < 1) || (channels > USB2CAN_MAX_CHANNELS)) {
+            fprintf(stderr, "Incorrect number of channels!\n\n");
+            printusage();
+            exit(1);
+          }
+        }
+        // e[n]:[rate] puts another node on the buses.
+        emu_bus[emulate] = 0;
+        char* colon = strchr(argv[i], ':');
+        if(colon != NULL) {
+          uint16_t sp;
+          if((parse_bitrate(colon + 1, &emu_bus[emulate], &sp) != 0) || (emu_bus[emulate] == 0)) {
+            fprintf(stderr, "Incorrect bus bitrate!\n\n");
+            printusage();
+            exit(1);
+          }
+        }
+        emu_channels[emulate++] = channels;
+      } else if(argv[i][0] == 'b') {
+        // b[us], busy-poll for this long after something happens.
+        int us = USB2CAN_BUSY_POLL_DEFAULT_US;
+        if(argv[i][1] != '\0') {
+          us = atoi(&(argv[i][1]));
+        }
+        if((us < 1) || (us > 1000000)) {
+          fprintf(stderr, "Incorrect busy-poll time!\n\n");
+          printusage();
+          exit(1);
+        }
+        busy_poll = (uint32_t)us;
+      } else if(argv[i][0] == 'u') {
+        // u[path][:mode], also listen on a Unix domain socket.
+        char* colon = strrchr(argv[i], ':');
+        if(colon != NULL) {
+          char* end;
+          long mode = strtol(colon + 1, &end, 8);
+          if((end == colon + 1) || (*end != '\0') || (mode < 0) || (mode > 0777)) {
+            fprintf(stderr, "Incorrect socket permissions!\n\n");
+            printusage();
+            exit(1);
+          }
+          unix_mode = (mode_t)mode;
+          *colon = '\0';
+        }
+        unix_path = (argv[i][1] != '\0') ? &argv[i][1] : USB2CAN_UNIX_PATH;
+      } else if(argv[i][0] == 'm') {
+        // m, the shared memory rings. They're handed out over the Unix domain socket.
+        use_shm = 1;
+        if(unix_path == NULL) {
+          unix_path = USB2CAN_UNIX_PATH;
+        }
+      } else if(argv[i][0] == 'q') {
+        // q[n][:policy], how far behind a client can fall and what happens then.
+        char* colon = strchr(argv[i], ':');
+        if(colon != NULL) {
+          if(strcmp(colon + 1, "new") == 0) {
+            out_policy = OUT_POLICY_DROP_NEWEST;
+          } else if(strcmp(colon + 1, "old") == 0) {
+            out_policy = OUT_POLICY_DROP_OLDEST;
+          } else if(strcmp(colon + 1, "close") == 0) {
+            out_policy = OUT_POLICY_DISCONNECT;
+          } else {
+            fprintf(stderr, "Incorrect policy!\n\n");
+            printusage();
+            exit(1);
+          }
+          *colon = '\0';
+        }
+        if(argv[i][1] != '\0') {
+          long depth = atol(&argv[i][1]);
+          if((depth < 4) || (depth > USB2CAN_OUT_DEPTH_MAX)) {
+            fprintf(stderr, "Incorrect number of frames!\n\n");
+            printusage();
+            exit(1);
+          }
+          out_depth = (uint32_t)depth;
+        }
+      } else if(argv[i][0] == 'c') {
+        // c[n], the most connections that we take at once.
+        long n = atol(&argv[i][1]);
+        if((n < 1) || (n > USB2CAN_CLIENTS_MAX)) {
+          fprintf(stderr, "Incorrect number of connections!\n\n");
+          printusage();
+          exit(1);
+        }
+        max_clients = (int)n;
+      } else if(argv[i][0] == 'x') {
+        pad_packets = 1;
+      } else if(argv[i][0] == 't') {
+        int depth = atoi(&(argv[i][1]));
+        if((depth < 1) || (depth > USB2CAN_MAX_TX_DEPTH)) {
+          fprintf(stderr, "Incorrect number of frames in flight!\n\n");
+          printusage();
+          exit(1);
+        }
+        tx_depth = depth;
+      } else if(argv[i][0] == 'w') {
+        // w[ms][@channel], how long the device has to confirm a frame.
+        char* end;
+        long ms = strtol(&argv[i][1], &end, 10);
+        if((end == &argv[i][1]) || (ms < 1) || (ms > 60000) || ((*end != '\0') && (*end != '@'))) {
+          fprintf(stderr, "Incorrect tx timeout!\n\n");
+          printusage();
+          exit(1);
+        }
+        int channel = parse_channel(argv[i]);
+        for(int c = 0; c < USB2CAN_MAX_CHANNELS; c++) {
+          if((channel < 0) || (channel == c)) {
+            tx_timeout[c] = (uint32_t)ms;
+          }
+        }
+      } else if(argv[i][0] == 'o') {
+        // o[@channel], one shot mode.
+        int channel = parse_channel(argv[i]);
+        for(int c = 0; c < USB2CAN_MAX_CHANNELS; c++) {
+          if((channel < 0) || (channel == c)) {
+            one_shot[c] = 1;
+          }
+        }
+      } else if(argv[i][0] == 'f') {
+        // f[rate][:sample point][@channel] turns on CAN FD with this data phase bitrate, i.e. f2m or f5m@1.
+        uint32_t rate;
+        uint16_t sp;
+        if((parse_bitrate(&argv[i][1], &rate, &sp) != 0) || (rate < 1000) || (rate > 16000000)) {
+          fprintf(stderr, "Incorrect data bitrate!\n\n");
           printusage();
           exit(1);
         }
+        int channel = parse_channel(argv[i]);
+        for(int c = 0; c < USB2CAN_MAX_CHANNELS; c++) {
+          if((channel < 0) || (channel == c)) {
+            data_bitrate[c] = rate;
+            data_sample_point[c] = sp;
+          }
+        }
+      } else if(argv[i][0] == 's') {
+        // s[rate][:sample point][@channel], or sauto[@channel] to find the bitrate.
+        uint32_t rate = BITRATE_AUTO;
+        uint16_t sp = BITTIMING_SAMPLE_POINT_DEFAULT;
+        if((0 != strcmp(argv[i], "sauto")) && (0 != strncmp(argv[i], "sauto@", 6))) {
+          if((parse_bitrate(&argv[i][1], &rate, &sp) != 0) || (rate < 1000) || (rate > 1000000)) {
+            fprintf(stderr, "Incorrect bitrate!\n\n");
+            printusage();
+            exit(1);
+          }
+        }
+        // s[rate]@[channel] sets just the one channel, otherwise it's all of them.
+        int channel = parse_channel(argv[i]);
+        for(int c = 0; c < USB2CAN_MAX_CHANNELS; c++) {
+          if((channel < 0) || (channel == c)) {
+            bitrate[c] = rate;
+            sample_point[c] = sp;
+          }
+        }
       }
     }
   }
 }
 
+// Find the compatible devices. validdevices must have room for cnt devices. Returns how many were found.
+int find_usb_devices(libusb_device** list, ssize_t cnt, libusb_device** validdevices) {
+  LOGI(__FUNCTION__, "INFO", "%ld USB devices found.\n", cnt);
+  LOGI(__FUNCTION__, "INFO", "USB Devices found:\n");
+
+  // This is where we build out list of device that we are looking for.
+  int devCnt = 0;
+  for (ssize_t i = 0; i < cnt; i++) {
+    libusb_device *dev = list[i];
+    struct libusb_device_descriptor desc;
+    int r = libusb_get_device_descriptor(dev, &desc);
+    if (r < 0) LOGI(__FUNCTION__, "ERROR", "failed to get device descriptor (r = %d)\n", r);
+    if(is_supported_device(&desc)) {
+      LOGI(__FUNCTION__, "INFO", "%2ld Vendor ID: %i (0x%04x), Product ID: %i (0x%04x), Manufacturer: %i, Product: %i, Serial: %i *** DEVICE %i ***\n", i+1, desc.idVendor, desc.idVendor, desc.idProduct, desc.idProduct, desc.iManufacturer, desc.iProduct, desc.iSerialNumber, devCnt);
+      validdevices[devCnt] = dev;
+      devCnt++;
+    } else {
+      LOGI(__FUNCTION__, "INFO", "%2ld Vendor ID: %i (0x%04x), Product ID: %i (0x%04x), Manufacturer: %i, Product: %i, Serial: %i\n", i+1, desc.idVendor, desc.idVendor, desc.idProduct, desc.idProduct, desc.iManufacturer, desc.iProduct, desc.iSerialNumber);
+    }
+  }
+
+  LOGI(__FUNCTION__, "INFO", "Compatible USB to CAN Devices found: %i\n", devCnt);
+  return devCnt;
+}
+
 // Main program entry point. 1st argument will be path to config.json, if it's not present then we'll use the default filename.
 int main(int argc, char *argv[]) {
   int ret = 0;
 
   // Create the signal handler here - ensures that Ctrl-C gets passed back up to 
   signal(SIGINT, sigint_handler);
+  // A client that hangs up while we're sending to it gets an EPIPE, which we don't want to kill us.
+  signal(SIGPIPE, SIG_IGN);
 
   processArgs(argc, argv);
+  cyclic_init();
 
   // Create and bind our socket here.
   LOGI(__FUNCTION__, "INFO", "Creating our server here...\n");
   struct sockaddr_in addr;
   memset(&addr, 0, sizeof(addr));
+#ifndef __linux__
   addr.sin_len = sizeof(addr);
+#endif
   addr.sin_family = AF_INET;
   addr.sin_addr.s_addr = htonl(INADDR_ANY);
   addr.sin_port = htons(port);
@@ -1297,9 +4721,45 @@ int main(int argc, char *argv[]) {
     perror("bind");
     return 1;
   }
-  assert(listen(sock, 5) != -1);
+  assert(listen(sock, SOMAXCONN) != -1);
   LOGI(__FUNCTION__, "INFO", "Listening on %i\n", port);
 
+  int unix_sock = -1;
+  if(unix_path != NULL) {
+    struct sockaddr_un uaddr;
+    memset(&uaddr, 0, sizeof(uaddr));
+    if(strlen(unix_path) >= sizeof(uaddr.sun_path)) {
+      LOGE(__FUNCTION__, "INFO", "ERROR: %s is too long for a socket.\n", unix_path);
+      return 1;
+    }
+    uaddr.sun_family = AF_UNIX;
+    strcpy(uaddr.sun_path, unix_path);
+#ifndef __linux__
+    uaddr.sun_len = SUN_LEN(&uaddr);
+#endif
+    // A socket left behind by a usb2can that didn't shut down cleanly would stop us binding, but
+    // don't delete anything that isn't a socket.
+    struct stat st;
+    if((lstat(unix_path, &st) == 0) && S_ISSOCK(st.st_mode)) {
+      unlink(unix_path);
+    }
+    unix_sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    assert(unix_sock != -1);
+    // The socket is created with these permissions rather than changed afterwards, so there's no moment when anyone else can connect.
+    mode_t mask = umask(~unix_mode & 0777);
+    ret = bind(unix_sock, (struct sockaddr *)&uaddr, sizeof(uaddr));
+    umask(mask);
+    if(ret == -1) {
+      perror("bind");
+      return 1;
+    }
+    assert(listen(unix_sock, SOMAXCONN) != -1);
+    LOGI(__FUNCTION__, "INFO", "Listening on %s\n", unix_path);
+    if(use_shm && (shm_init() != 0)) {
+      return 1;
+    }
+  }
+
   LOGI(__FUNCTION__, "INFO", "Setting up libusb for CAN socket...\n");
   const struct libusb_version * ver = NULL;
   LOGI(__FUNCTION__, "INFO", "LIBUSB_API_VERSION = %08x\n", LIBUSB_API_VERSION);
@@ -1318,153 +4778,103 @@ int main(int argc, char *argv[]) {
   libusb_set_debug(NULL, LIBUSB_LOG_LEVEL_DEBUG);
   //libusb_set_debug(NULL, LIBUSB_LOG_LEVEL_INFO);
 
-  libusb_device **list;
-  ssize_t cnt = libusb_get_device_list(NULL, &list);
-  if (cnt < 0) LOGI(__FUNCTION__, "INFO", "ERROR: failed to get device list (cnt = %ld)\n", cnt);
-  LOGI(__FUNCTION__, "INFO", "%ld USB devices found.\n", cnt);
-  LOGI(__FUNCTION__, "INFO", "USB Devices found:\n");
-
-  // This is where we build out list of device that we are looking for.
-  libusb_device* validdevices[cnt];
-  int devCnt = 0;
-  for (ssize_t i = 0; i < cnt; i++) {
-    libusb_device *dev = list[i];
-    struct libusb_device_descriptor desc;
-    int r = libusb_get_device_descriptor(dev, &desc);
-    if (r < 0) LOGI(__FUNCTION__, "ERROR", "failed to get device descriptor (r = %d)\n", r);
-    if(((USB_VENDOR_ID_GS_USB_1 == desc.idVendor) && (USB_PRODUCT_ID_GS_USB_1 == desc.idProduct))
-      || ((USB_VENDOR_ID_CANDLELIGHT == desc.idVendor) && (USB_PRODUCT_ID_CANDLELIGHT == desc.idProduct))
-      || ((USB_VENDOR_ID_CES_CANEXT_FD == desc.idVendor) && (USB_PRODUCT_ID_CES_CANEXT_FD == desc.idProduct))
-      || ((USB_VENDOR_ID_ABE_CANDEBUGGER_FD == desc.idVendor) && (USB_PRODUCT_ID_ABE_CANDEBUGGER_FD == desc.idProduct))) {
-      LOGI(__FUNCTION__, "INFO", "%2ld Vendor ID: %i (0x%04x), Product ID: %i (0x%04x), Manufacturer: %i, Product: %i, Serial: %i *** DEVICE %i ***\n", i+1, desc.idVendor, desc.idVendor, desc.idProduct, desc.idProduct, desc.iManufacturer, desc.iProduct, desc.iSerialNumber, devCnt);
-      validdevices[devCnt] = dev;
-      devCnt++;
-    } else {
-      LOGI(__FUNCTION__, "INFO", "%2ld Vendor ID: %i (0x%04x), Product ID: %i (0x%04x), Manufacturer: %i, Product: %i, Serial: %i\n", i+1, desc.idVendor, desc.idVendor, desc.idProduct, desc.idProduct, desc.iManufacturer, desc.iProduct, desc.iSerialNumber);
-    }
-  }
-
-  LOGI(__FUNCTION__, "INFO", "Compatible USB to CAN Devices found: %i\n", devCnt);
-
-
-  struct libusb_device_handle *devh = NULL;
-  if(deviceNumber >= devCnt) {
-    LOGE(__FUNCTION__, "INFO", "Unable to open device %i as there are only %i devices. Note: Device numbering starts at 0.\n", deviceNumber, devCnt);
-    exit(1);
-  }
-  LOGI(__FUNCTION__, "INFO", "Attempting to device %i now...\n", deviceNumber);
-  ret = libusb_open(validdevices[deviceNumber], &devh);
-  if(ret != 0) {
-    LOGE(__FUNCTION__, "INFO", "failed to open the device.\n");
+  LOGI(__FUNCTION__, "INFO", "Creating Event Queue...\n");
+  struct reactor reactor;
+  if(reactor_init(&reactor) != 0) {
+    LOGE(__FUNCTION__, "INFO", "ERROR: Unable to create the event queue.\n");
     exit(1);
   }
-  LOGI(__FUNCTION__, "INFO", "Device opened.\n");
-
-  libusb_free_device_list(list, 1);
-
-  int interface = 0;
-  LOGI(__FUNCTION__, "INFO", "Checking if kernel driver is active...\n");
-  if(libusb_kernel_driver_active(devh, interface) == 1) {
-    LOGI(__FUNCTION__, "INFO", "Detaching kernel driver...\n");
-    int ret = libusb_detach_kernel_driver(devh, interface);
-    if(ret < 0) {
-      LOGE(__FUNCTION__, "INFO", "%s: %s Unable to detach.\n", libusb_error_name(ret), libusb_strerror(ret));
-    }
-  }
 
-  LOGI(__FUNCTION__, "INFO", "Claiming interface...\n");
-  ret = libusb_claim_interface(devh, interface);
-  if(ret < 0) {
-    LOGE(__FUNCTION__, "INFO", "%s: %s Unable to claim interface %d.\n", libusb_error_name(ret), libusb_strerror(ret), interface);
+  // Register for hotplug before we look for devices so that we can't miss one being plugged in
+  // in between. Anything that we've already got is ignored when its event comes through.
+  uint8_t hotplug = 0;
+  if(!emulate && (deviceNumber < 0)) {
+    hotplug = (hotplug_register(ctx) == 0);
   }
 
-  LOGI(__FUNCTION__, "INFO", "Getting descriptor...\n");
-  libusb_device* device = libusb_get_device(devh);
-  struct libusb_config_descriptor* descriptor = NULL;
-  if(libusb_get_active_config_descriptor(device, &descriptor) < 0)
-  {
-    LOGE(__FUNCTION__, "INFO", "Failed to get config descriptor\n");
-  }
-  //check for correct endpoints
-  LOGI(__FUNCTION__, "INFO", "Endpoints found:\n");
-  if(descriptor->bNumInterfaces > 0)
-  {
-    struct libusb_interface_descriptor iface = descriptor->interface[0].altsetting[0];
-    for(int i=0; i<iface.bNumEndpoints; ++i) {
-      LOGI(__FUNCTION__, "INFO", " %d (0x%02x),\n", iface.endpoint[i].bEndpointAddress, iface.endpoint[i].bEndpointAddress);
+  // Open all of the devices first and then set them up at the same time, each one takes quite
+  // a few control transfers and most of that is waiting for the device.
+  struct usb2can_can* pending[USB2CAN_MAX_DEVICES];
+  int pending_count = 0;
+  libusb_device **list = NULL;
+  if(emulate) {
+    LOGI(__FUNCTION__, "INFO", "Creating %i emulated device(s)...\n", emulate);
+    for(int i = 0; i < emulate; i++) {
+      pending[pending_count] = create_emu_device(ctx, emu_channels[i], i);
+      if(pending[pending_count] != NULL) {
+        pending_count++;
+      }
+    }
+  } else {
+    ssize_t cnt = libusb_get_device_list(NULL, &list);
+    if (cnt < 0) {
+      LOGI(__FUNCTION__, "INFO", "ERROR: failed to get device list (cnt = %ld)\n", cnt);
+      cnt = 0;
+    }
+    libusb_device* validdevices[cnt + 1];
+    int devCnt = find_usb_devices(list, cnt, validdevices);
+    if(deviceNumber >= devCnt) {
+      LOGE(__FUNCTION__, "INFO", "Unable to open device %i as there are only %i devices. Note: Device numbering starts at 0.\n", deviceNumber, devCnt);
+      exit(1);
     }
+    for(int i = 0; (i < devCnt) && (pending_count < USB2CAN_MAX_DEVICES); i++) {
+      if((deviceNumber >= 0) && (i != deviceNumber)) {
+        continue;
+      }
+      LOGI(__FUNCTION__, "INFO", "Attempting to open device %i now...\n", i);
+      pending[pending_count] = create_usb_device(ctx, validdevices[i]);
+      if(pending[pending_count] != NULL) {
+        pending_count++;
+      }
+    }
+    libusb_free_device_list(list, 1);
   }
 
-  LOGI(__FUNCTION__, "INFO", "libusb_free_config_descriptor()\n");
-  libusb_free_config_descriptor(descriptor);
-
-  LOGI(__FUNCTION__, "INFO", "Creating our CAN context...\n");
-  struct usb2can_can * can = init_usb2can_can(devh);
-  LOGI(__FUNCTION__, "INFO", "CAN context created!\n");
-
-  LOGI(__FUNCTION__, "INFO", "Setting up for comms...\n");
-  ret = port_set_user_id(can);
-  if(ret < 0) {
-    LOGE(__FUNCTION__, "INFO", "ERROR! Unable to set user ID.\n");
-    exit(1);
-  }
-  ret = port_set_host_format(can);
-  if(ret < 0) {
-    LOGE(__FUNCTION__, "INFO", "ERROR! Unable to set host format.\n");
-    exit(1);
-  }
-  ret = port_get_device_config(can);
-  if(ret < 0) {
-    fprintf(stderr, "ERROR! Unable to setup2.\n");
-    exit(1);
+  pthread_t threads[USB2CAN_MAX_DEVICES];
+  uint8_t threaded[USB2CAN_MAX_DEVICES];
+  for(int i = 0; i < pending_count; i++) {
+    threaded[i] = (pthread_create(&threads[i], NULL, setup_device_thread, pending[i]) == 0);
+    if(!threaded[i]) {
+      LOGE(__FUNCTION__, "INFO", "Unable to create a thread, setting the device up now.\n");
+    }
   }
-  ret = port_get_bit_timing(can);
-  if(ret < 0) {
-    LOGE(__FUNCTION__, "INFO", "ERROR! Unable to get bit timing.\n");
-    exit(1);
+  for(int i = 0; i < pending_count; i++) {
+    void* result;
+    if(threaded[i]) {
+      pthread_join(threads[i], &result);
+    } else {
+      result = setup_device_thread(pending[i]);
+    }
+    if(((intptr_t)result < 0) || (attach_device(&reactor, pending[i]) != 0)) {
+      close_device(pending[i]);
+    }
   }
-
-  ret = set_bitrate(can);
-  if(ret < 0) {
-    LOGE(__FUNCTION__, "INFO", "ERROR! Unable to set bitrate.\n");
+  if((find_device(0) == NULL) && !hotplug) {
+    LOGE(__FUNCTION__, "INFO", "ERROR! No devices to use.\n");
     exit(1);
   }
 
-  LOGI(__FUNCTION__, "INFO", "Opening port...\n");
-  ret = port_open(devh);
-  if(ret < 0) {
-    LOGE(__FUNCTION__, "INFO", "ERROR! Unable to open port.\n");
-    exit(1);
+  assert(-1 != reactor_add(&reactor, sock, REACTOR_READ, NULL));
+  if(unix_sock != -1) {
+    assert(-1 != reactor_add(&reactor, unix_sock, REACTOR_READ, NULL));
   }
-  LOGI(__FUNCTION__, "INFO", "USB to CAN device is connected!\n");
-
-  LOGI(__FUNCTION__, "INFO", "Creating Event Queue...\n");
-  int kq = kqueue();
-  struct kevent evSet;
-
-  EV_SET(&evSet, sock, EVFILT_READ, EV_ADD, 0, 0, NULL);
-  assert(-1 != kevent(kq, &evSet, 1, NULL, 0, NULL));
 
   LOGI(__FUNCTION__, "INFO", "Starting main program loop...\n");
-  processing_loop(kq, sock, can, ctx);
-
-  ret = port_close(devh);
-  if(ret < 0) {
-    LOGE(__FUNCTION__, "INFO", "ERROR! Unable to close port.\n");
-  }
-
-  ret = libusb_attach_kernel_driver(devh, interface);
-  if(ret < 0) {
-    LOGE(__FUNCTION__, "INFO", "%s: %s Unable to reattach existing driver.\n", libusb_error_name(ret), libusb_strerror(ret));
+  processing_loop(&reactor, sock, unix_sock, emulate ? NULL : ctx, hotplug);
+  if(unix_sock != -1) {
+    close(unix_sock);
+    unlink(unix_path);
   }
+  shm_close();
 
-  if(devh != NULL) {
-    libusb_close(devh);
-    LOGI(__FUNCTION__, "INFO", "Device closed.\n");
+  for(int d = 0; d < USB2CAN_MAX_DEVICES; d++) {
+    if(devices[d] != NULL) {
+      detach_device(&reactor, devices[d]);
+    }
   }
 
+  reactor_close(&reactor);
   LOGI(__FUNCTION__, "INFO", "Trying libusb_exit...\n");
   libusb_exit(ctx);
   return ret;
 }
-
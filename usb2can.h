@@ -4,11 +4,14 @@
 // Max payload & DLC definitions accroding to ISO 11898-1
 #define CAN_MAX_DLEN	8
 #define CAN_MAX_DLC		8 	// Note DLC is NOT the same as DLEN. CANFD uses short codes to define lengths of 
+#define CANFD_MAX_DLEN	64
+#define CANFD_MAX_DLC	15	// 9 to 15 mean 12, 16, 20, 24, 32, 48 and 64 bytes, see can_fd_dlc2len()
 
 // Special address flags for the CAN_ID
 #define CAN_EFF_FLAG	0x80000000U	// EFF/SFF (extended frame format or standard frame format)
 #define CAN_RTR_FLAG	0x40000000U	// Remote Transmission Request
 #define CAN_ERR_FLAG	0x20000000U	// Error message frame
+#define CAN_INV_FILTER	0x20000000U	// In a filter's can_id: let through the frames that don't match (see USB2CAN_CTRL_FILTER)
 
 // Valid bits in the CAN_ID for frame formats
 #define CAN_SFF_MASK	0x000007FFU	// Standard Frame Format (SFF)
@@ -97,9 +100,269 @@ struct can_frame {
 	canid_t	can_id;	// 32-bit CAN_ID + EFF/RTR/ERR flags
 	uint8_t	len;	// frame payload length in bytes (0 to CAN_MAX_DLEN)
 	uint8_t	__pad;	// padding
-	uint8_t	__res0;	// reserved / padding
-	uint8_t	__res1;	// reserved / padding
+	uint8_t	channel;	// The channel (bus) on the device that the frame was received on or is to be sent on
+	uint8_t	msg_flags;	// usb2can message flags (USB2CAN_MSG_*), 0 for a plain CAN frame
 	uint8_t	data[CAN_MAX_DLEN] __attribute__((aligned(8)));
 };
 
+// A CAN FD frame. It's laid out like a can_frame, which is why can_frame has __pad, so the
+// two can be told apart by flags. Only used by connections that have asked for CAN FD with
+// USB2CAN_CTRL_FD, they then send and receive every message (including classic CAN frames
+// and control messages) as a struct canfd_frame.
+struct canfd_frame {
+	canid_t	can_id;	// 32-bit CAN_ID + EFF/RTR/ERR flags
+	uint8_t	len;	// frame payload length in bytes (0 to CANFD_MAX_DLEN), one that a DLC can encode, see can_fd_len2dlc()
+	uint8_t	flags;	// CANFD_* flags
+	uint8_t	channel;	// As for can_frame
+	uint8_t	msg_flags;	// As for can_frame
+	uint8_t	data[CANFD_MAX_DLEN] __attribute__((aligned(8)));
+};
+
+// canfd_frame.flags
+#define CANFD_BRS	0x01	// Bit Rate Switch, the data is sent at the data phase bitrate
+#define CANFD_ESI	0x02	// Error State Indicator of the transmitting node
+#define CANFD_FDF	0x04	// It's a CAN FD frame, otherwise it's a classic CAN frame (len <= 8)
+
+// The size of each message on the wire.
+#define CAN_MTU		(sizeof(struct can_frame))
+#define CANFD_MTU	(sizeof(struct canfd_frame))
+
+// CAN FD lengths from the DLC, DLCs above 8 don't map directly on to the length.
+static inline uint8_t can_fd_dlc2len(uint8_t dlc) {
+	static const uint8_t dlc2len[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64 };
+	return dlc2len[dlc & 0x0F];
+}
+
+// The DLC for a CAN FD length. Lengths that a DLC can't encode are rounded up to the next
+// one that it can, the frame then gets padded with zeros.
+static inline uint8_t can_fd_len2dlc(uint8_t len) {
+	static const uint8_t len2dlc[65] = {
+		0, 1, 2, 3, 4, 5, 6, 7, 8,				// 0 - 8
+		9, 9, 9, 9,								// 9 - 12
+		10, 10, 10, 10,							// 13 - 16
+		11, 11, 11, 11,							// 17 - 20
+		12, 12, 12, 12,							// 21 - 24
+		13, 13, 13, 13, 13, 13, 13, 13,			// 25 - 32
+		14, 14, 14, 14, 14, 14, 14, 14,			// 33 - 40
+		14, 14, 14, 14, 14, 14, 14, 14,			// 41 - 48
+		15, 15, 15, 15, 15, 15, 15, 15,			// 49 - 56
+		15, 15, 15, 15, 15, 15, 15, 15			// 57 - 64
+	};
+	return (len > CANFD_MAX_DLEN) ? CANFD_MAX_DLC : len2dlc[len];
+}
+
+// usb2can message flags (can_frame.msg_flags)
+#define USB2CAN_MSG_CTRL	0x80	// Not a CAN frame but a control message, can_id holds one of enum usb2can_ctrl
+#define USB2CAN_MSG_OWN		0x01	// usb2can -> client: a frame that this connection sent, now that it's been sent (see USB2CAN_CTRL_RECV_OWN_MSGS)
+#define USB2CAN_MSG_HW_TIMESTAMP	0x02	// usb2can -> client, protocol v2 only: the entry's timestamp was taken by the device (see USB2CAN_TIMESTAMP_HW)
+
+// Control messages. These are sent in a struct can_frame (struct canfd_frame on connections
+// that are using CAN FD) with USB2CAN_MSG_CTRL set in msg_flags,
+// the request in can_id and its arguments in len and data. They're how a client changes the
+// options of its connection, and how usb2can sends a client anything that isn't a CAN frame.
+enum usb2can_ctrl {
+	// Client -> usb2can: len = 1 to receive timestamps, 0 to stop.
+	// usb2can -> client: sent immediately before each CAN frame, data holds the time the frame was
+	// received as a uint64_t in nanoseconds on the CLOCK_MONOTONIC timebase and len is one of
+	// USB2CAN_TIMESTAMP_*.
+	USB2CAN_CTRL_TIMESTAMP = 1,
+	// Client -> usb2can: data[0] is a bitmask of the channels to receive frames from, bit 0 is
+	// channel 0. New connections only receive channel 0. Transmitting is unaffected, a frame
+	// goes out on whichever channel it names.
+	// usb2can -> client: the reply, data[0] is the mask that is now in use (only channels that
+	// exist) and data[1] is the number of channels that the device has.
+	USB2CAN_CTRL_SUBSCRIBE = 2,
+	// Client -> usb2can: choose the device that this connection uses, data[0..3] holds its id as
+	// a uint32_t (see usb2can_device_id()), 0 for the default device (the first one attached).
+	// Channel subscriptions are reset to channel 0.
+	// usb2can -> client: the reply, with the same id and len = 1 if the device is attached or
+	// len = 0 if it isn't. It is also sent with len = 0 if the device is unplugged, the binding
+	// remains so that frames flow again as soon as it is plugged back in.
+	USB2CAN_CTRL_BIND = 3,
+	// Client -> usb2can: list the devices, len = 0.
+	// usb2can -> client: one reply per attached device, data[0..3] is its id, data[4] its number
+	// of channels, data[5] is the index of this reply and data[6] is the number of devices.
+	// data[7] is a bitmask of its channels that are running CAN FD.
+	// A single reply with len = 0 means there aren't any.
+	USB2CAN_CTRL_DEVICES = 4,
+	// Client -> usb2can: len = 1 to send and receive struct canfd_frame, 0 to go back to
+	// struct can_frame (the default). Connections that haven't asked for CAN FD never receive
+	// CAN FD frames.
+	// usb2can -> client: the reply, in the new format, len is 1 if the connection is now using
+	// struct canfd_frame and data[0] is a bitmask of the bound device's channels that are
+	// running CAN FD. CAN FD frames can only be sent on those channels.
+	USB2CAN_CTRL_FD = 5,
+	// Client -> usb2can: len = 1 to be told what becomes of each CAN frame that the connection
+	// sends from now on, 0 to stop. The frames are numbered from 0, starting with the first one
+	// sent after this.
+	// usb2can -> client: the reply, with the same len. Then one for each frame, in the order that
+	// they're settled which isn't always the order that they were sent (see Flow Control in the
+	// README). len is one of USB2CAN_TX_*, channel is the frame's channel, data[0..3] is its
+	// number as a uint32_t and data[4..7] is the time from usb2can reading it to the device
+	// confirming it, in microseconds as a uint32_t (0 unless it was confirmed).
+	USB2CAN_CTRL_TX_STATUS = 6,
+	// Client -> usb2can: len = 0 so that the other connections bound to the same device don't
+	// receive the frames that this connection sends, 1 so that they do (the default). Frames that
+	// are already on their way are unaffected. Like SocketCAN's CAN_RAW_LOOPBACK.
+	USB2CAN_CTRL_LOOPBACK = 7,
+	// Client -> usb2can: len = 1 to receive the frames that this connection sends, once the
+	// device has sent them, with USB2CAN_MSG_OWN set in msg_flags. 0 to stop (the default). Like
+	// SocketCAN's CAN_RAW_RECV_OWN_MSGS.
+	USB2CAN_CTRL_RECV_OWN_MSGS = 8,
+	// Client -> usb2can: set up a frame for usb2can to send over and over again, like SocketCAN's
+	// broadcast manager. The next CAN frame that the connection sends isn't sent, it's the frame
+	// that the job sends, jobs are known by its channel and can_id. len is one of USB2CAN_CYCLIC_*:
+	//   USB2CAN_CYCLIC_START: start the job, or restart it if it's already running. The first frame
+	//   goes straight away. data[0..3] is the period in microseconds as a uint32_t, data[4..5] is the
+	//   number of frames to send as a uint16_t (0 for no limit). data[6] can give a byte of the frame
+	//   that holds an alive counter, plus 1 (0 for none), and data[7] the bits of that byte that the
+	//   counter uses (0 for all of them). It goes up by one with every frame that's sent.
+	//   USB2CAN_CYCLIC_UPDATE: the frame's data (and len and flags) replaces the job's, it carries on
+	//   with the same timing.
+	//   USB2CAN_CYCLIC_STOP: stop the job, the frame's data doesn't matter.
+	// Jobs only last as long as the connection. Their frames go to the device that the connection
+	// is bound to when they're started and they follow USB2CAN_CTRL_LOOPBACK and
+	// USB2CAN_CTRL_RECV_OWN_MSGS like any other frame that it sends.
+	// usb2can -> client: sent with len = USB2CAN_CYCLIC_STOP, the job's channel and its can_id in
+	// data[0..3] as a uint32_t when a job stops without being asked to: it's sent all of its frames,
+	// it couldn't be started (no such channel, a period under USB2CAN_CYCLIC_MIN_PERIOD_US or there
+	// are already USB2CAN_CYCLIC_JOBS jobs) or an update was for a job that isn't running.
+	USB2CAN_CTRL_CYCLIC = 9,
+	// Client -> usb2can: move this connection's frames to the shared memory rings (see usb2can's
+	// m option and usb2can_shm.h), only on the Unix domain socket. len is one of USB2CAN_SHM_*.
+	// usb2can -> client: the reply, or a doorbell.
+	USB2CAN_CTRL_SHM = 10,
+	// Client -> usb2can: choose which frames this connection receives, like SocketCAN's CAN_RAW_FILTER
+	// and CAN_RAW_ERR_FILTER. A frame gets through if it matches any of the filters, usb2can checks
+	// them before it sends the frame so frames that nobody wants cost next to nothing. len is one of
+	// USB2CAN_FILTER_*:
+	//   USB2CAN_FILTER_ADD: add a filter to a new list, data[0..3] is its can_id and data[4..7] its
+	//   can_mask as uint32_t. It matches if (frame can_id & can_mask) == (can_id & can_mask), only the
+	//   id and CAN_EFF_FLAG and CAN_RTR_FLAG count. CAN_INV_FILTER in can_id lets through the frames
+	//   that don't match instead. The first one after a USB2CAN_FILTER_SET starts the new list.
+	//   USB2CAN_FILTER_SET: use the new list from now on. With no USB2CAN_FILTER_ADDs it's empty and
+	//   no frames get through.
+	//   USB2CAN_FILTER_ALL: go back to receiving every frame (the default).
+	//   USB2CAN_FILTER_ERR: data[0..3] is a mask of the error classes (CAN_ERR_*) whose error frames
+	//   get through as a uint32_t, the filters don't apply to them. Unlike SocketCAN the default is
+	//   all of them.
+	// usb2can -> client: the reply to USB2CAN_FILTER_SET and USB2CAN_FILTER_ALL, with the same len and
+	// the number of filters now in use in data[0..3] as a uint32_t. A list only holds
+	// USB2CAN_FILTER_MAX, any more are dropped.
+	USB2CAN_CTRL_FILTER = 11,
+	// Client -> usb2can: let the frames for this connection wait for up to data[0..3] microseconds
+	// as a uint32_t (at most USB2CAN_DELAY_MAX_US), so that they're sent in fewer, larger writes.
+	// 0 (the default) sends them as soon as usb2can has dealt with what's come in. They go sooner
+	// once USB2CAN_DELAY_BATCH messages (frames and their timestamps) are waiting, which is as many
+	// as usb2can sends in one go, and anything else that's sent to the connection (a reply, say)
+	// takes the ones before it along with it. Frames that go through the shared memory rings never
+	// wait.
+	// usb2can -> client: the reply, with the delay now in use in data[0..3] as a uint32_t.
+	USB2CAN_CTRL_DELAY = 12,
+	// Client -> usb2can: len is the version of the protocol (USB2CAN_PROTOCOL_*) to use from the
+	// next message on, both ways. In protocol v2 it has to be the last entry in its record.
+	// usb2can -> client: the reply, in the new protocol, with len the version now in use (the old
+	// one if it doesn't know the version that was asked for). When it switches to
+	// USB2CAN_PROTOCOL_V2 a struct usb2can_v2_hello comes first.
+	USB2CAN_CTRL_PROTOCOL = 13,
+};
+
+#define USB2CAN_CYCLIC_STOP		0
+#define USB2CAN_CYCLIC_START	1
+#define USB2CAN_CYCLIC_UPDATE	2
+
+#define USB2CAN_CYCLIC_MIN_PERIOD_US	100		// The shortest period that a cyclic job can have.
+#define USB2CAN_CYCLIC_JOBS				1024	// The most cyclic jobs that can be running, for all of the connections together.
+
+#define USB2CAN_FILTER_ALL		0
+#define USB2CAN_FILTER_ADD		1
+#define USB2CAN_FILTER_SET		2
+#define USB2CAN_FILTER_ERR		3
+#define USB2CAN_FILTER_MAX		512		// The most filters that a connection can have.
+
+#define USB2CAN_DELAY_MAX_US	1000000	// The longest that a connection can have its frames wait, see USB2CAN_CTRL_DELAY.
+#define USB2CAN_DELAY_BATCH		64		// How many messages it takes for them to go without waiting any longer.
+
+#define USB2CAN_PROTOCOL_V1		1	// Each message is a struct can_frame or a struct canfd_frame, the default.
+#define USB2CAN_PROTOCOL_V2		2	// Records of entries, see struct usb2can_v2_record.
+
+#define USB2CAN_TIMESTAMP_HOST	0	// Taken by usb2can when the frame came in from USB
+#define USB2CAN_TIMESTAMP_HW	1	// Taken by the device when the frame was on the bus, converted to our clock
+
+// What became of a frame, the len of a USB2CAN_CTRL_TX_STATUS. They start at 2 so that they can't be mistaken for its reply.
+#define USB2CAN_TX_CONFIRMED	2	// The device has confirmed that the frame was sent
+#define USB2CAN_TX_TIMEOUT		3	// The device didn't confirm it in time. Unless the channel is in one shot mode it may still be sent
+#define USB2CAN_TX_FAILED		4	// It was refused (i.e. no such channel, too long) or never got to the device
+
+// Local clients can connect to a Unix domain socket rather than over TCP (see usb2can's u option).
+// It's a SOCK_SEQPACKET socket so messages arrive whole: each message that a client sends is one
+// frame (or control message) or a batch of up to USB2CAN_SEQPACKET_BATCH of them back to back, and
+// each message that usb2can sends is exactly one.
+#define USB2CAN_UNIX_PATH		"/var/run/usb2can.sock"	// Where the socket is unless another path is given.
+#define USB2CAN_SEQPACKET_BATCH	16		// The most frames (or control messages) that a client can send in one message.
+
+// Protocol v2 (see USB2CAN_CTRL_PROTOCOL). Once a connection has switched, usb2can sends a
+// struct usb2can_v2_hello and then both ways everything is records: a struct usb2can_v2_record
+// followed by count entries, each a struct usb2can_v2_entry and then usb2can_v2_data_size() bytes
+// of data, padded with zeros. An entry is a CAN frame, or a control message if USB2CAN_MSG_CTRL is
+// set in msg_flags, with the same fields as a struct canfd_frame, so the rest of this file applies
+// to them unchanged. The differences are that every frame from usb2can carries the time it was
+// received and its number, so there's no USB2CAN_CTRL_TIMESTAMP before it, and that CAN FD frames
+// don't need USB2CAN_CTRL_FD to be sent (though they still need it to be received). Over TCP the
+// records follow one another, on the Unix domain socket each message is a record. Everything
+// is little endian.
+#define USB2CAN_V2_MAGIC		0x32433255U	// "U2C2"
+#define USB2CAN_V2_MAX_ENTRIES	64		// The most entries in a record.
+
+/// @brief The first thing that usb2can sends in protocol v2.
+struct usb2can_v2_hello {
+	uint32_t magic;			// USB2CAN_V2_MAGIC
+	uint16_t version;		// USB2CAN_PROTOCOL_V2
+	uint16_t hello_size;	// sizeof(struct usb2can_v2_hello), later versions may add to it
+	uint16_t record_size;	// sizeof(struct usb2can_v2_record)
+	uint16_t entry_size;	// sizeof(struct usb2can_v2_entry)
+	uint16_t max_entries;	// USB2CAN_V2_MAX_ENTRIES, for both ways
+	uint16_t reserved;
+};
+
+/// @brief The start of a record, its entries follow.
+struct usb2can_v2_record {
+	uint32_t size;		// The size of the record in bytes, this included
+	uint16_t count;		// The number of entries, up to USB2CAN_V2_MAX_ENTRIES
+	uint16_t reserved;
+};
+
+/// @brief The start of an entry in a record, its data follows.
+struct usb2can_v2_entry {
+	uint64_t timestamp;	// usb2can -> client: when a frame was received, as USB2CAN_CTRL_TIMESTAMP. 0 for control messages and from clients
+	uint64_t seq;		// usb2can -> client: each device's frames are numbered from 1 in the order that usb2can receives them (echoes
+						// included), so a gap is frames that this connection didn't get (filtered out, another channel or dropped). 0 as timestamp
+	canid_t	can_id;
+	uint8_t	len;
+	uint8_t	flags;		// CANFD_*
+	uint8_t	channel;
+	uint8_t	msg_flags;	// USB2CAN_MSG_*
+};
+
+// The size of the data after an entry: len rounded up to a multiple of 8 for a frame, always 8 for
+// a control message (its len isn't a length).
+static inline uint32_t usb2can_v2_data_size(const struct usb2can_v2_entry* e) {
+	return (e->msg_flags & USB2CAN_MSG_CTRL) ? CAN_MAX_DLEN : ((e->len + 7U) & ~7U);
+}
+
+#define USB2CAN_V2_ENTRY_MAX	(sizeof(struct usb2can_v2_entry) + CANFD_MAX_DLEN)	// The biggest an entry can be, data included.
+#define USB2CAN_V2_RECORD_MAX	(sizeof(struct usb2can_v2_record) + (USB2CAN_V2_MAX_ENTRIES * USB2CAN_V2_ENTRY_MAX))
+
+// The id of a device, from its USB serial number. It stays the same whichever USB port the
+// device is plugged into and whatever order devices are found in. usb2can logs the serial
+// number and id of each device as it is attached. (32-bit FNV-1a, never 0.)
+static inline uint32_t usb2can_device_id(const char* serial) {
+	uint32_t id = 2166136261U;
+	while(*serial != '\0') {
+		id ^= (uint8_t)*serial++;
+		id *= 16777619U;
+	}
+	return (id == 0) ? 1 : id;
+}
+
 #endif	// __USB2CAN_H__
\ No newline at end of file
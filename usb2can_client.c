@@ -0,0 +1,629 @@
+// usb2can_client.c
+//
+// The client library, see usb2can_client.h.
+//
+// Everything that comes in is turned into a struct canfd_frame as soon as it's read, which is when
+// we look at the control messages to keep track of what the connection is doing, and kept in rx
+// until it's handed out. Over TCP the bytes are put back together in raw first, the stream can
+// split a message anywhere. The reply to a USB2CAN_CTRL_FD is the first message in the new format
+// so its len says how big it is, everything after it is that size too.
+
+#define _GNU_SOURCE   // recvmmsg() on Linux
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "usb2can_client.h"
+#include "utils/timestamp.h"
+#include "utils/canfilter.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// The size of the header that says what a message is, can_id to msg_flags.
+#define CLIENT_HEADER (offsetof(struct can_frame, data))
+
+static void client_init(struct usb2can_client* c, int fd, uint8_t seqpacket) {
+  memset(c, 0, sizeof(*c));
+  c->fd = fd;
+  c->seqpacket = seqpacket;
+  c->channels = 0x01;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+int usb2can_client_open_tcp(struct usb2can_client* c, const char* host, int port) {
+  struct addrinfo hints;
+  struct addrinfo* list;
+  char service[16];
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(service, sizeof(service), "%i", port);
+  if(getaddrinfo(host, service, &hints, &list) != 0) {
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+  int fd = -1;
+  for(struct addrinfo* ai = list; (ai != NULL) && (fd < 0); ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if((fd >= 0) && (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0)) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(list);
+  if(fd < 0) {
+    return -1;
+  }
+  // We batch the frames up ourselves, waiting for more only delays them.
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  client_init(c, fd, 0);
+  return 0;
+}
+
+int usb2can_client_open_unix(struct usb2can_client* c, const char* path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  if(path == NULL) {
+    path = USB2CAN_UNIX_PATH;
+  }
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+#ifndef __linux__
+  addr.sun_len = SUN_LEN(&addr);
+#endif
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if(fd < 0) {
+    return -1;
+  }
+  if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  client_init(c, fd, 1);
+  return 0;
+}
+
+static void shm_unmap(struct usb2can_client* c) {
+  if(c->shm != NULL) {
+    munmap(c->shm, sizeof(struct usb2can_shm));
+  }
+  c->shm = NULL;
+  c->ring = NULL;
+}
+
+void usb2can_client_close(struct usb2can_client* c) {
+  shm_unmap(c);
+  free(c->filter);
+  c->filter = NULL;
+  if(c->fd >= 0) {
+    close(c->fd);
+  }
+  c->fd = -1;
+}
+
+// How much of timeout_ms is left, having started at start. -1 is forever.
+static int time_left(int timeout_ms, uint64_t start) {
+  if(timeout_ms < 0) {
+    return -1;
+  }
+  uint64_t spent = millis() - start;
+  return (spent >= (uint64_t)timeout_ms) ? 0 : (int)(timeout_ms - spent);
+}
+
+// Wait for the socket. Returns -1 on an error, otherwise we've either waited long enough or it's ready.
+static int client_wait(struct usb2can_client* c, short events, int timeout_ms) {
+  struct pollfd p = { .fd = c->fd, .events = events, .revents = 0 };
+  int ret = poll(&p, 1, timeout_ms);
+  return ((ret < 0) && (errno != EINTR)) ? -1 : 0;
+}
+
+// Use the shared memory that came with a USB2CAN_SHM_ATTACH.
+static int shm_map(struct usb2can_client* c, int fd, struct canfd_frame* reply) {
+  if((fd < 0) || (c->shm != NULL)) {
+    return (c->shm != NULL) ? 0 : -1;
+  }
+  void* p = mmap(NULL, sizeof(struct usb2can_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED) {
+    return -1;
+  }
+  struct usb2can_shm* shm = (struct usb2can_shm*)p;
+  uint32_t index;
+  memcpy(&index, &reply->data[0], sizeof(index));
+  if((shm->magic != USB2CAN_SHM_MAGIC) || (shm->version != USB2CAN_SHM_VERSION) || (shm->rx_slots != USB2CAN_SHM_RX_SLOTS) ||
+     (shm->tx_slots != USB2CAN_SHM_TX_SLOTS) || (index >= shm->clients) || (index >= USB2CAN_SHM_CLIENTS)) {
+    munmap(p, sizeof(struct usb2can_shm));
+    return -1;
+  }
+  c->shm = shm;
+  c->ring = &shm->tx[index];
+  c->cursor = c->ring->rx_start;
+  memcpy(&c->conn, &reply->data[4], sizeof(c->conn));
+  return 0;
+}
+
+// Keep track of what the connection is doing from what usb2can sends it. fd is a file descriptor
+// that came with the message, or -1. Returns 0 for the messages that were only for us.
+static int client_received(struct usb2can_client* c, struct canfd_frame* frame, int fd) {
+  if(!(frame->msg_flags & USB2CAN_MSG_CTRL)) {
+    return 1;
+  }
+  switch(frame->can_id) {
+    case USB2CAN_CTRL_FD:
+      c->rx_fd_frames = (frame->len != 0);
+      break;
+    case USB2CAN_CTRL_SUBSCRIBE:
+      c->channels = frame->data[0];
+      break;
+    case USB2CAN_CTRL_SHM:
+      if(frame->len == USB2CAN_SHM_DOORBELL) {
+        return 0;
+      }
+      if(frame->len == USB2CAN_SHM_ATTACH) {
+        // If we can't use it then it's as good as refused.
+        if(shm_map(c, fd, frame) != 0) {
+          frame->len = USB2CAN_SHM_DETACH;
+        }
+      } else {
+        shm_unmap(c);
+      }
+      break;
+  }
+  return 1;
+}
+
+// Keep track of what the connection is doing from what we send usb2can.
+static void client_sent(struct usb2can_client* c, const struct canfd_frame* frame) {
+  if(!(frame->msg_flags & USB2CAN_MSG_CTRL)) {
+    return;
+  }
+  switch(frame->can_id) {
+    case USB2CAN_CTRL_FD:
+      // Everything after it is in the new format.
+      c->tx_fd_frames = (frame->len != 0);
+      break;
+    case USB2CAN_CTRL_TIMESTAMP:
+      c->timestamps = (frame->len != 0);
+      break;
+    case USB2CAN_CTRL_RECV_OWN_MSGS:
+      c->recv_own = (frame->len != 0);
+      break;
+    case USB2CAN_CTRL_BIND:
+      memcpy(&c->device, frame->data, sizeof(c->device));
+      c->channels = 0x01;
+      break;
+    case USB2CAN_CTRL_FILTER: {
+      // The same filters as usb2can, for the frames in the shared memory.
+      if(c->filter == NULL) {
+        c->filter = malloc(sizeof(struct canfilter));
+        if(c->filter == NULL) {
+          break;
+        }
+        canfilter_init(c->filter);
+      }
+      uint32_t id, mask;
+      memcpy(&id, frame->data, sizeof(id));
+      memcpy(&mask, &frame->data[4], sizeof(mask));
+      if(frame->len == USB2CAN_FILTER_ADD) {
+        canfilter_add(c->filter, id, mask);
+      } else if(frame->len == USB2CAN_FILTER_SET) {
+        canfilter_set(c->filter);
+      } else if(frame->len == USB2CAN_FILTER_ALL) {
+        canfilter_all(c->filter);
+      } else if(frame->len == USB2CAN_FILTER_ERR) {
+        canfilter_err(c->filter, id);
+      }
+      break;
+    }
+  }
+}
+
+// Add a message that we've received to rx, size bytes of it.
+static void rx_add(struct usb2can_client* c, const void* msg, size_t size, int fd) {
+  struct canfd_frame* frame = &c->rx[c->rx_pos + c->rx_count];
+  memset(frame, 0, sizeof(*frame));
+  memcpy(frame, msg, (size < CANFD_MTU) ? size : CANFD_MTU);
+  if(size <= CAN_MTU) {
+    frame->flags = 0;  // It's a struct can_frame, this is its __pad.
+  }
+  c->rx_count += client_received(c, frame, fd);
+}
+
+// The size of the message at the start of raw, 0 if we haven't got all of it yet.
+static size_t raw_message(struct usb2can_client* c) {
+  if((c->raw_len - c->raw_pos) < CLIENT_HEADER) {
+    return 0;
+  }
+  struct can_frame header;
+  memcpy(&header, &c->raw[c->raw_pos], CLIENT_HEADER);
+  size_t size = c->rx_fd_frames ? CANFD_MTU : CAN_MTU;
+  if((header.msg_flags & USB2CAN_MSG_CTRL) && (header.can_id == USB2CAN_CTRL_FD)) {
+    size = (header.len != 0) ? CANFD_MTU : CAN_MTU;
+  }
+  return ((c->raw_len - c->raw_pos) < size) ? 0 : size;
+}
+
+// Read what there is on a TCP connection, one recv() for as much as we've got room for.
+static int read_stream(struct usb2can_client* c) {
+  if(c->raw_pos > 0) {
+    memmove(c->raw, &c->raw[c->raw_pos], c->raw_len - c->raw_pos);
+    c->raw_len -= c->raw_pos;
+    c->raw_pos = 0;
+  }
+  if(!c->eof && (c->raw_len < sizeof(c->raw))) {
+    ssize_t ret = recv(c->fd, &c->raw[c->raw_len], sizeof(c->raw) - c->raw_len, 0);
+    if(ret == 0) {
+      c->eof = 1;
+    } else if(ret > 0) {
+      c->raw_len += ret;
+    } else if((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+      return -1;
+    }
+  }
+  // Pick out the whole messages.
+  size_t size;
+  while(((c->rx_pos + c->rx_count) < USB2CAN_CLIENT_BUF_FRAMES) && ((size = raw_message(c)) > 0)) {
+    rx_add(c, &c->raw[c->raw_pos], size, -1);
+    c->raw_pos += size;
+  }
+  return 0;
+}
+
+// Read what there is on the Unix domain socket, one recvmmsg() for as many messages as we've got room for.
+static int read_seqpacket(struct usb2can_client* c) {
+  struct canfd_frame frames[USB2CAN_CLIENT_BUF_FRAMES];
+  struct mmsghdr msgs[USB2CAN_CLIENT_BUF_FRAMES];
+  struct iovec iov[USB2CAN_CLIENT_BUF_FRAMES];
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control[USB2CAN_CLIENT_BUF_FRAMES];
+  int room = USB2CAN_CLIENT_BUF_FRAMES - (c->rx_pos + c->rx_count);
+  if(c->eof || (room <= 0)) {
+    return 0;
+  }
+  memset(msgs, 0, room * sizeof(msgs[0]));
+  for(int m = 0; m < room; m++) {
+    iov[m].iov_base = &frames[m];
+    iov[m].iov_len = sizeof(frames[m]);
+    msgs[m].msg_hdr.msg_iov = &iov[m];
+    msgs[m].msg_hdr.msg_iovlen = 1;
+    msgs[m].msg_hdr.msg_control = control[m].buf;
+    msgs[m].msg_hdr.msg_controllen = sizeof(control[m].buf);
+  }
+  int got = recvmmsg(c->fd, msgs, room, 0, NULL);
+  if(got < 0) {
+    return ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) ? 0 : -1;
+  }
+  for(int m = 0; m < got; m++) {
+    int fd = -1;
+    struct msghdr* hdr = &msgs[m].msg_hdr;
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+      if((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+      }
+    }
+    if(msgs[m].msg_len == 0) {
+      c->eof = 1;
+    } else if(msgs[m].msg_len >= CLIENT_HEADER) {
+      rx_add(c, &frames[m], msgs[m].msg_len, fd);
+    }
+    // Once it's mapped we don't need it.
+    if(fd >= 0) {
+      close(fd);
+    }
+  }
+  return 0;
+}
+
+static int client_read(struct usb2can_client* c) {
+  if(c->rx_pos > 0) {
+    memmove(c->rx, &c->rx[c->rx_pos], c->rx_count * sizeof(struct canfd_frame));
+    c->rx_pos = 0;
+  }
+  return c->seqpacket ? read_seqpacket(c) : read_stream(c);
+}
+
+// Pick out the frames that the connection would have been sent from the shared memory rx ring.
+static int shm_read(struct usb2can_client* c, struct canfd_frame* frames, int max) {
+  int n = 0;
+  uint64_t head = atomic_load_explicit(&c->shm->rx_head, memory_order_acquire);
+  uint32_t device = (c->device != 0) ? c->device : atomic_load(&c->shm->default_device);
+  while((c->cursor < head) && (n < max)) {
+    struct usb2can_shm_rx_slot* slot = &c->shm->rx[c->cursor % USB2CAN_SHM_RX_SLOTS];
+    uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    struct canfd_frame frame;
+    memcpy(&frame, &slot->frame, sizeof(frame));
+    uint64_t timestamp = slot->timestamp;
+    uint32_t from = slot->device;
+    uint32_t conn = slot->conn;
+    uint8_t timestamp_source = slot->timestamp_source;
+    uint8_t loopback = slot->loopback;
+    atomic_thread_fence(memory_order_acquire);
+    if((seq != c->cursor + 1) || (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)) {
+      // It's been overwritten, carry on from the oldest frame that's still there. The one after
+      // that is the slot that's being written now.
+      head = atomic_load_explicit(&c->shm->rx_head, memory_order_acquire);
+      uint64_t oldest = (head >= USB2CAN_SHM_RX_SLOTS) ? head - USB2CAN_SHM_RX_SLOTS + 1 : c->cursor + 1;
+      if(oldest <= c->cursor) {
+        oldest = c->cursor + 1;
+      }
+      c->lost += oldest - c->cursor;
+      c->cursor = oldest;
+      continue;
+    }
+
+    uint8_t own = (conn == c->conn);
+    if((from != device) || !(c->channels & (1 << frame.channel)) || ((frame.flags & CANFD_FDF) && !c->rx_fd_frames) ||
+       (own ? !c->recv_own : ((conn != 0) && !loopback)) || ((c->filter != NULL) && !canfilter_match(c->filter, frame.can_id))) {
+      c->cursor++;
+      continue;
+    }
+    if(c->timestamps) {
+      if((n + 2) > max) {
+        break;  // It has to go with its timestamp.
+      }
+      struct canfd_frame* ts = &frames[n++];
+      memset(ts, 0, sizeof(*ts));
+      ts->can_id = USB2CAN_CTRL_TIMESTAMP;
+      ts->msg_flags = USB2CAN_MSG_CTRL;
+      ts->len = timestamp_source;
+      memcpy(ts->data, &timestamp, sizeof(timestamp));
+    }
+    if(own) {
+      frame.msg_flags |= USB2CAN_MSG_OWN;
+    }
+    frames[n++] = frame;
+    c->cursor++;
+  }
+  return n;
+}
+
+// Put as many frames as there's room for into the shared memory tx ring.
+static int shm_write(struct usb2can_client* c, const struct canfd_frame* frames, int count) {
+  uint32_t head = atomic_load_explicit(&c->ring->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&c->ring->tail, memory_order_acquire);
+  int n = 0;
+  while((n < count) && ((uint32_t)(head - tail) < USB2CAN_SHM_TX_SLOTS)) {
+    memcpy(&c->ring->slots[head % USB2CAN_SHM_TX_SLOTS], &frames[n], sizeof(struct canfd_frame));
+    client_sent(c, &frames[n]);
+    head++;
+    n++;
+  }
+  if(n == 0) {
+    return 0;
+  }
+  atomic_store_explicit(&c->ring->head, head, memory_order_release);
+  // Pairs with usb2can setting sleeping and then looking at the rings again.
+  atomic_thread_fence(memory_order_seq_cst);
+  if(atomic_load(&c->shm->sleeping)) {
+    struct canfd_frame bell;
+    memset(&bell, 0, sizeof(bell));
+    bell.can_id = USB2CAN_CTRL_SHM;
+    bell.msg_flags = USB2CAN_MSG_CTRL;
+    bell.len = USB2CAN_SHM_DOORBELL;
+    // If the socket's full then usb2can has plenty to wake it up already.
+    send(c->fd, &bell, c->tx_fd_frames ? CANFD_MTU : CAN_MTU, MSG_NOSIGNAL);
+  }
+  return n;
+}
+
+// Send what's in tx_buf, as much as the socket will take.
+static int client_write(struct usb2can_client* c) {
+  while(c->tx_pos < c->tx_len) {
+    ssize_t ret = send(c->fd, &c->tx_buf[c->tx_pos], c->tx_len - c->tx_pos, MSG_NOSIGNAL);
+    if(ret < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+    }
+    c->tx_pos += ret;
+  }
+  c->tx_pos = 0;
+  c->tx_len = 0;
+  return 0;
+}
+
+// Put frames into tx_buf in the connection's format, as many as there's room for. On the Unix
+// domain socket tx_buf is one message, up to USB2CAN_SEQPACKET_BATCH frames.
+static int client_encode(struct usb2can_client* c, const struct canfd_frame* frames, int count) {
+  if(c->seqpacket && (c->tx_len > 0)) {
+    return 0;
+  }
+  if(c->tx_pos > 0) {
+    memmove(c->tx_buf, &c->tx_buf[c->tx_pos], c->tx_len - c->tx_pos);
+    c->tx_len -= c->tx_pos;
+    c->tx_pos = 0;
+  }
+  int n = 0;
+  while((n < count) && (!c->seqpacket || (n < USB2CAN_SEQPACKET_BATCH))) {
+    size_t size = c->tx_fd_frames ? CANFD_MTU : CAN_MTU;
+    if((c->tx_len + size) > sizeof(c->tx_buf)) {
+      break;
+    }
+    memcpy(&c->tx_buf[c->tx_len], &frames[n], size);
+    if(size == CAN_MTU) {
+      c->tx_buf[c->tx_len + offsetof(struct can_frame, __pad)] = 0;
+    }
+    c->tx_len += size;
+    client_sent(c, &frames[n]);
+    n++;
+  }
+  return n;
+}
+
+// Whether the library can follow the connection through a control message. It only speaks
+// USB2CAN_PROTOCOL_V1, once usb2can has switched to records it can't read a thing.
+static int client_supported(const struct canfd_frame* frame) {
+  return !(frame->msg_flags & USB2CAN_MSG_CTRL) || (frame->can_id != USB2CAN_CTRL_PROTOCOL) || (frame->len == USB2CAN_PROTOCOL_V1);
+}
+
+int usb2can_client_send(struct usb2can_client* c, const struct canfd_frame* frames, int count, int timeout_ms) {
+  for(int k = 0; k < count; k++) {
+    if(!client_supported(&frames[k])) {
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+  }
+  uint64_t start = millis();
+  int n = 0;
+  while(1) {
+    // Anything that was on its way over the socket before we moved to the rings has to go first.
+    if(client_write(c) != 0) {
+      return (n > 0) ? n : -1;
+    }
+    if((c->shm != NULL) && (c->tx_len == 0)) {
+      n += shm_write(c, &frames[n], count - n);
+    } else {
+      n += client_encode(c, &frames[n], count - n);
+      if(client_write(c) != 0) {
+        return (n > 0) ? n : -1;
+      }
+    }
+    if(n == count) {
+      return n;
+    }
+    int left = time_left(timeout_ms, start);
+    if(left == 0) {
+      return n;
+    }
+    if((c->shm != NULL) && (c->tx_len == 0)) {
+      // Wait for usb2can to make room in the ring. Whatever else comes in meanwhile is kept for
+      // usb2can_client_recv(), unless there's no more room for it.
+      if((client_read(c) != 0) || c->eof || ((c->rx_pos + c->rx_count) >= USB2CAN_CLIENT_BUF_FRAMES)) {
+        return n;
+      }
+      atomic_store(&c->ring->waiting, 1);
+      atomic_thread_fence(memory_order_seq_cst);
+      uint32_t used = atomic_load(&c->ring->head) - atomic_load(&c->ring->tail);
+      if((used < USB2CAN_SHM_TX_SLOTS) || (client_wait(c, POLLIN, left) != 0)) {
+        continue;
+      }
+    } else if(client_wait(c, POLLOUT, left) != 0) {
+      return n;
+    }
+  }
+}
+
+int usb2can_client_ctrl(struct usb2can_client* c, uint32_t request, uint8_t len, const void* data, size_t size, int timeout_ms) {
+  struct canfd_frame frame;
+  memset(&frame, 0, sizeof(frame));
+  frame.can_id = request;
+  frame.msg_flags = USB2CAN_MSG_CTRL;
+  frame.len = len;
+  memcpy(frame.data, data, (size < sizeof(frame.data)) ? size : sizeof(frame.data));
+  return usb2can_client_send(c, &frame, 1, timeout_ms);
+}
+
+int usb2can_client_flush(struct usb2can_client* c, int timeout_ms) {
+  uint64_t start = millis();
+  while(1) {
+    if(client_write(c) != 0) {
+      return -1;
+    }
+    if(c->tx_len == 0) {
+      return 0;
+    }
+    int left = time_left(timeout_ms, start);
+    if(left == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if(client_wait(c, POLLOUT, left) != 0) {
+      return -1;
+    }
+  }
+}
+
+int usb2can_client_recv(struct usb2can_client* c, struct canfd_frame* frames, int max, int timeout_ms) {
+  uint64_t start = millis();
+  while(1) {
+    // Keep whatever is waiting to be sent moving, it may be what usb2can is waiting for.
+    if(client_write(c) != 0) {
+      return -1;
+    }
+    if(client_read(c) != 0) {
+      return -1;
+    }
+    int n = (c->rx_count < max) ? c->rx_count : max;
+    memcpy(frames, &c->rx[c->rx_pos], n * sizeof(struct canfd_frame));
+    c->rx_pos += n;
+    c->rx_count -= n;
+    if(c->shm != NULL) {
+      n += shm_read(c, &frames[n], max - n);
+    }
+    if(n > 0) {
+      return n;
+    }
+    if(c->eof) {
+      errno = ECONNRESET;
+      return -1;
+    }
+    int left = time_left(timeout_ms, start);
+    if(left == 0) {
+      return 0;
+    }
+    if(!usb2can_client_ready(c) && (client_wait(c, POLLIN, left) != 0)) {
+      return -1;
+    }
+  }
+}
+
+int usb2can_client_attach_shm(struct usb2can_client* c) {
+  if(!c->seqpacket) {
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+  if(c->shm != NULL) {
+    return 0;
+  }
+  if(usb2can_client_ctrl(c, USB2CAN_CTRL_SHM, USB2CAN_SHM_ATTACH, NULL, 0, -1) != 1) {
+    return -1;
+  }
+  return usb2can_client_flush(c, -1);
+}
+
+int usb2can_client_fd(struct usb2can_client* c) {
+  return c->fd;
+}
+
+short usb2can_client_events(struct usb2can_client* c) {
+  return POLLIN | ((c->tx_len > 0) ? POLLOUT : 0);
+}
+
+int usb2can_client_ready(struct usb2can_client* c) {
+  if((c->rx_count > 0) || c->eof || (!c->seqpacket && (raw_message(c) > 0))) {
+    return 1;
+  }
+  if(c->shm != NULL) {
+    // Ask for a doorbell and then make sure that we haven't just missed something.
+    atomic_store(&c->ring->waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if(c->cursor != atomic_load(&c->shm->rx_head)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+uint64_t usb2can_client_lost(struct usb2can_client* c) {
+  return c->lost;
+}
@@ -0,0 +1,113 @@
+// usb2can_client.h
+//
+// A library for talking to usb2can, so that clients don't each have to get the framing right.
+//
+// Frames (and control messages) are always passed in and out as arrays of struct canfd_frame,
+// whichever format the connection is using; classic CAN frames just don't use the rest of it.
+// Over TCP the messages are read and written a buffer at a time and put back together however the
+// stream splits them, on the Unix domain socket they're batched into as few messages (and system
+// calls) as possible. The socket is always non-blocking underneath, timeout_ms says how long a
+// call can wait: 0 not at all and -1 for as long as it takes.
+//
+// To use it from an event loop, watch usb2can_client_fd() for usb2can_client_events() and call
+// usb2can_client_recv() (and usb2can_client_flush()) with a timeout of 0 when it's ready. Call
+// usb2can_client_ready() before waiting, if it returns 1 then there's already something to read.
+//
+// On the Unix domain socket usb2can_client_attach_shm() moves the connection to the shared
+// memory rings (see usb2can_shm.h). Nothing else changes, the library picks out the frames that
+// the connection would have received and makes up the USB2CAN_CTRL_TIMESTAMP before each one if
+// timestamps are on. Use usb2can_client_ctrl() (or usb2can_client_send()) for control messages so
+// that it knows what the connection has asked for.
+//
+// It only speaks USB2CAN_PROTOCOL_V1, a USB2CAN_CTRL_PROTOCOL asking for anything else is refused.
+
+#ifndef __USB2CAN_CLIENT_H__
+#define __USB2CAN_CLIENT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "usb2can.h"
+#include "usb2can_shm.h"
+
+#define USB2CAN_CLIENT_BUF_FRAMES (64) // How many CAN FD frames each of the buffers can hold.
+
+/// @brief A connection to usb2can. Its members are private.
+struct usb2can_client {
+	int fd;
+	uint8_t seqpacket;	// It's the Unix domain socket, each message is whole frames.
+	uint8_t eof;		// usb2can has hung up.
+	uint8_t tx_fd_frames;	// We're sending struct canfd_frame.
+	uint8_t rx_fd_frames;	// We're receiving struct canfd_frame.
+	uint8_t raw[USB2CAN_CLIENT_BUF_FRAMES * CANFD_MTU];	// What we've read over TCP that isn't a whole message yet.
+	size_t raw_pos;
+	size_t raw_len;
+	struct canfd_frame rx[USB2CAN_CLIENT_BUF_FRAMES];	// What we've received but not handed out yet.
+	int rx_pos;
+	int rx_count;
+	uint8_t tx_buf[USB2CAN_CLIENT_BUF_FRAMES * CANFD_MTU];	// What we've been given but not sent yet.
+	size_t tx_pos;
+	size_t tx_len;
+
+	// The shared memory rings, shm is NULL unless they're in use.
+	struct usb2can_shm* shm;
+	struct usb2can_shm_tx_ring* ring;
+	uint64_t cursor;	// The next frame that we want from rx.
+	uint64_t lost;		// How many frames we've missed by falling too far behind.
+	uint32_t conn;		// Our connection number, for usb2can_shm_rx_slot.conn.
+	// What the connection has asked for, to pick out its frames from rx.
+	uint32_t device;
+	uint8_t channels;
+	uint8_t timestamps;
+	uint8_t recv_own;
+	struct canfilter* filter;	// NULL until it asks for anything but every frame (see USB2CAN_CTRL_FILTER).
+};
+
+/// @brief Connect to usb2can over TCP.
+/// @return 0 on success or -1 (check errno).
+extern int usb2can_client_open_tcp(struct usb2can_client* c, const char* host, int port);
+
+/// @brief Connect to usb2can's Unix domain socket, path is USB2CAN_UNIX_PATH if NULL.
+/// @return 0 on success or -1 (check errno).
+extern int usb2can_client_open_unix(struct usb2can_client* c, const char* path);
+
+/// @brief Hang up. Anything that hasn't been sent yet is dropped.
+extern void usb2can_client_close(struct usb2can_client* c);
+
+/// @brief Send count frames (or control messages), waiting for up to timeout_ms for room.
+/// @return How many were taken, which may be less than count if the time ran out, or -1 (check errno,
+/// EOPNOTSUPP if one of them asks for a protocol other than USB2CAN_PROTOCOL_V1 and nothing was sent).
+/// Frames that have been taken are sent as soon as they can be, see usb2can_client_flush().
+extern int usb2can_client_send(struct usb2can_client* c, const struct canfd_frame* frames, int count, int timeout_ms);
+
+/// @brief Send a control message (see enum usb2can_ctrl), size bytes of data.
+/// @return 1 if it was taken, 0 if there wasn't room in time, or -1 (check errno).
+extern int usb2can_client_ctrl(struct usb2can_client* c, uint32_t request, uint8_t len, const void* data, size_t size, int timeout_ms);
+
+/// @brief Send what usb2can_client_send() has taken, waiting for up to timeout_ms.
+/// @return 0 once it's all gone, or -1 (check errno, EAGAIN if the time ran out).
+extern int usb2can_client_flush(struct usb2can_client* c, int timeout_ms);
+
+/// @brief Receive up to max frames (or control messages), waiting for up to timeout_ms for the first.
+/// @return How many there are, 0 if the time ran out, or -1 (check errno, ECONNRESET if usb2can has hung up).
+extern int usb2can_client_recv(struct usb2can_client* c, struct canfd_frame* frames, int max, int timeout_ms);
+
+/// @brief Ask to use the shared memory rings, only on the Unix domain socket. The reply (a
+/// USB2CAN_CTRL_SHM) comes back through usb2can_client_recv() like any other, the rings are
+/// used from then on if its len is USB2CAN_SHM_ATTACH.
+/// @return 0 or -1 (check errno).
+extern int usb2can_client_attach_shm(struct usb2can_client* c);
+
+/// @brief The file descriptor to watch from an event loop.
+extern int usb2can_client_fd(struct usb2can_client* c);
+
+/// @brief What to watch usb2can_client_fd() for, POLLIN and POLLOUT if there's something waiting to be sent.
+extern short usb2can_client_events(struct usb2can_client* c);
+
+/// @brief Call before waiting on usb2can_client_fd().
+/// @return 1 if usb2can_client_recv() already has something, so don't wait, or 0.
+extern int usb2can_client_ready(struct usb2can_client* c);
+
+/// @brief How many frames we've missed because we fell more than USB2CAN_SHM_RX_SLOTS behind in the shared memory.
+extern uint64_t usb2can_client_lost(struct usb2can_client* c);
+
+#endif // __USB2CAN_CLIENT_H__
@@ -0,0 +1,91 @@
+// usb2can_shm.h
+//
+// The shared memory transport (usb2can's m option). Rather than sending every frame it receives to
+// every client, usb2can writes it once into a ring in a shared memory segment and any number of
+// clients read it from there, each at its own pace. Each client also gets a ring of its own to
+// send frames through.
+//
+// A client connects to the Unix domain socket as usual and sends a USB2CAN_CTRL_SHM. The reply has
+// the segment's file descriptor attached (SCM_RIGHTS) and says which of the tx rings is the
+// client's. From then on the frames that it would have received come through rx instead, the
+// replies to its control messages (and its USB2CAN_CTRL_TX_STATUS) still come over the socket.
+//
+// rx: usb2can writes frame n to rx[n % USB2CAN_SHM_RX_SLOTS]. It sets the slot's seq to 0 while
+// it writes it and to n + 1 once it's done, and then sets rx_head to n + 1. A client keeps its own
+// cursor, the number of the next frame that it wants, starting at its tx ring's rx_start. If the
+// slot's seq isn't cursor + 1, before and after the client copies the frame out, then it has been
+// overwritten: the client has fallen more than USB2CAN_SHM_RX_SLOTS behind and lost the frames up
+// to rx_head - USB2CAN_SHM_RX_SLOTS. Every frame from every device is in rx, the client picks out
+// the ones that it wants the same way that usb2can would for its socket (device, channels, CAN FD,
+// loopback and own messages).
+//
+// tx: the client writes a frame to its ring's slots[head % USB2CAN_SHM_TX_SLOTS] and then moves
+// head on, usb2can takes them from tail. Control messages go the same way, so that they stay in
+// order with the frames (i.e. USB2CAN_CTRL_CYCLIC), and they're always a struct canfd_frame.
+//
+// Nobody spins waiting for anyone else. A client that wants to wait sets its ring's waiting, looks
+// at the rings again in case it just missed something, and then waits for its socket to be
+// readable. Once there's something new in rx, or room in its tx ring, usb2can clears waiting and
+// sends it a USB2CAN_CTRL_SHM with len USB2CAN_SHM_DOORBELL. It works the same the other way:
+// usb2can sets sleeping before it waits, and a client that has just written to its tx ring and
+// finds sleeping set sends usb2can a USB2CAN_SHM_DOORBELL.
+//
+// Anyone who can connect to the socket can write to the whole segment, the socket's permissions
+// are what keeps everyone else out.
+
+#ifndef __USB2CAN_SHM_H__
+#define __USB2CAN_SHM_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "usb2can.h"
+
+#define USB2CAN_SHM_MAGIC     0x53433255U // "U2CS"
+#define USB2CAN_SHM_VERSION   1
+#define USB2CAN_SHM_RX_SLOTS  4096  // A power of 2.
+#define USB2CAN_SHM_TX_SLOTS  256   // A power of 2.
+#define USB2CAN_SHM_CLIENTS   32    // The number of tx rings, the most clients that can use the segment at once.
+
+// The len of a USB2CAN_CTRL_SHM.
+#define USB2CAN_SHM_DETACH    0     // client -> usb2can: go back to sending frames over the socket. The reply is the same.
+#define USB2CAN_SHM_ATTACH    1     // client -> usb2can: use the rings. The reply has the segment attached, with data[0..3]
+	                                  // the client's tx ring and data[4..7] its connection number (for usb2can_shm_rx_slot.conn)
+	                                  // as uint32_t. It's USB2CAN_SHM_DETACH if the client can't have one.
+#define USB2CAN_SHM_DOORBELL  2     // Either way: something has changed in the rings.
+
+/// @brief A frame in the rx ring.
+struct usb2can_shm_rx_slot {
+	_Atomic uint64_t seq;       // The number of the frame in it plus 1, 0 while it's being written.
+	uint64_t timestamp;         // When it was received in nanoseconds, as USB2CAN_CTRL_TIMESTAMP.
+	uint32_t device;            // The id of the device that it came from.
+	uint32_t conn;              // The connection that sent it if it's the echo of a client's frame, 0 if it came from the bus.
+	uint8_t timestamp_source;   // USB2CAN_TIMESTAMP_*.
+	uint8_t loopback;           // Whether the connection that sent it had loopback on (see USB2CAN_CTRL_LOOPBACK).
+	uint8_t reserved[6];
+	struct canfd_frame frame;   // Classic CAN frames don't have CANFD_FDF set in flags.
+};
+
+/// @brief A client's tx ring.
+struct usb2can_shm_tx_ring {
+	_Alignas(64) _Atomic uint32_t head;   // Written by the client.
+	_Alignas(64) _Atomic uint32_t tail;   // Written by usb2can.
+	_Alignas(64) _Atomic uint32_t waiting; // Set by the client when it wants a doorbell.
+	uint64_t rx_start;                      // rx_head when the ring was handed out, where the client starts reading rx.
+	struct canfd_frame slots[USB2CAN_SHM_TX_SLOTS];
+};
+
+/// @brief The shared memory segment.
+struct usb2can_shm {
+	uint32_t magic;             // USB2CAN_SHM_MAGIC
+	uint32_t version;           // USB2CAN_SHM_VERSION
+	uint32_t rx_slots;          // USB2CAN_SHM_RX_SLOTS
+	uint32_t tx_slots;          // USB2CAN_SHM_TX_SLOTS
+	uint32_t clients;           // USB2CAN_SHM_CLIENTS
+	_Atomic uint32_t default_device; // The id of the device that clients bound to device 0 get.
+	_Alignas(64) _Atomic uint32_t sleeping; // Set by usb2can when it wants a doorbell.
+	_Alignas(64) _Atomic uint64_t rx_head;  // The number of frames that have been written to rx.
+	struct usb2can_shm_rx_slot rx[USB2CAN_SHM_RX_SLOTS];
+	struct usb2can_shm_tx_ring tx[USB2CAN_SHM_CLIENTS];
+};
+
+#endif // __USB2CAN_SHM_H__
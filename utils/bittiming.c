@@ -0,0 +1,107 @@
+// Works out CAN bit timing from a controller's clock and limits.
+//
+// A bit is made up of a whole number of time quanta (tq): one for the sync segment, tseg1
+// before the sample point and tseg2 after it. A time quantum is brp cycles of the clock. We
+// try every number of time quanta that the limits allow, with the prescaler that gets closest
+// to the bitrate, and split each one around the sample point. This is the same approach as
+// can_calc_bittiming() in Linux.
+
+#include "bittiming.h"
+
+// Bitrate errors are compared in parts per million, tenths of a percent are too coarse to pick between timings.
+#define BITTIMING_PPM (1000000)
+
+uint16_t bittiming_default_sample_point(uint32_t bitrate) {
+  if(bitrate > 800000) {
+    return 750;
+  }
+  if(bitrate > 500000) {
+    return 800;
+  }
+  return 875;
+}
+
+uint32_t bittiming_bitrate(uint32_t fclk, uint32_t prop_seg, uint32_t phase_seg1, uint32_t phase_seg2, uint32_t brp) {
+  uint64_t tq = 1 + (uint64_t)prop_seg + phase_seg1 + phase_seg2;
+  if(brp == 0) {
+    return 0;
+  }
+  return (uint32_t)(fclk / (brp * tq));
+}
+
+int bittiming_calc(const struct bittiming_limits* limits, uint32_t bitrate, uint16_t sample_point, struct bittiming* bt) {
+  if((bitrate == 0) || (limits->fclk == 0)) {
+    return -1;
+  }
+  if(sample_point == BITTIMING_SAMPLE_POINT_DEFAULT) {
+    sample_point = bittiming_default_sample_point(bitrate);
+  }
+  uint32_t brp_inc = (limits->brp_inc > 0) ? limits->brp_inc : 1;
+
+  int64_t best_rate_error = -1;
+  uint32_t best_sp_error = 0;
+  // From the most time quanta down, so that on a tie we keep the finest resolution.
+  for(uint32_t tq = 1 + limits->tseg1_max + limits->tseg2_max; tq >= 1 + limits->tseg1_min + limits->tseg2_min; tq--) {
+    // The prescaler to the nearest step that the controller allows.
+    uint64_t brp = ((uint64_t)limits->fclk + (((uint64_t)tq * bitrate) / 2)) / ((uint64_t)tq * bitrate);
+    brp = ((brp + (brp_inc / 2)) / brp_inc) * brp_inc;
+    if((brp < limits->brp_min) || (brp > limits->brp_max) || (brp == 0)) {
+      continue;
+    }
+    uint64_t actual = limits->fclk / (brp * tq);
+    int64_t rate_error = (int64_t)(((actual > bitrate) ? (actual - bitrate) : (bitrate - actual)) * BITTIMING_PPM / bitrate);
+    if((best_rate_error >= 0) && (rate_error > best_rate_error)) {
+      continue;
+    }
+
+    // Split the bit around the sample point.
+    uint32_t tseg2 = tq - (uint32_t)((((uint64_t)sample_point * tq) + 500) / 1000);
+    if(tseg2 < limits->tseg2_min) {
+      tseg2 = limits->tseg2_min;
+    } else if(tseg2 > limits->tseg2_max) {
+      tseg2 = limits->tseg2_max;
+    }
+    uint32_t tseg1 = tq - 1 - tseg2;
+    if(tseg1 > limits->tseg1_max) {
+      tseg1 = limits->tseg1_max;
+      tseg2 = tq - 1 - tseg1;
+    } else if(tseg1 < limits->tseg1_min) {
+      tseg1 = limits->tseg1_min;
+      tseg2 = tq - 1 - tseg1;
+    }
+    if((tseg1 < limits->tseg1_min) || (tseg1 > limits->tseg1_max) || (tseg2 < limits->tseg2_min) || (tseg2 > limits->tseg2_max)) {
+      continue;
+    }
+    uint16_t sp = (uint16_t)((1000 * (1 + tseg1)) / tq);
+    uint32_t sp_error = (sp > sample_point) ? (sp - sample_point) : (sample_point - sp);
+    if((best_rate_error >= 0) && (rate_error == best_rate_error) && (sp_error >= best_sp_error)) {
+      continue;
+    }
+
+    best_rate_error = rate_error;
+    best_sp_error = sp_error;
+    bt->prop_seg = tseg1 / 2;
+    bt->phase_seg1 = tseg1 - bt->prop_seg;
+    bt->phase_seg2 = tseg2;
+    // Linux's default, as much as the sample point can move without going past the middle of phase_seg2.
+    bt->sjw = tseg2 / 2;
+    if(bt->sjw > bt->phase_seg1) {
+      bt->sjw = bt->phase_seg1;
+    }
+    if(bt->sjw > limits->sjw_max) {
+      bt->sjw = limits->sjw_max;
+    }
+    if(bt->sjw == 0) {
+      bt->sjw = 1;
+    }
+    bt->brp = (uint32_t)brp;
+    bt->bitrate = (uint32_t)actual;
+    bt->sample_point = sp;
+  }
+
+  if(best_rate_error < 0) {
+    return -1;
+  }
+  // Round up so that any error at all shows up.
+  return (int)((best_rate_error + 999) / 1000);
+}
@@ -0,0 +1,45 @@
+#ifndef __BITTIMING_H__
+#define __BITTIMING_H__
+
+#include <inttypes.h>
+
+// Sample points are in tenths of a percent, i.e. 875 is 87.5%.
+#define BITTIMING_SAMPLE_POINT_DEFAULT  (0)
+
+/// @brief What a CAN controller can do, from the device's bit timing constants.
+struct bittiming_limits {
+  uint32_t fclk;        // The CAN controller's clock in Hz.
+  uint32_t tseg1_min;   // Time segment 1 (prop_seg + phase_seg1) in time quanta.
+  uint32_t tseg1_max;
+  uint32_t tseg2_min;   // Time segment 2 (phase_seg2) in time quanta.
+  uint32_t tseg2_max;
+  uint32_t sjw_max;     // Synchronisation jump width in time quanta.
+  uint32_t brp_min;     // Bitrate prescaler, a time quantum is brp clock cycles.
+  uint32_t brp_max;
+  uint32_t brp_inc;
+};
+
+/// @brief The bit timing worked out by bittiming_calc().
+struct bittiming {
+  uint32_t prop_seg;
+  uint32_t phase_seg1;
+  uint32_t phase_seg2;
+  uint32_t sjw;
+  uint32_t brp;
+  uint32_t bitrate;       // The bitrate that this actually gives, in bits/s.
+  uint16_t sample_point;  // The sample point that this actually gives, in tenths of a percent.
+};
+
+/// @brief The sample point recommended by CiA for a bitrate: 87.5% up to 500k, 80% up to 800k and 75% above that.
+extern uint16_t bittiming_default_sample_point(uint32_t bitrate);
+
+/// @brief Work out the bit timing for a bitrate, getting as close to the sample point as the limits allow.
+/// Of the timings that get closest to the bitrate we use the one closest to the sample point and then the one with the most time quanta.
+/// @param sample_point In tenths of a percent, or BITTIMING_SAMPLE_POINT_DEFAULT for bittiming_default_sample_point().
+/// @return The error in the bitrate in tenths of a percent, or -1 if the limits can't get anywhere near it.
+extern int bittiming_calc(const struct bittiming_limits* limits, uint32_t bitrate, uint16_t sample_point, struct bittiming* bt);
+
+/// @brief The bitrate that a timing gives with a clock of fclk Hz, 0 if the timing isn't valid.
+extern uint32_t bittiming_bitrate(uint32_t fclk, uint32_t prop_seg, uint32_t phase_seg1, uint32_t phase_seg2, uint32_t brp);
+
+#endif // __BITTIMING_H__
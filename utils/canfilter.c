@@ -0,0 +1,183 @@
+// SocketCAN style acceptance filters, compiled so that checking a frame costs the same however
+// many filters there are.
+//
+// A standard id only has 2048 values (twice that with the RTR bit) so each filter is tried
+// against all of them up front and the answers go in a bitmap. Extended ids have far too many
+// values for that, but the masks that people use keep the top bits of the id and ignore the
+// rest, so each filter matches a run of ids (or, inverted, everything but one). The runs are
+// sorted and merged and a frame is looked for with a binary search. Only filters with masks
+// that have gaps in them are left to check one by one.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../usb2can.h"
+#include "canfilter.h"
+
+#define CANFILTER_FLAGS   (CAN_EFF_FLAG | CAN_RTR_FLAG)
+
+void canfilter_init(struct canfilter* f) {
+  f->all = 1;
+  f->err_mask = CAN_ERR_MASK;
+  f->count = 0;
+  f->pending = 0;
+  f->building = 0;
+}
+
+int canfilter_add(struct canfilter* f, uint32_t can_id, uint32_t can_mask) {
+  if(!f->building) {
+    f->building = 1;
+    f->pending = 0;
+  }
+  if(f->pending >= CANFILTER_MAX) {
+    return -1;
+  }
+  f->filters[f->pending].can_id = can_id;
+  f->filters[f->pending].can_mask = can_mask;
+  f->pending++;
+  return 0;
+}
+
+// Whether a frame matches one filter, after canfilter_set() has tidied it up.
+static int entry_match(const struct canfilter_entry* e, uint32_t can_id) {
+  int match = ((can_id ^ e->can_id) & e->can_mask) == 0;
+  return (e->can_id & CAN_INV_FILTER) ? !match : match;
+}
+
+static int range_compare(const void* a, const void* b) {
+  uint32_t x = ((const struct canfilter_range*)a)->lo;
+  uint32_t y = ((const struct canfilter_range*)b)->lo;
+  return (x > y) - (x < y);
+}
+
+static void range_add(struct canfilter* f, int rtr, uint32_t lo, uint32_t hi) {
+  struct canfilter_range* r = &f->ranges[rtr][f->range_count[rtr]++];
+  r->lo = lo;
+  r->hi = hi;
+}
+
+// Sort the runs and join up the ones that overlap or touch.
+static void range_merge(struct canfilter* f, int rtr) {
+  struct canfilter_range* r = f->ranges[rtr];
+  uint32_t n = f->range_count[rtr];
+  if(n == 0) {
+    return;
+  }
+  qsort(r, n, sizeof(struct canfilter_range), range_compare);
+  uint32_t out = 0;
+  for(uint32_t i = 1; i < n; i++) {
+    if(r[i].lo <= r[out].hi + 1) {
+      if(r[i].hi > r[out].hi) {
+        r[out].hi = r[i].hi;
+      }
+    } else {
+      r[++out] = r[i];
+    }
+  }
+  f->range_count[rtr] = out + 1;
+}
+
+uint32_t canfilter_set(struct canfilter* f) {
+  if(!f->building) {
+    f->pending = 0;
+  }
+  f->building = 0;
+  f->all = 0;
+  f->count = f->pending;
+  f->slow_count = 0;
+  f->range_count[0] = 0;
+  f->range_count[1] = 0;
+  memset(f->sff, 0, sizeof(f->sff));
+  for(uint32_t i = 0; i < f->count; i++) {
+    // As SocketCAN, only the id and the EFF and RTR flags count.
+    struct canfilter_entry* e = &f->filters[i];
+    e->can_mask &= CAN_EFF_MASK | CANFILTER_FLAGS;
+    e->can_id &= e->can_mask | CAN_INV_FILTER;
+  }
+  for(uint32_t k = 0; k < 4096; k++) {
+    uint32_t can_id = (k & CAN_SFF_MASK) | ((k & 0x800) ? CAN_RTR_FLAG : 0);
+    for(uint32_t i = 0; i < f->count; i++) {
+      if(entry_match(&f->filters[i], can_id)) {
+        f->sff[k / 32] |= 1U << (k % 32);
+        break;
+      }
+    }
+  }
+  for(uint32_t i = 0; i < f->count; i++) {
+    struct canfilter_entry* e = &f->filters[i];
+    uint32_t id_mask = e->can_mask & CAN_EFF_MASK;
+    uint32_t free_bits = ~id_mask & CAN_EFF_MASK;
+    if((free_bits & (free_bits + 1)) != 0) {
+      f->slow[f->slow_count++] = *e;
+      continue;
+    }
+    uint32_t lo = e->can_id & id_mask;
+    uint32_t hi = lo | free_bits;
+    for(int rtr = 0; rtr < 2; rtr++) {
+      uint32_t flags = CAN_EFF_FLAG | (rtr ? CAN_RTR_FLAG : 0);
+      int flags_match = ((flags ^ e->can_id) & e->can_mask & CANFILTER_FLAGS) == 0;
+      if(!(e->can_id & CAN_INV_FILTER)) {
+        if(flags_match) {
+          range_add(f, rtr, lo, hi);
+        }
+      } else if(!flags_match) {
+        range_add(f, rtr, 0, CAN_EFF_MASK);
+      } else {
+        if(lo > 0) {
+          range_add(f, rtr, 0, lo - 1);
+        }
+        if(hi < CAN_EFF_MASK) {
+          range_add(f, rtr, hi + 1, CAN_EFF_MASK);
+        }
+      }
+    }
+  }
+  range_merge(f, 0);
+  range_merge(f, 1);
+  return f->count;
+}
+
+void canfilter_all(struct canfilter* f) {
+  f->all = 1;
+  f->count = 0;
+  f->pending = 0;
+  f->building = 0;
+}
+
+void canfilter_err(struct canfilter* f, uint32_t err_mask) {
+  f->err_mask = err_mask & CAN_ERR_MASK;
+}
+
+int canfilter_match(const struct canfilter* f, uint32_t can_id) {
+  if(can_id & CAN_ERR_FLAG) {
+    return (can_id & f->err_mask) != 0;
+  }
+  if(f->all) {
+    return 1;
+  }
+  int rtr = (can_id & CAN_RTR_FLAG) ? 1 : 0;
+  if(!(can_id & CAN_EFF_FLAG)) {
+    uint32_t k = (can_id & CAN_SFF_MASK) | (rtr << 11);
+    return (f->sff[k / 32] >> (k % 32)) & 1;
+  }
+  uint32_t id = can_id & CAN_EFF_MASK;
+  const struct canfilter_range* r = f->ranges[rtr];
+  uint32_t lo = 0;
+  uint32_t hi = f->range_count[rtr];
+  while(lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if(id < r[mid].lo) {
+      hi = mid;
+    } else if(id > r[mid].hi) {
+      lo = mid + 1;
+    } else {
+      return 1;
+    }
+  }
+  for(uint32_t i = 0; i < f->slow_count; i++) {
+    if(entry_match(&f->slow[i], can_id & (CAN_EFF_MASK | CANFILTER_FLAGS))) {
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef __CANFILTER_H__
+#define __CANFILTER_H__
+
+#include <inttypes.h>
+
+// The most filters in a list, the same as SocketCAN's CAN_RAW_FILTER_MAX.
+#define CANFILTER_MAX   (512)
+
+/// @brief A filter as SocketCAN's struct can_filter, a frame matches if (its can_id & can_mask) == (can_id & can_mask).
+/// CAN_INV_FILTER in can_id turns it round so that only frames that don't match get through.
+struct canfilter_entry {
+  uint32_t can_id;
+  uint32_t can_mask;
+};
+
+/// @brief A run of extended ids, lo to hi inclusive.
+struct canfilter_range {
+  uint32_t lo;
+  uint32_t hi;
+};
+
+/// @brief A list of filters, compiled so that checking a frame doesn't mean going through the list.
+struct canfilter {
+  uint8_t all;          // There's no list, every frame gets through.
+  uint32_t err_mask;    // The error classes (CAN_ERR_*) whose error frames get through, filters don't apply to them.
+  uint32_t sff[4096 / 32];  // One bit for each standard id, RTR frames are the top 2048.
+  uint32_t range_count[2];  // Extended ids: sorted runs that don't overlap, [0] for data frames and [1] for RTR.
+  struct canfilter_range ranges[2][2 * CANFILTER_MAX];
+  uint32_t slow_count;  // Filters whose masks don't make a run of extended ids, they're checked one by one.
+  struct canfilter_entry slow[CANFILTER_MAX];
+  uint32_t count;       // The number of filters in the list.
+  uint32_t pending;     // The number of filters in the list being built, see canfilter_add().
+  uint8_t building;     // canfilter_add() has started a new list.
+  struct canfilter_entry filters[CANFILTER_MAX];
+};
+
+/// @brief Reset a filter so that every frame gets through, error frames included.
+extern void canfilter_init(struct canfilter* f);
+
+/// @brief Add a filter to a new list, the first after canfilter_set() or canfilter_all() starts it. The
+/// filters in use don't change until canfilter_set().
+/// @return 0, or -1 if there are already CANFILTER_MAX filters in the new list.
+extern int canfilter_add(struct canfilter* f, uint32_t can_id, uint32_t can_mask);
+
+/// @brief Use the new list in place of the old one. If nothing has been added then no frames get through (except error frames).
+/// @return The number of filters in the list.
+extern uint32_t canfilter_set(struct canfilter* f);
+
+/// @brief Go back to letting every frame through. Any new list is dropped.
+extern void canfilter_all(struct canfilter* f);
+
+/// @brief Choose the error classes (CAN_ERR_*) whose error frames get through, 0 for none.
+extern void canfilter_err(struct canfilter* f, uint32_t err_mask);
+
+/// @brief Whether a frame with can_id gets through.
+extern int canfilter_match(const struct canfilter* f, uint32_t can_id);
+
+#endif // __CANFILTER_H__
@@ -0,0 +1,120 @@
+// Maps a device's microsecond counter onto our own clock.
+//
+// The device's time is sampled every so often with the host time taken just before and just
+// after the request. We use the mid point of the two as the host time of the sample and
+// throw away samples that took much longer than the best one we've seen, as they're the
+// ones where USB scheduling got in the way. A least squares line through the remaining
+// samples gives us both the offset and the drift between the two clocks.
+
+#include <string.h>
+#include "clocksync.h"
+
+// Sync points with a round trip longer than this many times the best one are ignored...
+#define CLOCKSYNC_RTT_FACTOR    (2)
+// ...plus this much slack so that a very quick best round trip doesn't reject everything.
+#define CLOCKSYNC_RTT_SLACK_NS  (100000)
+// If we've rejected this many in a row then the conditions have changed and we take it anyway.
+#define CLOCKSYNC_MAX_REJECTED  (8)
+// Don't try to estimate the drift until the sync points span at least this long.
+#define CLOCKSYNC_MIN_SPAN_US   (1000000)
+// Crystals are much better than this, anything worse is noise.
+#define CLOCKSYNC_MAX_DRIFT_PPM (500.0)
+
+void clocksync_init(struct clocksync* cs) {
+  memset(cs, 0, sizeof(struct clocksync));
+  cs->ns_per_us = 1000.0;
+}
+
+uint64_t clocksync_unwrap(struct clocksync* cs, uint32_t raw_us) {
+  if(!cs->have_raw) {
+    cs->have_raw = 1;
+    cs->last_raw = raw_us;
+    cs->last_us = raw_us;
+    return cs->last_us;
+  }
+  // The signed difference copes with both the wrap and values that are slightly out of order.
+  int32_t delta = (int32_t)(raw_us - cs->last_raw);
+  uint64_t us = cs->last_us + delta;
+  if(delta > 0) {
+    cs->last_raw = raw_us;
+    cs->last_us = us;
+  }
+  return us;
+}
+
+// Fit host_ns against dev_us for the sync points that we have.
+static void clocksync_fit(struct clocksync* cs) {
+  uint32_t oldest = (cs->head + CLOCKSYNC_SAMPLES - cs->count) % CLOCKSYNC_SAMPLES;
+  uint32_t newest = (cs->head + CLOCKSYNC_SAMPLES - 1) % CLOCKSYNC_SAMPLES;
+  cs->ref_us = cs->dev_us[oldest];
+  cs->ref_ns = cs->host_ns[oldest];
+
+  double mean_x = 0.0;
+  double mean_y = 0.0;
+  for(uint32_t i = 0; i < cs->count; i++) {
+    uint32_t n = (oldest + i) % CLOCKSYNC_SAMPLES;
+    mean_x += (double)(int64_t)(cs->dev_us[n] - cs->ref_us);
+    mean_y += (double)(int64_t)(cs->host_ns[n] - cs->ref_ns);
+  }
+  mean_x /= cs->count;
+  mean_y /= cs->count;
+
+  double slope = 1000.0;
+  if((cs->dev_us[newest] - cs->dev_us[oldest]) >= CLOCKSYNC_MIN_SPAN_US) {
+    double sxy = 0.0;
+    double sxx = 0.0;
+    for(uint32_t i = 0; i < cs->count; i++) {
+      uint32_t n = (oldest + i) % CLOCKSYNC_SAMPLES;
+      double dx = (double)(int64_t)(cs->dev_us[n] - cs->ref_us) - mean_x;
+      double dy = (double)(int64_t)(cs->host_ns[n] - cs->ref_ns) - mean_y;
+      sxy += dx * dy;
+      sxx += dx * dx;
+    }
+    if(sxx > 0.0) {
+      slope = sxy / sxx;
+    }
+    double max_dev = 1000.0 * CLOCKSYNC_MAX_DRIFT_PPM / 1000000.0;
+    if(slope > 1000.0 + max_dev) {
+      slope = 1000.0 + max_dev;
+    } else if(slope < 1000.0 - max_dev) {
+      slope = 1000.0 - max_dev;
+    }
+  }
+  cs->ns_per_us = slope;
+  cs->offset_ns = mean_y - (slope * mean_x);
+}
+
+int clocksync_add_sample(struct clocksync* cs, uint32_t raw_us, uint64_t host_before_ns, uint64_t host_after_ns) {
+  uint64_t dev_us = clocksync_unwrap(cs, raw_us);
+  uint64_t rtt = host_after_ns - host_before_ns;
+
+  if((cs->count > 0) && (rtt > (cs->min_rtt_ns * CLOCKSYNC_RTT_FACTOR) + CLOCKSYNC_RTT_SLACK_NS) && (cs->rejected < CLOCKSYNC_MAX_REJECTED)) {
+    cs->rejected++;
+    return 0;
+  }
+  if((cs->count == 0) || (rtt < cs->min_rtt_ns) || (cs->rejected >= CLOCKSYNC_MAX_REJECTED)) {
+    cs->min_rtt_ns = rtt;
+  }
+  cs->rejected = 0;
+
+  cs->dev_us[cs->head] = dev_us;
+  cs->host_ns[cs->head] = host_before_ns + (rtt / 2);
+  cs->head = (cs->head + 1) % CLOCKSYNC_SAMPLES;
+  if(cs->count < CLOCKSYNC_SAMPLES) {
+    cs->count++;
+  }
+  clocksync_fit(cs);
+  return 1;
+}
+
+uint64_t clocksync_to_host(struct clocksync* cs, uint64_t dev_us) {
+  if(cs->count == 0) {
+    return 0;
+  }
+  double dx = (double)(int64_t)(dev_us - cs->ref_us);
+  return cs->ref_ns + (int64_t)(cs->offset_ns + (dx * cs->ns_per_us));
+}
+
+double clocksync_drift_ppm(struct clocksync* cs) {
+  return ((1000.0 / cs->ns_per_us) - 1.0) * 1000000.0;
+}
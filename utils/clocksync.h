@@ -0,0 +1,44 @@
+#ifndef __CLOCKSYNC_H__
+#define __CLOCKSYNC_H__
+
+#include <inttypes.h>
+
+// The number of sync points that we fit the device clock against.
+#define CLOCKSYNC_SAMPLES   (16)
+
+/// @brief Maps a free running 32-bit microsecond counter on a device onto our nanosecond clock (see nanos()).
+struct clocksync {
+  uint32_t last_raw;    // The last raw counter value that we've seen.
+  uint64_t last_us;     // last_raw extended to 64 bits.
+  uint8_t have_raw;     // Set once last_raw is valid.
+  uint64_t dev_us[CLOCKSYNC_SAMPLES];   // Device time of each sync point.
+  uint64_t host_ns[CLOCKSYNC_SAMPLES];  // Our time at each sync point.
+  uint32_t head;        // Where the next sync point goes.
+  uint32_t count;       // The number of valid sync points.
+  uint64_t min_rtt_ns;  // The shortest round trip that we've seen for a sync point.
+  uint32_t rejected;    // The number of sync points rejected in a row because of their round trip.
+  uint64_t ref_us;      // The model is: host_ns = ref_ns + offset_ns + (dev_us - ref_us) * ns_per_us
+  uint64_t ref_ns;
+  double offset_ns;
+  double ns_per_us;     // 1000.0 if both clocks agree, the difference is the drift.
+};
+
+/// @brief Reset a struct clocksync.
+extern void clocksync_init(struct clocksync* cs);
+
+/// @brief Extend a raw 32-bit counter value to 64 bits, taking care of it wrapping around every ~71 minutes.
+/// Values must be passed in (roughly) the order the device produced them.
+extern uint64_t clocksync_unwrap(struct clocksync* cs, uint32_t raw_us);
+
+/// @brief Add a sync point. The device's counter was read as raw_us somewhere between host_before_ns and host_after_ns.
+/// @return 1 if the sync point was used, 0 if it was rejected because its round trip was too long to be accurate.
+extern int clocksync_add_sample(struct clocksync* cs, uint32_t raw_us, uint64_t host_before_ns, uint64_t host_after_ns);
+
+/// @brief Convert an (unwrapped) device time to our time.
+/// @return The time in nanoseconds or 0 if we don't have any sync points yet.
+extern uint64_t clocksync_to_host(struct clocksync* cs, uint64_t dev_us);
+
+/// @brief The estimated drift of the device's clock relative to ours in parts per million.
+extern double clocksync_drift_ppm(struct clocksync* cs);
+
+#endif // __CLOCKSYNC_H__
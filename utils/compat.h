@@ -0,0 +1,17 @@
+#ifndef __COMPAT_H__
+#define __COMPAT_H__
+
+// The bits that differ between the BSDs and Linux.
+
+#if defined(__linux__)
+#include <endian.h>     // le16toh() etc.
+#include <sys/cdefs.h>
+#ifndef __packed
+#define __packed __attribute__((packed))
+#endif
+#else
+#include <sys/endian.h> // le16toh() etc.
+#include <sys/cdefs.h>  // __packed
+#endif
+
+#endif // __COMPAT_H__
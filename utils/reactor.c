@@ -0,0 +1,339 @@
+// Waits for file descriptors and timers, using kqueue on the BSDs and epoll on Linux.
+//
+// Both are used the same way: a file descriptor is added once with a pointer that is handed back
+// with each of its events, and whoever handles a readable socket is told how much there is to
+// read. kqueue gives us all of that with the event. epoll only gives us back the file descriptor,
+// so we keep a table of what each one was added with and ask the socket how much it has
+// (FIONREAD). epoll has no timers of its own so we use timerfds, one for each timer and one for
+// waits that aren't a whole number of milliseconds, which is all that epoll_wait() can do.
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include "reactor.h"
+
+#ifdef REACTOR_KQUEUE
+#include <sys/event.h>
+
+int reactor_init(struct reactor* r) {
+  r->timers = 0;
+  r->fd = kqueue();
+  return (r->fd < 0) ? -1 : 0;
+}
+
+void reactor_close(struct reactor* r) {
+  if(r->fd >= 0) {
+    close(r->fd);
+  }
+  r->fd = -1;
+}
+
+int reactor_add(struct reactor* r, int fd, uint8_t events, void* udata) {
+  struct kevent ev[2];
+  int n = 0;
+  unsigned short flags = EV_ADD | EV_ENABLE | ((events & REACTOR_EDGE) ? EV_CLEAR : 0);
+  if(events & REACTOR_READ) {
+    EV_SET(&ev[n++], fd, EVFILT_READ, flags, 0, 0, udata);
+  }
+  if(events & REACTOR_WRITE) {
+    EV_SET(&ev[n++], fd, EVFILT_WRITE, flags, 0, 0, udata);
+  }
+  return (kevent(r->fd, ev, n, NULL, 0, NULL) == -1) ? -1 : 0;
+}
+
+void reactor_remove(struct reactor* r, int fd) {
+  struct kevent ev;
+  // We don't know which filters were added so remove both and ignore the errors. They have to be
+  // done one at a time, kevent() gives up on the first one that fails.
+  EV_SET(&ev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+  kevent(r->fd, &ev, 1, NULL, 0, NULL);
+  EV_SET(&ev, fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+  kevent(r->fd, &ev, 1, NULL, 0, NULL);
+}
+
+void reactor_pause(struct reactor* r, int fd) {
+  struct kevent ev;
+  EV_SET(&ev, fd, EVFILT_READ, EV_DISABLE, 0, 0, NULL);
+  kevent(r->fd, &ev, 1, NULL, 0, NULL);
+}
+
+void reactor_resume(struct reactor* r, int fd) {
+  struct kevent ev;
+  EV_SET(&ev, fd, EVFILT_READ, EV_ENABLE, 0, 0, NULL);
+  kevent(r->fd, &ev, 1, NULL, 0, NULL);
+}
+
+void reactor_watch_write(struct reactor* r, int fd, uint8_t on, void* udata) {
+  struct kevent ev;
+  EV_SET(&ev, fd, EVFILT_WRITE, on ? (EV_ADD | EV_ENABLE | EV_CLEAR) : EV_DELETE, 0, 0, udata);
+  kevent(r->fd, &ev, 1, NULL, 0, NULL);
+}
+
+int reactor_add_timer(struct reactor* r, uint32_t period_ms, void* udata) {
+  struct kevent ev;
+  // Timers have their own ids, they can't clash with file descriptors.
+  int id = ++r->timers;
+  EV_SET(&ev, id, EVFILT_TIMER, EV_ADD | EV_ENABLE, 0, period_ms, udata);
+  return (kevent(r->fd, &ev, 1, NULL, 0, NULL) == -1) ? -1 : id;
+}
+
+int reactor_wait(struct reactor* r, struct reactor_event* events, int max, int64_t timeout_ns) {
+  struct kevent list[max];
+  struct timespec ts = {
+    .tv_sec = (timeout_ns > 0) ? (timeout_ns / 1000000000) : 0,
+    .tv_nsec = (timeout_ns > 0) ? (timeout_ns % 1000000000) : 0
+  };
+  int nev = kevent(r->fd, NULL, 0, list, max, (timeout_ns < 0) ? NULL : &ts);
+  for(int i = 0; i < nev; i++) {
+    struct reactor_event* ev = &events[i];
+    ev->fd = (int)list[i].ident;
+    ev->udata = list[i].udata;
+    ev->eof = ((list[i].flags & EV_EOF) != 0);
+    ev->avail = 0;
+    switch(list[i].filter) {
+    case EVFILT_READ:
+      ev->events = REACTOR_READ;
+      ev->avail = (int)list[i].data;
+      break;
+    case EVFILT_WRITE:
+      ev->events = REACTOR_WRITE;
+      break;
+    default:
+      ev->events = REACTOR_TIMER;
+      ev->eof = 0;
+      break;
+    }
+  }
+  return nev;
+}
+
+#else // REACTOR_EPOLL
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+// What we keep for a file descriptor, the table grows as needed.
+static struct reactor_source* reactor_source(struct reactor* r, int fd, uint8_t grow) {
+  if(fd < 0) {
+    return NULL;
+  }
+  if(fd >= r->size) {
+    if(!grow) {
+      return NULL;
+    }
+    int size = (r->size > 0) ? r->size : 64;
+    while(size <= fd) {
+      size *= 2;
+    }
+    struct reactor_source* sources = realloc(r->sources, size * sizeof(struct reactor_source));
+    if(sources == NULL) {
+      return NULL;
+    }
+    memset(&sources[r->size], 0, (size - r->size) * sizeof(struct reactor_source));
+    r->sources = sources;
+    r->size = size;
+  }
+  return &r->sources[fd];
+}
+
+static uint32_t reactor_epoll_events(uint8_t events) {
+  uint32_t e = 0;
+  if(events & REACTOR_READ) {
+    e |= EPOLLIN | EPOLLRDHUP;
+  }
+  if(events & REACTOR_WRITE) {
+    e |= EPOLLOUT;
+  }
+  if(events & REACTOR_EDGE) {
+    e |= EPOLLET;
+  }
+  return e;
+}
+
+// What a paused file descriptor is watched for. epoll always reports hang ups and errors, even with
+// no events. Edge triggered they're only reported once, rather than on every wait, and we drop them
+// unless it's also being watched for being writable.
+static uint32_t reactor_paused_events(uint8_t events) {
+  return EPOLLET | ((events & REACTOR_WRITE) ? EPOLLOUT : 0);
+}
+
+static int reactor_ctl(struct reactor* r, int op, int fd, uint32_t events) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.fd = fd;
+  return epoll_ctl(r->fd, op, fd, &ev);
+}
+
+int reactor_init(struct reactor* r) {
+  r->sources = NULL;
+  r->size = 0;
+  r->fd = epoll_create1(EPOLL_CLOEXEC);
+  if(r->fd < 0) {
+    return -1;
+  }
+  r->wait_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if((r->wait_fd < 0) || (reactor_ctl(r, EPOLL_CTL_ADD, r->wait_fd, EPOLLIN) != 0)) {
+    reactor_close(r);
+    return -1;
+  }
+  return 0;
+}
+
+void reactor_close(struct reactor* r) {
+  for(int fd = 0; fd < r->size; fd++) {
+    if(r->sources[fd].timer) {
+      close(fd);
+    }
+  }
+  free(r->sources);
+  r->sources = NULL;
+  r->size = 0;
+  if(r->wait_fd >= 0) {
+    close(r->wait_fd);
+  }
+  r->wait_fd = -1;
+  if(r->fd >= 0) {
+    close(r->fd);
+  }
+  r->fd = -1;
+}
+
+int reactor_add(struct reactor* r, int fd, uint8_t events, void* udata) {
+  struct reactor_source* src = reactor_source(r, fd, 1);
+  if(src == NULL) {
+    return -1;
+  }
+  if(reactor_ctl(r, EPOLL_CTL_ADD, fd, reactor_epoll_events(events)) != 0) {
+    if((errno != EEXIST) || (reactor_ctl(r, EPOLL_CTL_MOD, fd, reactor_epoll_events(events)) != 0)) {
+      return -1;
+    }
+  }
+  src->udata = udata;
+  src->events = events;
+  src->paused = 0;
+  src->timer = 0;
+  return 0;
+}
+
+void reactor_remove(struct reactor* r, int fd) {
+  reactor_ctl(r, EPOLL_CTL_DEL, fd, 0);
+  struct reactor_source* src = reactor_source(r, fd, 0);
+  if(src != NULL) {
+    memset(src, 0, sizeof(struct reactor_source));
+  }
+}
+
+void reactor_pause(struct reactor* r, int fd) {
+  struct reactor_source* src = reactor_source(r, fd, 0);
+  if((src == NULL) || src->paused) {
+    return;
+  }
+  src->paused = 1;
+  reactor_ctl(r, EPOLL_CTL_MOD, fd, reactor_paused_events(src->events));
+}
+
+void reactor_resume(struct reactor* r, int fd) {
+  struct reactor_source* src = reactor_source(r, fd, 0);
+  if((src == NULL) || !src->paused) {
+    return;
+  }
+  src->paused = 0;
+  // epoll looks at whether it's ready when it's changed, so we don't miss what arrived while it was paused.
+  reactor_ctl(r, EPOLL_CTL_MOD, fd, reactor_epoll_events(src->events));
+}
+
+void reactor_watch_write(struct reactor* r, int fd, uint8_t on, void* udata) {
+  struct reactor_source* src = reactor_source(r, fd, 0);
+  if((src == NULL) || (src->events == 0)) {
+    return;
+  }
+  src->udata = udata;
+  src->events = on ? (src->events | REACTOR_WRITE) : (src->events & ~REACTOR_WRITE);
+  reactor_ctl(r, EPOLL_CTL_MOD, fd, src->paused ? reactor_paused_events(src->events) : reactor_epoll_events(src->events));
+}
+
+int reactor_add_timer(struct reactor* r, uint32_t period_ms, void* udata) {
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if(fd < 0) {
+    return -1;
+  }
+  struct itimerspec its;
+  its.it_interval.tv_sec = period_ms / 1000;
+  its.it_interval.tv_nsec = (period_ms % 1000) * 1000000;
+  its.it_value = its.it_interval;
+  if((timerfd_settime(fd, 0, &its, NULL) != 0) || (reactor_add(r, fd, REACTOR_READ, udata) != 0)) {
+    close(fd);
+    return -1;
+  }
+  r->sources[fd].timer = 1;
+  return fd;
+}
+
+int reactor_wait(struct reactor* r, struct reactor_event* events, int max, int64_t timeout_ns) {
+  struct epoll_event list[max];
+  int ms = -1;
+  if(timeout_ns >= 0) {
+    if((timeout_ns % 1000000) == 0) {
+      ms = (int)(timeout_ns / 1000000);
+    } else {
+      // A one shot timer that wakes us up if nothing else does.
+      struct itimerspec its;
+      memset(&its, 0, sizeof(its));
+      its.it_value.tv_sec = timeout_ns / 1000000000;
+      its.it_value.tv_nsec = timeout_ns % 1000000000;
+      timerfd_settime(r->wait_fd, 0, &its, NULL);
+    }
+  }
+  int nev = epoll_wait(r->fd, list, max, ms);
+  if(nev < 0) {
+    return -1;
+  }
+
+  int n = 0;
+  uint64_t expirations;
+  for(int i = 0; i < nev; i++) {
+    int fd = list[i].data.fd;
+    if(fd == r->wait_fd) {
+      // We've timed out, which is the same as nothing happening.
+      while(read(fd, &expirations, sizeof(expirations)) > 0) {
+      }
+      continue;
+    }
+    struct reactor_source* src = reactor_source(r, fd, 0);
+    if((src == NULL) || (src->paused && !((src->events & REACTOR_WRITE) && (list[i].events & EPOLLOUT)))) {
+      continue;
+    }
+    struct reactor_event* ev = &events[n++];
+    ev->fd = fd;
+    ev->udata = src->udata;
+    ev->events = 0;
+    ev->eof = 0;
+    ev->avail = 0;
+    if(src->timer) {
+      while(read(fd, &expirations, sizeof(expirations)) > 0) {
+      }
+      ev->events = REACTOR_TIMER;
+      continue;
+    }
+    if(list[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+      ev->eof = 1;
+    }
+    if(!src->paused && (src->events & REACTOR_READ) && (list[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+      ev->events |= REACTOR_READ;
+      int avail;
+      if(ioctl(fd, FIONREAD, &avail) == 0) {
+        ev->avail = avail;
+      }
+    }
+    if((src->events & REACTOR_WRITE) && (list[i].events & EPOLLOUT)) {
+      ev->events |= REACTOR_WRITE;
+    }
+  }
+  return n;
+}
+
+#endif // REACTOR_EPOLL
@@ -0,0 +1,90 @@
+#ifndef __REACTOR_H__
+#define __REACTOR_H__
+
+#include <inttypes.h>
+
+// kqueue on the BSDs, epoll on Linux. Either can be picked with -DREACTOR_KQUEUE or -DREACTOR_EPOLL,
+// i.e. to use libkqueue on Linux.
+#if !defined(REACTOR_KQUEUE) && !defined(REACTOR_EPOLL)
+#if defined(__linux__)
+#define REACTOR_EPOLL
+#else
+#define REACTOR_KQUEUE
+#endif
+#endif
+
+// What to watch a file descriptor for.
+#define REACTOR_READ    (0x01)
+#define REACTOR_WRITE   (0x02)
+// Only report it when it becomes ready rather than for as long as it stays ready. Whoever handles
+// it must read everything that's there or pause it (see reactor_pause()), or it won't be reported
+// again until more arrives.
+#define REACTOR_EDGE    (0x04)
+// Reported for a timer (see reactor_add_timer()).
+#define REACTOR_TIMER   (0x08)
+
+/// @brief Something that happened.
+struct reactor_event {
+  int fd;               // The file descriptor, or the timer's id.
+  void* udata;          // Whatever it was added with.
+  uint8_t events;       // REACTOR_READ and/or REACTOR_WRITE, or REACTOR_TIMER.
+  uint8_t eof;          // The other end has hung up, there may still be something left to read.
+  int avail;            // How many bytes there are to read if it's readable, 0 if we can't tell.
+};
+
+#ifdef REACTOR_EPOLL
+/// @brief What we added a file descriptor with, epoll only gives us back the file descriptor.
+struct reactor_source {
+  void* udata;
+  uint8_t events;       // REACTOR_*, as it was added.
+  uint8_t paused;
+  uint8_t timer;        // It's a timerfd that we created.
+};
+#endif
+
+/// @brief An event queue.
+struct reactor {
+  int fd;               // The kqueue or epoll instance.
+#ifdef REACTOR_EPOLL
+  int wait_fd;          // A timerfd for waits that aren't a whole number of milliseconds.
+  struct reactor_source* sources; // Indexed by file descriptor.
+  int size;
+#else
+  int timers;           // The last timer id that we handed out.
+#endif
+};
+
+/// @brief Create the event queue.
+/// @return 0 on success or -1 if it can't be created.
+extern int reactor_init(struct reactor* r);
+
+/// @brief Close the event queue and any timers.
+extern void reactor_close(struct reactor* r);
+
+/// @brief Watch a file descriptor. events is REACTOR_READ and/or REACTOR_WRITE, optionally with REACTOR_EDGE.
+/// @return 0 on success or -1.
+extern int reactor_add(struct reactor* r, int fd, uint8_t events, void* udata);
+
+/// @brief Stop watching a file descriptor. Closing it does this too.
+extern void reactor_remove(struct reactor* r, int fd);
+
+/// @brief Stop reporting a file descriptor until reactor_resume() without forgetting it.
+extern void reactor_pause(struct reactor* r, int fd);
+
+/// @brief Start reporting a file descriptor again. If it's ready then it's reported straight away, even if it's edge triggered.
+extern void reactor_resume(struct reactor* r, int fd);
+
+/// @brief Start (or stop) also watching a file descriptor that was added edge triggered for being
+/// writable, i.e. while there's something that its socket wouldn't take. udata is what it was added
+/// with. It's reported even while it's paused.
+extern void reactor_watch_write(struct reactor* r, int fd, uint8_t on, void* udata);
+
+/// @brief Add a timer that goes off every period_ms.
+/// @return The timer's id, which its events are reported with, or -1.
+extern int reactor_add_timer(struct reactor* r, uint32_t period_ms, void* udata);
+
+/// @brief Wait for something to happen, for up to timeout_ns or forever if it's negative.
+/// @return The number of events put into events, 0 if we timed out, or -1 (check errno, it may be EINTR).
+extern int reactor_wait(struct reactor* r, struct reactor_event* events, int max, int64_t timeout_ns);
+
+#endif // __REACTOR_H__
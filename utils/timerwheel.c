@@ -0,0 +1,91 @@
+// A hashed timing wheel for timers that go off over and over again, i.e. cyclic frames.
+//
+// Time is divided into ticks and a timer goes in the slot for its tick modulo the number of
+// slots, so adding and removing a timer is O(1) however many there are. As time passes we
+// look at each slot in turn, a slot can hold timers for later turns of the wheel so we only
+// take the ones that have come due. A timer for a time that has already gone goes in the next
+// slot that we'll look at, so that it can't be missed.
+
+#include <string.h>
+#include "timerwheel.h"
+
+void timerwheel_init(struct timerwheel* wheel, uint64_t now_us) {
+  memset(wheel, 0, sizeof(struct timerwheel));
+  wheel->tick = now_us / TIMERWHEEL_TICK_US;
+}
+
+void timerwheel_add(struct timerwheel* wheel, struct timerwheel_entry* entry, uint64_t expiry_us) {
+  // Round up, so that timers never go off early.
+  uint64_t expiry = (expiry_us + TIMERWHEEL_TICK_US - 1) / TIMERWHEEL_TICK_US;
+  if(expiry < wheel->tick) {
+    expiry = wheel->tick;
+  }
+  struct timerwheel_entry** slot = &wheel->slots[expiry & (TIMERWHEEL_SLOTS - 1)];
+  entry->expiry = expiry;
+  entry->prev = NULL;
+  entry->next = *slot;
+  if(*slot != NULL) {
+    (*slot)->prev = entry;
+  }
+  *slot = entry;
+  entry->active = 1;
+  wheel->count++;
+}
+
+void timerwheel_remove(struct timerwheel* wheel, struct timerwheel_entry* entry) {
+  if(!entry->active) {
+    return;
+  }
+  if(entry->prev != NULL) {
+    entry->prev->next = entry->next;
+  } else {
+    wheel->slots[entry->expiry & (TIMERWHEEL_SLOTS - 1)] = entry->next;
+  }
+  if(entry->next != NULL) {
+    entry->next->prev = entry->prev;
+  }
+  entry->prev = NULL;
+  entry->next = NULL;
+  entry->active = 0;
+  wheel->count--;
+}
+
+struct timerwheel_entry* timerwheel_expire(struct timerwheel* wheel, uint64_t now_us) {
+  uint64_t now = now_us / TIMERWHEEL_TICK_US;
+  if(wheel->count == 0) {
+    if(now >= wheel->tick) {
+      wheel->tick = now + 1;
+    }
+    return NULL;
+  }
+  // If we've fallen more than a turn behind then one turn looks at every slot.
+  if((now >= wheel->tick) && ((now - wheel->tick) >= TIMERWHEEL_SLOTS)) {
+    wheel->tick = now - TIMERWHEEL_SLOTS + 1;
+  }
+  while(wheel->tick <= now) {
+    for(struct timerwheel_entry* entry = wheel->slots[wheel->tick & (TIMERWHEEL_SLOTS - 1)]; entry != NULL; entry = entry->next) {
+      if(entry->expiry <= now) {
+        timerwheel_remove(wheel, entry);
+        return entry;
+      }
+    }
+    wheel->tick++;
+  }
+  return NULL;
+}
+
+uint64_t timerwheel_next(struct timerwheel* wheel, uint64_t now_us, uint64_t limit_us) {
+  if(wheel->count == 0) {
+    return limit_us;
+  }
+  uint64_t last = (now_us + limit_us) / TIMERWHEEL_TICK_US;
+  for(uint64_t tick = wheel->tick; (tick <= last) && (tick < wheel->tick + TIMERWHEEL_SLOTS); tick++) {
+    for(struct timerwheel_entry* entry = wheel->slots[tick & (TIMERWHEEL_SLOTS - 1)]; entry != NULL; entry = entry->next) {
+      if(entry->expiry <= tick) {
+        uint64_t due_us = tick * TIMERWHEEL_TICK_US;
+        return (due_us > now_us) ? (due_us - now_us) : 0;
+      }
+    }
+  }
+  return limit_us;
+}
@@ -0,0 +1,48 @@
+#ifndef __TIMERWHEEL_H__
+#define __TIMERWHEEL_H__
+
+#include <inttypes.h>
+#include <stddef.h>
+
+// Each slot of the wheel is one tick of this many microseconds, timers go off on the first tick at or after their time.
+#define TIMERWHEEL_TICK_US  (100)
+// The number of slots, a power of 2. One turn of the wheel is TIMERWHEEL_SLOTS ticks, timers further away than that
+// stay in their slot for more than one turn.
+#define TIMERWHEEL_SLOTS    (1024)
+
+/// @brief A timer, embed it in whatever it's the timer for.
+struct timerwheel_entry {
+  struct timerwheel_entry* prev;
+  struct timerwheel_entry* next;
+  uint64_t expiry;      // The tick that it goes off on.
+  uint8_t active;       // Set while it's on the wheel.
+};
+
+/// @brief A hashed timing wheel. Adding and removing a timer is O(1) and only the slots that have come due are looked at.
+struct timerwheel {
+  uint64_t tick;        // The next tick that hasn't been dealt with.
+  uint32_t count;       // The number of timers on the wheel.
+  struct timerwheel_entry* slots[TIMERWHEEL_SLOTS];
+};
+
+/// @brief Get the struct that a struct timerwheel_entry is embedded in.
+#define timerwheel_container(entry, type, member) ((type*)((char*)(entry) - offsetof(type, member)))
+
+/// @brief Reset a wheel, now_us is the time in microseconds (see micros()).
+extern void timerwheel_init(struct timerwheel* wheel, uint64_t now_us);
+
+/// @brief Put a timer on the wheel to go off at expiry_us, or straight away if that has already gone. It mustn't already be on it.
+extern void timerwheel_add(struct timerwheel* wheel, struct timerwheel_entry* entry, uint64_t expiry_us);
+
+/// @brief Take a timer off the wheel, it's fine if it isn't on it.
+extern void timerwheel_remove(struct timerwheel* wheel, struct timerwheel_entry* entry);
+
+/// @brief Take the next timer that has gone off by now_us off the wheel.
+/// @return The timer, or NULL once there are none left. Call it until it returns NULL.
+extern struct timerwheel_entry* timerwheel_expire(struct timerwheel* wheel, uint64_t now_us);
+
+/// @brief How long until a timer goes off, looking no further ahead than limit_us.
+/// @return The time in microseconds, 0 if one is already due, or limit_us if none are due before then.
+extern uint64_t timerwheel_next(struct timerwheel* wheel, uint64_t now_us, uint64_t limit_us);
+
+#endif // __TIMERWHEEL_H__
@@ -2,12 +2,20 @@
 
 #include <inttypes.h>
 #include <sys/time.h>
+// For clock_gettime(). glibc's headers have already defined it (to something newer) by now.
+#ifndef _POSIX_C_SOURCE
 #define _POSIX_C_SOURCE 199309L
+#endif
 #include <time.h>
 
 // #define CLOCK_SOURCE    CLOCK_MONOTONIC_FAST
 // #define CLOCK_SOURCE    CLOCK_MONOTONIC
+#ifdef CLOCK_MONOTONIC_PRECISE
 #define CLOCK_SOURCE    CLOCK_MONOTONIC_PRECISE
+#else
+// Linux doesn't have the choice, CLOCK_MONOTONIC is always the precise one.
+#define CLOCK_SOURCE    CLOCK_MONOTONIC
+#endif
 
 /// Convert seconds to milliseconds
 #define SEC_TO_MS(sec) ((sec)*1000)